@@ -1,8 +1,11 @@
 #include <proto/exec.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 extern void exc_handler();
+extern int add_core_region(void *p_address, unsigned long size);
 
 
 int main()
@@ -10,6 +13,11 @@ int main()
     // TODO: Install exception handler in startup code
     FindTask(NULL)->tc_TrapCode = exc_handler;
 
+    // include some heap memory in the core dump
+    char *p_buffer = malloc(64);
+    strcpy(p_buffer, "This string should show up in the core dump");
+    add_core_region(p_buffer, 64);
+
     printf("Address of main() = %p\n", main);
     asm("trap #3");
     return 0;
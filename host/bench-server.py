@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+#
+# bench-server.py - part of cwdbg, a debugger for the AmigaOS
+#                   This file contains benchmarks for the protocol between host and server. They drive the server with
+#                   scripted workloads and report the latency of the round trips and the number of bytes transferred.
+#
+# Copyright(C) 2018-2022 Constantin Wiemer
+
+
+import argparse
+import math
+import sys
+import time
+from dataclasses import dataclass, field
+from loguru import logger
+
+from cli import CliNextLine
+from debugger import dbg
+from disasm import Disassembler
+from hunklib import get_debug_infos_from_exe
+from replay import SessionRecorder, SessionReplayer
+from server import (
+    MAX_MSG_DATA_LEN,
+    PROTO_SUPPORTED_FEATURES,
+    ServerBackend,
+    ServerCommand,
+    ServerConnection,
+    SrvBatch,
+    SrvClearBreakpoint,
+    SrvContinue,
+    SrvGetSegments,
+    SrvKill,
+    SrvPeekMem,
+    SrvRun,
+    SrvSetBreakpoint,
+    SrvSingleStep,
+)
+from stabslib import ProgramWithDebugInfo
+from target import TargetStates
+
+
+PEEK_SIZES = (255, 1024, 4096, 16384, MAX_MSG_DATA_LEN)
+WORKLOADS = ('stepi', 'peek', 'bpoint-storm', 'next')
+
+
+@dataclass
+class BenchResult:
+    name: str
+    latencies: list[float] = field(default_factory=list)     # seconds for each operation
+    nbytes_payload: int = 0                                  # bytes of data the operations have returned
+    nbytes_sent: int = 0                                     # bytes on the wire
+    nbytes_received: int = 0
+
+
+def _percentile(values: list[float], percent: int) -> float:
+    # nearest-rank method, which is good enough for the number of samples we take
+    values = sorted(values)
+    return values[max(0, math.ceil(percent / 100 * len(values)) - 1)]
+
+
+class Benchmark:
+    """Runs the workloads against a server that has just been started (or a replay of such a session)
+
+    The server numbers the breakpoints itself and doesn't report the numbers, so we count them like test-server.py
+    does, starting with 1.
+    """
+    def __init__(self, server_conn: ServerBackend):
+        self._server_conn = server_conn
+        self._next_bpoint_num = 1
+        self.results: list[BenchResult] = []
+
+    def bench_stepi(self, count: int):
+        result = BenchResult(f'stepi (x{count})')
+        bpoint_num = self._set_bpoint(0)
+        target_info = self._execute(SrvRun(), None).target_info
+        while len(result.latencies) < count:
+            if not (target_info.target_state & TargetStates.TS_RUNNING):
+                target_info = self._execute(SrvRun(), None).target_info
+                continue
+            target_info = self._execute(SrvSingleStep(), result).target_info
+        self._stop_target(target_info)
+        self._execute(SrvClearBreakpoint(bpoint_num), None)
+        self.results.append(result)
+
+    def bench_peek(self, address: int, repeat: int):
+        # The cache is bypassed, otherwise we would only measure it after the first read.
+        for nbytes in PEEK_SIZES:
+            result = BenchResult(f'peek {nbytes} bytes (x{repeat})')
+            for _ in range(repeat):
+                result.nbytes_payload += len(self._execute(SrvPeekMem(address, nbytes, use_cache=False), result).result)
+            self.results.append(result)
+
+    def bench_bpoint_storm(self):
+        # Set a breakpoint on every instruction of the first code segment and run the target until it exits, so the
+        # target stops as often as possible (best with examples/loop.s).
+        address, size = self._execute(SrvGetSegments(), None).result[0]
+        code = b''
+        while len(code) < size:
+            nbytes = min(size - len(code), MAX_MSG_DATA_LEN)
+            code += self._execute(SrvPeekMem(address + len(code), nbytes, use_cache=False), None).result
+        batch = SrvBatch()
+        bpoint_nums = []
+        for instr in Disassembler().disasm(code, address):
+            batch.add(SrvSetBreakpoint(instr.address - address))
+            bpoint_nums.append(self._next_bpoint_num)
+            self._next_bpoint_num += 1
+        batch.execute(self._server_conn)
+        if any(cmd.error_code != 0 for cmd in batch.commands):
+            raise RuntimeError("Setting the breakpoints failed")
+        result = BenchResult(f'bpoint storm ({len(bpoint_nums)} bpoints)')
+        target_info = self._execute(SrvRun(), result).target_info
+        while target_info.target_state & TargetStates.TS_RUNNING:
+            target_info = self._execute(SrvContinue(), result).target_info
+        batch = SrvBatch()
+        for bpoint_num in bpoint_nums:
+            batch.add(SrvClearBreakpoint(bpoint_num))
+        batch.execute(self._server_conn)
+        self.results.append(result)
+
+    def bench_next(self, program: ProgramWithDebugInfo, count: int):
+        # Execute the program line by line from the start of main() (best with examples/numbers.c), the same way the
+        # CLI does it, so the time for processing the stops on the host is included.
+        result = BenchResult(f'next (x{count})')
+        dbg.program = program
+        dbg.server_conn = self._server_conn
+        bpoint_num = self._set_bpoint(program.get_addr_range_for_func_name('main')[0])
+        dbg.target_info = self._execute(SrvRun(), None).target_info
+        next_cmd = CliNextLine()
+        while len(result.latencies) < count:
+            if not (dbg.target_info.target_state & TargetStates.TS_RUNNING):
+                dbg.target_info = self._execute(SrvRun(), None).target_info
+                continue
+            nbytes_sent, nbytes_received = self._get_wire_counters()
+            start = time.perf_counter()
+            if (error := next_cmd.execute(None)) is not None:
+                raise RuntimeError(error)
+            result.latencies.append(time.perf_counter() - start)
+            self._add_wire_counters(result, nbytes_sent, nbytes_received)
+        self._stop_target(dbg.target_info)
+        self._execute(SrvClearBreakpoint(bpoint_num), None)
+        self.results.append(result)
+
+    def print_results(self):
+        has_counters = isinstance(self._server_conn, ServerConnection)
+        print(f"{'workload':<32}{'count':>7}{'p50 ms':>10}{'p90 ms':>10}{'p99 ms':>10}{'max ms':>10}{'KB/s':>10}{'sent/op':>10}{'recv/op':>10}")
+        for result in self.results:
+            n = len(result.latencies)
+            total_time = sum(result.latencies)
+            throughput = f'{result.nbytes_payload / total_time / 1024:.1f}' if result.nbytes_payload and total_time else '-'
+            print(
+                f'{result.name:<32}{n:>7}'
+                + ''.join(f'{_percentile(result.latencies, p) * 1000:>10.2f}' for p in (50, 90, 99, 100))
+                + f'{throughput:>10}'
+                + (f'{result.nbytes_sent / n:>10.0f}{result.nbytes_received / n:>10.0f}' if has_counters else f"{'-':>10}{'-':>10}")
+            )
+
+    def _execute(self, cmd: ServerCommand, result: BenchResult | None) -> ServerCommand:
+        nbytes_sent, nbytes_received = self._get_wire_counters()
+        start = time.perf_counter()
+        cmd.execute(self._server_conn)
+        if result is not None:
+            result.latencies.append(time.perf_counter() - start)
+            self._add_wire_counters(result, nbytes_sent, nbytes_received)
+        return cmd
+
+    def _get_wire_counters(self) -> tuple[int, int]:
+        return getattr(self._server_conn, 'nbytes_sent', 0), getattr(self._server_conn, 'nbytes_received', 0)
+
+    def _add_wire_counters(self, result: BenchResult, nbytes_sent: int, nbytes_received: int):
+        new_nbytes_sent, new_nbytes_received = self._get_wire_counters()
+        result.nbytes_sent += new_nbytes_sent - nbytes_sent
+        result.nbytes_received += new_nbytes_received - nbytes_received
+
+    def _set_bpoint(self, offset: int) -> int:
+        self._execute(SrvSetBreakpoint(offset), None)
+        self._next_bpoint_num += 1
+        return self._next_bpoint_num - 1
+
+    def _stop_target(self, target_info):
+        if target_info.target_state & TargetStates.TS_RUNNING:
+            self._execute(SrvKill(), None)
+
+
+def main():
+    args = _parse_command_line()
+    logger.remove()
+    logger.add(sys.stderr, level='DEBUG' if args.verbose else 'WARNING')
+
+    if args.replay:
+        server_conn = SessionReplayer(args.replay)
+    else:
+        server_conn = ServerConnection(args.host, args.port, args.features)
+    if args.record:
+        server_conn = SessionRecorder(server_conn, args.record)
+    dbg.disassembler = Disassembler()
+    benchmark = Benchmark(server_conn)
+    try:
+        for workload in args.workloads:
+            if workload == 'stepi':
+                benchmark.bench_stepi(args.count)
+            elif workload == 'peek':
+                benchmark.bench_peek(args.peek_address, args.count)
+            elif workload == 'bpoint-storm':
+                benchmark.bench_bpoint_storm()
+            elif workload == 'next':
+                if not args.prog:
+                    raise RuntimeError("Workload 'next' needs the program with debug information (--prog)")
+                benchmark.bench_next(ProgramWithDebugInfo.from_stabs_data(get_debug_infos_from_exe(args.prog)), args.count)
+    finally:
+        server_conn.close()
+    print(f"Features: {hex(server_conn.features)}")
+    benchmark.print_results()
+
+
+def _parse_command_line() -> argparse.Namespace:
+    parser = argparse.ArgumentParser(
+        description="Benchmarks for the protocol between cwdbg host and server",
+        formatter_class=argparse.ArgumentDefaultsHelpFormatter,
+    )
+    parser.add_argument('workloads', nargs='*', choices=WORKLOADS, default=['stepi', 'peek'], help="Workloads to run")
+    parser.add_argument('--prog', help="Program loaded by the server (with debug information), needed for 'next'")
+    parser.add_argument('--count', '-n', type=int, default=100, help="Number of operations per workload")
+    parser.add_argument('--peek-address', type=lambda s: int(s, 0), default=0x400, help="Address of the memory read by 'peek'")
+    parser.add_argument('--features', type=lambda s: int(s, 0), default=PROTO_SUPPORTED_FEATURES, help="Protocol features to negotiate with the server")
+    parser.add_argument('--host', '-H', default='127.0.0.1', help="IP address / name of debugger server")
+    parser.add_argument('--port', '-P', type=int, default=1234, help="Port of debugger server")
+    parser.add_argument('--record', help="Record the session with the server to this file")
+    parser.add_argument('--replay', help="Replay a session recorded with --record instead of connecting to the server")
+    parser.add_argument('--verbose', '-v', action="store_true", default=False, help="Enable verbose logging")
+    return parser.parse_args()
+
+
+if __name__ == '__main__':
+    main()
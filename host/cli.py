@@ -14,22 +14,41 @@ import struct
 from abc import abstractmethod
 from dataclasses import dataclass
 
-import capstone
-from loguru import logger
-
 from debugger import dbg
+from errors import ErrorCodes
 from server import (
+    BreakpointCondition,
+    BreakpointConditionTypes,
+    ConditionOps,
+    MAX_WATCH_SIZE,
+    Profile,
     ServerCommandError,
+    SrvBatch,
     SrvClearBreakpoint,
+    SrvClearSyscallTrace,
+    SrvClearWatchpoint,
     SrvContinue,
+    SrvGetProfile,
+    SrvGetStats,
+    SrvGetSyscallStats,
     SrvKill,
     SrvPeekMem,
+    SrvProfile,
     SrvQuit,
+    SrvReadSyscallTrace,
+    SrvReadTrace,
     SrvRun,
+    SrvSelectTarget,
     SrvSetBreakpoint,
-    SrvSingleStep
+    SrvSetSyscallTrace,
+    SrvSetTracepoint,
+    SrvSetWatchpoint,
+    SrvSingleStep,
+    SrvStepFlow,
+    SrvStepRange,
+    SyscallStats
 )
-from target import MAX_INSTR_BYTES, TargetStates
+from target import MAX_INSTR_BYTES, TS_STOPPED, TargetStates
 
 
 class QuitDebuggerException(RuntimeError):
@@ -49,12 +68,162 @@ class ThrowingArgumentParser(argparse.ArgumentParser):
         raise ArgumentParserError(message)
 
 
+# operators, registers and operand sizes for breakpoint conditions (see compile_bpoint_condition() below)
+COND_OPS = {
+    '==': ConditionOps.COND_OP_EQ,
+    '!=': ConditionOps.COND_OP_NE,
+    '<':  ConditionOps.COND_OP_LT,
+    '<=': ConditionOps.COND_OP_LE,
+    '>':  ConditionOps.COND_OP_GT,
+    '>=': ConditionOps.COND_OP_GE,
+}
+COND_REGS = {f'd{i}': i for i in range(8)} | {f'a{i}': i + 8 for i in range(7)} | {'a7': 15, 'sp': 15}
+COND_SIZES = {'b': 1, 'w': 2, 'l': 4}
+
+
+def compile_bpoint_condition(tokens: list[str]) -> BreakpointCondition | None:
+    """
+    Compile a breakpoint condition of the form [if <operand> <op> <value>] [ignore <count>] into the structure
+    evaluated by the server. The operand is a register (d0-d7, a0-a6, sp) or a memory location (*<address>), optionally
+    followed by the size .b, .w or .l (default). All comparisons are unsigned.
+    """
+    if not tokens:
+        return None
+    match = re.search(
+        r'^(?:if\s+(?P<operand>\*?\w+)(?:\.(?P<size>[bwl]))?\s*(?P<op>==|!=|<=|>=|<|>)\s*(?P<value>-?\w+))?'
+        r'\s*(?:ignore\s+(?P<ignore_count>\d+))?$',
+        ' '.join(tokens).lower()
+    )
+    if match is None or match.group(0) == '':
+        raise ValueError("Invalid format of breakpoint condition")
+
+    cond = BreakpointCondition(
+        type=BreakpointConditionTypes.BPOINT_COND_NONE,
+        size=COND_SIZES[match.group('size') or 'l'],
+        ignore_count=int(match.group('ignore_count') or 0),
+    )
+    if match.group('operand'):
+        cond.op    = COND_OPS[match.group('op')]
+        cond.value = int(match.group('value'), 0) & (0xffffffff >> (32 - cond.size * 8))
+        if match.group('operand').startswith('*'):
+            cond.type    = BreakpointConditionTypes.BPOINT_COND_MEM
+            cond.address = int(match.group('operand')[1:], 0)
+            if cond.size > 1 and cond.address & 1:
+                raise ValueError("Memory location for word / long compare must be at an even address")
+        elif match.group('operand') in COND_REGS:
+            cond.type    = BreakpointConditionTypes.BPOINT_COND_REG
+            cond.reg_num = COND_REGS[match.group('operand')]
+        else:
+            raise ValueError(f"Invalid operand {match.group('operand')} in breakpoint condition")
+    return cond
+
+
+def get_offset_for_location(location: str) -> int:
+    """
+    Return the offset relative to the entry point for a breakpoint location, meaning depends on format:
+    hex number = offset, decimal number = line number, string = function name
+    """
+    if re.search(r'^0x[0-9a-fA-F]+$', location):
+        return int(location, 16)
+    if dbg.program is None:
+        raise ValueError("Program not loaded on host, source-level debugging not available")
+    if not re.search(r'^(\d+|[a-zA-Z_]\w+)$', location):
+        # TODO: Implement <file name>:<line number> as location
+        raise ValueError("Invalid format of breakpoint location")
+    try:
+        if re.search('^\d+$', location):
+            addr_range = dbg.program.get_addr_range_for_lineno(int(location, 10))
+        else:
+            addr_range = dbg.program.get_addr_range_for_func_name(location)
+    except ValueError as e:
+        raise ValueError(f"Failed to find address for breakpoint location {location}: {e}")
+    if addr_range is None:
+        raise ValueError(f"No address available for breakpoint location {location}")
+    return addr_range[0]
+
+
+def format_profile(profile: Profile, max_entries: int = 20) -> str:
+    """Map the bins of a profile to source lines (if debug information is available) and list the hottest ones"""
+    samples_by_location: dict[str, int] = {}
+    for bin_idx, nsamples in enumerate(profile.bins):
+        if nsamples == 0:
+            continue
+        offset = bin_idx << profile.bin_shift
+        location = f"entry + 0x{offset:08x}"
+        if dbg.program is not None:
+            if (comp_unit := dbg.program.get_comp_unit_for_addr(offset)) is not None:
+                if (lineno := dbg.program.get_lineno_for_addr(offset, comp_unit=comp_unit)) is not None:
+                    location = f"{comp_unit}:{lineno}"
+                if (func_name := dbg.program.get_func_name_for_addr(offset)) is not None:
+                    location += f" ({func_name})"
+        samples_by_location[location] = samples_by_location.get(location, 0) + nsamples
+
+    report = (
+        f"{profile.nsamples} samples every {profile.interval_us} us, {profile.nsamples_waiting} while target was waiting, "
+        f"{profile.nsamples_outside} outside of code segment\n"
+    )
+    for location, nsamples in sorted(samples_by_location.items(), key=lambda item: item[1], reverse=True)[:max_entries]:
+        report += f"{nsamples * 100 / max(profile.nsamples, 1):6.2f}% {nsamples:8d}  {location}\n"
+    return report
+
+
+# Functions that can't be traced because they're called from interrupts or manipulate the stack / SR, so they can't be
+# routed through the stub routine on the server, or because the stub routine calls them itself (GetCC). They're skipped
+# when a whole library is traced.
+UNTRACEABLE_SYSCALLS = {
+    'exec': {
+        'Supervisor', 'ExitIntr', 'Schedule', 'Reschedule', 'Switch', 'Dispatch', 'Exception', 'Disable', 'Enable',
+        'Forbid', 'Permit', 'SetSR', 'SuperState', 'UserState', 'Cause', 'Signal', 'PutMsg', 'ReplyMsg',
+        'CacheClearU', 'CacheClearE', 'CacheControl', 'GetCC',
+    },
+}
+
+
+def get_syscall_name(lib_base: int, offset: int) -> str:
+    if (lib_name := dbg.lib_base_addresses.get(lib_base)) is not None:
+        if (syscall_info := dbg.syscall_db[lib_name].get(offset)) is not None:
+            return f"{lib_name}.{syscall_info.name}"
+        return f"{lib_name}.-{offset}"
+    return f"0x{lib_base:08x}.-{offset}"
+
+
+def format_syscall_stats(eclock_freq: int, stats: list[SyscallStats], max_entries: int = 20) -> str:
+    """List the traced library functions with the most time spent in them"""
+    total_ticks = sum(entry.ticks for entry in stats)
+    report = f"{'calls':>8} {'total ms':>10} {'avg us':>10} {'time':>7}  function\n"
+    for entry in sorted(stats, key=lambda entry: entry.ticks, reverse=True)[:max_entries]:
+        report += (
+            f"{entry.ncalls:8d} {entry.ticks * 1000 / eclock_freq:10.3f} {entry.ticks * 1000000 / eclock_freq / entry.ncalls:10.1f} "
+            f"{entry.ticks * 100 / max(total_ticks, 1):6.2f}%  {get_syscall_name(entry.lib_base, entry.offset)}\n"
+        )
+    return report
+
+
+def _check_target_stopped(command: str) -> tuple[bool, str | None]:
+    # With several targets, the selected target can be running while another one has stopped.
+    if not dbg.target_info or not (dbg.target_info.target_state & TargetStates.TS_RUNNING):
+        return False, f"Incorrect state for command '{command}': target is not yet running"
+    elif not (dbg.target_info.target_state & TS_STOPPED):
+        return False, f"Incorrect state for command '{command}': target has not stopped"
+    else:
+        return True, None
+
+
+def _check_target_not_running(command: str) -> tuple[bool, str | None]:
+    # The trace buffers are filled by the running target, so they can only be read while it has stopped or isn't running.
+    if dbg.target_info and (dbg.target_info.target_state & TargetStates.TS_RUNNING) and not (dbg.target_info.target_state & TS_STOPPED):
+        return False, f"Incorrect state for command '{command}': target has not stopped"
+    else:
+        return True, None
+
+
 @dataclass
 class CliCommandArg:
     name: str
     help: str
     type: type = str
     choices: list[str] | None = None
+    nargs: str | None = None
 
 
 #
@@ -97,10 +266,7 @@ class CliBacktrace(CliCommand):
         return call_stack_repr
 
     def is_correct_target_state_for_command(self) -> tuple[bool, str | None]:
-        if not dbg.target_info or not (dbg.target_info.target_state & TargetStates.TS_RUNNING):
-            return False, "Incorrect state for command 'backtrace': target is not yet running"
-        else:
-            return True, None
+        return _check_target_stopped('backtrace')
 
 
 class CliClearBreakpoint(CliCommand):
@@ -126,6 +292,29 @@ class CliClearBreakpoint(CliCommand):
             return f"Clearing breakpoint failed: {e}"
 
 
+class CliClearWatchpoint(CliCommand):
+    def __init__(self):
+        super().__init__(
+            'unwatch',
+            ('uw', ),
+            'Delete watchpoint',
+            (
+                CliCommandArg(
+                    name='number',
+                    help='Watchpoint number',
+                    type=int,
+                ),
+            ),
+        )
+
+    def execute(self, args: argparse.Namespace) -> str | None:
+        try:
+            SrvClearWatchpoint(args.number).execute(dbg.server_conn)
+            return f"Watchpoint #{args.number} cleared"
+        except ServerCommandError as e:
+            return f"Clearing watchpoint failed: {e}"
+
+
 class CliContinue(CliCommand):
     def __init__(self):
         super().__init__('continue', ('c', 'cont'), 'Continue target')
@@ -138,10 +327,7 @@ class CliContinue(CliCommand):
             return f"Continuing target failed: {e}"
 
     def is_correct_target_state_for_command(self) -> tuple[bool, str | None]:
-        if not dbg.target_info or not (dbg.target_info.target_state & TargetStates.TS_RUNNING):
-            return False, "Incorrect state for command 'continue': target is not yet running"
-        else:
-            return True, None
+        return _check_target_stopped('continue')
 
 
 class CliDisassemble(CliCommand):
@@ -158,21 +344,24 @@ class CliDisassemble(CliCommand):
                 ),
                 CliCommandArg(
                     name='ninstr',
-                    help='Number of instructions (currently limited to <= 32)',
+                    help='Number of instructions (currently limited to <= 8191)',
                     type=functools.partial(int, base=10),
                 ),
             ),
         )
 
     def execute(self, args: argparse.Namespace) -> str | None:
-        try:
-            cmd = SrvPeekMem(address=args.address, nbytes=args.ninstr * MAX_INSTR_BYTES).execute(dbg.server_conn)
-        except ServerCommandError as e:
-            return f"Reading memory failed: {e}"
+        nbytes = args.ninstr * MAX_INSTR_BYTES
+        if dbg.code_image is not None and dbg.code_image.contains(args.address, nbytes):
+            code = dbg.code_image.get(args.address, nbytes)
+        else:
+            try:
+                code = SrvPeekMem(address=args.address, nbytes=nbytes).execute(dbg.server_conn).result
+            except ServerCommandError as e:
+                return f"Reading memory failed: {e}"
 
-        disasm = capstone.Cs(capstone.CS_ARCH_M68K, capstone.CS_MODE_32)
         listing = ''
-        for instr in disasm.disasm(cmd.result, args.address, args.ninstr):
+        for instr in dbg.disassembler.disasm(code, args.address, args.ninstr):
             listing += f"0x{instr.address:08x}:  {instr.mnemonic:<10}{instr.op_str}\n"
         return listing
 
@@ -224,7 +413,7 @@ class CliHexdump(CliCommand):
                 ),
                 CliCommandArg(
                     name='size',
-                    help='Size of memory block (currently limited to <= 255)',
+                    help='Size of memory block (currently limited to <= 65535)',
                     type=functools.partial(int, base=0),
                 ),
             ),
@@ -271,10 +460,7 @@ class CliInspect(CliCommand):
             return ''.join(dbg.target_info.get_source_view())
 
     def is_correct_target_state_for_command(self) -> tuple[bool, str | None]:
-        if not dbg.target_info or not (dbg.target_info.target_state & TargetStates.TS_RUNNING):
-            return False, "Incorrect state for command 'inspect': target is not yet running"
-        else:
-            return True, None
+        return _check_target_stopped('inspect')
 
 
 class CliKill(CliCommand):
@@ -301,29 +487,22 @@ class CliNextInstr(CliCommand):
 
     def execute(self, args: argparse.Namespace) -> str | None:
         try:
-            # Check if next instruction is a JSR. If yes, set one-shot breakpoint at the instruction following the JSR
-            # and continue. If no, just single-step.
+            # Let the server step through a range containing just the next instruction. If it is a JSR / BSR, the
+            # server steps over the subroutine call. The range is given as offset from the entry point, so this only
+            # works inside the program's code. Elsewhere (ROM, libraries) we just single-step.
             # TODO: Should we stop if we reach the end of the program (here and when single-stepping)?
-            if dbg.target_info.next_instr_is_jsr():
-                offset = (
-                    dbg.target_info.task_context.reg_pc
-                    - dbg.target_info.initial_pc
-                    + dbg.target_info.get_bytes_used_by_jsr()
-                )
-                SrvSetBreakpoint(bpoint_offset=offset, is_one_shot=True).execute(dbg.server_conn)
-                cmd = SrvContinue().execute(dbg.server_conn)
-                dbg.target_info = cmd.target_info
+            pc = dbg.target_info.task_context.reg_pc
+            offset = pc - dbg.target_info.initial_pc
+            if offset >= 0 and (dbg.code_image is None or dbg.code_image.contains(pc, 2)):
+                cmd = SrvStepRange(start_offset=offset, end_offset=offset + 1, step_over=True).execute(dbg.server_conn)
             else:
                 cmd = SrvSingleStep().execute(dbg.server_conn)
-                dbg.target_info = cmd.target_info
+            dbg.target_info = cmd.target_info
         except ServerCommandError as e:
             return f"Executing target until next instruction failed: {e}"
 
     def is_correct_target_state_for_command(self) -> tuple[bool, str | None]:
-        if not dbg.target_info or not (dbg.target_info.target_state & TargetStates.TS_RUNNING):
-            return False, "Incorrect state for command 'nexti': target is not yet running"
-        else:
-            return True, None
+        return _check_target_stopped('nexti')
 
 
 class CliNextLine(CliCommand):
@@ -339,10 +518,7 @@ class CliNextLine(CliCommand):
             return f"Can't execute target until next line: {e}"
 
     def is_correct_target_state_for_command(self) -> tuple[bool, str | None]:
-        if not dbg.target_info or not (dbg.target_info.target_state & TargetStates.TS_RUNNING):
-            return False, "Incorrect state for command 'next': target is not yet running"
-        else:
-            return True, None
+        return _check_target_stopped('next')
 
     def _execute_until_next_line(self):
         current_comp_unit = dbg.program.get_comp_unit_for_addr(
@@ -363,35 +539,58 @@ class CliNextLine(CliCommand):
                 f"but looking up address range for that line failed"
             )
 
-        disasm = capstone.Cs(capstone.CS_ARCH_M68K, capstone.CS_MODE_32)
-        while (
-            addr_range_of_current_line[0] <=
-            (dbg.target_info.task_context.reg_pc - dbg.target_info.initial_pc) <
-            addr_range_of_current_line[1]
+        # The server executes all instructions that are part of the current line, stepping over function calls
+        # (JSR / BSR), and only stops once the PC is outside of the line (or a breakpoint has been hit).
+        cmd = SrvStepRange(
+            start_offset=addr_range_of_current_line[0],
+            end_offset=addr_range_of_current_line[1],
+            step_over=True
+        ).execute(dbg.server_conn)
+        dbg.target_info = cmd.target_info
+        if (
+            (dbg.target_info.target_state & TargetStates.TS_RUNNING) and
+            (dbg.target_info.target_state & TargetStates.TS_STOPPED_AFTER_RETURN)
         ):
-            # execute all instructions that are part of the current line
-            instr = next(disasm.disasm(bytes(dbg.target_info.next_instr_bytes), dbg.target_info.task_context.reg_pc, 1))
-            logger.debug(f"Next instruction: 0x{instr.address:08x} :    {instr.mnemonic:<10}{instr.op_str}")
-            if dbg.target_info.next_instr_is_jsr():
-                # function call => set breakpoint on the return address (the instruction following the JSR) and continue
-                # TODO: For some reason GCC sometimes generates a BSR instead of a JSR instruction. Can we catch these cases as well?
-                SrvSetBreakpoint(
-                    bpoint_offset=dbg.target_info.task_context.reg_pc - dbg.target_info.initial_pc + instr.size,
-                    is_one_shot=True,
-                ).execute(dbg.server_conn)
-                cmd = SrvContinue().execute(dbg.server_conn)
-                dbg.target_info = cmd.target_info
-            elif dbg.target_info.next_instr_is_rts():
-                # return from the current function => execute the RTS and then the rest of the line
-                #                                     containing the function call in the parent
-                # We can't rely on the stack pointer / stack frames to determine that we're in parent function
-                # because not all functions use them.
-                cmd = SrvSingleStep().execute(dbg.server_conn)
-                dbg.target_info = cmd.target_info
-                return self._execute_until_next_line()
-            else:
-                cmd = SrvSingleStep().execute(dbg.server_conn)
-                dbg.target_info = cmd.target_info
+            # return from the current function => execute the rest of the line containing the function call in the parent
+            # We can't rely on the stack pointer / stack frames to determine that we're in parent function
+            # because not all functions use them.
+            return self._execute_until_next_line()
+
+
+class CliProfile(CliCommand):
+    def __init__(self):
+        super().__init__(
+            'profile',
+            ('pr', ),
+            'Run target and sample its PC to find hot spots, the profile is shown when the target has exited',
+            (
+                CliCommandArg(
+                    'interval',
+                    'Sampling interval in microseconds (1000 - 1000000, default 10000)',
+                    type=int,
+                    nargs='?',
+                ),
+            ),
+        )
+
+    def execute(self, args: argparse.Namespace) -> str | None:
+        try:
+            cmd = SrvProfile(interval_us=args.interval or 10000).execute(dbg.server_conn)
+            dbg.target_info = cmd.target_info
+        except ServerCommandError as e:
+            return f"Profiling target failed: {e}"
+        if dbg.target_info.target_state & TargetStates.TS_RUNNING:
+            return "Target has stopped, use 'profreport' to show the profile once it has exited"
+        try:
+            return format_profile(SrvGetProfile().execute(dbg.server_conn).result)
+        except ServerCommandError as e:
+            return f"Reading profile failed: {e}"
+
+    def is_correct_target_state_for_command(self) -> tuple[bool, str | None]:
+        if dbg.target_info and dbg.target_info.target_state & TargetStates.TS_RUNNING:
+            return False, "Incorrect state for command 'profile': target is already running"
+        else:
+            return True, None
 
 
 class CliQuit(CliCommand):
@@ -427,6 +626,31 @@ class CliRun(CliCommand):
             return True, None
 
 
+class CliSelectTarget(CliCommand):
+    def __init__(self):
+        super().__init__(
+            'target',
+            ('tg', ),
+            'Select the target the other commands address',
+            (
+                CliCommandArg(
+                    name='number',
+                    help='Target number (in the order the server has loaded the targets)',
+                    type=int,
+                ),
+            ),
+        )
+
+    def execute(self, args: argparse.Namespace) -> str | None:
+        try:
+            cmd = SrvSelectTarget(args.number).execute(dbg.server_conn)
+            # This also switches to the program and code image of the target, see Debugger.
+            dbg.target_info = cmd.result
+            return f"Target #{args.number} selected"
+        except ServerCommandError as e:
+            return f"Selecting target failed: {e}"
+
+
 class CliSetBreakpoint(CliCommand):
     def __init__(self):
         super().__init__(
@@ -441,37 +665,275 @@ class CliSetBreakpoint(CliCommand):
                     'decimal number = line number, '
                     'string = function name',
                 ),
+                CliCommandArg(
+                    'condition',
+                    'Optional condition evaluated by the server: [if <operand> <op> <value>] [ignore <count>], '
+                    'operand = register (d0-d7, a0-a6, sp) or memory location (*<address>) with optional size .b / .w / .l, '
+                    'op = one of == != < <= > >= (unsigned), the first <count> hits are ignored',
+                    nargs='*',
+                ),
             ),
         )
 
     def execute(self, args: argparse.Namespace) -> str | None:
-        if re.search(r'^0x[0-9a-fA-F]+$', args.location):
-            offset = int(args.location, 16)
-        else:
-            try:
-                if dbg.program is None:
-                    return "Program not loaded on host, source-level debugging not available"
-                if re.search('^\d+$', args.location):
-                    addr_range = dbg.program.get_addr_range_for_lineno(int(args.location, 10))
-                elif re.search(r'^[a-zA-Z_]\w+$', args.location):
-                    addr_range = dbg.program.get_addr_range_for_func_name(args.location)
-                else:
-                    # TODO: Implement <file name>:<line number> as location
-                    return "Invalid format of breakpoint location"
-            except ValueError as e:
-                return f"Failed to find address for breakpoint location {args.location}: {e}"
-            if addr_range is not None:
-                offset, _ = addr_range
-            else:
-                return f"No address available for breakpoint location {args.location}"
-
         try:
-            SrvSetBreakpoint(offset).execute(dbg.server_conn)
+            offset = get_offset_for_location(args.location)
+        except ValueError as e:
+            return str(e)
+        try:
+            condition = compile_bpoint_condition(args.condition)
+        except ValueError as e:
+            return f"Failed to compile condition for breakpoint: {e}"
+        try:
+            SrvSetBreakpoint(offset, condition=condition).execute(dbg.server_conn)
             return "Breakpoint set"
         except ServerCommandError as e:
             return f"Setting breakpoint failed: {e}"
 
 
+class CliSetTracepoint(CliCommand):
+    def __init__(self):
+        super().__init__(
+            'trace',
+            ('t', ),
+            'Set tracepoint that records the PC, a timestamp and registers without stopping the target',
+            (
+                CliCommandArg(
+                    'location',
+                    'Location of the tracepoint, same format as for breakpoints',
+                ),
+                CliCommandArg(
+                    'registers',
+                    'Registers to record (d0-d7, a0-a6, sp), optionally followed by a condition as for breakpoints',
+                    nargs='*',
+                ),
+            ),
+        )
+
+    def execute(self, args: argparse.Namespace) -> str | None:
+        try:
+            offset = get_offset_for_location(args.location)
+        except ValueError as e:
+            return str(e)
+        reg_mask = 0
+        tokens = list(args.registers)
+        while tokens and tokens[0].lower() not in ('if', 'ignore'):
+            reg_name = tokens.pop(0).lower()
+            if reg_name not in COND_REGS:
+                return f"Invalid register {reg_name} for tracepoint"
+            reg_mask |= 1 << COND_REGS[reg_name]
+        try:
+            condition = compile_bpoint_condition(tokens)
+        except ValueError as e:
+            return f"Failed to compile condition for tracepoint: {e}"
+        try:
+            SrvSetTracepoint(offset, reg_mask, condition=condition).execute(dbg.server_conn)
+            return "Tracepoint set"
+        except ServerCommandError as e:
+            return f"Setting tracepoint failed: {e}"
+
+
+class CliSetWatchpoint(CliCommand):
+    def __init__(self):
+        super().__init__(
+            'watch',
+            ('w', ),
+            'Stop target when memory changes (target runs much slower while there are watchpoints)',
+            (
+                CliCommandArg(
+                    name='address',
+                    help='Memory address',
+                    type=functools.partial(int, base=0),
+                ),
+                CliCommandArg(
+                    name='nbytes',
+                    help=f'Number of bytes to watch (default 4, at most {MAX_WATCH_SIZE})',
+                    type=int,
+                    nargs='?',
+                ),
+            ),
+        )
+
+    def execute(self, args: argparse.Namespace) -> str | None:
+        try:
+            cmd = SrvSetWatchpoint(args.address, args.nbytes or 4).execute(dbg.server_conn)
+            return f"Watchpoint #{cmd.result} set at {hex(args.address)}"
+        except ServerCommandError as e:
+            return f"Setting watchpoint failed: {e}"
+
+
+class CliShowSyscallLog(CliCommand):
+    def __init__(self):
+        super().__init__('syslog', ('sl', ), 'Show (and remove) the records of the traced library calls')
+
+    def execute(self, args: argparse.Namespace) -> str | None:
+        reg_names = {reg_num: reg_name for reg_name, reg_num in COND_REGS.items() if reg_name != 'a7'}
+        lines = []
+        try:
+            while True:
+                cmd = SrvReadSyscallTrace().execute(dbg.server_conn)
+                for record in cmd.result:
+                    args_str = ', '.join(f"{reg_names[reg_num]}={value:08x}" for reg_num, value in record.regs.items())
+                    lines.append(
+                        f"t = {record.timestamp / cmd.eclock_freq:.6f}s {get_syscall_name(record.lib_base, record.offset)}"
+                        f"({args_str}) = {record.result:08x}, {record.elapsed * 1000000 / cmd.eclock_freq:.0f} us\n"
+                    )
+                if cmd.nremaining == 0:
+                    break
+        except ServerCommandError as e:
+            return f"Reading syscall records failed: {e}"
+        if cmd.noverruns:
+            lines.append(f"{cmd.noverruns} records have been dropped because the syscall buffer was full\n")
+        return ''.join(lines) if lines else "No syscall records available"
+
+    def is_correct_target_state_for_command(self) -> tuple[bool, str | None]:
+        return _check_target_not_running('syslog')
+
+
+class CliShowSyscallStats(CliCommand):
+    def __init__(self):
+        super().__init__('sysstats', ('ss', ), 'Show number of calls and time spent for each traced library function')
+
+    def execute(self, args: argparse.Namespace) -> str | None:
+        try:
+            cmd = SrvGetSyscallStats().execute(dbg.server_conn)
+        except ServerCommandError as e:
+            return f"Reading syscall statistics failed: {e}"
+        return format_syscall_stats(cmd.eclock_freq, cmd.result) if cmd.result else "No traced library calls so far"
+
+
+class CliShowServerStats(CliCommand):
+    def __init__(self):
+        super().__init__('srvstats', ('sv', ), 'Show the counters of the server (messages, breakpoint hits, time spent for commands)')
+
+    def execute(self, args: argparse.Namespace) -> str | None:
+        try:
+            cmd = SrvGetStats().execute(dbg.server_conn)
+        except ServerCommandError as e:
+            return f"Reading server statistics failed: {e}"
+        stats = cmd.result
+        return (
+            f"frames sent / received / corrupted: {stats.nframes_sent} / {stats.nframes_received} / {stats.nframes_corrupted}\n"
+            f"bytes escaped:                      {stats.nbytes_escaped}\n"
+            f"breakpoint hits / step traps:       {stats.nbpoint_hits} / {stats.nstep_traps}\n"
+            f"commands:                           {stats.ncmds}, {stats.cmd_ticks / cmd.eclock_freq:.6f}s "
+            f"({stats.cmd_ticks / cmd.eclock_freq / max(stats.ncmds, 1) * 1000:.3f}ms per command)"
+        )
+
+
+class CliShowProfile(CliCommand):
+    def __init__(self):
+        super().__init__('profreport', ('pp', ), 'Show the profile of the last profiling run')
+
+    def execute(self, args: argparse.Namespace) -> str | None:
+        try:
+            return format_profile(SrvGetProfile().execute(dbg.server_conn).result)
+        except ServerCommandError as e:
+            return f"Reading profile failed: {e}"
+
+
+class CliShowTraceLog(CliCommand):
+    def __init__(self):
+        super().__init__('tracelog', ('tl', ), 'Show (and remove) the records written by the tracepoints')
+
+    def execute(self, args: argparse.Namespace) -> str | None:
+        reg_names = {reg_num: reg_name for reg_name, reg_num in COND_REGS.items() if reg_name != 'a7'}
+        lines = []
+        try:
+            while True:
+                cmd = SrvReadTrace().execute(dbg.server_conn)
+                initial_pc = dbg.target_info.initial_pc if dbg.target_info else 0
+                for record in cmd.result:
+                    line = f"#{record.bpoint_num} at entry + {hex(record.pc - initial_pc)}, t = {record.timestamp / cmd.eclock_freq:.6f}s"
+                    if record.regs:
+                        line += ', ' + ' '.join(f"{reg_names[reg_num]}={value:08x}" for reg_num, value in record.regs.items())
+                    lines.append(line + '\n')
+                if cmd.nremaining == 0:
+                    break
+        except ServerCommandError as e:
+            return f"Reading trace records failed: {e}"
+        if cmd.noverruns:
+            lines.append(f"{cmd.noverruns} records have been dropped because the trace buffer was full\n")
+        return ''.join(lines) if lines else "No trace records available"
+
+    def is_correct_target_state_for_command(self) -> tuple[bool, str | None]:
+        return _check_target_not_running('tracelog')
+
+
+class CliTraceSyscalls(CliCommand):
+    def __init__(self):
+        super().__init__(
+            'systrace',
+            ('st', ),
+            'Trace calls of library functions without stopping the target, "systrace off" stops tracing',
+            (
+                CliCommandArg(
+                    'library',
+                    'Name of the library (e. g. dos), or off',
+                ),
+                CliCommandArg(
+                    'functions',
+                    'Functions to trace (default all functions of the library)',
+                    nargs='*',
+                ),
+            ),
+        )
+
+    def execute(self, args: argparse.Namespace) -> str | None:
+        if args.library == 'off':
+            # The patched functions can't be restored while the target could be in one of them.
+            if dbg.target_info and dbg.target_info.target_state & TargetStates.TS_RUNNING:
+                return "Incorrect state for command 'systrace off': target is still running"
+            try:
+                SrvClearSyscallTrace().execute(dbg.server_conn)
+                return "Stopped tracing library calls"
+            except ServerCommandError as e:
+                return f"Stopping tracing of library calls failed: {e}"
+
+        lib_name = args.library.removesuffix('.library')
+        if lib_name not in dbg.syscall_db:
+            return f"Library {lib_name} not found in syscall database"
+        untraceable = UNTRACEABLE_SYSCALLS.get(lib_name, set())
+        if args.functions:
+            syscalls = {offset: info for offset, info in dbg.syscall_db[lib_name].items() if info.name in args.functions}
+            if unknown_funcs := set(args.functions) - {info.name for info in syscalls.values()}:
+                return f"Unknown functions for library {lib_name}: {', '.join(sorted(unknown_funcs))}"
+            if untraceable_funcs := set(args.functions) & untraceable:
+                return f"Functions of library {lib_name} can't be traced: {', '.join(sorted(untraceable_funcs))}"
+        else:
+            syscalls = {offset: info for offset, info in dbg.syscall_db[lib_name].items() if info.name not in untraceable}
+        # The registers with the arguments are recorded for each call.
+        funcs = [
+            (offset, functools.reduce(lambda mask, arg: mask | (1 << arg.register), (arg for arg in info.args if arg.register is not None), 0))
+            for offset, info in sorted(syscalls.items())
+        ]
+        batch = SrvBatch()
+        for cmd in SrvSetSyscallTrace.for_functions(lib_name + '.library', funcs):
+            batch.add(cmd)
+        try:
+            batch.execute(dbg.server_conn)
+        except ServerCommandError as e:
+            return f"Tracing library calls failed: {e}"
+        if failed_cmds := [cmd for cmd in batch.commands if cmd.error_code != 0]:
+            return f"Tracing library calls failed with error {ErrorCodes(failed_cmds[0].error_code).name}"
+        return f"Tracing {len(funcs)} functions of {lib_name}.library"
+
+
+class CliStepBranch(CliCommand):
+    def __init__(self):
+        super().__init__('stepb', ('sb',), 'Execute target until next branch, jump, call or return (68020 - 68040 only)')
+
+    def execute(self, args: argparse.Namespace) -> str | None:
+        try:
+            cmd = SrvStepFlow().execute(dbg.server_conn)
+            dbg.target_info = cmd.target_info
+        except ServerCommandError as e:
+            return f"Executing target until next branch failed: {e}"
+
+    def is_correct_target_state_for_command(self) -> tuple[bool, str | None]:
+        return _check_target_stopped('stepb')
+
+
 class CliStepInstr(CliCommand):
     def __init__(self):
         super().__init__('stepi', ('si',), 'Step one instruction')
@@ -484,10 +946,7 @@ class CliStepInstr(CliCommand):
             return f"Stepping one instruction failed: {e}"
 
     def is_correct_target_state_for_command(self) -> tuple[bool, str | None]:
-        if not dbg.target_info or not (dbg.target_info.target_state & TargetStates.TS_RUNNING):
-            return False, "Incorrect state for command 'stepi': target is not yet running"
-        else:
-            return True, None
+        return _check_target_stopped('stepi')
 
 
 class CliStepLine(CliCommand):
@@ -503,13 +962,10 @@ class CliStepLine(CliCommand):
             return f"Can't step one line: {e}"
 
     def is_correct_target_state_for_command(self) -> tuple[bool, str | None]:
-        if not dbg.target_info or not (dbg.target_info.target_state & TargetStates.TS_RUNNING):
-            return False, "Incorrect state for command 'step': target is not yet running"
-        else:
-            return True, None
+        return _check_target_stopped('step')
 
     def _execute_one_line(self):
-        # Single-step instructions until we're outside of the range of the current line
+        # Let the server single-step instructions until we're outside of the range of the current line
         current_comp_unit = dbg.program.get_comp_unit_for_addr(
             dbg.target_info.task_context.reg_pc - dbg.target_info.initial_pc
         )
@@ -528,28 +984,27 @@ class CliStepLine(CliCommand):
                 f"but looking up address range for that line failed"
             )
 
-        while (
-            addr_range_of_current_line[0] <=
-            (dbg.target_info.task_context.reg_pc - dbg.target_info.initial_pc) <
-            addr_range_of_current_line[1]
+        cmd = SrvStepRange(
+            start_offset=addr_range_of_current_line[0],
+            end_offset=addr_range_of_current_line[1],
+            step_over=False
+        ).execute(dbg.server_conn)
+        dbg.target_info = cmd.target_info
+        if (
+            (dbg.target_info.target_state & TargetStates.TS_RUNNING) and
+            (dbg.target_info.target_state & TargetStates.TS_STOPPED_AFTER_RETURN)
         ):
-            if dbg.target_info.next_instr_is_rts():
-                # return from the current function => execute the RTS and then the rest of the line
-                #                                     containing the function call in the parent
-                # We can't rely on the stack pointer / stack frames to determine that we're in parent function
-                # because not all functions use them.
-                cmd = SrvSingleStep().execute(dbg.server_conn)
-                dbg.target_info = cmd.target_info
-                return self._execute_one_line()
-            else:
-                cmd = SrvSingleStep().execute(dbg.server_conn)
-                dbg.target_info = cmd.target_info
+            # return from the current function => execute the rest of the line containing the function call in the parent
+            # We can't rely on the stack pointer / stack frames to determine that we're in parent function
+            # because not all functions use them.
+            return self._execute_one_line()
 
 
 # TODO: Align commands with GDB
 CLI_COMMANDS = [
     CliBacktrace(),
     CliClearBreakpoint(),
+    CliClearWatchpoint(),
     CliContinue(),
     CliDisassemble(),
     CliExamine(),
@@ -558,11 +1013,22 @@ CLI_COMMANDS = [
     CliKill(),
     CliNextInstr(),
     CliNextLine(),
+    CliProfile(),
     CliQuit(),
     CliRun(),
+    CliSelectTarget(),
     CliSetBreakpoint(),
+    CliSetTracepoint(),
+    CliSetWatchpoint(),
+    CliShowProfile(),
+    CliShowServerStats(),
+    CliShowSyscallLog(),
+    CliShowSyscallStats(),
+    CliShowTraceLog(),
+    CliStepBranch(),
     CliStepInstr(),
     CliStepLine(),
+    CliTraceSyscalls(),
 ]
 
 
@@ -586,7 +1052,7 @@ class Cli:
                     raise ValueError(f"Command alias '{alias}' already used by command '{self._commands_by_name[alias]}'")
             subparser = subparsers.add_parser(cmd.command, aliases=cmd.aliases, help=cmd.help)
             for arg in cmd.arg_spec:
-                subparser.add_argument(arg.name, help=arg.help, type=arg.type, choices=arg.choices)
+                subparser.add_argument(arg.name, help=arg.help, type=arg.type, choices=arg.choices, nargs=arg.nargs)
 
 
     # TODO: Pass server connection explicitly instead of accessing it via the global debugger object to break the circular import
@@ -9,6 +9,7 @@
 
 import argparse
 import glob
+import hashlib
 import os
 import pickle
 import sys
@@ -16,16 +17,30 @@ from loguru import logger
 
 from cli import Cli, QuitDebuggerException
 from debugger import dbg
+from disasm import CodeImage, Disassembler
 from errors import ErrorCodes
-from hunklib import get_debug_infos_from_exe
-from server import ServerCommandError, ServerConnection, SrvGetBaseAddress
+from hunklib import BlockTypes, CoreDump, HunkFile, get_debug_infos_from_exe
+from replay import CoreDumpReplayer, SessionRecorder, SessionReplayer
+from server import (
+    MAX_MSG_DATA_LEN,
+    ServerCommandError,
+    ServerConnection,
+    SrvBatch,
+    SrvGetBaseAddress,
+    SrvGetSegments,
+    SrvPeekMem,
+    SrvSelectTarget,
+)
 from stabslib import ProgramWithDebugInfo
+from target import TargetInfo
 from ui import MainScreen
 
 
 RETURN_OK    = 0
 RETURN_ERROR = 1
 
+DEBUG_INFO_CACHE_SUFFIX = '.dbginfo'
+
 
 def main():
     args = _parse_command_line()
@@ -33,7 +48,7 @@ def main():
 
     try:
         _init_debugger(args)
-        if args.no_tui:
+        if args.no_tui or args.core:
             _print_banner()
             while True:
                 cmd_line = input('> ')
@@ -58,12 +73,16 @@ def _parse_command_line() -> argparse.Namespace:
         description="cwdbg, a debugger for the AmigaOS",
         formatter_class=argparse.ArgumentDefaultsHelpFormatter,
     )
-    parser.add_argument('--prog', help="Program you want to debug (with debug information)")
+    parser.add_argument('--prog', action='append', default=[], help="Program you want to debug (with debug information), give it once for each target in the order the server loads them")
     parser.add_argument('--verbose', '-v', action="store_true", default=False, help="Enable verbose logging")
     parser.add_argument('--host', '-H', default='127.0.0.1', help="IP address / name of debugger server")
     parser.add_argument('--port', '-P', type=int, default=1234, help="Port of debugger server")
     parser.add_argument('--no-tui', action='store_true', default=False, help="Disable TUI (mainly for debugging the debugger itself)")
     parser.add_argument('--syscall-db-dir', default='../syscall-db', help="Directory containing the system call database files")
+    parser.add_argument('--core', help="Core dump written by the program (see dump-core.c) to analyze instead of connecting to the server, implies --no-tui")
+    parser.add_argument('--record', help="Record the session with the server to this file")
+    parser.add_argument('--replay', help="Replay a session recorded with --record instead of connecting to the server")
+    parser.add_argument('--no-debug-info-cache', action='store_true', default=False, help="Always read the debug information from the program instead of the cache file next to it")
     args = parser.parse_args()
     return args
 
@@ -93,12 +112,110 @@ def _print_banner():
 
 
 def _init_debugger(args: argparse.Namespace):
-    if args.prog:
-        dbg.program = ProgramWithDebugInfo.from_stabs_data(get_debug_infos_from_exe(args.prog))
-    dbg.server_conn = ServerConnection(args.host, args.port) 
+    for target_id, fname in enumerate(args.prog, 1):
+        dbg.programs[target_id] = _load_program(fname, not args.no_debug_info_cache)
+    # The commands talk to the live server, or for offline debugging, to a recording or a core dump.
+    if args.core:
+        core_dump = CoreDump(args.core)
+        dbg.server_conn = CoreDumpReplayer(core_dump)
+    elif args.replay:
+        dbg.server_conn = SessionReplayer(args.replay)
+    else:
+        dbg.server_conn = ServerConnection(args.host, args.port)
+    if args.record:
+        dbg.server_conn = SessionRecorder(dbg.server_conn, args.record)
     dbg.cli = Cli()
+    dbg.disassembler = Disassembler()
+    if args.core:
+        dbg.code_images[1] = _load_code_image(args.prog[0] if args.prog else None)
+    elif args.prog:
+        _load_code_images(args.prog)
     dbg.syscall_db = _load_syscall_db(args.syscall_db_dir)
-    dbg.lib_base_addresses = _get_lib_base_addresses(args.syscall_db_dir)
+    if args.core:
+        # The core dump doesn't know the libraries.
+        dbg.lib_base_addresses = {}
+        dbg.target_info = TargetInfo.from_core_dump(core_dump)
+        _print_core_dump_report()
+    else:
+        dbg.lib_base_addresses = _get_lib_base_addresses(args.syscall_db_dir)
+
+
+def _print_core_dump_report():
+    # The target info has been built from the core dump, so all views are available immediately.
+    print(dbg.target_info.get_status_str())
+    for title, lines in (
+        ('Registers', dbg.target_info.get_register_view()),
+        ('Stack', dbg.target_info.get_stack_view()),
+        ('Disassembly', dbg.target_info.get_disasm_view()),
+        ('Source', dbg.target_info.get_source_view()),
+        ('Call stack', dbg.target_info.get_call_stack_view()),
+    ):
+        print(f"{title}:\n{''.join(lines)}")
+
+
+def _load_program(fname: str, use_cache: bool) -> ProgramWithDebugInfo:
+    # Parsing the debug information of a big program takes a while, so we keep the lookup tables in a cache file next
+    # to the program. The cache file is only used if modification time, size and hash of the program still match.
+    if not use_cache:
+        return ProgramWithDebugInfo.from_stabs_data(get_debug_infos_from_exe(fname))
+    stat = os.stat(fname)
+    with open(fname, 'rb') as f:
+        key = stat.st_mtime_ns.to_bytes(8, 'big') + stat.st_size.to_bytes(8, 'big') + hashlib.sha1(f.read()).digest()
+    cache_fname = fname + DEBUG_INFO_CACHE_SUFFIX
+    if os.path.exists(cache_fname) and (program := ProgramWithDebugInfo.load_from_cache(cache_fname, key)) is not None:
+        logger.info(f"Loaded debug information from cache file '{cache_fname}'")
+        return program
+
+    program = ProgramWithDebugInfo.from_stabs_data(get_debug_infos_from_exe(fname))
+    # write into a temporary file first so that another instance of the debugger never maps a half-written file
+    try:
+        program.save_to_cache(cache_fname + '.tmp', key)
+        os.replace(cache_fname + '.tmp', cache_fname)
+    except OSError as e:
+        logger.warning(f"Could not write debug information to cache file '{cache_fname}': {e}")
+    return program
+
+
+def _load_code_images(fnames: list[str]):
+    # The server only returns the segments of the selected target, so we select each target in turn and finally the
+    # first one again, which the server has selected at the start.
+    for target_id, fname in enumerate(fnames, 1):
+        if len(fnames) > 1:
+            try:
+                SrvSelectTarget(target_id).execute(dbg.server_conn)
+            except ServerCommandError as e:
+                raise RuntimeError(f"Selecting target #{target_id} for program '{fname}' failed") from e
+        dbg.code_images[target_id] = _load_code_image(fname)
+    if len(fnames) > 1:
+        SrvSelectTarget(1).execute(dbg.server_conn)
+
+
+def _load_code_image(fname: str | None) -> CodeImage | None:
+    # The seglist doesn't tell which segments contain code, but the segments are in the order of the hunks, so we take
+    # the code hunks from the executable (without it, we take all segments). This must happen before any breakpoint is
+    # set, see CodeImage.
+    logger.info("Reading code segments from server")
+    code_hunk_nums = None
+    if fname:
+        with HunkFile(fname) as hunk_file:
+            code_hunk_nums = {block.hunk_num for block in hunk_file.get_blocks(BlockTypes.HUNK_CODE)}
+    code_image = CodeImage()
+    try:
+        segments = SrvGetSegments().execute(dbg.server_conn).result
+        for hunk_num, (address, size) in enumerate(segments):
+            if code_hunk_nums is not None and hunk_num not in code_hunk_nums:
+                continue
+            code = b''
+            while len(code) < size:
+                # The code is read only once, so there is no point in putting it into the memory cache.
+                nbytes = min(size - len(code), MAX_MSG_DATA_LEN)
+                code += SrvPeekMem(address=address + len(code), nbytes=nbytes, use_cache=False).execute(dbg.server_conn).result
+            logger.debug(f"Code segment #{hunk_num} at address {hex(address)} has {size} bytes")
+            code_image.add_segment(address, code)
+    except ServerCommandError as e:
+        logger.warning(f"Reading code segments failed, code will be read from the target instead: {e}")
+        return None
+    return code_image
 
 
 def _load_syscall_db(syscall_db_dir: str):
@@ -115,13 +232,21 @@ def _get_lib_base_addresses(syscall_db_dir: str):
     lib_base_addresses = {}
     file_names = glob.glob(os.path.join(syscall_db_dir, '*.data'))
     lib_names = [os.path.splitext(os.path.basename(fname))[0] for fname in file_names]
+    # get all base addresses at once
+    batch = SrvBatch()
     for lname in lib_names:
-        try:
-            cmd = SrvGetBaseAddress(library_name=lname + '.library').execute(dbg.server_conn)
-            logger.debug(f"Library '{lname}.library' has address {hex(cmd.result)}")
-            lib_base_addresses[cmd.result] = lname
-        except ServerCommandError as e:
-            raise RuntimeError(f"Getting library base addresses failed") from e
+        batch.add(SrvGetBaseAddress(library_name=lname + '.library'))
+    try:
+        batch.execute(dbg.server_conn)
+    except ServerCommandError as e:
+        raise RuntimeError(f"Getting library base addresses failed") from e
+    for lname, cmd in zip(lib_names, batch.commands):
+        if cmd.error_code != 0:
+            raise RuntimeError(
+                f"Getting base address of library '{lname}.library' failed with error {ErrorCodes(cmd.error_code).name}"
+            )
+        logger.debug(f"Library '{lname}.library' has address {hex(cmd.result)}")
+        lib_base_addresses[cmd.result] = lname
     return lib_base_addresses
 
 
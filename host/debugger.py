@@ -9,21 +9,47 @@ import argparse
 import glob
 import os
 import pickle
-from dataclasses import dataclass
+from dataclasses import dataclass, field
 from typing import Optional
 
 
 # This is the global debugger object used to pass around all other objects that are needed by the other modules. It
 # will be populated in cwdbg.py. We can't do this here because this would require us to import several things from
 # other modules, and thus would cause circular imports. It's basically a form of dependency injection.
+#
+# The server can host several targets, each with its own program and code image. They are kept by target ID, and
+# program / code_image always refer to the ones of the selected target. The server selects the first target at the
+# start and the target that has stopped on each stop, so the selected target is the one of target_info.
 @dataclass
 class Debugger:
-    program: Optional['ProgramWithDebugInfo'] = None
-    server_conn: Optional['ServerConnection'] = None
+    server_conn: Optional['ServerBackend'] = None
     cli: Optional['Cli'] = None
     syscall_db: dict[str, dict[int, 'SyscallInfo']] | None = None
     lib_base_addresses: dict[int, str] | None = None
     target_info: Optional['TargetInfo'] = None
+    disassembler: Optional['Disassembler'] = None
+    programs: dict[int, 'ProgramWithDebugInfo'] = field(default_factory=dict)
+    code_images: dict[int, 'CodeImage'] = field(default_factory=dict)
+
+    @property
+    def target_id(self) -> int:
+        return self.target_info.target_id if self.target_info else 1
+
+    @property
+    def program(self) -> Optional['ProgramWithDebugInfo']:
+        return self.programs.get(self.target_id)
+
+    @program.setter
+    def program(self, program: Optional['ProgramWithDebugInfo']):
+        self.programs[self.target_id] = program
+
+    @property
+    def code_image(self) -> Optional['CodeImage']:
+        return self.code_images.get(self.target_id)
+
+    @code_image.setter
+    def code_image(self, code_image: Optional['CodeImage']):
+        self.code_images[self.target_id] = code_image
 
 
 dbg =  Debugger()
@@ -0,0 +1,92 @@
+#
+# disasm.py - part of cwdbg, a debugger for the AmigaOS
+#             This file contains the disassembler for the target's code.
+#
+# Copyright(C) 2018-2022 Constantin Wiemer
+
+
+import bisect
+from dataclasses import dataclass
+
+import capstone
+
+
+MAX_M68K_INSTR_LEN = 22             # longest instruction of the 68020+ (with all extension words)
+MAX_CACHED_INSTRUCTIONS = 65536     # the cache is cleared when it reaches this size
+
+
+@dataclass
+class Instruction:
+    address: int
+    code: bytes
+    mnemonic: str
+    op_str: str
+
+    @property
+    def size(self) -> int:
+        return len(self.code)
+
+
+class Disassembler:
+    """Disassembler with a cache of the decoded instructions
+
+    The views and commands disassemble the same code again and again while stepping through it, so we keep all
+    decoded instructions by address. An instruction from the cache is only used if the code at its address still
+    consists of the same bytes, so instructions changed by the target, by breakpoints or by pokes are decoded again
+    without having to track these changes.
+    """
+    def __init__(self):
+        self._cs = capstone.Cs(capstone.CS_ARCH_M68K, capstone.CS_MODE_32)
+        self._instructions: dict[int, Instruction] = {}
+
+    def invalidate(self):
+        self._instructions.clear()
+
+    def disasm(self, code: bytes, address: int, count: int = 0) -> list[Instruction]:
+        """Decode up to count instructions (0 = as many as possible) of the code, which starts at address"""
+        code = bytes(code)
+        instructions = []
+        pos = 0
+        while pos < len(code) and (count == 0 or len(instructions) < count):
+            instr = self._instructions.get(address + pos)
+            if instr is None or code[pos : pos + instr.size] != instr.code:
+                if (decoded := next(self._cs.disasm_lite(code[pos : pos + MAX_M68K_INSTR_LEN], address + pos, 1), None)) is None:
+                    # invalid instruction or not enough bytes left for the whole instruction
+                    break
+                _, size, mnemonic, op_str = decoded
+                instr = Instruction(address + pos, code[pos : pos + size], mnemonic, op_str)
+                if len(self._instructions) >= MAX_CACHED_INSTRUCTIONS:
+                    self._instructions.clear()
+                self._instructions[instr.address] = instr
+            instructions.append(instr)
+            pos += instr.size
+        return instructions
+
+
+class CodeImage:
+    """Copy of the target's code segments on the host
+
+    The code segments don't change after the program has been loaded, apart from the TRAP opcodes of the breakpoints.
+    So we read them once before any breakpoint is set and take the code from this copy instead of reading it from the
+    target every time. This also means that the copy never contains the TRAP opcodes.
+    """
+    def __init__(self):
+        self._start_addrs: list[int] = []
+        self._segments: list[bytes] = []
+
+    def add_segment(self, address: int, code: bytes):
+        idx = bisect.bisect(self._start_addrs, address)
+        self._start_addrs.insert(idx, address)
+        self._segments.insert(idx, bytes(code))
+
+    def get(self, address: int, nbytes: int) -> bytes | None:
+        """Return up to nbytes of code at address (less at the end of a segment), or None if it's not in a code segment"""
+        if (idx := bisect.bisect(self._start_addrs, address) - 1) < 0:
+            return None
+        offset = address - self._start_addrs[idx]
+        if offset >= len(self._segments[idx]):
+            return None
+        return self._segments[idx][offset : offset + nbytes]
+
+    def contains(self, address: int, nbytes: int) -> bool:
+        return (code := self.get(address, nbytes)) is not None and len(code) == nbytes
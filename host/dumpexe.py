@@ -4,7 +4,7 @@
 import sys
 from loguru import logger
 
-from hunklib import get_debug_infos_from_exe
+from hunklib import dump_exe, get_debug_infos_from_exe
 from stabslib import ProgramWithDebugInfo
 
 
@@ -16,4 +16,5 @@ logger.add(
             '<cyan>{file}</cyan>:<cyan>{function}</cyan>:<cyan>{line}</cyan> | '
             '<level>{message}</level>'
 )
+dump_exe(sys.argv[1])
 program = ProgramWithDebugInfo.from_stabs_data(get_debug_infos_from_exe(sys.argv[1]))
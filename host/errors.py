@@ -22,3 +22,10 @@ class ErrorCodes(IntEnum):
     ERROR_RUN_COMMAND_FAILED     = 8
     ERROR_BAD_DATA               = 9
     ERROR_OPEN_LIB_FAILED        = 10
+    ERROR_PROTO_VERSION_MISMATCH = 11
+    ERROR_NO_PROFILE             = 12
+    ERROR_BAD_CHECKSUM           = 13
+    ERROR_NO_FLOW_TRACE          = 14
+    ERROR_UNKNOWN_WATCHPOINT     = 15
+    ERROR_TOO_MANY_WATCHPOINTS   = 16
+    ERROR_UNKNOWN_TARGET         = 17
@@ -1,14 +1,16 @@
 #
 # hunklib.py - part of cwdbg, a debugger for the AmigaOS
 #              This file contains the routines to read executables in the Amiga Hunk format,
-#              including the debug information.
+#              including the debug information, and core dumps written by dump-core.c.
 #
 # Copyright(C) 2018-2022 Constantin Wiemer
 
 
+import mmap
+from dataclasses import dataclass
 from enum import IntEnum
 from loguru import logger
-from struct import unpack
+from struct import unpack, unpack_from
 
 
 # block types from from dos/doshunks.h
@@ -33,6 +35,10 @@ class BlockTypes(IntEnum):
     HUNK_DREL8	  = 1017
     HUNK_LIB	  = 1018
     HUNK_INDEX	  = 1019
+    # additional block types of core dumps, keep in sync with dump-core.c
+    HUNK_CORE     = 1100
+    HUNK_STACK    = 1101
+    HUNK_MEMORY   = 1102
 
 
 # symbol types from from dos/doshunks.h
@@ -50,6 +56,12 @@ class SymbolTypes(IntEnum):
     EXT_DEXT8  = 135
 
 
+# types of memory regions in core dumps, keep in sync with dump-core.c
+class CoreMemoryTypes(IntEnum):
+    CORE_MEM_SEGMENT = 0
+    CORE_MEM_REGION  = 1
+
+
 def _read_word(exe_file) -> int:
     buffer = exe_file.read(4)
     if buffer:
@@ -80,11 +92,11 @@ def _read_header_block(exe_file):
 
 def _read_unit_block(exe_file):
     logger.info("HUNK_UNIT block... file is an AmigaDOS object file")
-    logger.info(f"Unit name: {_read_string(exe_file)}")
+    logger.info(f"Unit name: {_read_string(exe_file, _read_word(exe_file) * 4)}")
 
 
 def _read_name_block(exe_file):
-    logger.info(f"Hunk name: {_read_string(exe_file)}")
+    logger.info(f"Hunk name: {_read_string(exe_file, _read_word(exe_file) * 4)}")
 
 
 def _read_code_block(exe_file) -> bytes:
@@ -166,7 +178,7 @@ def _read_debug_block(exe_file):
     #   type definitions, a list of all functions and variables and a line / offset table
     if data[offset + 4:offset + 8] == b'LINE':
         logger.debug("Format is assumed to be LINE (SAS/C or VBCC) - dumping it")
-        logger.debug(f"Section offset: 0x{unpack('>L')}")
+        logger.debug(f"Section offset: 0x{unpack('>L', data[offset:offset + 4])[0]:08x}")
         offset += 8  # skip section offset and 'LINE'
         nwords_fname = unpack('>L', data[offset:offset + 4])[0]
         offset += 4
@@ -200,14 +212,14 @@ READ_FUNC_BY_BLOCK_TYPE = {
 }
 
 
-def read_exe(fname: str) -> dict[int, bytes]:
-    content_by_type: dict[int, bytes] = {}
+def dump_exe(fname: str):
+    """Log the content of all blocks of an executable (for debugging)"""
     hunk_num = 0
     logger.info("Reading executable...")
     with open(fname, 'rb') as exe_file:
         while True:
             try:
-                block_type = _read_word(exe_file)
+                block_type = _read_word(exe_file) & 0x3fffffff    # upper bits may contain memory flags
                 logger.debug(f"Reading hunk #{hunk_num}, {BlockTypes(block_type).name} ({block_type}) block")
                 if block_type == BlockTypes.HUNK_END:
                     # possibly another hunk follows, nothing else to do
@@ -215,7 +227,7 @@ def read_exe(fname: str) -> dict[int, bytes]:
                     hunk_num += 1
                     continue
                 else:
-                    content_by_type[block_type] = READ_FUNC_BY_BLOCK_TYPE[block_type](exe_file)
+                    READ_FUNC_BY_BLOCK_TYPE[block_type](exe_file)
 
             except EOFError:
                 if block_type == BlockTypes.HUNK_END:
@@ -232,8 +244,174 @@ def read_exe(fname: str) -> dict[int, bytes]:
                 logger.error(f"Error occured while reading file: {ex}")
                 raise
 
-    return content_by_type
+
+@dataclass
+class HunkBlock:
+    hunk_num: int
+    type: int
+    offset: int     # offset of the block's content (after the block type and, if any, the size) in the file
+    size: int       # size of the content in bytes
+
+
+class HunkFile:
+    """Index of the blocks of an executable
+
+    The file is memory-mapped and scanned once for the block headers when it is opened. The content of a block is only
+    read when asked for, so code and data of big executables never get loaded.
+    """
+    def __init__(self, fname: str):
+        self._fname = fname
+        with open(fname, 'rb') as exe_file:
+            self._mm = mmap.mmap(exe_file.fileno(), 0, access=mmap.ACCESS_READ)
+        self.blocks: list[HunkBlock] = []
+        try:
+            self._scan()
+        except Exception:
+            self._mm.close()
+            raise
+
+    def __enter__(self) -> 'HunkFile':
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def close(self):
+        self._mm.close()
+
+    def get_blocks(self, block_type: int) -> list[HunkBlock]:
+        return [block for block in self.blocks if block.type == block_type]
+
+    def read_block(self, block: HunkBlock) -> bytes:
+        return self._mm[block.offset : block.offset + block.size]
+
+    def _word(self, pos: int) -> int:
+        if pos + 4 > len(self._mm):
+            raise EOFError
+        return unpack_from('>L', self._mm, pos)[0]
+
+    def _skip_word_lists(self, pos: int, nextra_words: int) -> int:
+        # Skip lists of words preceded by their number of words (plus nextra_words) and terminated by 0, as in
+        # HUNK_RELOC32 and HUNK_SYMBOL blocks. Returns the position after the terminating 0.
+        while (nwords := self._word(pos)) != 0:
+            pos += 4 + (nwords + nextra_words) * 4
+        return pos + 4
+
+    def _skip_ext_block(self, pos: int) -> int:
+        # see _read_ext_block()
+        while (type_len := self._word(pos)) != 0:
+            sym_type = (type_len & 0xff000000) >> 24
+            pos += 4 + (type_len & 0x00ffffff) * 4
+            if sym_type in (SymbolTypes.EXT_DEF, SymbolTypes.EXT_ABS, SymbolTypes.EXT_RES):
+                pos += 4
+            elif sym_type in (SymbolTypes.EXT_REF8, SymbolTypes.EXT_REF16, SymbolTypes.EXT_REF32):
+                pos += 4 + self._word(pos) * 4
+            elif sym_type == SymbolTypes.EXT_COMMON:
+                pos += 4
+                pos += 4 + self._word(pos) * 4
+            else:
+                raise ValueError(f"Symbol type {sym_type} not supported")
+        return pos + 4
+
+    def _scan(self):
+        hunk_num = 0
+        pos = 0
+        while pos < len(self._mm):
+            block_type = self._word(pos) & 0x3fffffff    # upper bits may contain memory flags
+            pos += 4
+            start = pos
+            if block_type in (BlockTypes.HUNK_END, BlockTypes.HUNK_BREAK):
+                hunk_num += 1
+                continue
+            elif block_type in (BlockTypes.HUNK_CODE, BlockTypes.HUNK_DATA, BlockTypes.HUNK_DEBUG, BlockTypes.HUNK_NAME, BlockTypes.HUNK_UNIT,
+                                BlockTypes.HUNK_CORE, BlockTypes.HUNK_STACK, BlockTypes.HUNK_MEMORY):
+                start = pos + 4
+                pos = start + (self._word(pos) & 0x3fffffff) * 4
+            elif block_type == BlockTypes.HUNK_BSS:
+                pos += 4
+            elif block_type == BlockTypes.HUNK_HEADER:
+                # names of resident libraries, table size, first and last hunk, size of each hunk
+                pos = self._skip_word_lists(pos, 0) + 4
+                first_hunk, last_hunk = self._word(pos), self._word(pos + 4)
+                pos += 8
+                for _ in range(first_hunk, last_hunk + 1):
+                    # With both memory flags set, another word with the memory attributes follows.
+                    pos += 8 if self._word(pos) & 0xc0000000 == 0xc0000000 else 4
+            elif block_type in (BlockTypes.HUNK_RELOC32, BlockTypes.HUNK_RELOC16, BlockTypes.HUNK_RELOC8, BlockTypes.HUNK_SYMBOL):
+                # offsets preceded by the number of the referenced hunk / value preceded by the symbol name
+                pos = self._skip_word_lists(pos, 1)
+            elif block_type == BlockTypes.HUNK_EXT:
+                pos = self._skip_ext_block(pos)
+            else:
+                # We can't know the size of the block, so we keep the blocks scanned so far (like dump_exe()).
+                logger.error(f"Block type {block_type} at offset {pos - 4} of file '{self._fname}' not known or implemented")
+                break
+            if pos > len(self._mm):
+                raise EOFError(f"Encountered EOF while reading block {BlockTypes(block_type).name} of file '{self._fname}'")
+            self.blocks.append(HunkBlock(hunk_num, block_type, start, pos - start))
+        logger.debug(f"Executable contains {hunk_num} hunks and {len(self.blocks)} blocks")
+
+
+@dataclass
+class CoreMemory:
+    address: int
+    data: bytes
+
+
+class CoreDump:
+    """Content of a core dump written by dump_core() in dump-core.c
+
+    The dump is in the Hunk format, with a HUNK_CORE block for the task context, a HUNK_STACK block for the used part
+    of the stack and a HUNK_MEMORY block for each segment of the program (in the order of the seglist) and each memory
+    region the program has added with add_core_region().
+    """
+    def __init__(self, fname: str):
+        with HunkFile(fname) as hunk_file:
+            if not hunk_file.blocks or hunk_file.blocks[0].type != BlockTypes.HUNK_CORE:
+                raise ValueError(f"File '{fname}' is not a core dump")
+            self.task_context = hunk_file.read_block(hunk_file.blocks[0])
+            self.stack: CoreMemory | None = None
+            self.segments: list[CoreMemory] = []
+            self.regions: list[CoreMemory] = []
+            for block in hunk_file.blocks[1:]:
+                data = hunk_file.read_block(block)
+                if block.type == BlockTypes.HUNK_STACK:
+                    address, size = unpack_from('>LL', data)
+                    self.stack = CoreMemory(address, data[8 : 8 + size])
+                elif block.type == BlockTypes.HUNK_MEMORY:
+                    address, size, mem_type = unpack_from('>LLL', data)
+                    memory = CoreMemory(address, data[12 : 12 + size])
+                    if mem_type == CoreMemoryTypes.CORE_MEM_SEGMENT:
+                        self.segments.append(memory)
+                    else:
+                        self.regions.append(memory)
+        logger.debug(f"Core dump contains {len(self.segments)} segments and {len(self.regions)} memory regions")
+
+    def read_memory(self, address: int, nbytes: int) -> bytes | None:
+        """Return the memory at the address, or None if it is not completely contained in the dump"""
+        for memory in ([self.stack] if self.stack else []) + self.segments + self.regions:
+            if memory.address <= address and address + nbytes <= memory.address + len(memory.data):
+                return memory.data[address - memory.address : address - memory.address + nbytes]
+        return None
 
 
 def get_debug_infos_from_exe(fname: str) -> bytes:
-    return read_exe(fname)[BlockTypes.HUNK_DEBUG]
+    """Return the debug information in STABS format of the executable
+
+    The addresses in the debug information are relative to the start of the hunk it belongs to, and the debugger only
+    supports the debug information of one hunk (the first code hunk, where GCC puts it), so we take the first block
+    in STABS format.
+    """
+    with HunkFile(fname) as hunk_file:
+        blocks = []
+        for block in hunk_file.get_blocks(BlockTypes.HUNK_DEBUG):
+            # see _read_debug_block()
+            if hunk_file.read_block(block)[4:8] == b'LINE':
+                logger.warning(f"Ignoring debug information of hunk #{block.hunk_num} in LINE format, only STABS is supported")
+            else:
+                blocks.append(block)
+        if not blocks:
+            raise ValueError(f"Executable '{fname}' contains no debug information in STABS format")
+        if len(blocks) > 1:
+            logger.warning(f"Ignoring the debug information of hunks {[b.hunk_num for b in blocks[1:]]}, only the one of hunk #{blocks[0].hunk_num} is used")
+        return hunk_file.read_block(blocks[0])
@@ -0,0 +1,224 @@
+#
+# replay.py - part of cwdbg, a debugger for the AmigaOS
+#             This file contains the backends for the server commands that work without a live server: a recorder for
+#             sessions with the server and replayers that answer the commands from a recording or a core dump.
+#
+# Copyright(C) 2018-2022 Constantin Wiemer
+
+
+import struct
+from collections import deque
+from ctypes import c_uint8
+from loguru import logger
+
+from errors import ErrorCodes
+from hunklib import CoreDump
+from server import (
+    MAX_CALL_STACK_DEPTH,
+    MAX_RETRIES,
+    MAX_SEGMENTS,
+    PROTO_SUPPORTED_FEATURES,
+    PROTO_VERSION,
+    M68K_UINT16,
+    ConnectionError,
+    MemoryCache,
+    MsgTypes,
+    NoMemoryCache,
+    ServerBackend,
+)
+
+
+#
+# constants
+#
+
+# A recording starts with a header (magic, format version, features negotiated with the server, flags), followed
+# by one record per message (direction, message type, length of data, data).
+RECORDING_MAGIC   = b'CWDBGREC'
+RECORDING_VERSION = 1
+RECORDING_HEADER  = '>8sHHH'
+RECORD_HEADER     = '>BBI'
+
+# The commands only send the same messages again if the memory cache behaves the same as in the recorded session.
+RECORDING_FLAG_NO_MEM_CACHE = 1 << 0
+
+# direction of a recorded message
+RECORD_SENT     = 0
+RECORD_RECEIVED = 1
+
+
+class SessionRecorder(ServerBackend):
+    """Backend that passes all messages to another backend and writes them to a recording
+
+    The messages exchanged while the other backend was created (i.e. MSG_INIT) are not recorded, only the features
+    negotiated by them.
+    """
+    def __init__(self, backend: ServerBackend, fname: str):
+        self._backend = backend
+        self.features = backend.features
+        self.mem_cache = backend.mem_cache
+        flags = RECORDING_FLAG_NO_MEM_CACHE if isinstance(self.mem_cache, NoMemoryCache) else 0
+        self._file = open(fname, 'wb')
+        self._file.write(struct.pack(RECORDING_HEADER, RECORDING_MAGIC, RECORDING_VERSION, self.features, flags))
+        logger.info(f"Recording session to file '{fname}'")
+
+    def close(self):
+        self._file.close()
+        self._backend.close()
+
+    def send_message(self, msg_type: c_uint8, data: bytes | None = None):
+        self._backend.send_message(msg_type, data)
+        self._write_record(RECORD_SENT, msg_type, data)
+
+    def recv_message(self, timeout: float | None = None, max_retries: int | None = MAX_RETRIES) -> tuple[c_uint8, bytes | None]:
+        msg_type, data = self._backend.recv_message(timeout, max_retries)
+        self._write_record(RECORD_RECEIVED, msg_type, data)
+        return msg_type, data
+
+    def _write_record(self, direction: int, msg_type: c_uint8, data: bytes | None):
+        data = data or b''
+        self._file.write(struct.pack(RECORD_HEADER, direction, msg_type, len(data)) + data)
+        # The debugger might crash later on, and then the recording is what we need most.
+        self._file.flush()
+
+
+class SessionReplayer(ServerBackend):
+    """Backend that answers the commands from a recording written by SessionRecorder
+
+    The commands have to be the same as in the recorded session, any deviation is a ConnectionError. This way, a
+    session can be replayed at full speed, e.g. for regression tests or benchmarks of the host.
+    """
+    def __init__(self, fname: str):
+        with open(fname, 'rb') as f:
+            data = f.read()
+        if len(data) < struct.calcsize(RECORDING_HEADER):
+            raise ValueError(f"File '{fname}' is not a recording")
+        magic, version, self.features, flags = struct.unpack_from(RECORDING_HEADER, data)
+        if magic != RECORDING_MAGIC or version != RECORDING_VERSION:
+            raise ValueError(f"File '{fname}' is not a recording of version {RECORDING_VERSION}")
+        self.mem_cache = NoMemoryCache() if flags & RECORDING_FLAG_NO_MEM_CACHE else MemoryCache()
+        self._records: deque[tuple[int, int, bytes]] = deque()
+        pos = struct.calcsize(RECORDING_HEADER)
+        while pos < len(data):
+            direction, msg_type, length = struct.unpack_from(RECORD_HEADER, data, pos)
+            pos += struct.calcsize(RECORD_HEADER)
+            self._records.append((direction, msg_type, data[pos : pos + length]))
+            pos += length
+        logger.info(f"Replaying {len(self._records)} messages from file '{fname}'")
+
+    def send_message(self, msg_type: c_uint8, data: bytes | None = None):
+        direction, rec_type, rec_data = self._next_record()
+        if direction != RECORD_SENT or rec_type != msg_type or rec_data != (data or b''):
+            raise ConnectionError(
+                f"Message {MsgTypes(msg_type).name} deviates from the recording, which has "
+                f"{'sent' if direction == RECORD_SENT else 'received'} message {MsgTypes(rec_type).name} at this point"
+            )
+
+    def recv_message(self, timeout: float | None = None, max_retries: int | None = MAX_RETRIES) -> tuple[c_uint8, bytes | None]:
+        direction, msg_type, data = self._next_record()
+        if direction != RECORD_RECEIVED:
+            raise ConnectionError(f"Waiting for a message but the recording has sent message {MsgTypes(msg_type).name} at this point")
+        return msg_type, data
+
+    def _next_record(self) -> tuple[int, int, bytes]:
+        if not self._records:
+            raise ConnectionError("End of recording has been reached")
+        return self._records.popleft()
+
+
+class CoreDumpReplayer(ServerBackend):
+    """Backend that answers the commands that only read the state of the target from a core dump
+
+    The core dump only contains the stack, the segments and the memory regions the program has added, so reading other
+    memory fails with ERROR_INVALID_ADDRESS. Commands that would resume or change the target fail with
+    ERROR_RUN_COMMAND_FAILED.
+    """
+    def __init__(self, core_dump: CoreDump):
+        self._core_dump = core_dump
+        self.features = PROTO_SUPPORTED_FEATURES
+        # There is no round trip, so caching would only make reads fail whose pages are not completely in the dump.
+        self.mem_cache = NoMemoryCache()
+        self._replies: deque[tuple[c_uint8, bytes]] = deque()
+        self._executors = {
+            MsgTypes.MSG_INIT:           self._exec_init_cmd,
+            MsgTypes.MSG_PEEK_MEM:       self._exec_peek_mem_cmd,
+            MsgTypes.MSG_GET_CALL_STACK: self._exec_get_call_stack_cmd,
+            MsgTypes.MSG_GET_SEGMENTS:   self._exec_get_segments_cmd,
+            MsgTypes.MSG_QUIT:           lambda data: (ErrorCodes.ERROR_OK, b''),
+        }
+
+    def send_message(self, msg_type: c_uint8, data: bytes | None = None):
+        # The acknowledgement of a MSG_TARGET_STOPPED message never happens because the target can't be resumed.
+        if msg_type in (MsgTypes.MSG_ACK, MsgTypes.MSG_NACK):
+            return
+        if msg_type == MsgTypes.MSG_BATCH:
+            error_code, reply = self._exec_batch_cmd(data or b'')
+        else:
+            error_code, reply = self._exec_cmd(msg_type, data or b'')
+        if error_code == ErrorCodes.ERROR_OK:
+            self._replies.append((MsgTypes.MSG_ACK, reply))
+        else:
+            self._replies.append((MsgTypes.MSG_NACK, bytes([error_code])))
+
+    def recv_message(self, timeout: float | None = None, max_retries: int | None = MAX_RETRIES) -> tuple[c_uint8, bytes | None]:
+        if not self._replies:
+            raise ConnectionError("Waiting for a message that a core dump can't provide")
+        return self._replies.popleft()
+
+    def _exec_cmd(self, msg_type: c_uint8, data: bytes) -> tuple[int, bytes]:
+        if msg_type not in self._executors:
+            logger.warning(f"Command {MsgTypes(msg_type).name} is not possible with a core dump")
+            return ErrorCodes.ERROR_RUN_COMMAND_FAILED, b''
+        return self._executors[msg_type](data)
+
+    def _exec_batch_cmd(self, data: bytes) -> tuple[int, bytes]:
+        # see handle_batch_msg() in server.c
+        reply = b''
+        pos = 0
+        while pos < len(data):
+            msg_type, length = struct.unpack_from('>BB', data, pos)
+            error_code, cmd_reply = self._exec_cmd(msg_type, data[pos + 2 : pos + 2 + length])
+            reply += struct.pack('>BH', error_code, len(cmd_reply)) + cmd_reply
+            pos += 2 + length
+        return ErrorCodes.ERROR_OK, reply
+
+    def _exec_init_cmd(self, data: bytes) -> tuple[int, bytes]:
+        version, features = struct.unpack('>HH', data[0:4])
+        if version != PROTO_VERSION:
+            return ErrorCodes.ERROR_PROTO_VERSION_MISMATCH, b''
+        return ErrorCodes.ERROR_OK, struct.pack('>HH', PROTO_VERSION, features & self.features)
+
+    def _exec_peek_mem_cmd(self, data: bytes) -> tuple[int, bytes]:
+        address, nbytes = struct.unpack('>IH', data[0:6])
+        if (memory := self._core_dump.read_memory(address, nbytes)) is None:
+            return ErrorCodes.ERROR_INVALID_ADDRESS, b''
+        return ErrorCodes.ERROR_OK, memory
+
+    def _exec_get_call_stack_cmd(self, data: bytes) -> tuple[int, bytes]:
+        # same as get_call_stack() in target.c, with the stack in the dump instead of the task's stack
+        max_depth = min(struct.unpack(M68K_UINT16, data[0:2])[0], MAX_CALL_STACK_DEPTH)
+        regs = struct.unpack_from('>IIHI8I7I', self._core_dump.task_context)
+        sp, pc, frame_ptr = regs[0], regs[3], regs[4 + 8 + 5]
+        stack = self._core_dump.stack
+        frames = []
+        prev_frame_ptr = 0
+        while len(frames) < max_depth and frame_ptr != 0xffffffff:
+            if (
+                (frame_ptr & 1)
+                or frame_ptr < sp
+                or stack is None or frame_ptr < stack.address or frame_ptr + 8 > stack.address + len(stack.data)
+                or frame_ptr <= prev_frame_ptr
+            ):
+                logger.debug(f"Frame pointer {hex(frame_ptr)} is invalid, stopping at frame #{len(frames)}")
+                break
+            next_frame_ptr, return_addr = struct.unpack('>II', self._core_dump.read_memory(frame_ptr, 8))
+            frames.append((frame_ptr, pc, return_addr))
+            pc, prev_frame_ptr, frame_ptr = return_addr, frame_ptr, next_frame_ptr
+        return ErrorCodes.ERROR_OK, struct.pack(M68K_UINT16, len(frames)) + b''.join(struct.pack('>III', *frame) for frame in frames)
+
+    def _exec_get_segments_cmd(self, data: bytes) -> tuple[int, bytes]:
+        segments = self._core_dump.segments[:MAX_SEGMENTS]
+        reply = struct.pack(M68K_UINT16, len(segments))
+        for segment in segments:
+            reply += struct.pack('>II', segment.address, len(segment.data))
+        return ErrorCodes.ERROR_OK, reply
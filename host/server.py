@@ -7,8 +7,9 @@
 
 import socket
 import struct
+from collections import deque
 from dataclasses import dataclass
-from ctypes import BigEndianStructure, c_uint8, c_uint16, sizeof
+from ctypes import BigEndianStructure, c_uint8, c_uint16, c_uint32, sizeof
 from enum import IntEnum
 from loguru import logger
 
@@ -21,7 +22,35 @@ from errors import ErrorCodes
 # constants
 #
 MAX_FRAME_SIZE = 4096       # maximum number of bytes we try to read at once
-MAX_MSG_DATA_LEN = 255      # maximum number of bytes a message can carry
+MAX_MSG_DATA_LEN = 65535    # maximum number of bytes a message can carry (keep in sync with transport.h)
+MAX_FRAME_DATA_LEN = 256    # maximum number of bytes one frame can carry (keep in sync with transport.h)
+MAX_BATCH_REPLY_LEN = 8192  # maximum size of the reply to a MSG_BATCH message (keep in sync with server.c)
+MAX_CALL_STACK_DEPTH = 64   # maximum number of frames returned by MSG_GET_CALL_STACK (keep in sync with target.h)
+MAX_TRACE_REPLY_LEN = 4096  # maximum size of the reply to a MSG_READ_TRACE message (keep in sync with server.c)
+NUM_TRACE_REGS = 16         # number of registers a tracepoint can record (keep in sync with target.h)
+MAX_SYSCALL_PATCHES = 512   # maximum number of library functions that can be traced (keep in sync with systrace.h)
+MAX_SEGMENTS = 64           # maximum number of segments returned by MSG_GET_SEGMENTS (keep in sync with target.h)
+MAX_WATCH_SIZE = 16         # maximum number of bytes a watchpoint can watch (keep in sync with target.h)
+
+# protocol version and optional features (keep in sync with server.c)
+PROTO_VERSION = 5
+PROTO_FEATURE_FRAGMENTS = 1 << 0
+PROTO_FEATURE_COMPRESSION = 1 << 1
+PROTO_FEATURE_DELTA_INFO = 1 << 2
+PROTO_FEATURE_WINDOW = 1 << 3
+PROTO_SUPPORTED_FEATURES = PROTO_FEATURE_FRAGMENTS | PROTO_FEATURE_COMPRESSION | PROTO_FEATURE_DELTA_INFO | PROTO_FEATURE_WINDOW
+
+# The memory cache reads whole pages. The areas with the CIAs, the custom chips and the autoconfig boards are never cached
+# because their contents change all the time and reading them can have side effects (keep in sync with target.c).
+MEM_CACHE_PAGE_SIZE = 256
+UNCACHED_MEM_RANGES = ((0xa00000, 0xc00000), (0xd80000, 0xe00000), (0xe80000, 0xf00000))
+
+FRAME_TIMEOUT = 2.0         # seconds we wait for a frame of a reply before we ask the server to resend it
+MAX_RETRIES = 5             # number of times we ask for a frame / send a message again before we give up
+
+# message flags (keep in sync with server.c)
+MSG_FLAG_COMPRESSED = 1 << 0
+MSG_FLAG_DELTA = 1 << 1
 
 M68K_UINT16 = '>H'
 M68K_UINT32 = '>I'
@@ -48,6 +77,24 @@ class MsgTypes(IntEnum):
     MSG_CLEAR_BPOINT     = 11
     MSG_TARGET_STOPPED   = 12
     MSG_GET_BASE_ADDRESS = 13
+    MSG_STEP_RANGE       = 14
+    MSG_BATCH            = 15
+    MSG_GET_CALL_STACK   = 16
+    MSG_READ_TRACE       = 17
+    MSG_PROFILE          = 18
+    MSG_GET_PROFILE      = 19
+    MSG_SET_SYSCALL_TRACE   = 20
+    MSG_CLEAR_SYSCALL_TRACE = 21
+    MSG_READ_SYSCALL_TRACE  = 22
+    MSG_GET_SYSCALL_STATS   = 23
+    MSG_ACK_FRAMES          = 24
+    MSG_RESEND_FRAMES       = 25
+    MSG_GET_SEGMENTS        = 26
+    MSG_STEP_FLOW           = 27
+    MSG_GET_STATS           = 28
+    MSG_SET_WATCHPOINT      = 29
+    MSG_CLEAR_WATCHPOINT    = 30
+    MSG_SELECT_TARGET       = 31
 
 
 class ProtoMessage(BigEndianStructure):
@@ -55,29 +102,295 @@ class ProtoMessage(BigEndianStructure):
         ("seqnum", c_uint16),
         ("checksum", c_uint16),
         ("type", c_uint8),
-        ("length", c_uint8)
+        ("flags", c_uint8),
+        ("length", c_uint16),
+        ("offset", c_uint16),
         # field 'data' omitted because we just append the data
     )
 
 
+# breakpoint types (keep in sync with target.h)
+class BreakpointTypes(IntEnum):
+    BPOINT_TYPE_REGULAR  = 0
+    BPOINT_TYPE_ONE_SHOT = 1
+    BPOINT_TYPE_TRACE    = 2
+
+
+# breakpoint conditions (keep in sync with target.h)
+class BreakpointConditionTypes(IntEnum):
+    BPOINT_COND_NONE = 0
+    BPOINT_COND_REG  = 1
+    BPOINT_COND_MEM  = 2
+
+
+class ConditionOps(IntEnum):
+    COND_OP_EQ = 0
+    COND_OP_NE = 1
+    COND_OP_LT = 2
+    COND_OP_LE = 3
+    COND_OP_GT = 4
+    COND_OP_GE = 5
+
+
+class BreakpointCondition(BigEndianStructure):
+    # Registers are numbered D0-D7 = 0-7, A0-A6 = 8-14 and SP = 15, size is the size of the operand in bytes.
+    _fields_ = (
+        ("type", c_uint8),
+        ("op", c_uint8),
+        ("reg_num", c_uint8),
+        ("size", c_uint8),
+        ("address", c_uint32),
+        ("value", c_uint32),
+        ("ignore_count", c_uint32),
+    )
+
+
 class ConnectionError(RuntimeError):
     pass
 
 
+class CorruptedFrameError(ConnectionError):
+    pass
+
+
+def calc_checksum(data: bytes) -> int:
+    """Calculate the checksum of a frame (header with the checksum set to 0 plus data) like calc_checksum() in util.c"""
+    if len(data) % 2:
+        data += b'\x00'
+    total = sum(struct.unpack(f'>{len(data) // 2}H', data))
+    while total >> 16:
+        total = (total >> 16) + (total & 0xffff)
+    return ~total & 0xffff
+
+
+def decompress_data(data: bytes) -> bytes:
+    """Decompress data compressed with the PackBits algorithm by compress_data() in util.c"""
+    result = bytearray()
+    pos = 0
+    while pos < len(data):
+        ctrl = data[pos]
+        if ctrl < 128:
+            # ctrl + 1 literal bytes follow
+            result += data[pos + 1 : pos + ctrl + 2]
+            pos += ctrl + 2
+        elif ctrl > 128:
+            # next byte is repeated 257 - ctrl times
+            result += data[pos + 1 : pos + 2] * (257 - ctrl)
+            pos += 2
+        else:
+            pos += 1
+    return bytes(result)
+
+
+def apply_delta(old_data: bytes, delta: bytes) -> bytes:
+    """Apply the changes encoded by encode_delta() in util.c to a block of data"""
+    ndwords = len(old_data) // 4
+    mask_size = (ndwords + 7) // 8
+    result = bytearray(old_data)
+    pos = mask_size
+    for i in range(ndwords):
+        if delta[i // 8] & (0x80 >> (i % 8)):
+            result[i * 4 : i * 4 + 4] = delta[pos : pos + 4]
+            pos += 4
+    if pos != len(delta):
+        raise ConnectionError(f"Delta of {len(delta)} bytes does not match the bitmask")
+    return bytes(result)
+
+
+class SlipDecoder:
+    """Incremental SLIP decoder, the received data is fed in as it arrives and the decoded frames are taken out
+
+    Each received byte is only scanned once for the end-of-frame marker, and frames without escape sequences (the
+    usual case) are returned as they are.
+    """
+    def __init__(self):
+        self._partial_frame = bytearray()
+        self._frames: deque[bytes] = deque()
+
+    def feed(self, data: bytes):
+        start = 0
+        while (pos := data.find(SLIP_END, start)) != -1:
+            self._partial_frame += data[start:pos]
+            # empty frames (e. g. caused by line noise before the first frame) are ignored
+            if self._partial_frame:
+                self._frames.append(bytes(self._partial_frame))
+                self._partial_frame.clear()
+            start = pos + 1
+        self._partial_frame += data[start:]
+
+    def get_frame(self) -> bytes | None:
+        """Return the next decoded frame without the end-of-frame marker, or None if there is no complete frame yet"""
+        if not self._frames:
+            return None
+        frame = self._frames.popleft()
+        if SLIP_ESC not in frame:
+            return frame
+        parts = frame.split(SLIP_ESC)
+        decoded = bytearray(parts[0])
+        for part in parts[1:]:
+            if part[0:1] == SLIP_ESCAPED_END:
+                decoded += SLIP_END
+            elif part[0:1] == SLIP_ESCAPED_ESC:
+                decoded += SLIP_ESC
+            else:
+                raise CorruptedFrameError(f"Invalid escape sequence {part[0:1].hex()} in SLIP frame")
+            decoded += part[1:]
+        return bytes(decoded)
+
+
+class MemoryCache:
+    """Page-granular cache of the target's memory
+
+    A target can only change memory while it is running, so the cache stays valid until the next command that resumes
+    a target or writes to memory, see ServerCommand.execute(). All targets share the same memory, so we invalidate the
+    whole cache whenever any of them stops, is resumed or gets selected.
+    """
+    def __init__(self):
+        self._pages: dict[int, bytes] = {}
+
+    def invalidate(self):
+        self._pages.clear()
+
+    @staticmethod
+    def is_cacheable(address: int, nbytes: int) -> bool:
+        return not any(address < end and address + nbytes > start for start, end in UNCACHED_MEM_RANGES)
+
+    @staticmethod
+    def _pages_of_range(address: int, nbytes: int) -> range:
+        return range(address - address % MEM_CACHE_PAGE_SIZE, address + nbytes, MEM_CACHE_PAGE_SIZE)
+
+    def get(self, address: int, nbytes: int) -> bytes | None:
+        """Return the data of the given range, or None if not all of its pages are in the cache"""
+        data = bytearray()
+        for page_address in self._pages_of_range(address, nbytes):
+            if (page := self._pages.get(page_address)) is None:
+                return None
+            data += page
+        start = address % MEM_CACHE_PAGE_SIZE
+        # only the last page of the address space can be shorter than MEM_CACHE_PAGE_SIZE
+        if len(data) < start + nbytes:
+            return None
+        return bytes(data[start : start + nbytes])
+
+    def get_missing_range(self, address: int, nbytes: int) -> tuple[int, int] | None:
+        """Return address and size of the smallest page-aligned range that covers all missing pages of the given range
+
+        Adjacent missing pages are merged into one range, and so are the gaps between them (reading a few pages
+        more is cheaper than another round trip).
+        """
+        missing = [a for a in self._pages_of_range(address, nbytes) if a not in self._pages]
+        if not missing:
+            return None
+        # The server can't read beyond 0xffffffff (the last byte excluded), so the last page is shorter.
+        end = min(missing[-1] + MEM_CACHE_PAGE_SIZE, 0xffffffff)
+        return missing[0], end - missing[0]
+
+    def put(self, address: int, data: bytes):
+        """Put the data read from a page-aligned range into the cache"""
+        for pos in range(0, len(data), MEM_CACHE_PAGE_SIZE):
+            self._pages[address + pos] = data[pos : pos + MEM_CACHE_PAGE_SIZE]
+
+
 class ServerCommandError(RuntimeError):
     pass
 
 
-class ServerConnection:
-    def __init__(self, host: str, port: int):
+@dataclass
+class Profile:
+    interval_us: int
+    bin_shift: int              # each bin covers 2^bin_shift bytes of the first code segment
+    nsamples: int
+    nsamples_waiting: int       # target was waiting (e. g. for IO)
+    nsamples_outside: int       # PC was outside of the first code segment (e. g. in a library)
+    bins: list[int]
+
+
+@dataclass
+class TraceRecord:
+    bpoint_num: int
+    pc: int
+    timestamp: int              # value of the E clock when the tracepoint was hit
+    regs: dict[int, int]        # register number (D0-D7 = 0-7, A0-A6 = 8-14, SP = 15) -> value
+
+
+@dataclass
+class SyscallRecord:
+    lib_base: int
+    offset: int                 # offset of the function in the jump table (positive, as in the syscall database)
+    timestamp: int              # value of the E clock when the function was called
+    elapsed: int                # number of E clock ticks until the function returned
+    result: int                 # D0 after the call
+    regs: dict[int, int]        # register number (as for tracepoints) -> value at the time of the call
+
+
+@dataclass
+class SyscallStats:
+    lib_base: int
+    offset: int
+    ncalls: int
+    ticks: int                  # total time spent in the function in E clock ticks
+
+
+@dataclass
+class ServerStats:
+    """Counters of the server (see ServerStats in util.h), they count from the start of the server"""
+    nframes_sent: int
+    nframes_received: int
+    nframes_corrupted: int      # received frames that have been dropped
+    nbytes_escaped: int         # bytes that had to be escaped in the SLIP frames sent
+    nbpoint_hits: int
+    nstep_traps: int            # trace exceptions (single steps and steps to the next change of flow)
+    ncmds: int                  # commands received from the host
+    cmd_ticks: int              # time spent processing the commands in E clock ticks
+
+
+class NoMemoryCache(MemoryCache):
+    """Memory cache that caches nothing, for backends where reading memory doesn't involve a round trip"""
+    @staticmethod
+    def is_cacheable(address: int, nbytes: int) -> bool:
+        return False
+
+
+class ServerBackend:
+    """Interface of the backends the commands talk to
+
+    ServerCommand.execute() only exchanges protocol messages with the backend, with all the framing, resending and
+    reassembling of messages hidden behind send_message() and recv_message(). The received messages are complete
+    (a MSG_TARGET_STOPPED message always contains the complete TargetInfo). ServerConnection talks to the live server,
+    the backends in replay.py record sessions or answer the commands from a recording or a core dump.
+    """
+    features: int = 0
+    mem_cache: MemoryCache
+
+    def close(self):
+        pass
+
+    def send_message(self, msg_type: c_uint8, data: bytes | None = None):
+        raise NotImplementedError
+
+    def recv_message(self, timeout: float | None = None, max_retries: int | None = MAX_RETRIES) -> tuple[c_uint8, bytes | None]:
+        raise NotImplementedError
+
+
+class ServerConnection(ServerBackend):
+    def __init__(self, host: str, port: int, features: int = PROTO_SUPPORTED_FEATURES):
         logger.info("Connecting to server...")
         try:
             self._conn = socket.create_connection((host, port))
             self._next_seqnum = 0
+            self._slip_decoder = SlipDecoder()
+            self._last_target_info_data = None
+            self.features = 0
+            self.mem_cache = MemoryCache()
+            # number of bytes that went over the wire (SLIP-encoded frames, including control frames)
+            self.nbytes_sent = 0
+            self.nbytes_received = 0
         except ConnectionRefusedError as e:
             raise RuntimeError(f"Could not connect to server '{host}:{port}'") from e
 
-        SrvInit().execute(self)
+        cmd = SrvInit(features).execute(self)
+        self.features = cmd.features
+        logger.info(f"Using protocol version {cmd.version} with features {hex(self.features)}")
 
 
     def close(self):
@@ -85,60 +398,155 @@ class ServerConnection:
 
 
     def send_message(self, msg_type: c_uint8, data: bytes | None = None):
+        # The server only accepts messages that fit into one frame, so we never need to split messages we send.
+        if data and len(data) > MAX_FRAME_DATA_LEN:
+            raise ConnectionError(f"Message data of {len(data)} bytes exceeds maximum frame data size {MAX_FRAME_DATA_LEN}")
         try:
-            msg = ProtoMessage(
-                seqnum=self._next_seqnum,
-                checksum=0xdead,
-                type=msg_type,
-                length=len(data) if data else 0
-            )
-            buffer = bytearray(msg)
-            if data:
-                buffer += data
-
-            # SLIP-encode buffer and add end-of-frame marker
-            buffer = buffer.replace(SLIP_ESC, SLIP_ESC + SLIP_ESCAPED_ESC)
-            buffer = buffer.replace(SLIP_END, SLIP_ESC + SLIP_ESCAPED_END)
-            buffer += SLIP_END
-
-            logger.debug("Sending message to server: seqnum={}, checksum={}, type={}, length={}".format(
-                msg.seqnum,
-                hex(msg.checksum),
-                MsgTypes(msg.type).name,
-                msg.length
-            ))
-            self._conn.send(buffer)
+            self._send_frame(msg_type, data)
             if msg_type in (MsgTypes.MSG_ACK, MsgTypes.MSG_NACK):
                 self._next_seqnum += 1
         except Exception as e:
             raise ConnectionError(f"Could not send message to server") from e
 
 
-    def recv_message(self) -> tuple[c_uint8, bytes | None]:
+    def _send_frame(self, msg_type: c_uint8, data: bytes | None):
+        msg = ProtoMessage(
+            seqnum=self._next_seqnum,
+            checksum=0,
+            type=msg_type,
+            flags=0,
+            length=len(data) if data else 0,
+            offset=0
+        )
+        buffer = bytearray(msg)
+        if data:
+            buffer += data
+        msg.checksum = calc_checksum(buffer)
+        buffer[0:sizeof(ProtoMessage)] = bytes(msg)
+
+        # SLIP-encode buffer and add end-of-frame marker
+        buffer = buffer.replace(SLIP_ESC, SLIP_ESC + SLIP_ESCAPED_ESC)
+        buffer = buffer.replace(SLIP_END, SLIP_ESC + SLIP_ESCAPED_END)
+        buffer += SLIP_END
+
+        logger.debug("Sending message to server: seqnum={}, checksum={}, type={}, length={}".format(
+            msg.seqnum,
+            hex(msg.checksum),
+            MsgTypes(msg.type).name,
+            msg.length
+        ))
+        self._conn.send(buffer)
+        self.nbytes_sent += len(buffer)
+
+
+    def _send_frame_ctrl(self, msg_type: c_uint8, seqnum: int, offset: int):
+        """Send MSG_ACK_FRAMES / MSG_RESEND_FRAMES for the fragments of message seqnum before / from offset"""
+        # These messages are outside of the sequence, so they don't change our sequence number.
+        self._send_frame(msg_type, struct.pack('>HH', seqnum, offset))
+
+
+    def _recv_frame(self, timeout: float | None = None) -> tuple[ProtoMessage, bytes]:
+        # check if the decoder has already a complete SLIP frame, if not read data from the connection until it has
+        # one (any bytes after the end-of-frame marker are kept by the decoder for the next frame)
+        self._conn.settimeout(timeout)
+        while (buffer := self._slip_decoder.get_frame()) is None:
+            if not (received := self._conn.recv(MAX_FRAME_SIZE)):
+                raise ConnectionError("Connection has been closed by the server")
+            self.nbytes_received += len(received)
+            self._slip_decoder.feed(received)
+
+        if len(buffer) < sizeof(ProtoMessage):
+            raise CorruptedFrameError(f"Received frame of {len(buffer)} bytes which is shorter than the message header")
+        msg = ProtoMessage.from_buffer_copy(buffer)
+        if calc_checksum(buffer[0:2] + b'\x00\x00' + buffer[4:]) != msg.checksum:
+            raise CorruptedFrameError(f"Received frame with wrong checksum {hex(msg.checksum)}")
+        data = bytes(buffer[sizeof(ProtoMessage):])
+        logger.debug("Received frame from server: seqnum={}, checksum={}, type={}, flags={}, length={}, offset={}".format(
+            msg.seqnum,
+            hex(msg.checksum),
+            MsgTypes(msg.type).name,
+            hex(msg.flags),
+            msg.length,
+            msg.offset
+        ))
+        if msg.flags & MSG_FLAG_COMPRESSED:
+            data = decompress_data(data)
+        return msg, data
+
+
+    def recv_message(self, timeout: float | None = None, max_retries: int | None = MAX_RETRIES) -> tuple[c_uint8, bytes | None]:
+        """Receive the next message from the server
+
+        If the window feature has been negotiated, we acknowledge each frame and ask the server to resend a frame that
+        is corrupted or doesn't arrive within the timeout (None means to wait forever), at most max_retries times in a
+        row (None means to keep asking). Otherwise, a corrupted frame is an error.
+        """
         try:
-            # check if there is already a complete SLIP frame in the buffer, if not 
-            # read data from the connection until we have a complete frame
-            buffer = bytearray()
-            pos    = -1
-            while pos == -1:
-                buffer += self._conn.recv(MAX_FRAME_SIZE)
-                pos = buffer.find(SLIP_END)
-
-            # SLIP-decode buffer
-            buffer = buffer.replace(SLIP_ESC + SLIP_ESCAPED_END, SLIP_END)
-            buffer = buffer.replace(SLIP_ESC + SLIP_ESCAPED_ESC, SLIP_ESC)
-
-            msg = ProtoMessage.from_buffer(buffer)
-            data = buffer[sizeof(ProtoMessage) : sizeof(ProtoMessage) + msg.length]
-            logger.debug("Received message from server: seqnum={}, checksum={}, type={}, length={}".format(
+            # The server splits messages with more than MAX_FRAME_DATA_LEN bytes of data into several frames, which
+            # it sends in order, so we read frames until we have all the data.
+            use_window = bool(self.features & PROTO_FEATURE_WINDOW)
+            msg = None
+            fragments = []
+            nbytes = 0
+            nretries = 0
+            while msg is None or nbytes < msg.length:
+                try:
+                    frame, frame_data = self._recv_frame(timeout if use_window else None)
+                except (CorruptedFrameError, TimeoutError) as e:
+                    if not use_window:
+                        raise
+                    if nretries == max_retries:
+                        raise ConnectionError("Giving up after too many corrupted or missing frames") from e
+                    nretries += 1
+                    # Without a limit, we're waiting for a target to stop, which can take any time.
+                    if max_retries is None and msg is None and isinstance(e, TimeoutError):
+                        logger.debug(f"No frame received yet, asking server to resend frames from offset {nbytes}")
+                    else:
+                        logger.warning(f"Frame is corrupted or missing ({e}), asking server to resend frames from offset {nbytes}")
+                    self._send_frame_ctrl(MsgTypes.MSG_RESEND_FRAMES, self._next_seqnum, nbytes)
+                    continue
+
+                if use_window and frame.seqnum != self._next_seqnum:
+                    # The server has resent frames of an earlier message because our acknowledgement has been lost.
+                    logger.debug(f"Ignoring frame of message #{frame.seqnum} we have already received")
+                    self._send_frame_ctrl(MsgTypes.MSG_ACK_FRAMES, frame.seqnum, frame.length)
+                    continue
+                if msg is not None and (frame.seqnum, frame.type, frame.length) != (msg.seqnum, msg.type, msg.length):
+                    raise ConnectionError(
+                        f"Received unexpected fragment with seqnum={frame.seqnum}, type={frame.type}, offset={frame.offset}"
+                    )
+                if frame.offset != nbytes:
+                    if not use_window:
+                        raise ConnectionError(f"Received fragment with offset {frame.offset}, expected {nbytes}")
+                    # This is either a duplicate of a fragment we already have or a fragment after a missing one
+                    # (which the server will resend together with the missing one).
+                    logger.debug(f"Ignoring fragment with offset {frame.offset}, expected {nbytes}")
+                    if frame.offset < nbytes:
+                        self._send_frame_ctrl(MsgTypes.MSG_ACK_FRAMES, frame.seqnum, nbytes)
+                    continue
+
+                msg = frame
+                fragments.append(frame_data)
+                nbytes += len(frame_data)
+                nretries = 0
+                if use_window:
+                    self._send_frame_ctrl(MsgTypes.MSG_ACK_FRAMES, frame.seqnum, nbytes)
+            data = b''.join(fragments)[0:msg.length]
+
+            # The server sends only the changes to the last TargetInfo if the message has the delta flag set,
+            # so we always keep the complete data of the last TargetInfo.
+            if msg.type == MsgTypes.MSG_TARGET_STOPPED:
+                if msg.flags & MSG_FLAG_DELTA:
+                    if self._last_target_info_data is None:
+                        raise ConnectionError("Received delta for TargetInfo without having received a complete TargetInfo")
+                    data = apply_delta(self._last_target_info_data, data)
+                self._last_target_info_data = data
+            logger.debug("Received message from server: seqnum={}, type={}, length={}".format(
                 msg.seqnum,
-                hex(msg.checksum),
                 MsgTypes(msg.type).name,
                 msg.length
             ))
 
-            # TODO: Check that checksum is correct first
-
             if msg.type in (MsgTypes.MSG_ACK, MsgTypes.MSG_NACK):
                 if msg.seqnum == self._next_seqnum:
                     logger.debug("Received ACK / NACK with correct sequence number")
@@ -165,12 +573,41 @@ class ServerCommand:
     error_code: int = -1
     target_info: target.TargetInfo | None = None
 
-    def execute(self, server_conn: ServerConnection) -> 'ServerCommand':
+    # Commands that neither resume a target nor change memory, all others invalidate the memory cache. MSG_BATCH is
+    # handled by SrvBatch because it depends on the commands in the batch. MSG_SELECT_TARGET is missing on purpose,
+    # the other targets might have run and changed memory while the host was looking at the selected one.
+    MEMORY_PRESERVING_MSG_TYPES = (
+        MsgTypes.MSG_INIT,
+        MsgTypes.MSG_PEEK_MEM,
+        MsgTypes.MSG_GET_BASE_ADDRESS,
+        MsgTypes.MSG_BATCH,
+        MsgTypes.MSG_GET_CALL_STACK,
+        MsgTypes.MSG_READ_TRACE,
+        MsgTypes.MSG_GET_PROFILE,
+        MsgTypes.MSG_READ_SYSCALL_TRACE,
+        MsgTypes.MSG_GET_SYSCALL_STATS,
+        MsgTypes.MSG_GET_SEGMENTS,
+        MsgTypes.MSG_GET_STATS,
+        MsgTypes.MSG_SET_WATCHPOINT,
+        MsgTypes.MSG_CLEAR_WATCHPOINT,
+    )
+
+    def execute(self, server_conn: ServerBackend) -> 'ServerCommand':
         logger.debug(f"Sending message {MsgTypes(self.msg_type).name}")
-        server_conn.send_message(self.msg_type, self.data)
-        msg_type, data = server_conn.recv_message()
-        if msg_type not in (MsgTypes.MSG_ACK, MsgTypes.MSG_NACK):
-            raise ConnectionError(f"Received unexpected message of type {MsgTypes(msg_type).name} from server instead of the expected ACK / NACK")
+        if self.msg_type not in self.MEMORY_PRESERVING_MSG_TYPES:
+            server_conn.mem_cache.invalidate()
+        nretries = 0
+        while True:
+            server_conn.send_message(self.msg_type, self.data)
+            msg_type, data = server_conn.recv_message(timeout=FRAME_TIMEOUT)
+            if msg_type not in (MsgTypes.MSG_ACK, MsgTypes.MSG_NACK):
+                raise ConnectionError(f"Received unexpected message of type {MsgTypes(msg_type).name} from server instead of the expected ACK / NACK")
+            # The server has received our message corrupted (or not at all), so we send it again.
+            if msg_type == MsgTypes.MSG_NACK and data[0] == ErrorCodes.ERROR_BAD_CHECKSUM and nretries < MAX_RETRIES:
+                nretries += 1
+                logger.warning(f"Message {MsgTypes(self.msg_type).name} has been corrupted, sending it again")
+                continue
+            break
         if msg_type == MsgTypes.MSG_ACK:
             self.error_code = 0
             self.data = data
@@ -179,12 +616,26 @@ class ServerCommand:
             raise ServerCommandError(f"Server command failed with error {ErrorCodes(self.error_code).name} ({self.error_code})")
 
         # If we just sent a message that caused the target to stop / terminate, we need to wait for the MSG_TARGET_STOPPED message.
-        if self.msg_type in (MsgTypes.MSG_RUN, MsgTypes.MSG_STEP, MsgTypes.MSG_CONT, MsgTypes.MSG_KILL):
+        if self.msg_type in (
+            MsgTypes.MSG_RUN,
+            MsgTypes.MSG_STEP,
+            MsgTypes.MSG_CONT,
+            MsgTypes.MSG_KILL,
+            MsgTypes.MSG_STEP_RANGE,
+            MsgTypes.MSG_STEP_FLOW,
+            MsgTypes.MSG_PROFILE
+        ):
+            # The target can run for any time, but if the frame with the MSG_TARGET_STOPPED message gets lost (or our
+            # acknowledgement of it, for which the server waits), only asking the server to resend it gets us out of
+            # waiting, so we keep asking as long as it takes.
             logger.info("Waiting for MSG_TARGET_STOPPED message from server...")
-            msg_type, data = server_conn.recv_message()
+            msg_type, data = server_conn.recv_message(timeout=FRAME_TIMEOUT, max_retries=None)
             if msg_type == MsgTypes.MSG_TARGET_STOPPED:
                 logger.debug("Received MSG_TARGET_STOPPED message from server, sending ACK")
                 server_conn.send_message(MsgTypes.MSG_ACK)
+                # The stopped target isn't necessarily the one we have resumed, and the other targets might still be
+                # running, so the memory might have changed since we've sent the command.
+                server_conn.mem_cache.invalidate()
                 # TODO: Should we let the caller create a TargetInfo object from the data? This way we wouldn't have
                 #       to import target.py here and thus prevent circular imports.
                 self.target_info = target.TargetInfo.from_buffer(data)
@@ -193,17 +644,115 @@ class ServerCommand:
                 raise ConnectionError(f"Received unexpected message {MsgTypes(msg_type).name} from server, expected MSG_TARGET_STOPPED")
         return self
 
+    @property
+    def max_reply_len(self) -> int:
+        """Maximum size of the reply data, used by SrvBatch to decide how many commands fit into one batch"""
+        return 0
+
+
+class SrvBatch:
+    """Builder for batches of commands that are executed by the server back to back with only one round trip
+
+    Only commands that don't resume the target can be batched. After execute() has been called, each command has
+    its error code and reply data set as if it had been executed on its own, but no exception is raised for failed
+    commands, the caller has to check the error codes. If the commands don't fit into one MSG_BATCH message, they are
+    split into several ones. SrvPeekMem commands that can be served from the memory cache are not sent at all.
+    """
+    BATCHABLE_MSG_TYPES = (
+        MsgTypes.MSG_SET_BPOINT,
+        MsgTypes.MSG_CLEAR_BPOINT,
+        MsgTypes.MSG_GET_BASE_ADDRESS,
+        MsgTypes.MSG_PEEK_MEM,
+        MsgTypes.MSG_GET_CALL_STACK,
+        MsgTypes.MSG_READ_TRACE,
+        MsgTypes.MSG_SET_SYSCALL_TRACE,
+        MsgTypes.MSG_SET_WATCHPOINT,
+        MsgTypes.MSG_CLEAR_WATCHPOINT,
+    )
+
+    def __init__(self):
+        self.commands: list[ServerCommand] = []
+
+    def add(self, cmd: ServerCommand) -> 'SrvBatch':
+        if cmd.msg_type not in self.BATCHABLE_MSG_TYPES:
+            raise ValueError(f"Command {MsgTypes(cmd.msg_type).name} can't be batched")
+        if cmd.max_reply_len + 3 > MAX_BATCH_REPLY_LEN:
+            raise ValueError(f"Reply of command {MsgTypes(cmd.msg_type).name} is too big for a batch")
+        self.commands.append(cmd)
+        return self
+
+    def execute(self, server_conn: ServerBackend) -> 'SrvBatch':
+        # If the batch changes the target's memory, the peeks after such a command must see the change, so we don't
+        # use the cache for the whole batch.
+        use_cache = all(cmd.msg_type in ServerCommand.MEMORY_PRESERVING_MSG_TYPES for cmd in self.commands)
+        if not use_cache:
+            server_conn.mem_cache.invalidate()
+        batch: list[ServerCommand] = []
+        data = b''
+        reply_len = 0
+        for cmd in self.commands:
+            if isinstance(cmd, SrvPeekMem) and cmd.prepare_read(server_conn, use_cache and cmd.use_cache, MAX_BATCH_REPLY_LEN - 3):
+                continue
+            cmd_data = struct.pack('>BB', cmd.msg_type, len(cmd.data or b'')) + (cmd.data or b'')
+            if batch and (len(data) + len(cmd_data) > MAX_FRAME_DATA_LEN or reply_len + cmd.max_reply_len + 3 > MAX_BATCH_REPLY_LEN):
+                self._execute_batch(server_conn, batch, data)
+                batch, data, reply_len = [], b'', 0
+            batch.append(cmd)
+            data += cmd_data
+            reply_len += cmd.max_reply_len + 3
+        if batch:
+            self._execute_batch(server_conn, batch, data)
+        return self
+
+    def _execute_batch(self, server_conn: ServerBackend, batch: list[ServerCommand], data: bytes):
+        logger.debug(f"Executing batch of {len(batch)} commands")
+        reply = ServerCommand(MsgTypes.MSG_BATCH, data=data).execute(server_conn).data
+        pos = 0
+        for cmd in batch:
+            cmd.error_code, length = struct.unpack('>BH', reply[pos : pos + 3])
+            cmd.data = reply[pos + 3 : pos + 3 + length]
+            pos += 3 + length
+            if isinstance(cmd, SrvPeekMem) and cmd.error_code == 0:
+                cmd.finish_read(server_conn)
+
 
 class SrvClearBreakpoint(ServerCommand):
     def __init__(self, bpoint_num: int):
         super().__init__(MsgTypes.MSG_CLEAR_BPOINT, data=struct.pack(M68K_UINT32, bpoint_num))
 
 
+class SrvClearWatchpoint(ServerCommand):
+    def __init__(self, wpoint_num: int):
+        super().__init__(MsgTypes.MSG_CLEAR_WATCHPOINT, data=struct.pack(M68K_UINT32, wpoint_num))
+
+
+class SrvClearSyscallTrace(ServerCommand):
+    """Restore all library functions patched by SrvSetSyscallTrace, this also discards their statistics"""
+    def __init__(self):
+        super().__init__(MsgTypes.MSG_CLEAR_SYSCALL_TRACE)
+
+
 class SrvContinue(ServerCommand):
     def __init__(self):
         super().__init__(MsgTypes.MSG_CONT)
 
 
+class SrvGetCallStack(ServerCommand):
+    def __init__(self, max_depth: int = MAX_CALL_STACK_DEPTH):
+        super().__init__(MsgTypes.MSG_GET_CALL_STACK, data=struct.pack(M68K_UINT16, max_depth))
+        self.max_depth = max_depth
+
+    @property
+    def result(self) -> list[tuple[int, int, int]]:
+        """List of (frame pointer, PC, return address) for each frame, starting with the innermost one"""
+        nframes = struct.unpack(M68K_UINT16, self.data[0:2])[0]
+        return [struct.unpack('>III', self.data[2 + i * 12 : 14 + i * 12]) for i in range(nframes)]
+
+    @property
+    def max_reply_len(self) -> int:
+        return 2 + self.max_depth * 12
+
+
 class SrvGetBaseAddress(ServerCommand):
     def __init__(self, library_name: str):
         super().__init__(MsgTypes.MSG_GET_BASE_ADDRESS, data=library_name.encode() + b'\x00')
@@ -212,10 +761,87 @@ class SrvGetBaseAddress(ServerCommand):
     def result(self):
         return struct.unpack(M68K_UINT32, self.data[0:4])[0]
 
+    @property
+    def max_reply_len(self) -> int:
+        return 4
 
-class SrvInit(ServerCommand):
+
+class SrvGetProfile(ServerCommand):
+    def __init__(self):
+        super().__init__(MsgTypes.MSG_GET_PROFILE)
+
+    @property
+    def result(self) -> Profile:
+        # The server sends its Profile structure as it is (all fields are dwords), see target.h.
+        interval_us, bin_shift, nsamples, nsamples_waiting, nsamples_outside, nbins = struct.unpack('>IIIIII', self.data[0:24])
+        bins = list(struct.unpack(f'>{nbins}I', self.data[24 : 24 + nbins * 4]))
+        return Profile(interval_us, bin_shift, nsamples, nsamples_waiting, nsamples_outside, bins)
+
+
+class SrvGetSegments(ServerCommand):
+    def __init__(self):
+        super().__init__(MsgTypes.MSG_GET_SEGMENTS)
+
+    @property
+    def result(self) -> list[tuple[int, int]]:
+        """List of (address, size) for each segment, in the order of the hunks in the executable"""
+        nsegs = struct.unpack(M68K_UINT16, self.data[0:2])[0]
+        return [struct.unpack('>II', self.data[2 + i * 8 : 10 + i * 8]) for i in range(nsegs)]
+
+    @property
+    def max_reply_len(self) -> int:
+        return 2 + MAX_SEGMENTS * 8
+
+
+class SrvGetStats(ServerCommand):
     def __init__(self):
-        super().__init__(MsgTypes.MSG_INIT)
+        super().__init__(MsgTypes.MSG_GET_STATS)
+
+    @property
+    def eclock_freq(self) -> int:
+        return struct.unpack(M68K_UINT32, self.data[0:4])[0]
+
+    @property
+    def result(self) -> ServerStats:
+        # The server sends the E clock frequency followed by its ServerStats structure (all fields are dwords).
+        counters = struct.unpack('>9I', self.data[4:40])
+        return ServerStats(*counters[0:7], (counters[7] << 32) | counters[8])
+
+    @property
+    def max_reply_len(self) -> int:
+        return 40
+
+
+class SrvGetSyscallStats(ServerCommand):
+    def __init__(self):
+        super().__init__(MsgTypes.MSG_GET_SYSCALL_STATS)
+
+    @property
+    def eclock_freq(self) -> int:
+        return struct.unpack(M68K_UINT32, self.data[0:4])[0]
+
+    @property
+    def result(self) -> list[SyscallStats]:
+        """Statistics of all traced functions that have been called at least once"""
+        nentries = struct.unpack(M68K_UINT16, self.data[4:6])[0]
+        stats = []
+        for pos in range(6, 6 + nentries * 18, 18):
+            lib_base, offset, ncalls, ticks_hi, ticks_lo = struct.unpack('>IHIII', self.data[pos : pos + 18])
+            stats.append(SyscallStats(lib_base, offset, ncalls, (ticks_hi << 32) | ticks_lo))
+        return stats
+
+
+class SrvInit(ServerCommand):
+    def __init__(self, features: int = PROTO_SUPPORTED_FEATURES):
+        super().__init__(MsgTypes.MSG_INIT, data=struct.pack('>HH', PROTO_VERSION, features))
+
+    @property
+    def version(self):
+        return struct.unpack(M68K_UINT16, self.data[0:2])[0]
+
+    @property
+    def features(self):
+        return struct.unpack(M68K_UINT16, self.data[2:4])[0]
 
 
 class SrvKill(ServerCommand):
@@ -224,29 +850,236 @@ class SrvKill(ServerCommand):
 
 
 class SrvPeekMem(ServerCommand):
-    def __init__(self, address: int, nbytes: int):
+    """Read target memory through the memory cache of the connection
+
+    The pages of the range that are not in the cache yet are read with one message and put into the cache. With
+    use_cache = False, the range is always read from the target and not put into the cache.
+    """
+    def __init__(self, address: int, nbytes: int, use_cache: bool = True):
         super().__init__(MsgTypes.MSG_PEEK_MEM, data=struct.pack(M68K_UINT32, address) + struct.pack(M68K_UINT16, nbytes))
+        self.address = address
+        self.nbytes = nbytes
+        self.use_cache = use_cache
+        # range that is actually read, set by prepare_read()
+        self._read_address = address
+        self._read_nbytes = nbytes
+        self._f_cached_read = False
+
+    def execute(self, server_conn: ServerBackend) -> 'SrvPeekMem':
+        if not self.prepare_read(server_conn, self.use_cache):
+            super().execute(server_conn)
+            self.finish_read(server_conn)
+        return self
+
+    def prepare_read(self, server_conn: ServerBackend, use_cache: bool = True, max_nbytes: int = MAX_MSG_DATA_LEN) -> bool:
+        """Take the data from the cache and return True if possible, otherwise set up the message for reading the missing pages"""
+        self._read_address, self._read_nbytes, self._f_cached_read = self.address, self.nbytes, False
+        cache = server_conn.mem_cache
+        if use_cache and cache.is_cacheable(self.address, self.nbytes):
+            if (data := cache.get(self.address, self.nbytes)) is not None:
+                logger.debug(f"Taking {self.nbytes} bytes at address {hex(self.address)} from memory cache")
+                self.error_code = 0
+                self.data = data
+                return True
+            # Without fragments, the reply has to fit into one frame. If the pages don't fit, we read just the range itself.
+            if not (server_conn.features & PROTO_FEATURE_FRAGMENTS):
+                max_nbytes = min(max_nbytes, MAX_FRAME_DATA_LEN)
+            missing = cache.get_missing_range(self.address, self.nbytes)
+            if missing is not None and missing[1] <= max_nbytes:
+                self._read_address, self._read_nbytes = missing
+                self._f_cached_read = True
+        self.data = struct.pack(M68K_UINT32, self._read_address) + struct.pack(M68K_UINT16, self._read_nbytes)
+        return False
+
+    def finish_read(self, server_conn: ServerBackend):
+        """Put the pages read into the cache and extract the requested range from them"""
+        if self._f_cached_read:
+            server_conn.mem_cache.put(self._read_address, self.data)
+            self.data = server_conn.mem_cache.get(self.address, self.nbytes)
+
+    @property
+    def max_reply_len(self) -> int:
+        return self._read_nbytes
 
     @property
     def result(self):
         return self.data
 
 
+class SrvProfile(ServerCommand):
+    """Run the target and sample its PC every interval_us microseconds, the profile can be read with SrvGetProfile"""
+    def __init__(self, interval_us: int = 10000, bin_shift: int = 2):
+        super().__init__(MsgTypes.MSG_PROFILE, data=struct.pack(M68K_UINT32, interval_us) + struct.pack(M68K_UINT16, bin_shift))
+
+
 class SrvQuit(ServerCommand):
     def __init__(self):
         super().__init__(MsgTypes.MSG_QUIT)
 
 
+class SrvReadTrace(ServerCommand):
+    """Read (and remove) the records written by the tracepoints from the server's trace buffer
+
+    The server returns only as many records as fit into one reply, so the command needs to be repeated as long as
+    nremaining is not 0. max_records = 0 means no limit.
+    """
+    def __init__(self, max_records: int = 0):
+        super().__init__(MsgTypes.MSG_READ_TRACE, data=struct.pack(M68K_UINT16, max_records))
+
+    @property
+    def eclock_freq(self) -> int:
+        return struct.unpack(M68K_UINT32, self.data[0:4])[0]
+
+    @property
+    def noverruns(self) -> int:
+        """Number of records dropped so far because the buffer was full"""
+        return struct.unpack(M68K_UINT32, self.data[4:8])[0]
+
+    @property
+    def nremaining(self) -> int:
+        return struct.unpack(M68K_UINT32, self.data[8:12])[0]
+
+    @property
+    def result(self) -> list[TraceRecord]:
+        nrecords = struct.unpack(M68K_UINT16, self.data[12:14])[0]
+        records = []
+        pos = 14
+        for _ in range(nrecords):
+            bpoint_num, pc, ts_hi, ts_lo, reg_mask = struct.unpack('>IIIIH', self.data[pos : pos + 18])
+            pos += 18
+            regs = {}
+            for reg_num in range(NUM_TRACE_REGS):
+                if reg_mask & (1 << reg_num):
+                    regs[reg_num] = struct.unpack(M68K_UINT32, self.data[pos : pos + 4])[0]
+                    pos += 4
+            records.append(TraceRecord(bpoint_num, pc, (ts_hi << 32) | ts_lo, regs))
+        return records
+
+    @property
+    def max_reply_len(self) -> int:
+        return MAX_TRACE_REPLY_LEN
+
+
+class SrvReadSyscallTrace(SrvReadTrace):
+    """Read (and remove) the records of the traced library calls, works like SrvReadTrace"""
+    def __init__(self, max_records: int = 0):
+        # same data and reply header as MSG_READ_TRACE, only the records differ
+        super().__init__(max_records)
+        self.msg_type = MsgTypes.MSG_READ_SYSCALL_TRACE
+
+    @property
+    def result(self) -> list[SyscallRecord]:
+        nrecords = struct.unpack(M68K_UINT16, self.data[12:14])[0]
+        records = []
+        pos = 14
+        for _ in range(nrecords):
+            lib_base, offset, reg_mask, ts_hi, ts_lo, elapsed, result = struct.unpack('>IHHIIII', self.data[pos : pos + 24])
+            pos += 24
+            regs = {}
+            for reg_num in range(NUM_TRACE_REGS):
+                if reg_mask & (1 << reg_num):
+                    regs[reg_num] = struct.unpack(M68K_UINT32, self.data[pos : pos + 4])[0]
+                    pos += 4
+            records.append(SyscallRecord(lib_base, offset, (ts_hi << 32) | ts_lo, elapsed, result, regs))
+        return records
+
+
 class SrvRun(ServerCommand):
     def __init__(self):
         super().__init__(MsgTypes.MSG_RUN)
 
 
+class SrvSelectTarget(ServerCommand):
+    """Select the target (numbered from 1 in the order the server has loaded them) the following commands address
+
+    The server reports the stops of all targets, the TargetInfo of a MSG_TARGET_STOPPED message contains the ID of
+    the target that has stopped, which is selected then.
+    """
+    def __init__(self, target_id: int):
+        super().__init__(MsgTypes.MSG_SELECT_TARGET, data=struct.pack(M68K_UINT16, target_id))
+
+    @property
+    def result(self) -> target.TargetInfo:
+        return target.TargetInfo.from_buffer_copy(self.data)
+
+    @property
+    def max_reply_len(self) -> int:
+        return sizeof(target.TargetInfo)
+
+
 class SrvSetBreakpoint(ServerCommand):
-    def __init__(self, bpoint_offset: int, is_one_shot: bool = False):
-        super().__init__(MsgTypes.MSG_SET_BPOINT, data=struct.pack(M68K_UINT32, bpoint_offset) + struct.pack(M68K_UINT16, is_one_shot))
+    def __init__(self, bpoint_offset: int, is_one_shot: bool = False, condition: BreakpointCondition | None = None):
+        # The condition is optional, the server only evaluates it if it is present.
+        bpoint_type = BreakpointTypes.BPOINT_TYPE_ONE_SHOT if is_one_shot else BreakpointTypes.BPOINT_TYPE_REGULAR
+        super().__init__(
+            MsgTypes.MSG_SET_BPOINT,
+            data=struct.pack(M68K_UINT32, bpoint_offset) + struct.pack(M68K_UINT16, bpoint_type) + (bytes(condition) if condition else b'')
+        )
+
+
+class SrvSetTracepoint(ServerCommand):
+    def __init__(self, bpoint_offset: int, reg_mask: int, condition: BreakpointCondition | None = None):
+        # A tracepoint always carries a condition, even if it's just the default one that is always true.
+        super().__init__(
+            MsgTypes.MSG_SET_BPOINT,
+            data=struct.pack(M68K_UINT32, bpoint_offset)
+                + struct.pack(M68K_UINT16, BreakpointTypes.BPOINT_TYPE_TRACE)
+                + bytes(condition or BreakpointCondition(size=4))
+                + struct.pack(M68K_UINT16, reg_mask)
+        )
+
+
+class SrvSetSyscallTrace(ServerCommand):
+    """Trace calls of library functions, given as (offset, register mask) tuples, without stopping the target
+
+    The functions have to fit into one frame (also as part of a batch), use for_functions() to split long lists.
+    """
+    def __init__(self, library_name: str, funcs: list[tuple[int, int]]):
+        super().__init__(
+            MsgTypes.MSG_SET_SYSCALL_TRACE,
+            data=library_name.encode() + b'\x00' + b''.join(struct.pack('>HH', offset, reg_mask) for offset, reg_mask in funcs)
+        )
+
+    @staticmethod
+    def for_functions(library_name: str, funcs: list[tuple[int, int]]) -> list['SrvSetSyscallTrace']:
+        # 2 bytes for the header of the command in a batch, 1 byte for the null byte of the library name
+        nfuncs = (MAX_FRAME_DATA_LEN - 2 - len(library_name) - 1) // 4
+        return [SrvSetSyscallTrace(library_name, funcs[i : i + nfuncs]) for i in range(0, len(funcs), nfuncs)]
+
+
+class SrvSetWatchpoint(ServerCommand):
+    """Stop the target when the memory at the address changes (at most MAX_WATCH_SIZE bytes)
+
+    While there are watchpoints, the server traces the target when it is resumed with SrvContinue, so the target runs
+    much slower than usual. The memory below the stack pointer can't be watched.
+    """
+    def __init__(self, address: int, nbytes: int):
+        super().__init__(MsgTypes.MSG_SET_WATCHPOINT, data=struct.pack('>IH', address, nbytes))
+
+    @property
+    def result(self) -> int:
+        """Number of the watchpoint"""
+        return struct.unpack(M68K_UINT32, self.data[0:4])[0]
+
+    @property
+    def max_reply_len(self) -> int:
+        return 4
 
 
 class SrvSingleStep(ServerCommand):
     def __init__(self):
         super().__init__(MsgTypes.MSG_STEP)
+
+
+class SrvStepFlow(ServerCommand):
+    """Execute target until the next branch, jump, subroutine call or return (only on 68020 - 68040)"""
+    def __init__(self):
+        super().__init__(MsgTypes.MSG_STEP_FLOW)
+
+
+class SrvStepRange(ServerCommand):
+    def __init__(self, start_offset: int, end_offset: int, step_over: bool = False):
+        super().__init__(
+            MsgTypes.MSG_STEP_RANGE,
+            data=struct.pack(M68K_UINT32, start_offset) + struct.pack(M68K_UINT32, end_offset) + struct.pack(M68K_UINT16, step_over)
+        )
@@ -6,6 +6,11 @@
 # Copyright(C) 2018-2022 Constantin Wiemer
 
 
+import mmap
+import struct
+from array import array
+from bisect import bisect_left, bisect_right
+from collections.abc import Sequence
 from copy import copy
 from dataclasses import dataclass, field
 from enum import IntEnum
@@ -13,6 +18,13 @@ from ctypes import BigEndianStructure, c_uint8, c_uint16, c_uint32, sizeof
 from loguru import logger
 
 
+# format of the cache files written by ProgramWithDebugInfo.save_to_cache()
+DEBUG_INFO_CACHE_MAGIC = b'CWDBGDI\x00'
+DEBUG_INFO_CACHE_VERSION = 1
+DEBUG_INFO_CACHE_BOM = 0x0102
+DEBUG_INFO_CACHE_HEADER = '=8sHHI'     # magic, byte-order mark, version, size of key
+
+
 # stab types / names from binutils-gdb/include/aout/stab.def
 class StabTypes(IntEnum):
     N_UNDF    = 0x00
@@ -119,7 +131,7 @@ class ProgramNode:
 
     @staticmethod
     def print_node(node: 'ProgramNode', indent: int = 0):
-        logger.debug(' ' * indent + str(node))
+        logger.opt(lazy=True).debug("{}", lambda: ' ' * indent + str(node))
         indent += 4
         for child in node.children:
             ProgramNode.print_node(child, indent)
@@ -134,6 +146,69 @@ class Type:
     num_bits: int = None
 
 
+class AddressIndex:
+    """Table of address ranges sorted by start address, the range containing an address is found by bisection
+
+    The ranges must not overlap. An end address of 0 means that the end is not known. If open_ended is True, such a
+    range extends up to the start of the next range, otherwise it never contains any address. The columns can be
+    any sequences, also views of a memory-mapped cache file.
+    """
+    def __init__(self, start_addrs: Sequence[int], end_addrs: Sequence[int], values: Sequence, open_ended: bool):
+        self.start_addrs = start_addrs
+        self.end_addrs = end_addrs
+        self.values = values
+        self._open_ended = open_ended
+
+    @staticmethod
+    def from_ranges(ranges: list[tuple[int, int, object]], open_ended: bool) -> 'AddressIndex':
+        # empty ranges (e. g. lines without any code) would hide the range starting at the same address
+        ranges = sorted([r for r in ranges if r[1] == 0 or r[1] > r[0]], key=lambda r: r[0])
+        return AddressIndex([r[0] for r in ranges], [r[1] for r in ranges], [r[2] for r in ranges], open_ended)
+
+    def lookup(self, addr: int) -> object | None:
+        idx = bisect_right(self.start_addrs, addr) - 1
+        if idx < 0:
+            return None
+        end_addr = self.end_addrs[idx]
+        if addr < end_addr or (end_addr == 0 and self._open_ended):
+            return self.values[idx]
+        return None
+
+
+class RangeTable:
+    """Table of address ranges sorted by a key (line number or function name), the range for a key is found by bisection"""
+    def __init__(self, keys: Sequence, start_addrs: Sequence[int], end_addrs: Sequence[int]):
+        self.keys = keys
+        self.start_addrs = start_addrs
+        self.end_addrs = end_addrs
+
+    @staticmethod
+    def from_dict(ranges_by_key: dict[object, tuple[int, int]]) -> 'RangeTable':
+        keys = sorted(ranges_by_key.keys())
+        return RangeTable(keys, [ranges_by_key[k][0] for k in keys], [ranges_by_key[k][1] for k in keys])
+
+    def get(self, key: object) -> tuple[int, int] | None:
+        idx = bisect_left(self.keys, key)
+        if idx < len(self.keys) and self.keys[idx] == key:
+            return self.start_addrs[idx], self.end_addrs[idx]
+        return None
+
+
+class _MappedStrings(Sequence):
+    """Strings in the string table of a memory-mapped cache file, referenced by their offsets"""
+    def __init__(self, mm: mmap.mmap, base: int, offsets: Sequence[int]):
+        self._mm = mm
+        self._base = base
+        self._offsets = offsets
+
+    def __len__(self) -> int:
+        return len(self._offsets)
+
+    def __getitem__(self, idx: int) -> str:
+        start = self._base + self._offsets[idx]
+        return self._mm[start : self._mm.find(b'\x00', start)].decode('ascii')
+
+
 class ProgramWithDebugInfo:
     def __init__(self, stabs: list[Stab]):
         builder = DataDictBuilder(stabs)
@@ -142,8 +217,112 @@ class ProgramWithDebugInfo:
         builder = ProgramTreeBuilder(stabs)
         builder.build()
         self._program_tree = builder.get_tree()
-        self._addresses_by_lineno = builder.get_addresses_by_lineno()
+        self._comp_unit_index = builder.get_comp_unit_index()
+        self._line_indexes = builder.get_line_indexes()
+        self._line_tables = {
+            comp_unit: RangeTable.from_dict(addresses)
+            for comp_unit, addresses in builder.get_addresses_by_lineno().items()
+        }
+        self._func_index = builder.get_func_index()
+        self._func_table = RangeTable.from_dict(builder.get_addresses_by_func_name())
+        self._cache_mmap = None
+
+
+    @staticmethod
+    def load_from_cache(fname: str, key: bytes) -> 'ProgramWithDebugInfo | None':
+        """Map the lookup tables written by save_to_cache() into memory, returns None if the file doesn't match the key
+
+        The program tree is not part of the cache, so a program loaded this way only supports the lookups.
+        """
+        try:
+            with open(fname, 'rb') as f:
+                mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        except (OSError, ValueError) as e:
+            # An empty file can't be mapped, for example.
+            logger.warning(f"Could not map cache file '{fname}': {e}")
+            return None
+        try:
+            magic, bom, version, key_len = struct.unpack_from(DEBUG_INFO_CACHE_HEADER, mm)
+            pos = struct.calcsize(DEBUG_INFO_CACHE_HEADER)
+            if (magic, bom, version) != (DEBUG_INFO_CACHE_MAGIC, DEBUG_INFO_CACHE_BOM, DEBUG_INFO_CACHE_VERSION) \
+                    or mm[pos : pos + key_len] != key:
+                logger.debug(f"Cache file '{fname}' has wrong format or is outdated")
+                mm.close()
+                return None
+            pos += (key_len + 3) & ~3
+            nwords = struct.unpack_from('=I', mm, pos)[0]
+            words = memoryview(mm)[pos + 4 : pos + 4 + nwords * 4].cast('I')
+            strings_base = pos + 4 + nwords * 4
+            wpos = 0
+
+            def read_table(ncolumns: int) -> list[Sequence[int]]:
+                nonlocal wpos
+                nentries = words[wpos]
+                columns = [words[wpos + 1 + i * nentries : wpos + 1 + (i + 1) * nentries] for i in range(ncolumns)]
+                wpos += 1 + ncolumns * nentries
+                return columns
+
+            program = ProgramWithDebugInfo.__new__(ProgramWithDebugInfo)
+            program._program_tree = None
+            starts, ends, names = read_table(3)
+            program._comp_unit_index = AddressIndex(starts, ends, _MappedStrings(mm, strings_base, names), open_ended=True)
+            starts, ends, names = read_table(3)
+            program._func_index = AddressIndex(starts, ends, _MappedStrings(mm, strings_base, names), open_ended=True)
+            names, starts, ends = read_table(3)
+            program._func_table = RangeTable(_MappedStrings(mm, strings_base, names), starts, ends)
+            program._line_indexes = {}
+            program._line_tables = {}
+            (comp_unit_names,) = read_table(1)
+            for comp_unit in _MappedStrings(mm, strings_base, comp_unit_names):
+                program._line_indexes[comp_unit] = AddressIndex(*read_table(3), open_ended=False)
+                program._line_tables[comp_unit] = RangeTable(*read_table(3))
+            program._cache_mmap = mm
+            return program
+        except (IndexError, ValueError, TypeError, struct.error) as e:
+            # The mapping can't be closed while views of it exist, it goes away together with them.
+            logger.warning(f"Cache file '{fname}' is corrupted: {e}")
+            return None
+
 
+    def save_to_cache(self, fname: str, key: bytes):
+        """Write the lookup tables to a cache file that load_from_cache() can map into memory
+
+        All numbers are stored as 32-bit words in the native byte order so that the tables can be used as they are,
+        each table as number of entries followed by its columns. Strings are stored in a string table at the end of
+        the file and referenced by their offset. The key identifies the version of the executable the tables were
+        created from.
+        """
+        words = array('I')
+        strings = bytearray()
+        string_offsets: dict[str, int] = {}
+
+        def add_string(string: str) -> int:
+            if string not in string_offsets:
+                string_offsets[string] = len(strings)
+                strings.extend(string.encode('ascii') + b'\x00')
+            return string_offsets[string]
+
+        def add_table(*columns: Sequence):
+            words.append(len(columns[0]))
+            for column in columns:
+                words.extend(add_string(v) if isinstance(v, str) else v for v in column)
+
+        add_table(self._comp_unit_index.start_addrs, self._comp_unit_index.end_addrs, self._comp_unit_index.values)
+        add_table(self._func_index.start_addrs, self._func_index.end_addrs, self._func_index.values)
+        add_table(self._func_table.keys, self._func_table.start_addrs, self._func_table.end_addrs)
+        add_table(list(self._line_indexes.keys()))
+        for comp_unit, line_index in self._line_indexes.items():
+            add_table(line_index.start_addrs, line_index.end_addrs, line_index.values)
+            line_table = self._line_tables[comp_unit]
+            add_table(line_table.keys, line_table.start_addrs, line_table.end_addrs)
+
+        header = struct.pack(DEBUG_INFO_CACHE_HEADER, DEBUG_INFO_CACHE_MAGIC, DEBUG_INFO_CACHE_BOM, DEBUG_INFO_CACHE_VERSION, len(key))
+        with open(fname, 'wb') as f:
+            f.write(header)
+            f.write(key + b'\x00' * (-len(key) % 4))
+            f.write(struct.pack('=I', len(words)))
+            f.write(words.tobytes())
+            f.write(strings)
 
 
     @staticmethod
@@ -152,47 +331,40 @@ class ProgramWithDebugInfo:
         # the size of the stabs table in bytes for this compilation unit (including this first stab), the value field
         # is the size of the string table. This format is somewhat described in the file binutils-gdb/bfd/stabs.c
         # of the GNU Binutils and GDB sources.
-        offset = 0
-        stab = Stab.from_buffer_copy(data[offset:])
+        # The stabs and strings are read in place (without copying the rest of the table for each of them), and
+        # the log message for each stab is only formatted if debug messages are enabled.
+        stab = Stab.from_buffer_copy(data)
         if stab.type == StabTypes.N_UNDF:
             num_stabs  = int(stab.desc / sizeof(Stab))
-            offset += sizeof(Stab)
-            stab_table = data[offset:]  # stab table without first stab
-            string_table  = data[offset + sizeof(Stab) * num_stabs:]
+            # stab table without first stab
+            stab_table_offset = sizeof(Stab)
+            string_table_offset = sizeof(Stab) + sizeof(Stab) * num_stabs
             logger.debug(f"Stab table contains {num_stabs} entries")
         else:
             raise ValueError("Stab table does not start with stab N_UNDF")
 
-        offset  = 0
         stabs: list[Stab] = []
-        for i in range(0, num_stabs - 1):
-            stab = Stab.from_buffer_copy(stab_table[offset:])
-            stab.string = ProgramWithDebugInfo._get_string_from_buffer(string_table[stab.offset:])
-            offset += sizeof(stab)
+        for offset in range(stab_table_offset, stab_table_offset + (num_stabs - 1) * sizeof(Stab), sizeof(Stab)):
+            stab = Stab.from_buffer_copy(data, offset)
+            stab.string = ProgramWithDebugInfo._get_string_from_buffer(data, string_table_offset + stab.offset)
             try:
-                logger.debug("Stab(type={}, string='{}' (at 0x{:x}), other=0x{:x}, desc=0x{:x}, value=0x{:08x})".format(
-                    StabTypes(stab.type).name,
-                    stab.string,
-                    stab.offset,
-                    stab.other,
-                    stab.desc,
-                    stab.value
-                ))
+                type_name = StabTypes(stab.type).name
             except ValueError:
                 try:
                     # stab probably contains external symbol => clear N_EXT bit to look up name
-                    logger.debug("Stab(type={}, string='{}' (at 0x{:x}), other=0x{:x}, desc=0x{:x}, value=0x{:08x})".format(
-                            StabTypes(stab.type & ~StabTypes.N_EXT).name,
-                            stab.string,
-                            stab.offset,
-                            stab.other,
-                            stab.desc,
-                            stab.value
-                        )
-                    )
+                    type_name = StabTypes(stab.type & ~StabTypes.N_EXT).name
                 except ValueError:
                     logger.error(f"Stab with unknown type 0x{stab.type:02x} found")
                     continue
+            logger.opt(lazy=True).debug(
+                "Stab(type={}, string='{}' (at 0x{:x}), other=0x{:x}, desc=0x{:x}, value=0x{:08x})",
+                lambda: type_name,
+                lambda: stab.string,
+                lambda: stab.offset,
+                lambda: stab.other,
+                lambda: stab.desc,
+                lambda: stab.value
+            )
 
             if stab.type in (
                 StabTypes.N_SO,
@@ -212,63 +384,47 @@ class ProgramWithDebugInfo:
 
     def get_addr_range_for_lineno(self, lineno: int, comp_unit: str | None = None) -> tuple[int, int] | None:
         if comp_unit is None:
-            if len(self._addresses_by_lineno.keys()) == 1:
-                comp_unit = next(iter(self._addresses_by_lineno.keys()))
+            if len(self._line_tables.keys()) == 1:
+                comp_unit = next(iter(self._line_tables.keys()))
             else:
                 raise ValueError("Compilation unit can't be omitted because the program consists of more than one")
-        if comp_unit in self._addresses_by_lineno and lineno in self._addresses_by_lineno[comp_unit]:
-            return self._addresses_by_lineno[comp_unit][lineno]
+        if comp_unit in self._line_tables:
+            return self._line_tables[comp_unit].get(lineno)
         else:
             return None
 
 
-    def get_addr_range_for_func_name(self, name: str) -> int | None:
-        raise NotImplementedError
+    def get_addr_range_for_func_name(self, name: str) -> tuple[int, int] | None:
+        # The end address is 0 for the last function of the program.
+        return self._func_table.get(name)
 
 
     def get_comp_unit_for_addr(self, addr: int) -> str | None:
-        for child in self._program_tree.children:
-            if child.type == StabTypes.N_SO:
-                if addr >= child.start_addr:
-                    # TODO: How to get end address for the last compilation unit so that we can correctly tell if an address is contained in it?
-                    # TODO: Compile startup code (from libnix) with debug information so that it shows up as compilation unit
-                    if child.end_addr == 0 or addr < child.end_addr:
-                        return child.name
-            else:
-                raise AssertionError(f"Found top-level node that is not a compilation unit, type = {StabTypes(child.type).name}")
-        else:
-            return None
+        # TODO: How to get end address for the last compilation unit so that we can correctly tell if an address is contained in it?
+        # TODO: Compile startup code (from libnix) with debug information so that it shows up as compilation unit
+        return self._comp_unit_index.lookup(addr)
 
 
     def get_lineno_for_addr(self, addr: int, comp_unit: str | None = None) -> int | None:
-        # TODO: Store address ranges in a segment tree so we can look up the line number for an address more quickly.
-        #       See https://leetcode.com/problems/range-sum-query-mutable/discuss/75784/python-well-commented-solution-using-segment-trees
         if comp_unit is None:
-            if len(self._addresses_by_lineno.keys()) == 1:
-                comp_unit = next(iter(self._addresses_by_lineno.keys()))
+            if len(self._line_indexes.keys()) == 1:
+                comp_unit = next(iter(self._line_indexes.keys()))
             else:
                 raise ValueError("Compilation unit can't be omitted because the program consists of more than one")
-        if comp_unit in self._addresses_by_lineno:
-            for lineno, addr_range in self._addresses_by_lineno[comp_unit].items():
-                if addr_range[0] <= addr < addr_range[1]:
-                    return lineno
-            else:
-                return None
+        if comp_unit in self._line_indexes:
+            return self._line_indexes[comp_unit].lookup(addr)
         else:
             return None
 
 
     def get_func_name_for_addr(self, addr: int) -> str | None:
-        raise NotImplementedError
+        return self._func_index.lookup(addr)
 
 
     @staticmethod
-    def _get_string_from_buffer(buffer: bytes) -> str:
-        idx = 0
-        while idx < len(buffer) and buffer[idx] != 0:
-            idx += 1
-        if idx < len(buffer):
-            return buffer[0:idx].decode('ascii')
+    def _get_string_from_buffer(buffer: bytes, offset: int = 0) -> str:
+        if (idx := buffer.find(b'\x00', offset)) != -1:
+            return buffer[offset:idx].decode('ascii')
         else:
             raise ValueError("No terminating NUL byte found in buffer")
 
@@ -292,24 +448,27 @@ class DataDictBuilder:
 
 
 # We build a tree structure from the stabs describing the program (sort of a simplified AST) because we need
-# to know which local variables a scope contains. In addition, we store the line number - address tuples for fast lookup.
+# to know which local variables a scope contains. In addition, we store the line number - address tuples for fast lookup
+# and build the indexes for looking up compilation unit, line number and function for an address.
 class ProgramTreeBuilder:
     def __init__(self, stabs: list[Stab]):
         self._stabs = [stab for stab in stabs if not (stab.type == StabTypes.N_LSYM and stab.value == 0)]
         self._nodes_stack: list[ProgramNode] = []
         self._func_nodes_stack: list[ProgramNode] = []
         self._addresses_by_lineno: dict[str, dict[int, tuple[int, int]]] = {}
+        self._addresses_by_func_name: dict[str, tuple[int, int]] = {}
 
     def build(self):
         self._root_node = ProgramNode(StabTypes.N_UNDF, '')
         # reverse list so build() can use pop()
         self._stabs.reverse()
         while self._stabs:
-            # loop over all compilation units
-            comp_unit_node = self._build_subtree()
-            self._root_node.children.append(comp_unit_node)
+            # loop over all compilation units (there is no node if only an end marker was left)
+            if (comp_unit_node := self._build_subtree()) is not None:
+                self._root_node.children.append(comp_unit_node)
         logger.debug("Program tree:")
         ProgramNode.print_node(self._root_node)
+        self._build_indexes()
     
 
     def get_tree(self) -> ProgramNode:
@@ -320,11 +479,55 @@ class ProgramTreeBuilder:
         return self._addresses_by_lineno
 
 
+    def get_comp_unit_index(self) -> AddressIndex:
+        return self._comp_unit_index
+
+
+    def get_line_indexes(self) -> dict[str, AddressIndex]:
+        return self._line_indexes
+
+
+    def get_func_index(self) -> AddressIndex:
+        return self._func_index
+
+
+    def get_addresses_by_func_name(self) -> dict[str, tuple[int, int]]:
+        return self._addresses_by_func_name
+
+
+    def _build_indexes(self):
+        self._comp_unit_index = AddressIndex.from_ranges(
+            [(node.start_addr, node.end_addr, node.name) for node in self._root_node.children],
+            open_ended=True
+        )
+        # The end address of the last line of a compilation unit is not known (see _build_subtree()), so we don't
+        # guess it is the rest of the program.
+        self._line_indexes = {
+            comp_unit: AddressIndex.from_ranges(
+                [(start_addr, end_addr, lineno) for lineno, (start_addr, end_addr) in addresses.items()],
+                open_ended=False
+            )
+            for comp_unit, addresses in self._addresses_by_lineno.items()
+        }
+        # Functions can also be nested in scopes of other functions.
+        func_ranges = []
+        nodes = list(self._root_node.children)
+        while nodes:
+            node = nodes.pop()
+            if node.type == StabTypes.N_FUN:
+                func_ranges.append((node.start_addr, node.end_addr, node.name))
+                # for static functions with the same name in several compilation units we use the one with the lowest address
+                if node.name not in self._addresses_by_func_name or node.start_addr < self._addresses_by_func_name[node.name][0]:
+                    self._addresses_by_func_name[node.name] = (node.start_addr, node.end_addr)
+            nodes.extend(node.children)
+        self._func_index = AddressIndex.from_ranges(func_ranges, open_ended=True)
+
+
     def _build_subtree(self,
         current_comp_unit: str = None,
         current_func_lineno: int = None,
         prev_lineno: int = None,
-    ) -> ProgramNode:
+    ) -> ProgramNode | None:
         # The stabs are emitted by the compiler (at least by GCC) in two different orders. Local variables (and nested
         # functions) appear *before* the enclosing scope. The same is true for line number - address pairs, they appear
         # before the function definition. Therefore we push their nodes onto a stack when we see them and pop them again
@@ -342,7 +545,11 @@ class ProgramTreeBuilder:
             if stab.type == StabTypes.N_SO:
                 if node is None:
                     # new compilation unit => create new node
-                    if stab.string.endswith('/'):
+                    if stab.string == '':
+                        # N_SO stab with empty name marks the end of the previous compilation unit (emitted by newer
+                        # versions of GCC), it has already been used as its end address
+                        continue
+                    elif stab.string.endswith('/'):
                         # stab for source directory
                         srcdir = stab.string
                     else:
@@ -350,11 +557,17 @@ class ProgramTreeBuilder:
                         node = ProgramNode(StabTypes.N_SO, srcdir + stab.string, start_addr=stab.value)
                         current_comp_unit = srcdir + stab.string
                         self._addresses_by_lineno[current_comp_unit] = {}
+                elif node.type == StabTypes.N_FUN:
+                    # end of compilation unit is also the end of its last function => use start address of next
+                    # compilation unit as end address of the function and return it
+                    self._stabs.append(stab)
+                    node.end_addr = stab.value
+                    return node
                 else:
                     # end of compilation unit => use start address of next compilation unit as end address of this one,
                     #                            add any functions on the stack to current node and return it
                     # TODO: Can we get an end address if there is only one compilation unit?
-                    self._stabs.append((stab, stab.string))
+                    self._stabs.append(stab)
                     node.end_addr = stab.value
                     node.children.extend(self._func_nodes_stack)
                     self._func_nodes_stack.clear()
@@ -457,7 +670,7 @@ class ProgramTreeBuilder:
                 raise AssertionError(f"Unknown stab type {StabTypes(stab.type).name}")
 
         # add any functions on the stack to compilation unit and return it
-        if node.type == StabTypes.N_SO:
+        if node is not None and node.type == StabTypes.N_SO:
             node.children.extend(self._func_nodes_stack)
             self._func_nodes_stack.clear()
         return node
@@ -5,15 +5,16 @@
 # Copyright(C) 2018-2022 Constantin Wiemer
 
 
+import os
 import struct
 import sys
-from ctypes import BigEndianStructure, c_uint8, c_uint16, c_uint32
+from ctypes import BigEndianStructure, c_uint8, c_uint16, c_uint32, memmove, sizeof
 from dataclasses import dataclass
 from enum import IntEnum
 
-import capstone
 from loguru import logger
 
+import hunklib
 # We can't use from server import ... because of the circular import target.py <-> server.py.
 import server
 from debugger import dbg
@@ -31,6 +32,19 @@ M68K_INT16  = '>h'
 M68K_UINT32 = '>I'
 
 
+# contents of the source files already read by get_source_view(), by file name together with the modification time
+_source_files: dict[str, tuple[int, list[str]]] = {}
+
+
+def _get_source_lines(fname: str) -> list[str]:
+    mtime = os.stat(fname).st_mtime_ns
+    if fname not in _source_files or _source_files[fname][0] != mtime:
+        with open(fname) as f:
+            _source_files[fname] = (mtime, [f'{lineno + 1:<4}:    {line}' for lineno, line in enumerate(f.readlines())])
+    # The caller modifies the list to mark the current line, so it gets a copy.
+    return list(_source_files[fname][1])
+
+
 class Breakpoint(BigEndianStructure):
     _pack_ = 2
     _fields_ = (
@@ -41,6 +55,15 @@ class Breakpoint(BigEndianStructure):
     )
 
 
+class Watchpoint(BigEndianStructure):
+    _pack_ = 2
+    _fields_ = (
+        ('num', c_uint32),
+        ('address', c_uint32),
+        ('pc', c_uint32)
+    )
+
+
 @dataclass
 class StackFrame:
     frame_ptr: int
@@ -90,9 +113,21 @@ class TargetStates(IntEnum):
     TS_STOPPED_BY_ONE_SHOT_BPOINT  = 32
     TS_STOPPED_BY_SINGLE_STEP      = 64
     TS_STOPPED_BY_EXCEPTION        = 128
+    TS_RANGE_STEPPING              = 256
+    TS_STOPPED_AFTER_RETURN        = 512
+    TS_STOPPED_BY_WATCHPOINT       = 1024
     TS_ERROR                       = 65536
 
 
+# one of these flags is set while a running target has stopped and waits to be resumed, see target.h
+TS_STOPPED = (
+    TargetStates.TS_STOPPED_BY_BPOINT
+    | TargetStates.TS_STOPPED_BY_ONE_SHOT_BPOINT
+    | TargetStates.TS_STOPPED_BY_SINGLE_STEP
+    | TargetStates.TS_STOPPED_BY_EXCEPTION
+    | TargetStates.TS_STOPPED_BY_WATCHPOINT
+)
+
 class TaskContext(BigEndianStructure):
     _pack_ = 2
     _fields_ = (
@@ -108,6 +143,7 @@ class TaskContext(BigEndianStructure):
 class TargetInfo(BigEndianStructure):
     _pack_ = 2
     _fields_ = (
+        ('target_id', c_uint32),
         ('initial_pc', c_uint32),
         ('initial_sp', c_uint32),
         ('task_context', TaskContext),
@@ -116,14 +152,43 @@ class TargetInfo(BigEndianStructure):
         ('error_code', c_uint32),
         ('next_instr_bytes', c_uint8 * NUM_NEXT_INSTRUCTIONS * MAX_INSTR_BYTES),
         ('top_stack_dwords', c_uint32 * NUM_TOP_STACK_DWORDS),
-        ('bpoint', Breakpoint)
+        ('bpoint', Breakpoint),
+        ('wpoint', Watchpoint)
     )
 
 
+    @staticmethod
+    def from_core_dump(core_dump: 'hunklib.CoreDump') -> 'TargetInfo':
+        """Build the target info of the crashed program from a core dump, as the server would have sent it"""
+        target_info = TargetInfo()
+        target_info.target_id = 1
+        target_info.task_context = TaskContext.from_buffer_copy(core_dump.task_context[:sizeof(TaskContext)])
+        target_info.target_state = TargetStates.TS_RUNNING | TargetStates.TS_STOPPED_BY_EXCEPTION
+        # The program is entered at the start of the first segment, see load_target() in target.c.
+        if core_dump.segments:
+            target_info.initial_pc = core_dump.segments[0].address
+        # Unlike the server, we only have the bytes that are contained in the dump.
+        nbytes = NUM_NEXT_INSTRUCTIONS * MAX_INSTR_BYTES
+        if (code := core_dump.read_memory(target_info.task_context.reg_pc, nbytes)) is not None:
+            memmove(target_info.next_instr_bytes, code, nbytes)
+        for i in range(NUM_TOP_STACK_DWORDS):
+            if (dword := core_dump.read_memory(target_info.task_context.reg_sp + i * 4, 4)) is not None:
+                target_info.top_stack_dwords[i] = struct.unpack(M68K_UINT32, dword)[0]
+        return target_info
+
+
+    def get_next_instr_bytes(self) -> bytes:
+        # The code image doesn't contain the TRAP opcodes of the breakpoints, so we prefer it to the bytes sent by the
+        # server. They are only used if the PC is outside of the code segments (e. g. in a library function).
+        if dbg.code_image is not None and (code := dbg.code_image.get(self.task_context.reg_pc, NUM_NEXT_INSTRUCTIONS * MAX_INSTR_BYTES)) is not None:
+            return code
+        return bytes(self.next_instr_bytes)
+
+
     def next_instr_is_jsr(self) -> bool:
         # check if next instruction is JSR, see Musashi's opcode info table in m68kdasm.c and Motorola's
         # M68000 Family Programmer’s Reference Manual for details
-        if (struct.unpack(M68K_UINT16, bytes(self.next_instr_bytes)[0:2])[0] & 0xffc0) == 0x4e80:
+        if (struct.unpack(M68K_UINT16, self.get_next_instr_bytes()[0:2])[0] & 0xffc0) == 0x4e80:
             return True
         else:
             return False
@@ -131,7 +196,7 @@ class TargetInfo(BigEndianStructure):
 
     def next_instr_is_rts(self) -> bool:
         # check if next instruction is RTS
-        if struct.unpack(M68K_UINT16, bytes(self.next_instr_bytes)[0:2])[0] == 0x4e75:
+        if struct.unpack(M68K_UINT16, self.get_next_instr_bytes()[0:2])[0] == 0x4e75:
             return True
         else:
             return False
@@ -140,15 +205,22 @@ class TargetInfo(BigEndianStructure):
     def get_bytes_used_by_jsr(self) -> int:
         # This only works if the next instruction is indeed a JSR. We use the disassembler here to get the size of the
         # JSR instruction so we don't have to decode the different address modes ourselves.
-        jsr_instr = next(capstone.Cs(capstone.CS_ARCH_M68K, capstone.CS_MODE_32).disasm(
-            bytes(self.next_instr_bytes),
-            self.task_context.reg_pc,
-            NUM_NEXT_INSTRUCTIONS,
-        ))
-        return jsr_instr.size
+        return dbg.disassembler.disasm(self.get_next_instr_bytes(), self.task_context.reg_pc, 1)[0].size
+
+
+    def has_stopped(self) -> bool:
+        # With several targets, the selected target can still be running, and then its context (registers, stack and
+        # next instructions) is not available.
+        return bool((self.target_state & TargetStates.TS_RUNNING) and (self.target_state & TS_STOPPED))
 
 
     def get_status_str(self) -> str:
+        # The watchpoint is reported together with the reason the target would have stopped anyway (if any).
+        if self.target_state & TargetStates.TS_STOPPED_BY_WATCHPOINT:
+            return (
+                f"Watchpoint #{self.wpoint.num} at {hex(self.wpoint.address)} has been changed by instruction at entry + "
+                f"{hex(self.wpoint.pc - self.initial_pc)}"
+            )
         if self.target_state & TargetStates.TS_STOPPED_BY_BPOINT:
             return (
                 f"Hit breakpoint #{self.bpoint.num} at entry + "
@@ -168,23 +240,35 @@ class TargetInfo(BigEndianStructure):
             return "Killed"
         elif self.target_state == TargetStates.TS_ERROR:
             return f"Error {ErrorCodes(self.error_code).name} occured"
+        elif self.target_state == TargetStates.TS_RUNNING:
+            # another target has stopped and this one has been selected while it's still running
+            return "Running"
         else:
             raise AssertionError(f"Target has stopped with invalid state {self.target_state}")
 
 
+    def get_register_values(self) -> list[tuple[str, int]]:
+        """Names and values of the address and data registers, in the order they are shown in the register view"""
+        regs = []
+        for i in range(8):
+            regs.append((f'A{i}', self.task_context.reg_a[i] if i < 7 else self.task_context.reg_sp))
+            regs.append((f'D{i}', self.task_context.reg_d[i]))
+        return regs
+
+
     def get_register_view(self) -> list[str]:
-        if not (self.target_state & TargetStates.TS_RUNNING):
+        if not self.has_stopped():
             return ['*** NOT AVAILABLE ***\n']
 
-        regs = []
-        for i in range(7):
-            regs.append(f'A{i}=0x{self.task_context.reg_a[i]:08x}        D{i}=0x{self.task_context.reg_d[i]:08x}\n')
-        regs.append(f'A7=0x{self.task_context.reg_sp:08x}        D7=0x{self.task_context.reg_d[7]:08x}\n')
-        return regs
+        regs = self.get_register_values()
+        return [
+            f'{a_name}=0x{a_value:08x}        {d_name}=0x{d_value:08x}\n'
+            for (a_name, a_value), (d_name, d_value) in zip(regs[0::2], regs[1::2])
+        ]
 
 
     def get_stack_view(self) -> list[str]:
-        if not (self.target_state & TargetStates.TS_RUNNING):
+        if not self.has_stopped():
             return ['*** NOT AVAILABLE ***\n']
 
         stack_dwords = []
@@ -194,20 +278,18 @@ class TargetInfo(BigEndianStructure):
 
 
     def get_disasm_view(self) -> list[str]:
-        if not (self.target_state & TargetStates.TS_RUNNING):
+        if not self.has_stopped():
             return ['*** NOT AVAILABLE ***\n']
 
-        disasm = capstone.Cs(capstone.CS_ARCH_M68K, capstone.CS_MODE_32)
         instructions = []
-        for idx, instr in enumerate(disasm.disasm(bytes(self.next_instr_bytes), self.task_context.reg_pc, NUM_NEXT_INSTRUCTIONS)):
+        for idx, instr in enumerate(dbg.disassembler.disasm(self.get_next_instr_bytes(), self.task_context.reg_pc, NUM_NEXT_INSTRUCTIONS)):
             instr_addr = f'0x{instr.address:08x} (PC + {instr.address - self.task_context.reg_pc:04}):    '
             instr_repr = f'{instr.mnemonic:<10}{instr.op_str}\n'
             instructions.append(instr_addr + instr_repr)
 
             if (idx == 0) and (syscall_info := self._get_syscall_info()):
                 instructions.append(f'{" " * len(instr_addr)}{syscall_info.name}(\n')
-                for arg in syscall_info.args:
-                    arg_int, arg_str = self._get_syscall_arg_values(syscall_info, arg)
+                for arg, (arg_int, arg_str) in zip(syscall_info.args, self._get_syscall_arg_values(syscall_info)):
                     arg_repr = f'{" " * (len(instr_addr) + 4)}{arg.decl} = {hex(arg_int)}'
                     if arg_str:
                         arg_repr += f' => "{arg_str}"'
@@ -221,7 +303,7 @@ class TargetInfo(BigEndianStructure):
 
 
     def get_source_view(self) -> list[str]:
-        if not (self.target_state & TargetStates.TS_RUNNING):
+        if not self.has_stopped():
             return ['*** NOT AVAILABLE ***\n']
 
         if dbg.program is None:
@@ -236,8 +318,7 @@ class TargetInfo(BigEndianStructure):
             source_fname = '/Users' + source_fname.removeprefix('/home')
 
         try:
-            with open(source_fname) as f:
-                source_lines = [f'{lineno + 1:<4}:    {line}' for lineno, line in enumerate(f.readlines())]
+            source_lines = _get_source_lines(source_fname)
         except Exception as e:
             logger.warning(f"Could not read source file '{source_fname}': {e}")
             return ['*** NOT AVAILABLE ***\n']
@@ -266,42 +347,34 @@ class TargetInfo(BigEndianStructure):
 
 
     def get_call_stack(self) -> list[StackFrame]:
-        if not (self.target_state & TargetStates.TS_RUNNING):
+        if not self.has_stopped():
             return []
 
-        stack_frames: list[StackFrame] = []
-        frame_ptr = self.task_context.reg_a[5]
-        program_counter = self.task_context.reg_pc
-        while frame_ptr != 0xffffffff:
-            # Previous frame pointer is stored at the address pointed to by the current frame pointer, return
-            # address is at current frame pointer + 4. We get them both at once to save a roundtrip to the server.
-            # A previous frame pointer 0xffffffff indicates that we've reached the initial frame.
-            # TODO: How do we get out of this loop if a function doesn't use the frame pointer?
-            try:
-                cmd = server.SrvPeekMem(address=frame_ptr, nbytes=8).execute(dbg.server_conn)
-            except server.ServerCommandError as e:
-                raise RuntimeError(f"Getting return address / previous frame pointer failed") from e
-            stack_frames.append(StackFrame(
-                frame_ptr=frame_ptr,
-                program_counter=program_counter,
-                return_addr=struct.unpack(M68K_UINT32, cmd.result[4:])[0],
-            ))
-            frame_ptr = struct.unpack(M68K_UINT32, cmd.result[0:4])[0]
-            program_counter = struct.unpack(M68K_UINT32, cmd.result[4:])[0]
+        # The server follows the chain of frame pointers for us and returns all frames at once. It stops if a frame
+        # pointer is invalid, e.g. because a function doesn't use the frame pointer.
+        try:
+            cmd = server.SrvGetCallStack().execute(dbg.server_conn)
+        except server.ServerCommandError as e:
+            raise RuntimeError(f"Getting call stack failed") from e
+        stack_frames = [
+            StackFrame(frame_ptr=frame_ptr, program_counter=program_counter, return_addr=return_addr)
+            for frame_ptr, program_counter, return_addr in cmd.result
+        ]
         return stack_frames
 
 
-    def get_call_stack_view(self) -> list[str]:
-        if not (self.target_state & TargetStates.TS_RUNNING):
+    def get_call_stack_view(self, call_stack: list[StackFrame] | None = None) -> list[str]:
+        """Render the call stack, which is read from the server unless the caller already has it"""
+        if not self.has_stopped():
             return ['*** NOT AVAILABLE ***\n']
 
         stack_frames = []
-        for idx, frame in enumerate(dbg.target_info.get_call_stack()):
-            if frame.program_counter >= dbg.target_info.initial_pc:
-                addr_offset = frame.program_counter - dbg.target_info.initial_pc
+        for idx, frame in enumerate(call_stack if call_stack is not None else self.get_call_stack()):
+            if frame.program_counter >= self.initial_pc:
+                addr_offset = frame.program_counter - self.initial_pc
             else:
                 addr_offset = -1
-            if (comp_unit := dbg.program.get_comp_unit_for_addr(addr_offset)) is not None:
+            if dbg.program is not None and (comp_unit := dbg.program.get_comp_unit_for_addr(addr_offset)) is not None:
                 if (lineno := dbg.program.get_lineno_for_addr(addr_offset, comp_unit=comp_unit)) is None:
                     lineno = '???'
             else:
@@ -340,7 +413,7 @@ class TargetInfo(BigEndianStructure):
 
     def _next_instr_is_syscall(self) -> bool:
         # check if next instruction is JSR with an effective address of register A6 + 16-bit offset
-        if (struct.unpack(M68K_UINT16, bytes(self.next_instr_bytes)[0:2])[0] & 0xffff) == 0x4eae:
+        if (struct.unpack(M68K_UINT16, self.get_next_instr_bytes()[0:2])[0] & 0xffff) == 0x4eae:
             return True
         else:
             return False
@@ -349,24 +422,37 @@ class TargetInfo(BigEndianStructure):
     def _get_syscall_offset(self) -> int:
         # This only works if the next instruction is indeed a system call. We return the unsigned value because that's
         # how they appear in the pragmas and therefore in the syscall database.
-        return abs(struct.unpack(M68K_INT16, bytes(self.next_instr_bytes)[2:4])[0])
+        return abs(struct.unpack(M68K_INT16, self.get_next_instr_bytes()[2:4])[0])
 
 
-    def _get_syscall_arg_values(self, syscall_info: SyscallInfo, arg: SyscallArg) -> tuple[int, str | None]:
-        if arg.register >= 8:
-            arg_int = self.task_context.reg_a[arg.register - 8]
-        else:
-            arg_int = self.task_context.reg_d[arg.register]
-
-        arg_str = None
-        if 'STRPTR' in arg.decl:
-            # Argument is a pointer to a string. As we don't know the string length, we just get the memory block
-            # with the maximum size at the address pointed to and search for a null byte in it.
-            try:
-                cmd = server.SrvPeekMem(address=arg_int, nbytes=server.MAX_MSG_DATA_LEN).execute(dbg.server_conn)
+    def _get_syscall_arg_values(self, syscall_info: SyscallInfo) -> list[tuple[int, str | None]]:
+        arg_ints = []
+        batch = server.SrvBatch()
+        for arg in syscall_info.args:
+            if arg.register >= 8:
+                arg_ints.append(self.task_context.reg_a[arg.register - 8])
+            else:
+                arg_ints.append(self.task_context.reg_d[arg.register])
+            if 'STRPTR' in arg.decl:
+                # Argument is a pointer to a string. As we don't know the string length, we just get the memory block
+                # with the maximum size at the address pointed to and search for a null byte in it. We get the strings
+                # for all arguments in one batch.
+                batch.add(server.SrvPeekMem(address=arg_ints[-1], nbytes=server.MAX_FRAME_DATA_LEN))
+        try:
+            batch.execute(dbg.server_conn)
+        except server.ServerCommandError as e:
+            raise RuntimeError(f"Getting strings for args of syscall {syscall_info} failed") from e
+
+        arg_values = []
+        peek_cmds = iter(batch.commands)
+        for arg, arg_int in zip(syscall_info.args, arg_ints):
+            arg_str = None
+            if 'STRPTR' in arg.decl:
+                cmd = next(peek_cmds)
+                if cmd.error_code != 0:
+                    raise RuntimeError(f"Getting string at address {hex(arg_int)} for arg {arg} of syscall {syscall_info} failed")
                 if (str_len := cmd.result.find(b'\x00')) == -1:
-                    str_len = server.MAX_MSG_DATA_LEN
+                    str_len = server.MAX_FRAME_DATA_LEN
                 arg_str = cmd.result[0:str_len].decode(errors='replace').replace('\n', '\\n').replace('\r', '\\r')
-            except server.ServerCommandError as e:
-                raise RuntimeError(f"Getting string at address {hex(arg_int)} for arg {arg} of syscall {syscall_info} failed") from e
-        return arg_int, arg_str
+            arg_values.append((arg_int, arg_str))
+        return arg_values
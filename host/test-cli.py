@@ -0,0 +1,13 @@
+#!/usr/bin/env python3
+
+
+from cli import CLI_COMMANDS, Cli
+
+
+def test_create_cli():
+    # Cli() raises ValueError if a command name or alias is used twice.
+    cli = Cli()
+    for cmd in CLI_COMMANDS:
+        assert cli._commands_by_name[cmd.command] is cmd
+        for alias in cmd.aliases:
+            assert cli._commands_by_name[alias] is cmd
@@ -6,20 +6,51 @@
 
 
 import pytest
+import struct
 
 from errors import ErrorCodes
+from hunklib import CoreDump
+from replay import CoreDumpReplayer, SessionRecorder, SessionReplayer
 from server import (
+    MAX_FRAME_DATA_LEN,
+    PROTO_FEATURE_FRAGMENTS,
+    BreakpointCondition,
+    BreakpointConditionTypes,
+    ConditionOps,
+    ConnectionError,
+    MemoryCache,
+    MsgTypes,
+    SrvBatch,
     SrvClearBreakpoint,
+    SrvClearSyscallTrace,
+    SrvClearWatchpoint,
     SrvContinue,
     SrvGetBaseAddress,
+    SrvGetCallStack,
+    SrvGetProfile,
+    SrvGetSegments,
+    SrvGetStats,
+    SrvGetSyscallStats,
     SrvKill,
     SrvPeekMem,
+    SrvProfile,
     SrvQuit,
+    SrvReadSyscallTrace,
+    SrvReadTrace,
     SrvRun,
+    SrvSelectTarget,
     SrvSetBreakpoint,
+    SrvSetSyscallTrace,
+    SrvSetTracepoint,
+    SrvSetWatchpoint,
     SrvSingleStep,
+    SrvStepFlow,
+    SrvStepRange,
+    ServerCommand,
     ServerCommandError,
     ServerConnection,
+    SlipDecoder,
+    calc_checksum,
 )
 from target import TargetStates
 
@@ -31,6 +62,81 @@ def server_conn():
     conn.close()
 
 
+def test_slip_decoder():
+    # This test doesn't need the server. Frames can be split at any byte, even in the middle of an escape sequence.
+    decoder = SlipDecoder()
+    data = b'\x01\xdb\xdc\x02\xc0\xc0\x03\xdb\xdd\xc0\x04'
+    for i in range(len(data)):
+        decoder.feed(data[i : i + 1])
+    assert decoder.get_frame() == b'\x01\xc0\x02'
+    assert decoder.get_frame() == b'\x03\xdb'
+    assert decoder.get_frame() is None
+    decoder.feed(b'\xdb\x00\xc0')
+    with pytest.raises(RuntimeError):
+        decoder.get_frame()
+
+
+def test_checksum():
+    # This test doesn't need the server either, the values are the same as in the unit tests of util.c.
+    assert calc_checksum(b'\x00\x01\xf2\x03\xf4\xf5\xf6\xf7') == 0x220d
+    assert calc_checksum(b'\x00\x01\xf2\x03\xf4\xf5\xf6\xf7\x42') == 0xe00c
+    assert calc_checksum(b'\x00\x01\xf2\x03') == 0x0dfb
+
+
+def test_memory_cache():
+    # This test doesn't need the server either.
+    cache = MemoryCache()
+    assert cache.get(0x1010, 4) is None
+    assert cache.get_missing_range(0x10f0, 0x20) == (0x1000, 0x200)
+    cache.put(0x1000, bytes(range(256)))
+    assert cache.get(0x1010, 4) == b'\x10\x11\x12\x13'
+    assert cache.get(0x10f0, 0x20) is None
+    assert cache.get_missing_range(0x10f0, 0x20) == (0x1100, 0x100)
+    # gaps between missing pages are read as well
+    cache.put(0x1200, bytes(256))
+    assert cache.get_missing_range(0x1000, 0x400) == (0x1100, 0x300)
+    assert cache.get_missing_range(0xffffff00, 0x10) == (0xffffff00, 0xff)
+    assert not MemoryCache.is_cacheable(0xdff000, 2)
+    assert MemoryCache.is_cacheable(0x1000, 0x100)
+    cache.invalidate()
+    assert cache.get(0x1010, 4) is None
+
+
+def _write_core_dump(fname: str):
+    # see dump-core.c for the format, the frame pointer A5 points to a chain of two frames on the stack
+    def block(block_type: int, content: bytes) -> bytes:
+        content += bytes(-len(content) % 4)
+        return struct.pack('>II', block_type, len(content) // 4) + content
+    task_context = struct.pack('>IIHI8I7I', 0x3000, 3, 0, 0x1004, *range(8), 0, 0, 0, 0, 0, 0x3008, 0)
+    stack = struct.pack('>6I', 0, 0, 0x3010, 0x1020, 0xffffffff, 0x1030)
+    with open(fname, 'wb') as f:
+        f.write(block(1100, task_context))
+        f.write(block(1101, struct.pack('>II', 0x3000, len(stack)) + stack))
+        f.write(block(1102, struct.pack('>III', 0x1000, 0x40, 0) + bytes(range(0x40))))
+        f.write(block(1102, struct.pack('>III', 0x5000, 3, 1) + b'abc'))
+
+
+def test_replay(tmp_path):
+    # This test doesn't need the server either. We record a session with a core dump and replay it.
+    _write_core_dump(tmp_path / 'core')
+    for create_conn in (
+        lambda: SessionRecorder(CoreDumpReplayer(CoreDump(tmp_path / 'core')), tmp_path / 'session'),
+        lambda: SessionReplayer(tmp_path / 'session'),
+    ):
+        conn = create_conn()
+        assert SrvGetSegments().execute(conn).result == [(0x1000, 0x40)]
+        assert SrvPeekMem(address=0x1004, nbytes=4).execute(conn).result == b'\x04\x05\x06\x07'
+        assert SrvGetCallStack().execute(conn).result == [(0x3008, 0x1004, 0x1020), (0x3010, 0x1020, 0x1030)]
+        batch = SrvBatch().add(SrvPeekMem(address=0x5000, nbytes=3)).add(SrvPeekMem(address=0x6000, nbytes=1)).execute(conn)
+        assert batch.commands[0].result == b'abc'
+        assert batch.commands[1].error_code == ErrorCodes.ERROR_INVALID_ADDRESS.value
+        with pytest.raises(ServerCommandError):
+            SrvRun().execute(conn)
+        conn.close()
+    with pytest.raises(ConnectionError):
+        SrvPeekMem(address=0x1004, nbytes=4).execute(SessionReplayer(tmp_path / 'session'))
+
+
 def test_get_base_address(server_conn: ServerConnection):
     # Addresses are valid for AmigaOS 3.1.
     cmd = SrvGetBaseAddress(library_name="exec.library").execute(server_conn)
@@ -45,6 +151,58 @@ def test_peek_mem(server_conn: ServerConnection):
     assert cmd.result == b'\x07\x80\x07\xf8'
 
 
+def test_peek_mem_cached(server_conn: ServerConnection):
+    # The second read is served from the cache and must return the same data, also for a range crossing a page boundary.
+    data = SrvPeekMem(address=0x3f0, nbytes=0x20).execute(server_conn).result
+    assert SrvPeekMem(address=0x3f0, nbytes=0x20).execute(server_conn).result == data
+    assert SrvPeekMem(address=0x400, nbytes=4).execute(server_conn).result == data[0x10:0x14]
+
+
+def test_peek_mem_multiple_frames(server_conn: ServerConnection):
+    # The server needs to split the data into several frames, the first 4 bytes are the same as above
+    assert server_conn.features & PROTO_FEATURE_FRAGMENTS
+    cmd = SrvPeekMem(address=4, nbytes=4 * MAX_FRAME_DATA_LEN + 10).execute(server_conn)
+    assert len(cmd.result) == 4 * MAX_FRAME_DATA_LEN + 10
+    assert cmd.result[0:4] == b'\x07\x80\x07\xf8'
+
+
+def test_batch(server_conn: ServerConnection):
+    batch = SrvBatch()
+    batch.add(SrvGetBaseAddress(library_name="exec.library"))
+    batch.add(SrvPeekMem(address=4, nbytes=4))
+    batch.add(SrvClearBreakpoint(bpoint_num=42))
+    batch.execute(server_conn)
+    assert batch.commands[0].error_code == 0
+    assert batch.commands[0].result == 0x078007f8
+    assert batch.commands[1].error_code == 0
+    assert batch.commands[1].result == b'\x07\x80\x07\xf8'
+    assert batch.commands[2].error_code == ErrorCodes.ERROR_UNKNOWN_BREAKPOINT.value
+
+
+def test_batch_get_profile(server_conn: ServerConnection):
+    # The profile doesn't fit into the reply to a batch, so the command fails while the batch itself succeeds.
+    cmd = ServerCommand(MsgTypes.MSG_BATCH, data=struct.pack('>BBB', MsgTypes.MSG_GET_PROFILE, 1, 0)).execute(server_conn)
+    error_code, length = struct.unpack('>BH', cmd.data[0:3])
+    assert error_code == ErrorCodes.ERROR_BAD_DATA.value
+    assert length == 0
+
+
+def test_batch_command_without_data(server_conn: ServerConnection):
+    # MSG_PEEK_MEM with a data length of 0
+    with pytest.raises(ServerCommandError):
+        cmd = ServerCommand(MsgTypes.MSG_BATCH, data=struct.pack('>BB', MsgTypes.MSG_PEEK_MEM, 0)).execute(server_conn)
+        assert cmd.error_code == ErrorCodes.ERROR_BAD_DATA.value
+
+
+def test_get_segments(server_conn: ServerConnection):
+    # The test program contains at least one code segment, which must be readable as a whole (without the cache).
+    segments = SrvGetSegments().execute(server_conn).result
+    assert len(segments) >= 1
+    address, size = segments[0]
+    assert size > 0
+    assert len(SrvPeekMem(address=address, nbytes=min(size, 1024), use_cache=False).execute(server_conn).result) == min(size, 1024)
+
+
 def test_set_bpoint(server_conn: ServerConnection):
     SrvSetBreakpoint(bpoint_offset=0x24).execute(server_conn)
 
@@ -72,6 +230,15 @@ def test_single_step(server_conn: ServerConnection):
     assert cmd.target_info.target_state == TargetStates.TS_RUNNING | TargetStates.TS_SINGLE_STEPPING | TargetStates.TS_STOPPED_BY_SINGLE_STEP
 
 
+def test_get_call_stack(server_conn: ServerConnection):
+    cmd = SrvGetCallStack().execute(server_conn)
+    assert len(cmd.result) >= 1
+    # frame pointers must be increasing because the stack grows downwards
+    assert all(cmd.result[i][0] < cmd.result[i + 1][0] for i in range(len(cmd.result) - 1))
+    cmd = SrvGetCallStack(max_depth=1).execute(server_conn)
+    assert len(cmd.result) == 1
+
+
 def test_continue_from_bpoint(server_conn: ServerConnection):
     SrvClearBreakpoint(bpoint_num=2).execute(server_conn)
     cmd = SrvContinue().execute(server_conn)
@@ -80,6 +247,15 @@ def test_continue_from_bpoint(server_conn: ServerConnection):
     assert cmd.target_info.exit_code == 0
 
 
+def test_wrong_state(server_conn: ServerConnection):
+    # The target has exited, so it can't be continued, but the server must keep serving us.
+    cmd = SrvContinue()
+    with pytest.raises(ServerCommandError):
+        cmd.execute(server_conn)
+    assert cmd.error_code == ErrorCodes.ERROR_BAD_DATA.value
+    SrvGetBaseAddress(library_name="exec.library").execute(server_conn)
+
+
 def test_kill(server_conn: ServerConnection):
     SrvSetBreakpoint(bpoint_offset=0x24).execute(server_conn)
     cmd = SrvRun().execute(server_conn)
@@ -101,5 +277,209 @@ def test_one_shot_bpoint(server_conn: ServerConnection):
     assert cmd.target_info.exit_code == 0
 
 
+def test_step_range(server_conn: ServerConnection):
+    SrvSetBreakpoint(bpoint_offset=0x24).execute(server_conn)
+    cmd = SrvRun().execute(server_conn)
+    assert cmd.target_info.target_state == TargetStates.TS_RUNNING | TargetStates.TS_STOPPED_BY_BPOINT
+    cmd = SrvStepRange(start_offset=0x24, end_offset=0x2a, step_over=True).execute(server_conn)
+    assert cmd.target_info is not None
+    assert cmd.target_info.target_state & TargetStates.TS_RUNNING
+    assert not (cmd.target_info.target_state & TargetStates.TS_RANGE_STEPPING)
+    assert not (0x24 <= cmd.target_info.task_context.reg_pc - cmd.target_info.initial_pc < 0x2a)
+    cmd = SrvKill().execute(server_conn)
+    assert cmd.target_info.target_state == TargetStates.TS_KILLED
+    SrvClearBreakpoint(bpoint_num=5).execute(server_conn)
+
+
+def test_step_range_invalid(server_conn: ServerConnection):
+    SrvSetBreakpoint(bpoint_offset=0x24).execute(server_conn)
+    SrvRun().execute(server_conn)
+    with pytest.raises(ServerCommandError):
+        SrvStepRange(start_offset=0x2a, end_offset=0x24).execute(server_conn)
+    SrvKill().execute(server_conn)
+    SrvClearBreakpoint(bpoint_num=6).execute(server_conn)
+
+
+def test_conditional_bpoint(server_conn: ServerConnection):
+    # The breakpoint is only hit once per run, so the target doesn't stop if we ignore the first hit.
+    SrvSetBreakpoint(bpoint_offset=0x24, condition=BreakpointCondition(size=4, ignore_count=1)).execute(server_conn)
+    cmd = SrvRun().execute(server_conn)
+    assert cmd.target_info.target_state == TargetStates.TS_EXITED
+    SrvClearBreakpoint(bpoint_num=7).execute(server_conn)
+    # SP is never 0, so the target stops
+    cond = BreakpointCondition(
+        type=BreakpointConditionTypes.BPOINT_COND_REG,
+        op=ConditionOps.COND_OP_NE,
+        reg_num=15,
+        size=4,
+        value=0,
+    )
+    SrvSetBreakpoint(bpoint_offset=0x24, condition=cond).execute(server_conn)
+    cmd = SrvRun().execute(server_conn)
+    assert cmd.target_info.target_state == TargetStates.TS_RUNNING | TargetStates.TS_STOPPED_BY_BPOINT
+    cmd = SrvKill().execute(server_conn)
+    assert cmd.target_info.target_state == TargetStates.TS_KILLED
+    SrvClearBreakpoint(bpoint_num=8).execute(server_conn)
+
+
+def test_conditional_bpoint_invalid(server_conn: ServerConnection):
+    with pytest.raises(ServerCommandError):
+        SrvSetBreakpoint(bpoint_offset=0x24, condition=BreakpointCondition(size=3)).execute(server_conn)
+
+
+def test_tracepoint(server_conn: ServerConnection):
+    # The target doesn't stop at a tracepoint, the tracepoint only writes a record with D0 and SP.
+    SrvSetTracepoint(bpoint_offset=0x24, reg_mask=(1 << 0) | (1 << 15)).execute(server_conn)
+    cmd = SrvRun().execute(server_conn)
+    assert cmd.target_info.target_state == TargetStates.TS_EXITED
+    cmd = SrvReadTrace().execute(server_conn)
+    assert cmd.nremaining == 0
+    assert len(cmd.result) == 1
+    assert cmd.result[0].bpoint_num == 9
+    assert sorted(cmd.result[0].regs.keys()) == [0, 15]
+    # records are removed from the buffer once they have been read
+    cmd = SrvReadTrace().execute(server_conn)
+    assert len(cmd.result) == 0
+    SrvClearBreakpoint(bpoint_num=9).execute(server_conn)
+
+
+def test_profile(server_conn: ServerConnection):
+    cmd = SrvProfile(interval_us=1000).execute(server_conn)
+    assert cmd.target_info.target_state == TargetStates.TS_EXITED
+    profile = SrvGetProfile().execute(server_conn).result
+    assert profile.interval_us == 1000
+    assert sum(profile.bins) + profile.nsamples_waiting + profile.nsamples_outside == profile.nsamples
+
+
+def test_profile_invalid_interval(server_conn: ServerConnection):
+    for interval_us in (10, 10000000):
+        with pytest.raises(ServerCommandError):
+            SrvProfile(interval_us=interval_us).execute(server_conn)
+
+
+def test_syscall_trace(server_conn: ServerConnection):
+    # The startup code of the target opens dos.library, so we trace OpenLibrary() (offset 552) and record A1 / D0.
+    dos_base = SrvGetBaseAddress(library_name="dos.library").execute(server_conn).result
+    exec_base = SrvGetBaseAddress(library_name="exec.library").execute(server_conn).result
+    SrvSetSyscallTrace(library_name="exec.library", funcs=[(552, (1 << 9) | (1 << 0))]).execute(server_conn)
+    cmd = SrvRun().execute(server_conn)
+    assert cmd.target_info.target_state == TargetStates.TS_EXITED
+    cmd = SrvReadSyscallTrace().execute(server_conn)
+    assert any(record.lib_base == exec_base and record.offset == 552 and record.result == dos_base for record in cmd.result)
+    stats = SrvGetSyscallStats().execute(server_conn).result
+    assert len(stats) == 1
+    assert stats[0].ncalls >= 1
+    SrvClearSyscallTrace().execute(server_conn)
+    assert len(SrvGetSyscallStats().execute(server_conn).result) == 0
+
+
+def test_syscall_trace_invalid_offset(server_conn: ServerConnection):
+    with pytest.raises(ServerCommandError):
+        SrvSetSyscallTrace(library_name="exec.library", funcs=[(553, 0)]).execute(server_conn)
+    # GetCC() is called by the stub routine itself
+    cmd = SrvSetSyscallTrace(library_name="exec.library", funcs=[(528, 0)])
+    with pytest.raises(ServerCommandError):
+        cmd.execute(server_conn)
+    assert cmd.error_code == ErrorCodes.ERROR_BAD_DATA.value
+
+
+def test_step_flow(server_conn: ServerConnection):
+    # Tracing on change of flow is only available on the 68020 - 68040.
+    SrvSetBreakpoint(bpoint_offset=0x24).execute(server_conn)
+    SrvRun().execute(server_conn)
+    cmd = SrvStepFlow()
+    try:
+        cmd.execute(server_conn)
+        assert cmd.target_info.target_state == TargetStates.TS_RUNNING | TargetStates.TS_SINGLE_STEPPING | TargetStates.TS_STOPPED_BY_SINGLE_STEP
+    except ServerCommandError:
+        assert cmd.error_code == ErrorCodes.ERROR_NO_FLOW_TRACE.value
+    finally:
+        SrvKill().execute(server_conn)
+        SrvClearBreakpoint(bpoint_num=10).execute(server_conn)
+
+
+def test_get_stats(server_conn: ServerConnection):
+    # All tests before have run against the same server, so all counters have been incremented.
+    stats = SrvGetStats().execute(server_conn).result
+    assert stats.nframes_sent > 0 and stats.nframes_received > 0
+    assert stats.nbpoint_hits > 0 and stats.nstep_traps > 0
+    assert stats.ncmds > 0 and stats.cmd_ticks > 0
+    SrvSetBreakpoint(bpoint_offset=0x24).execute(server_conn)
+    SrvRun().execute(server_conn)
+    SrvSingleStep().execute(server_conn)
+    SrvKill().execute(server_conn)
+    SrvClearBreakpoint(bpoint_num=11).execute(server_conn)
+    new_stats = SrvGetStats().execute(server_conn).result
+    assert new_stats.nbpoint_hits == stats.nbpoint_hits + 1
+    assert new_stats.nstep_traps >= stats.nstep_traps + 1
+    # GET_STATS itself is counted as well
+    assert new_stats.ncmds == stats.ncmds + 6
+
+
+def test_watchpoint(server_conn: ServerConnection):
+    # The address of DOSBase is the operand of MOVE.L D0, DOSBase at entry + 0x16, which is preceded by the call of
+    # OpenLibrary(). The library function is not traced, so this also tests running to the return address.
+    SrvSetBreakpoint(bpoint_offset=0).execute(server_conn)
+    cmd = SrvRun().execute(server_conn)
+    initial_pc = cmd.target_info.initial_pc
+    dos_base_addr = struct.unpack('>I', SrvPeekMem(initial_pc + 0x18, 4).execute(server_conn).result)[0]
+    # The stack below SP is overwritten whenever the target stops, so it can't be watched.
+    wpoint_cmd = SrvSetWatchpoint(cmd.target_info.task_context.reg_sp - 8, 4)
+    with pytest.raises(ServerCommandError):
+        wpoint_cmd.execute(server_conn)
+    assert wpoint_cmd.error_code == ErrorCodes.ERROR_BAD_DATA.value
+    wpoint_num = SrvSetWatchpoint(dos_base_addr, 4).execute(server_conn).result
+    cmd = SrvContinue().execute(server_conn)
+    assert cmd.target_info.target_state & TargetStates.TS_STOPPED_BY_WATCHPOINT
+    assert cmd.target_info.wpoint.num == wpoint_num
+    assert cmd.target_info.wpoint.address == dos_base_addr
+    assert cmd.target_info.wpoint.pc == initial_pc + 0x16
+    assert cmd.target_info.task_context.reg_pc == initial_pc + 0x1c
+    SrvClearWatchpoint(wpoint_num).execute(server_conn)
+    cmd = SrvContinue().execute(server_conn)
+    assert cmd.target_info.target_state == TargetStates.TS_EXITED
+    SrvClearBreakpoint(bpoint_num=12).execute(server_conn)
+
+
+def test_watchpoint_invalid(server_conn: ServerConnection):
+    with pytest.raises(ServerCommandError):
+        SrvSetWatchpoint(0x400, 17).execute(server_conn)
+    # reading the chip registers has side effects
+    for address, size in ((0xbfe001, 1), (0xdff006, 2), (0xe80000, 4), (0xbffffe, 4)):
+        cmd = SrvSetWatchpoint(address, size)
+        with pytest.raises(ServerCommandError):
+            cmd.execute(server_conn)
+        assert cmd.error_code == ErrorCodes.ERROR_INVALID_ADDRESS.value
+    cmd = SrvClearWatchpoint(1000)
+    with pytest.raises(ServerCommandError):
+        cmd.execute(server_conn)
+    assert cmd.error_code == ErrorCodes.ERROR_UNKNOWN_WATCHPOINT.value
+
+
+def test_select_target(server_conn: ServerConnection):
+    # The server has been started with one target, which is selected from the start. The stops are tagged with its ID.
+    target_info = SrvSelectTarget(1).execute(server_conn).result
+    assert target_info.target_id == 1
+    assert not (target_info.target_state & TargetStates.TS_RUNNING)
+    SrvSetBreakpoint(bpoint_offset=0).execute(server_conn)
+    cmd = SrvRun().execute(server_conn)
+    assert cmd.target_info.target_id == 1
+    assert cmd.target_info.target_state & TargetStates.TS_STOPPED_BY_BPOINT
+    target_info = SrvSelectTarget(1).execute(server_conn).result
+    assert target_info.task_context.reg_pc == cmd.target_info.task_context.reg_pc
+    cmd = SrvKill().execute(server_conn)
+    assert cmd.target_info.target_id == 1
+    assert cmd.target_info.target_state == TargetStates.TS_KILLED
+    SrvClearBreakpoint(bpoint_num=13).execute(server_conn)
+
+
+def test_select_target_invalid(server_conn: ServerConnection):
+    for target_id in (0, 100):
+        cmd = SrvSelectTarget(target_id)
+        with pytest.raises(ServerCommandError):
+            cmd.execute(server_conn)
+        assert cmd.error_code == ErrorCodes.ERROR_UNKNOWN_TARGET.value
+
+
 def test_quit(server_conn: ServerConnection):
     SrvQuit().execute(server_conn)
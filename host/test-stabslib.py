@@ -6,7 +6,7 @@ import sys
 from loguru import logger
 
 from hunklib import get_debug_infos_from_exe
-from stabslib import ProgramWithDebugInfo
+from stabslib import ProgramWithDebugInfo, Stab, StabTypes
 
 
 @pytest.fixture(scope='module')
@@ -32,3 +32,74 @@ def test_get_lineno_for_addr(program):
 
 def test_get_comp_unit_for_addr(program):
     assert program.get_comp_unit_for_addr(0x0000017c) == '/home/consti/Programmieren/Amiga/cwdbg/examples/numbers.c'
+
+
+def test_get_func_name_for_addr(program):
+    assert program.get_func_name_for_addr(0x0000017c) == 'main'
+
+
+def test_get_addr_range_for_func_name(program):
+    start_addr, _ = program.get_addr_range_for_func_name('main')
+    assert start_addr <= 0x0000017c
+    assert program.get_func_name_for_addr(start_addr) == 'main'
+    assert program.get_addr_range_for_func_name('get_num_trait')[1] == start_addr
+    assert program.get_addr_range_for_func_name('no_such_func') is None
+
+
+def _create_multi_comp_unit_program() -> ProgramWithDebugInfo:
+    # This program is created from made-up stabs for two compilation units, a.c with the functions f() and g() and
+    # b.c with the function h(). Newer GCC versions terminate each compilation unit with an N_SO stab without name.
+    stabs = []
+    for stab_type, string, desc, value in (
+        (StabTypes.N_SO,    '/src/', 0, 0x00),
+        (StabTypes.N_SO,    'a.c',   0, 0x00),
+        (StabTypes.N_SLINE, '',      3, 0x00),
+        (StabTypes.N_SLINE, '',      4, 0x08),
+        (StabTypes.N_FUN,   'f:F1',  2, 0x00),
+        (StabTypes.N_SLINE, '',      8, 0x10),
+        (StabTypes.N_SLINE, '',      9, 0x18),
+        (StabTypes.N_FUN,   'g:F1',  7, 0x10),
+        (StabTypes.N_SO,    '',      0, 0x20),
+        (StabTypes.N_SO,    '/src/', 0, 0x20),
+        (StabTypes.N_SO,    'b.c',   0, 0x20),
+        (StabTypes.N_SLINE, '',      2, 0x20),
+        (StabTypes.N_SLINE, '',      3, 0x28),
+        (StabTypes.N_FUN,   'h:F1',  1, 0x20),
+        (StabTypes.N_SO,    '',      0, 0x30),
+    ):
+        stab = Stab(type=stab_type, desc=desc, value=value)
+        stab.string = string
+        stabs.append(stab)
+    return ProgramWithDebugInfo(stabs)
+
+
+def _check_multi_comp_unit_program(program: ProgramWithDebugInfo):
+    assert program.get_comp_unit_for_addr(0x08) == '/src/a.c'
+    assert program.get_comp_unit_for_addr(0x24) == '/src/b.c'
+    assert program.get_func_name_for_addr(0x04) == 'f'
+    assert program.get_func_name_for_addr(0x14) == 'g'
+    assert program.get_func_name_for_addr(0x2c) == 'h'
+    assert program.get_addr_range_for_func_name('g') == (0x10, 0x20)
+    assert program.get_addr_range_for_func_name('no_such_func') is None
+    assert program.get_lineno_for_addr(0x04, comp_unit='/src/a.c') == 3
+    assert program.get_lineno_for_addr(0x24, comp_unit='/src/b.c') == 2
+    # end address of the last line of a compilation unit is not known
+    assert program.get_lineno_for_addr(0x2c, comp_unit='/src/b.c') is None
+    assert program.get_addr_range_for_lineno(4, comp_unit='/src/a.c') == (0x08, 0x10)
+    with pytest.raises(ValueError):
+        program.get_lineno_for_addr(0x04)
+
+
+def test_multiple_comp_units():
+    _check_multi_comp_unit_program(_create_multi_comp_unit_program())
+
+
+def test_debug_info_cache(tmp_path):
+    fname = str(tmp_path / 'program.dbginfo')
+    _create_multi_comp_unit_program().save_to_cache(fname, b'key')
+    assert ProgramWithDebugInfo.load_from_cache(fname, b'other key') is None
+    _check_multi_comp_unit_program(ProgramWithDebugInfo.load_from_cache(fname, b'key'))
+    # an empty file can't be mapped
+    empty_fname = str(tmp_path / 'empty.dbginfo')
+    open(empty_fname, 'wb').close()
+    assert ProgramWithDebugInfo.load_from_cache(empty_fname, b'key') is None
@@ -12,11 +12,12 @@ from urwid import AttrMap, Columns, Edit, ExitMainLoop, Filler, Frame, LineBox,
 
 from cli import QuitDebuggerException
 from debugger import dbg
-from target import TargetInfo
+from target import StackFrame, TargetInfo
 
 
 PALETTE = [
     ('banner', 'black,bold', 'dark green'),
+    ('changed', 'yellow,bold', 'default'),
 ]
 
 INPUT_WIDGET_HEIGHT = 15
@@ -35,6 +36,131 @@ class UrwidHandler:
         self._widget.set_text(self._messages)
 
 
+class View:
+    """Base class for the views showing the state of the target
+
+    A view only renders its content again if its input (the part of the TargetInfo it shows, see get_input()) has
+    changed since the last update, so holding down a function key isn't slowed down by views that stay the same.
+    Views with highlight_changes set highlight the lines that have changed since the last update.
+    """
+    highlight_changes = False
+
+    def __init__(self):
+        self.widget = Text("*** NOT AVAILABLE ***")
+        self._input: Any = None
+        self._lines: list[str] = []
+
+    def update(self, target_info: TargetInfo):
+        new_input = self.get_input(target_info) if target_info.has_stopped() else None
+        if self._input is not None and new_input == self._input:
+            return
+        is_first_update = self._input is None
+        self._input = new_input
+        lines = self.render(target_info)
+        if self.highlight_changes and not is_first_update:
+            self.widget.set_text([
+                ('changed', line) if idx >= len(self._lines) or line != self._lines[idx] else line
+                for idx, line in enumerate(lines)
+            ])
+        else:
+            self.widget.set_text(lines)
+        self._lines = lines
+
+    def get_input(self, target_info: TargetInfo) -> Any:
+        raise NotImplementedError
+
+    def render(self, target_info: TargetInfo) -> list[Any]:
+        raise NotImplementedError
+
+
+class SourceView(View):
+    def get_input(self, target_info: TargetInfo) -> Any:
+        return target_info.task_context.reg_pc
+
+    def render(self, target_info: TargetInfo) -> list[Any]:
+        return target_info.get_source_view()
+
+
+class DisasmView(View):
+    def get_input(self, target_info: TargetInfo) -> Any:
+        # The registers are needed for the arguments if the next instruction is a syscall.
+        return (
+            target_info.task_context.reg_pc,
+            bytes(target_info.next_instr_bytes),
+            tuple(target_info.get_register_values())
+        )
+
+    def render(self, target_info: TargetInfo) -> list[Any]:
+        return target_info.get_disasm_view()
+
+
+class RegisterView(View):
+    # This view highlights the registers that have changed (instead of whole lines).
+    def __init__(self):
+        super().__init__()
+        self._values: dict[str, int] = {}
+
+    def get_input(self, target_info: TargetInfo) -> Any:
+        return tuple(target_info.get_register_values())
+
+    def render(self, target_info: TargetInfo) -> list[Any]:
+        if not target_info.has_stopped():
+            self._values = {}
+            return target_info.get_register_view()
+        prev_values = self._values
+        self._values = dict(target_info.get_register_values())
+        markup = []
+        for name, value in target_info.get_register_values():
+            item = f'{name}=0x{value:08x}'
+            markup.append(('changed', item) if name in prev_values and prev_values[name] != value else item)
+            markup.append('        ' if name.startswith('A') else '\n')
+        return markup
+
+
+class StackView(View):
+    highlight_changes = True
+
+    def get_input(self, target_info: TargetInfo) -> Any:
+        return target_info.task_context.reg_sp, tuple(target_info.top_stack_dwords)
+
+    def render(self, target_info: TargetInfo) -> list[Any]:
+        return target_info.get_stack_view()
+
+
+class CallStackView(View):
+    """View of the call stack
+
+    The frames are only read from the server again if the frame pointer or the stack pointer has changed, i. e. after
+    a call or return, or if the target has been started again. Otherwise, only the PC of the innermost frame changes.
+    """
+    highlight_changes = True
+
+    def __init__(self):
+        super().__init__()
+        self._frames_key: tuple[int, int, int, int] | None = None
+        self._frames: list[StackFrame] = []
+
+    def get_input(self, target_info: TargetInfo) -> Any:
+        return target_info.task_context.reg_pc, target_info.task_context.reg_a[5], target_info.task_context.reg_sp
+
+    def render(self, target_info: TargetInfo) -> list[Any]:
+        if not target_info.has_stopped():
+            self._frames_key = None
+            return target_info.get_call_stack_view()
+        frames_key = (
+            target_info.initial_pc,
+            target_info.initial_sp,
+            target_info.task_context.reg_a[5],
+            target_info.task_context.reg_sp
+        )
+        if frames_key != self._frames_key:
+            self._frames = target_info.get_call_stack()
+            self._frames_key = frames_key
+        elif self._frames:
+            self._frames[0].program_counter = target_info.task_context.reg_pc
+        return target_info.get_call_stack_view(self._frames)
+
+
 class CommandInput(Edit):
     def __init__(self, main_screen: Any):
         super().__init__(caption='> ')
@@ -89,7 +215,7 @@ class MainScreen:
             return True
 
 
-        self._source_view = Text("*** NOT AVAILABLE ***")
+        self._source_view = SourceView()
         source_widget = LineBox(
             Padding(
                 Filler(
@@ -98,7 +224,7 @@ class MainScreen:
                             ('banner', "Source code"),
                             align='center'
                         ),
-                        self._source_view
+                        self._source_view.widget
                     ]),
                     valign='top',
                     top=1,
@@ -109,7 +235,7 @@ class MainScreen:
             )
         )
 
-        self._disasm_view = Text("*** NOT AVAILABLE ***")
+        self._disasm_view = DisasmView()
         disasm_widget = LineBox(
             Padding(
                 Filler(
@@ -118,7 +244,7 @@ class MainScreen:
                             ('banner', "Disassembled code"),
                             align='center'
                         ),
-                        self._disasm_view
+                        self._disasm_view.widget
                     ]),
                     valign='top',
                     top=1,
@@ -129,7 +255,7 @@ class MainScreen:
             )
         )
 
-        self._register_view = Text("*** NOT AVAILABLE ***")
+        self._register_view = RegisterView()
         register_widget = LineBox(
             Padding(
                 Filler(
@@ -138,7 +264,7 @@ class MainScreen:
                             ('banner', "Registers"),
                             align='center'
                         ),
-                        self._register_view
+                        self._register_view.widget
                     ]),
                     valign='top',
                     top=1,
@@ -169,7 +295,7 @@ class MainScreen:
             )
         )
 
-        self._stack_view = Text("*** NOT AVAILABLE ***")
+        self._stack_view = StackView()
         stack_widget = LineBox(
             Padding(
                 Filler(
@@ -178,7 +304,7 @@ class MainScreen:
                             ('banner', "Stack"),
                             align='center'
                         ),
-                        self._stack_view
+                        self._stack_view.widget
                     ]),
                     valign='top',
                     top=1,
@@ -189,7 +315,7 @@ class MainScreen:
             )
         )
 
-        self._call_stack_view = Text("*** NOT AVAILABLE ***")
+        self._call_stack_view = CallStackView()
         call_stack_widget = LineBox(
             Padding(
                 Filler(
@@ -198,7 +324,7 @@ class MainScreen:
                             ('banner', "Call Stack"),
                             align='center'
                         ),
-                        self._call_stack_view
+                        self._call_stack_view.widget
                     ]),
                     valign='top',
                     top=1,
@@ -271,16 +397,11 @@ class MainScreen:
     def update_status_line(self):
         self._status_line.original_widget.set_text(
             f"F5 = continue, F10 = next, F11 = step, Shift + F10 = nexti, Shift + F11 = stepi    "
-            f"Status: * {dbg.target_info.get_status_str()} *"
+            f"Status: * Target #{dbg.target_info.target_id}: {dbg.target_info.get_status_str()} *"
         )
 
 
     def update_views(self):
-        # TODO: Introduce view classes that get the necessary information from TargetInfo, track and highlight
-        #       changes and generate the content for the widgets via a render() method
         logger.debug("Updating views")
-        self._source_view.set_text(dbg.target_info.get_source_view())
-        self._register_view.set_text(dbg.target_info.get_register_view())
-        self._disasm_view.set_text(dbg.target_info.get_disasm_view())
-        self._stack_view.set_text(dbg.target_info.get_stack_view())
-        self._call_stack_view.set_text(dbg.target_info.get_call_stack_view())
+        for view in (self._source_view, self._register_view, self._disasm_view, self._stack_view, self._call_stack_view):
+            view.update(dbg.target_info)
@@ -22,6 +22,7 @@
 
 static uint8_t parse_args(char *p_cmd, char **pp_args);
 static int is_correct_target_state_for_command(uint32_t state, char cmd);
+static void wait_for_target();
 static void print_instr(const TaskContext *p_ctx);
 static void print_registers(const TaskContext *p_ctx);
 static void print_stack(const TaskContext *ctx, void *p_initial_sp);
@@ -39,13 +40,12 @@ void process_cli_commands()
     void                *p_mem_addr;
     uint32_t            mem_size;
     uint32_t            bpoint_num;
+    uint32_t            target_id;
     Breakpoint          *p_bpoint;
+    Target              *p_target;
     TargetInfo          target_info;
 
     LOG(DEBUG, "process_cli_commands() has been called");
-    get_target_info(gp_dbg->p_target, &target_info);
-    if (target_info.state & TS_RUNNING)
-        print_instr(&target_info.task_context);
     while(1) {
         // read command from standard input (and ignore errors and commands >= 64 characters)
         Write(Output(), "> ", 2);
@@ -53,12 +53,34 @@ void process_cli_commands()
         cmd_buffer[Read(Input(), cmd_buffer, 64)] = 0;
         nargs = parse_args(cmd_buffer, p_args);
 
+        // The state of the selected target can change between the commands, e.g. if another target has stopped.
+        get_target_info(gp_dbg->p_target, &target_info);
         if (!is_correct_target_state_for_command(target_info.state, p_args[0][0]))
             continue;
 
         switch (p_args[0][0]) {
             case 'r':   // run target
-                run_target(gp_dbg->p_target);
+                if (start_target(gp_dbg->p_target) == ERROR_OK)
+                    wait_for_target();
+                break;
+
+            case 't':   // select target
+                if (nargs != 2) {
+                    LOG(ERROR, "Command 't' requires a target number");
+                    break;
+                }
+                if (sscanf(p_args[1], "%d", &target_id) == 0) {
+                    LOG(ERROR, "Invalid format of target number");
+                    break;
+                }
+                if ((p_target = find_target(gp_dbg, target_id)) == NULL) {
+                    LOG(ERROR, "Target #%d not found", target_id);
+                    break;
+                }
+                gp_dbg->p_target = p_target;
+                get_target_info(p_target, &target_info);
+                if (target_info.state & TS_STOPPED)
+                    print_instr(&target_info.task_context);
                 break;
 
             case 'b':   // set breakpoint
@@ -70,7 +92,7 @@ void process_cli_commands()
                     LOG(ERROR, "Invalid format of breakpoint offset");
                     break;
                 }
-                set_breakpoint(gp_dbg->p_target, bpoint_offset, 0);
+                set_breakpoint(gp_dbg->p_target, bpoint_offset, BPOINT_TYPE_REGULAR, NULL, 0);
                 break;
 
             case 'd':   // delete breakpoint
@@ -91,20 +113,23 @@ void process_cli_commands()
 
             case 'k':   // kill (abort) target
                 kill_target(gp_dbg->p_target);
-                // Return to run_target() so it can exit and the outer invocation can take over again
-                return;
+                break;
 
             case 'q':   // quit debugger
                 quit_debugger(gp_dbg, RETURN_OK);
 
             case 'c':   // continue target
                 set_continue_mode(gp_dbg->p_target);
-                return;
+                resume_target(gp_dbg->p_target);
+                wait_for_target();
+                break;
 
             case 's':   // single step target
             case '\n':
                 set_single_step_mode(gp_dbg->p_target);
-                return;
+                resume_target(gp_dbg->p_target);
+                wait_for_target();
+                break;
 
             case 'i':   // inspect ...
                 if (nargs != 2) {
@@ -171,6 +196,10 @@ static uint8_t parse_args(char *p_cmd, char **pp_args)
 static int is_correct_target_state_for_command(uint32_t state, char cmd)
 {
     // keep list of commands (the 1st argument of strchr()) in sync with process_cli_commands()
+    if ((state & TS_RUNNING) && !(state & TS_STOPPED) && (strchr("cs\nix", cmd) != NULL)) {
+        LOG(ERROR, "incorrect state for command '%c': target has not stopped", cmd);
+        return 0;
+    }
     if (!(state & TS_RUNNING) && (strchr("cs\nikx", cmd) != NULL)) {
         LOG(ERROR, "incorrect state for command '%c': target is not yet running", cmd);
         return 0;
@@ -183,6 +212,20 @@ static int is_correct_target_state_for_command(uint32_t state, char cmd)
 }
 
 
+// This routine waits until one of the targets has stopped or terminated and selects it.
+static void wait_for_target()
+{
+    TargetInfo target_info;
+
+    gp_dbg->p_target = wait_for_target_event(gp_dbg);
+    get_target_info(gp_dbg->p_target, &target_info);
+    if (gp_dbg->ntargets > 1)
+        printf("Target #%d:\n", target_info.target_id);
+    if (target_info.state & TS_RUNNING)
+        print_instr(&target_info.task_context);
+}
+
+
 static void print_instr(const TaskContext *p_ctx)
 {
     uint32_t nbytes;
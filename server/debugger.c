@@ -28,7 +28,7 @@ Debugger *gp_dbg;
 // exported functions
 //
 
-Debugger *create_debugger(int f_server_mode)
+Debugger *create_debugger(int f_server_mode, uint32_t baud_rate, int f_fast_mode, uint16_t tcp_port)
 {
     Debugger *p_dbg;
 
@@ -39,7 +39,7 @@ Debugger *create_debugger(int f_server_mode)
     p_dbg->p_task = FindTask(NULL);
 
     if (f_server_mode) {
-        if ((p_dbg->p_host_conn = create_host_conn()) == NULL) {
+        if ((p_dbg->p_host_conn = create_host_conn(baud_rate, f_fast_mode, tcp_port)) == NULL) {
             LOG(ERROR, "Could not create host connection object");
             FreeVec(p_dbg);
             return NULL;
@@ -52,24 +52,18 @@ Debugger *create_debugger(int f_server_mode)
         LOG(DEBUG, "Initialized disassembler routines");
         p_dbg->p_process_commands_func = process_cli_commands;
     }
-
-    if ((p_dbg->p_target = create_target()) == NULL) {
-        if (f_server_mode)
-            destroy_host_conn(p_dbg->p_host_conn);
-        FreeVec(p_dbg);
-        LOG(ERROR, "Could not create target object");
-        return NULL;
-    }
-    LOG(DEBUG, "Created target object");
+    // the targets are added with add_target()
     return p_dbg;
 }
 
 
 void destroy_debugger(Debugger *p_dbg)
 {
-    if (p_dbg->p_target) {
-        LOG(DEBUG, "Destroying target object");
-        destroy_target(p_dbg->p_target);
+    uint32_t i;
+
+    for (i = 0; i < p_dbg->ntargets; ++i) {
+        LOG(DEBUG, "Destroying target object #%ld", get_target_id(p_dbg->p_targets[i]));
+        destroy_target(p_dbg->p_targets[i]);
     }
     if (p_dbg->p_host_conn) {
         LOG(DEBUG, "Destroying host connection object");
@@ -79,6 +73,94 @@ void destroy_debugger(Debugger *p_dbg)
 }
 
 
+// This routine creates a new target object and returns it, or NULL if there are already MAX_TARGETS targets or the
+// object could not be created. The first target is selected.
+Target *add_target(Debugger *p_dbg)
+{
+    Target *p_target;
+
+    if (p_dbg->ntargets == MAX_TARGETS) {
+        LOG(ERROR, "Too many targets, at most %d targets are supported", MAX_TARGETS);
+        return NULL;
+    }
+    if ((p_target = create_target(p_dbg->ntargets + 1)) == NULL) {
+        LOG(ERROR, "Could not create target object");
+        return NULL;
+    }
+    p_dbg->p_targets[p_dbg->ntargets++] = p_target;
+    if (p_dbg->p_target == NULL)
+        p_dbg->p_target = p_target;
+    LOG(DEBUG, "Created target object #%ld", get_target_id(p_target));
+    return p_target;
+}
+
+
+Target *find_target(Debugger *p_dbg, uint32_t target_id)
+{
+    if ((target_id == 0) || (target_id > p_dbg->ntargets))
+        return NULL;
+    return p_dbg->p_targets[target_id - 1];
+}
+
+
+// This routine waits until one of the running targets has stopped (and the user / host needs to be informed) or
+// terminated, and returns this target. The targets are handled in a round robin fashion so that a target that stops
+// often can't starve the others. If no target is running, it returns the selected target immediately.
+Target *wait_for_target_event(Debugger *p_dbg)
+{
+    Target   *p_target;
+    uint32_t i, signals, received, all_signals, wait_mask;
+
+    for (;;) {
+        all_signals = 0;
+        wait_mask   = 0;
+        for (i = 0; i < p_dbg->ntargets; ++i) {
+            p_target = p_dbg->p_targets[(p_dbg->next_target_idx + i) % p_dbg->ntargets];
+            signals = get_target_signals(p_target);
+            all_signals |= signals;
+            // The signals of a stopped target stay pending until it has been resumed.
+            if ((signals == 0) || is_target_stopped(p_target))
+                continue;
+            if ((received = p_dbg->pending_signals & signals) != 0) {
+                p_dbg->pending_signals &= ~received;
+                if (handle_target_signals(p_target, received)) {
+                    p_dbg->next_target_idx = (p_dbg->next_target_idx + i + 1) % p_dbg->ntargets;
+                    return p_target;
+                }
+                // The target has been resumed and might use other signals now (e.g. if profiling has finished).
+                signals = get_target_signals(p_target);
+            }
+            wait_mask |= signals;
+        }
+        // drop the signals of targets that have been killed in the meantime
+        p_dbg->pending_signals &= all_signals;
+        if (wait_mask == 0) {
+            LOG(CRIT, "Internal error: waiting for a target event but no target is running");
+            return p_dbg->p_target;
+        }
+        p_dbg->pending_signals |= Wait(wait_mask);
+    }
+}
+
+
+// This routine handles the signals the target has already sent but that haven't been handled yet (because they arrived
+// together with the event of another target or after wait_for_target_event() returned), so the state of the target is
+// up to date, e.g. before the host is told about it. It returns TRUE if the target has stopped or terminated.
+int handle_pending_target_signals(Debugger *p_dbg, Target *p_target)
+{
+    uint32_t signals, received;
+
+    signals = get_target_signals(p_target);
+    if ((signals == 0) || is_target_stopped(p_target))
+        return FALSE;
+    received = (p_dbg->pending_signals | SetSignal(0, signals)) & signals;
+    p_dbg->pending_signals &= ~received;
+    if (received == 0)
+        return FALSE;
+    return handle_target_signals(p_target, received);
+}
+
+
 void process_commands(Debugger *p_dbg)
 {
     p_dbg->p_process_commands_func();
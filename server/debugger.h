@@ -12,14 +12,26 @@
 #include "stdint.h"
 
 
+//
+// constants
+//
+#define MAX_TARGETS 4
+
+
 //
 // type declarations
 //
 typedef struct Debugger {
     struct Task    *p_task;
     HostConnection *p_host_conn;
+    // All targets are loaded at startup and numbered from 1 in this order. The commands address the selected target.
+    Target         *p_targets[MAX_TARGETS];
+    uint32_t       ntargets;
     Target         *p_target;
-    // function that handles either CLI or remote commands, called by run_target()
+    // signals received by wait_for_target_event() that belong to a target whose event hasn't been handled yet
+    uint32_t       pending_signals;
+    uint32_t       next_target_idx;             // target whose events are handled first next time (round robin)
+    // function that handles either CLI or remote commands
     void           (*p_process_commands_func)();
 } Debugger;
 
@@ -33,8 +45,12 @@ extern Debugger *gp_dbg;
 //
 // exported functions
 //
-Debugger *create_debugger(int f_server_mode);
+Debugger *create_debugger(int f_server_mode, uint32_t baud_rate, int f_fast_mode, uint16_t tcp_port);
 void destroy_debugger(Debugger *p_dbg);
+Target *add_target(Debugger *p_dbg);
+Target *find_target(Debugger *p_dbg, uint32_t target_id);
+Target *wait_for_target_event(Debugger *p_dbg);
+int handle_pending_target_signals(Debugger *p_dbg, Target *p_target);
 void process_commands(Debugger *p_dbg);
 void quit_debugger(Debugger *p_dbg, int exit_code);
 
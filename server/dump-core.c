@@ -9,22 +9,227 @@
  */
 
 
+#include <dos/dosextens.h>
 #include <proto/dos.h>
+#include <proto/exec.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "debugger.h"
+#include "util.h"
+
+
+//
+// constants
+//
+
+// The core dump uses the Hunk format, with additional block types for the parts of the dump. Each block consists of
+// the block type, the size of the content in longwords and the content. The dump starts with the HUNK_CORE block so
+// it can be told apart from an executable. Keep in sync with BlockTypes in hunklib.py.
+#define HUNK_CORE   1100            // content is the TaskContext, padded to a longword
+#define HUNK_STACK  1101            // content is address, size and content of the used part of the stack
+#define HUNK_MEMORY 1102            // content is address, size, type (one of the CORE_MEM_* values) and content of a memory region
+
+#define CORE_MEM_SEGMENT 0          // segment of the seglist
+#define CORE_MEM_REGION  1          // region added with add_core_region()
+
+#define MAX_CORE_REGIONS    8
+#define CORE_BUFFER_SIZE    512
+#define MAX_CORE_FNAME_LEN  108     // same as the size of fib_FileName
+#define CORE_FNAME_SUFFIX   ".core"
+
+
+//
+// type declarations
+//
+typedef struct CoreRegion {
+    void     *p_address;
+    uint32_t size;
+} CoreRegion;
+
+// All writes go through a small buffer in the data segment, the program has crashed and its heap might be corrupted,
+// so we don't allocate any memory while writing the dump.
+typedef struct CoreFile {
+    BPTR     fh;
+    uint32_t nbytes;                // number of bytes in the buffer
+    int      f_failed;              // a write has failed, all further writes are ignored
+    uint8_t  buffer[CORE_BUFFER_SIZE];
+} CoreFile;
+
+
+//
+// static variables
+//
+static CoreRegion g_core_regions[MAX_CORE_REGIONS];
+static uint32_t   g_num_core_regions = 0;
+static CoreFile   g_core_file;
+static char       g_core_fname[MAX_CORE_FNAME_LEN + sizeof(CORE_FNAME_SUFFIX)];
+
+
+//
+// local functions
+//
+static void flush_core_file(CoreFile *p_file)
+{
+    if (!p_file->f_failed && (p_file->nbytes > 0)) {
+        if (Write(p_file->fh, p_file->buffer, p_file->nbytes) != p_file->nbytes)
+            p_file->f_failed = TRUE;
+    }
+    p_file->nbytes = 0;
+}
+
+
+static void write_bytes(CoreFile *p_file, const void *p_data, uint32_t nbytes)
+{
+    const uint8_t *p_src = p_data;
+    uint32_t      nbytes_chunk;
+
+    while ((nbytes > 0) && !p_file->f_failed) {
+        nbytes_chunk = CORE_BUFFER_SIZE - p_file->nbytes;
+        if (nbytes_chunk > nbytes)
+            nbytes_chunk = nbytes;
+        memcpy(p_file->buffer + p_file->nbytes, p_src, nbytes_chunk);
+        p_file->nbytes += nbytes_chunk;
+        p_src          += nbytes_chunk;
+        nbytes         -= nbytes_chunk;
+        if (p_file->nbytes == CORE_BUFFER_SIZE)
+            flush_core_file(p_file);
+    }
+}
+
+
+static void write_dword(CoreFile *p_file, uint32_t value)
+{
+    write_bytes(p_file, &value, sizeof(value));
+}
+
+
+// write the content padded with zeros to a longword, so the next block starts on a longword boundary
+static void write_content(CoreFile *p_file, const void *p_data, uint32_t nbytes)
+{
+    static const uint8_t padding[3] = {0, 0, 0};
+
+    write_bytes(p_file, p_data, nbytes);
+    write_bytes(p_file, padding, (4 - nbytes % 4) % 4);
+}
+
+
+static uint32_t size_in_dwords(uint32_t nbytes)
+{
+    return (nbytes + 3) / 4;
+}
+
+
+// write a HUNK_STACK or HUNK_MEMORY block, type is ignored for HUNK_STACK
+static void write_mem_block(CoreFile *p_file, uint32_t block_type, const void *p_address, uint32_t size, uint32_t type)
+{
+    uint32_t nheader_dwords = (block_type == HUNK_MEMORY) ? 3 : 2;
+
+    write_dword(p_file, block_type);
+    write_dword(p_file, nheader_dwords + size_in_dwords(size));
+    write_dword(p_file, (uint32_t) p_address);
+    write_dword(p_file, size);
+    if (block_type == HUNK_MEMORY)
+        write_dword(p_file, type);
+    write_content(p_file, p_address, size);
+}
+
+
+static BPTR get_seglist()
+{
+    struct Process              *p_proc = (struct Process *) FindTask(NULL);
+    struct CommandLineInterface *p_cli;
+
+    // Started from the CLI, the seglist is kept in the CLI structure, started from the Workbench, it's the 4th
+    // element of the process' seglist array.
+    if ((p_cli = Cli()) != NULL)
+        return p_cli->cli_Module;
+    else
+        return ((BPTR *) BCPL_TO_C_PTR(p_proc->pr_SegList))[3];
+}
+
+
+static const char *get_core_fname()
+{
+    size_t len;
+
+    if (!GetProgramName(g_core_fname, MAX_CORE_FNAME_LEN) || (g_core_fname[0] == 0))
+        strcpy(g_core_fname, "program");
+    len = strlen(g_core_fname);
+    strcpy(g_core_fname + len, CORE_FNAME_SUFFIX);
+    return g_core_fname;
+}
+
+
+static int write_core_file(TaskContext *p_task_ctx, const char *p_fname)
+{
+    struct Task *p_task = FindTask(NULL);
+    CoreFile    *p_file = &g_core_file;
+    uint8_t     *p_stack_start;
+    uint32_t    *p_seg, i;
+
+    if ((p_file->fh = Open(p_fname, MODE_NEWFILE)) == 0)
+        return DOSFALSE;
+    p_file->nbytes   = 0;
+    p_file->f_failed = FALSE;
+
+    write_dword(p_file, HUNK_CORE);
+    write_dword(p_file, size_in_dwords(sizeof(TaskContext)));
+    write_content(p_file, p_task_ctx, sizeof(TaskContext));
+
+    // If the SP doesn't point into the stack (stack overflow or SP overwritten), we dump the whole stack.
+    p_stack_start = p_task_ctx->p_reg_sp;
+    if ((p_stack_start < (uint8_t *) p_task->tc_SPLower) || (p_stack_start > (uint8_t *) p_task->tc_SPUpper))
+        p_stack_start = p_task->tc_SPLower;
+    write_mem_block(p_file, HUNK_STACK, p_stack_start, (uint8_t *) p_task->tc_SPUpper - p_stack_start, 0);
+
+    // The segments are written in the order of the seglist, which is the order of the hunks in the executable. The
+    // first longword of a segment is the BPTR to the next one, the longword before it is the size of the segment
+    // (including these two longwords), see get_segments() in target.c.
+    for (p_seg = BCPL_TO_C_PTR(get_seglist()); p_seg != NULL; p_seg = BCPL_TO_C_PTR(*p_seg))
+        write_mem_block(p_file, HUNK_MEMORY, p_seg + 1, *(p_seg - 1) - 8, CORE_MEM_SEGMENT);
+
+    for (i = 0; i < g_num_core_regions; ++i)
+        write_mem_block(p_file, HUNK_MEMORY, g_core_regions[i].p_address, g_core_regions[i].size, CORE_MEM_REGION);
+
+    flush_core_file(p_file);
+    Close(p_file->fh);
+    return p_file->f_failed ? DOSFALSE : DOSTRUE;
+}
+
+
+//
+// exported functions
+//
+
+// Add a memory region (e.g. a heap-allocated structure the program wants to be able to inspect after a crash) to
+// the core dump. Returns DOSFALSE if no more regions can be added.
+int add_core_region(void *p_address, uint32_t size)
+{
+    if (g_num_core_regions == MAX_CORE_REGIONS)
+        return DOSFALSE;
+    g_core_regions[g_num_core_regions].p_address = p_address;
+    g_core_regions[g_num_core_regions].size      = size;
+    ++g_num_core_regions;
+    return DOSTRUE;
+}
 
 
 int dump_core(TaskContext *p_task_ctx)
 {
+    const char *p_fname;
+
     Printf(
         "Unhandled exception #%ld occurred at address 0x%08lx\n",
         p_task_ctx->exc_num,
         p_task_ctx->p_reg_pc
     );
-    
-    // TODO: Actually write a core dump. The dump could be in the Hunk format, with additional block types
-    //       HUNK_CORE, HUNK_STACK and HUNK_MEMORY
+
+    p_fname = get_core_fname();
+    if (write_core_file(p_task_ctx, p_fname))
+        Printf("Core dump written to file '%s'\n", p_fname);
+    else
+        Printf("Writing core dump to file '%s' failed\n", p_fname);
 
     exit(RETURN_FAIL);
 }
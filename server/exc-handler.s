@@ -20,13 +20,20 @@
 .set TS_STOPPED_BY_SINGLE_STEP,  64
 .set TS_STOPPED_BY_EXCEPTION,    128
 
-/* see TaskContext structure in debugger.h */
+/* see TaskContext and TrapContext structures in target.h */
 .set tc_reg_sp,  0
 .set tc_exc_num, 4
 .set tc_reg_sr,  8
 .set tc_reg_pc, 10
 .set tc_reg_d,  14
 .set tc_reg_a,  46
+.set tc_stop_reason, 74
+.set tc_flow_instr,  78
+
+/* see exec/execbase.h and exec/tasks.h */
+.set AbsExecBase,   4
+.set ThisTask,      0x114
+.set tc_TrapData,   0x2e
 
 
 .text
@@ -51,6 +58,13 @@
  * --------------------------------
  * | return address (low word)    |     +8
  * --------------------------------
+ *
+ * On the 68010 and up, the format / vector word follows (+10). For trace exceptions, the 68020 - 68040 put the
+ * address of the traced instruction after it (+12).
+ *
+ * The handler saves A0 on the stack first and uses it as pointer to the context of the target (TrapContext structure),
+ * which it finds via tc_TrapData of the current task. This way, several targets can stop at the same time. So all
+ * offsets into the stack frame are 4 bytes larger than shown above.
  */
 _exc_handler:
     ori.w       #0x0700, sr                                 /* disable interrupts in supervisor mode, we don't want to
@@ -64,49 +78,50 @@ _exc_handler:
 #    add.l       #8, sp
 #    movem.l     (sp)+, d0-d1/a0-a1
 
+    /* save A0 and load address of the target's context */
+    move.l      a0, -(sp)
+    movea.l     AbsExecBase, a0
+    movea.l     ThisTask(a0), a0
+    movea.l     tc_TrapData(a0), a0
+
     /* default stop reason, changed later if necessary */
-    move.l      #TS_STOPPED_BY_BREAKPOINT, stop_reason
+    move.l      #TS_STOPPED_BY_BREAKPOINT, tc_stop_reason(a0)
 
     /* branch depending on the exception number */
     /* TODO: If we hit a breakpoint while single-stepping, we get a crash because we don't disable the trace mode before returning to user mode */
-    cmp.l       #EXC_NUM_TRAP_BP, (sp)
+    cmp.l       #EXC_NUM_TRAP_BP, 4(sp)
     beq.s       exc_main
-    cmp.l       #EXC_NUM_TRAP_RESTORE, (sp)
+    cmp.l       #EXC_NUM_TRAP_RESTORE, 4(sp)
     beq.s       exc_restore
-    cmp.l       #EXC_NUM_TRACE, (sp)
+    cmp.l       #EXC_NUM_TRACE, 4(sp)
     beq.s       exc_trace
     bra.w       exc_exc                                     /* any other exception */
 
 
 exc_restore:
     /* restore all registers and resume target */
-    add.l       #10, sp                                     /* remove trap number, status register and return address from stack */
-    lea         g_target_task_ctx, a0                       /* load base address of struct */
+    lea         14(sp), sp                                  /* remove saved A0, trap number, status register and return address from stack */
     move.l      tc_reg_pc(a0), -(sp)                        /* push saved target PC and status register (possibly modified) onto stack */
     move.w      tc_reg_sr(a0), -(sp)
-    add.l       #tc_reg_d, a0                               /* move pointer to D0 */
-    movem.l     (a0)+, d0-d7                                /* restore data registers */
-    movem.l     (a0)+, a0-a6                                /* restore address registers without A0 (is skipped automatically because it contains the base address) */
-    lea         g_target_task_ctx + tc_reg_a, a0            /* finally restore A0 */
-    move.l      (a0), a0
+    move.l      tc_reg_a(a0), -(sp)                         /* push saved A0 so we can restore it last */
+    movem.l     tc_reg_d(a0), d0-d7                         /* restore data registers */
+    movem.l     tc_reg_a+4(a0), a1-a6                       /* restore address registers without A0 */
+    movea.l     (sp)+, a0                                   /* finally restore A0 */
     rte
 
 
 exc_main:
-    move.l      a0, g_target_task_ctx + tc_reg_a            /* save A0 first so we can use it as base / scratch register */
-    move.l      usp, a0                                     /* push user SP onto our stack */
-    move.l      a0, -(sp)
     /* now pop all items from the stack and save them in the target's task context */
-    lea         g_target_task_ctx, a0                       /* load base address of struct */
-    move.l      (sp)+, (a0)+                                /* SP */
-    move.l      (sp)+, (a0)+                                /* exception number */
-    move.w      (sp)+, (a0)+                                /* SR */
-    move.l      (sp)+, (a0)+                                /* PC (return address) */
-    lea         g_target_task_ctx + tc_reg_d + 32, a0       /* move pointer one longword beyond data registers for the pre-decrement mode to work */
-    movem.l     d0-d7, -(a0)                                /* save data registers */
-    lea         g_target_task_ctx + tc_reg_a + 28, a0       /* move pointer one longword beyond address registers */
-    movem.l     a1-a6, -(a0)                                /* save address registers without A0 because it has already been saved */
-    /* push again return address (our stub routine) and a "clean" SR onto stack and "return" to stub routine */
+    move.l      (sp)+, tc_reg_a(a0)                         /* A0 */
+    movem.l     d0-d7, tc_reg_d(a0)                         /* save data registers */
+    movem.l     a1-a6, tc_reg_a+4(a0)                       /* save address registers without A0 because it has already been saved */
+    move.l      usp, a1                                     /* SP */
+    move.l      a1, tc_reg_sp(a0)
+    move.l      (sp)+, tc_exc_num(a0)                       /* exception number */
+    move.w      (sp)+, tc_reg_sr(a0)                        /* SR */
+    move.l      (sp)+, tc_reg_pc(a0)                        /* PC (return address) */
+    /* push again return address (our stub routine) and a "clean" SR onto stack and "return" to stub routine, A0 still
+       points to the context */
     pea         debugger_stub
     move.w      #0x0000, -(sp)
     rte
@@ -114,21 +129,33 @@ exc_main:
 
 exc_trace:
     /* trace exception */
-    andi.w      #0x78ff, 4(sp)                              /* disable trace mode and re-enable interrupts in user mode */
-    move.l      #TS_STOPPED_BY_SINGLE_STEP, stop_reason
+    btst        #5, 8(sp)                                   /* S bit set => the CPU has traced a TRAP instruction and */
+    bne.s       exc_ignore                                  /* we're at the start of the trap handler, so we ignore it */
+    btst        #6, 8(sp)                                   /* T0 set => tracing on change of flow on a 68020 - 68040 */
+    beq.s       exc_single_step
+    move.l      16(sp), tc_flow_instr(a0)                   /* save address of the instruction that changed the flow */
+exc_single_step:
+    andi.w      #0x38ff, 8(sp)                              /* disable trace mode (T1 and T0) and re-enable interrupts in user mode */
+    move.l      #TS_STOPPED_BY_SINGLE_STEP, tc_stop_reason(a0)
     bra.s       exc_main                                    /* call debugger in the same way as with a breakpoint */
 
 
+exc_ignore:
+    movea.l     (sp)+, a0                                   /* restore A0, remove exception number from stack and return */
+    addq.l      #4, sp
+    rte
+
+
 exc_exc:
     /* another exception => just call debugger */
-    move.l      #TS_STOPPED_BY_EXCEPTION, stop_reason
+    move.l      #TS_STOPPED_BY_EXCEPTION, tc_stop_reason(a0)
     bra.s       exc_main
 
 
 debugger_stub:
     /* call the entry point into the debugger */
-    pea         g_target_task_ctx                           /* push target context address and stop reason onto stack */
-    move.l      stop_reason, -(sp)
+    move.l      a0, -(sp)                                   /* push target context address and stop reason onto stack */
+    move.l      tc_stop_reason(a0), -(sp)
     jsr         _handle_stopped_target
     addq.l      #8, sp                                      /* remove args from stack */
 
@@ -137,7 +164,5 @@ debugger_stub:
 
 
 .data
-    .lcomm stop_reason, 4                                   /* stop reason */
-    .lcomm g_target_task_ctx, 74                            /* target context, 74 == sizeof(TaskContext) */
 msg:
     .asciz "Exception #%ld occurred\n"
@@ -30,33 +30,44 @@ Debugger *gp_dbg;
 int main()
 {
     struct RDArgs *p_rdargs;
-    long args[3] = {0l, 0l, 0l};
-    int f_debug_mode, f_server_mode;
-    const char *p_target_fname;
+    long args[6] = {0l, 0l, 0l, 0l, 0l, 0l};
+    int f_debug_mode, f_server_mode, f_fast_mode;
+    uint32_t baud_rate;
+    uint16_t tcp_port;
+    const char **pp_target_fnames;
+    Target *p_target;
 
     g_loglevel = INFO;
-    if ((p_rdargs = ReadArgs("-d=--debug/S,-s=--server/S,target/A", args, NULL)) == NULL) {
-        LOG(ERROR, "wrong usage - usage: cwdbg [-d/--debug] [-s/--server] <target>");
+    if ((p_rdargs = ReadArgs("-d=--debug/S,-s=--server/S,-f=--fast/S,-b=--baud/K/N,-p=--port/K/N,target/A/M", args, NULL)) == NULL) {
+        LOG(ERROR, "wrong usage - usage: cwdbg [-d/--debug] [-s/--server] [-f/--fast] [-b/--baud <rate>] [-p/--port <port>] <target> [<target> ...]");
         exit(RETURN_FAIL);
     }
     f_debug_mode  = args[0] == DOSTRUE ? 1 : 0;
     f_server_mode = args[1] == DOSTRUE ? 1 : 0;
-    p_target_fname = (char *) args[2];
+    // fast mode and baud rate are only used in server mode, baud rate 0 = keep the rate from the preferences
+    f_fast_mode   = args[2] == DOSTRUE ? 1 : 0;
+    baud_rate     = args[3] ? *((long *) args[3]) : 0;
+    // In server mode, a TCP port means that the host connects via TCP instead of the serial line.
+    tcp_port      = args[4] ? *((long *) args[4]) : 0;
+    // several targets can be debugged at once, they are numbered from 1 in the order given on the command line
+    pp_target_fnames = (const char **) args[5];
     if (f_debug_mode)
         g_loglevel = DEBUG;
 
-    if ((gp_dbg = create_debugger(f_server_mode)) == NULL) {
+    if ((gp_dbg = create_debugger(f_server_mode, baud_rate, f_fast_mode, tcp_port)) == NULL) {
         LOG(ERROR, "Could not create debugger object");
         FreeArgs(p_rdargs);
         exit(RETURN_FAIL);
     }
 
-    if (load_target(gp_dbg->p_target, p_target_fname) != ERROR_OK) {
-        LOG(ERROR, "Could not load target")
-        FreeArgs(p_rdargs);
-        quit_debugger(gp_dbg, RETURN_FAIL);
+    for (; *pp_target_fnames != NULL; ++pp_target_fnames) {
+        if (((p_target = add_target(gp_dbg)) == NULL) || (load_target(p_target, *pp_target_fnames) != ERROR_OK)) {
+            LOG(ERROR, "Could not load target '%s'", *pp_target_fnames);
+            FreeArgs(p_rdargs);
+            quit_debugger(gp_dbg, RETURN_FAIL);
+        }
+        LOG(INFO, "Loaded target #%ld", get_target_id(p_target));
     }
-    LOG(INFO, "Loaded target");
     FreeArgs(p_rdargs);
 
     process_commands(gp_dbg);
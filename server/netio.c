@@ -0,0 +1,226 @@
+//
+// netio.c - part of cwdbg, a debugger for the AmigaOS
+//           This file contains the routines for the communication with the remote host via TCP (bsdsocket.library).
+//
+// Copyright(C) 2018-2022 Constantin Wiemer
+//
+
+
+#include <exec/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <proto/exec.h>
+#include <proto/socket.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "netio.h"
+#include "stdint.h"
+#include "util.h"
+
+
+// The library base of bsdsocket.library is per task, so all routines must be called by the task that has created
+// the connection (the debugger task, like the routines for the serial connection).
+struct Library *SocketBase;
+
+
+static int send_all(NetConnection *p_conn, const uint8_t *p_data, uint32_t size);
+
+
+//
+// exported routines
+//
+
+// This routine waits for the host to connect on the given port and returns the connection. Only one host can be
+// connected, so we stop listening as soon as it has connected.
+NetConnection *create_net_conn(uint16_t port)
+{
+    NetConnection      *p_conn;
+    struct sockaddr_in addr;
+    long               listen_sock = -1, one = 1;
+    int                i;
+
+    if ((p_conn = AllocVec(sizeof(NetConnection), MEMF_CLEAR)) == NULL) {
+        LOG(CRIT, "Could not allocate memory for network connection object");
+        return NULL;
+    }
+    p_conn->sock = -1;
+    if ((SocketBase = OpenLibrary("bsdsocket.library", 4l)) == NULL) {
+        LOG(CRIT, "Could not open bsdsocket.library, is a TCP/IP stack running?");
+        goto error;
+    }
+    if ((p_conn->p_recv_buffer = AllocVec(MAX_FRAME_SIZE, 0)) == NULL) {
+        LOG(CRIT, "Could not allocate memory for frame buffer");
+        goto error;
+    }
+    for (i = 0; i < NUM_KEPT_FRAMES; i++) {
+        if ((p_conn->p_send_buffers[i] = AllocVec(MAX_FRAME_SIZE, 0)) == NULL) {
+            LOG(CRIT, "Could not allocate memory for frame buffer");
+            goto error;
+        }
+    }
+
+    if ((listen_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        LOG(CRIT, "Could not create socket: %ld", Errno());
+        goto error;
+    }
+    // allows restarting the server right away, without waiting for the old connection to time out
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((bind(listen_sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) || (listen(listen_sock, 1) == -1)) {
+        LOG(CRIT, "Could not listen on port %d: %ld", port, Errno());
+        goto error;
+    }
+    LOG(INFO, "Waiting for host to connect on TCP port %d...", port);
+    if ((p_conn->sock = accept(listen_sock, NULL, NULL)) == -1) {
+        LOG(CRIT, "Could not accept connection from host: %ld", Errno());
+        goto error;
+    }
+    CloseSocket(listen_sock);
+    // We wait for the reply after each message anyway, so delaying small frames (Nagle's algorithm) only adds latency.
+    setsockopt(p_conn->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    LOG(INFO, "Host has connected");
+    return p_conn;
+
+    error:
+        if (listen_sock != -1)
+            CloseSocket(listen_sock);
+        for (i = 0; i < NUM_KEPT_FRAMES; i++) {
+            if (p_conn->p_send_buffers[i])
+                FreeVec(p_conn->p_send_buffers[i]);
+        }
+        if (p_conn->p_recv_buffer)
+            FreeVec(p_conn->p_recv_buffer);
+        if (SocketBase) {
+            CloseLibrary(SocketBase);
+            SocketBase = NULL;
+        }
+        FreeVec(p_conn);
+        return NULL;
+}
+
+
+void destroy_net_conn(NetConnection *p_conn)
+{
+    int i;
+
+    LOG(DEBUG, "Closing network connection");
+    CloseSocket(p_conn->sock);
+    for (i = 0; i < NUM_KEPT_FRAMES; i++)
+        FreeVec(p_conn->p_send_buffers[i]);
+    FreeVec(p_conn->p_recv_buffer);
+    CloseLibrary(SocketBase);
+    SocketBase = NULL;
+    FreeVec(p_conn);
+}
+
+
+// This routine SLIP-encodes the header and the data (which can be NULL) into the next send buffer and sends the frame.
+int send_net_frame(NetConnection *p_conn, const Buffer *pb_header, const Buffer *pb_data)
+{
+    uint16_t idx = p_conn->next_send;
+    uint8_t  *p_frame = p_conn->p_send_buffers[idx], *p_frame_pos;
+    uint32_t data_size = pb_data ? pb_data->size : 0;
+
+    // Every byte is encoded into two bytes at the most, so we only need to check the size once.
+    if (2 * (pb_header->size + data_size) + 1 > MAX_FRAME_SIZE) {
+        LOG(ERROR, "Frame with %ld bytes might not fit into the frame buffer", pb_header->size + data_size);
+        p_conn->errno = ERROR_BUFFER_OVERFLOW;
+        return DOSFALSE;
+    }
+    p_frame_pos = encode_slip_data(pb_header->p_addr, pb_header->size, p_frame);
+    if (data_size > 0)
+        p_frame_pos = encode_slip_data(pb_data->p_addr, data_size, p_frame_pos);
+    *p_frame_pos++ = SLIP_END;
+    p_conn->send_lens[idx] = p_frame_pos - p_frame;
+    p_conn->next_send = (idx + 1) % NUM_KEPT_FRAMES;
+    return send_all(p_conn, p_frame, p_conn->send_lens[idx]);
+}
+
+
+// This routine sends the last nframes frames again (in the order in which they were sent before).
+int resend_net_frames(NetConnection *p_conn, uint16_t nframes)
+{
+    uint16_t idx, i;
+
+    if (nframes > NUM_KEPT_FRAMES) {
+        LOG(ERROR, "Can't resend %d frames, only the last %d frames are kept", nframes, NUM_KEPT_FRAMES);
+        p_conn->errno = ERROR_BAD_NUMBER;
+        return DOSFALSE;
+    }
+    for (i = nframes; i > 0; i--) {
+        idx = (p_conn->next_send + NUM_KEPT_FRAMES - i) % NUM_KEPT_FRAMES;
+        if (send_all(p_conn, p_conn->p_send_buffers[idx], p_conn->send_lens[idx]) == DOSFALSE)
+            return DOSFALSE;
+    }
+    return DOSTRUE;
+}
+
+
+// This routine receives the next SLIP frame and decodes it into the buffer. TCP delivers a stream of bytes, so the
+// data received from the socket can contain several frames or only part of one. We therefore keep the data in the
+// receive buffer until it contains a complete frame, and keep anything after the frame for the next call.
+int recv_net_frame(NetConnection *p_conn, Buffer *pb_data)
+{
+    uint8_t  *p_frame_end;
+    uint32_t frame_size;
+    long     nbytes;
+
+    while ((p_frame_end = memchr(p_conn->p_recv_buffer, SLIP_END, p_conn->recv_len)) == NULL) {
+        if (p_conn->recv_len == MAX_FRAME_SIZE) {
+            LOG(WARN, "No end-of-frame marker found in %ld bytes, dropping them", p_conn->recv_len);
+            p_conn->recv_len = 0;
+            return RECV_CORRUPTED;
+        }
+        if ((nbytes = recv(p_conn->sock, p_conn->p_recv_buffer + p_conn->recv_len, MAX_FRAME_SIZE - p_conn->recv_len, 0)) <= 0) {
+            if (nbytes == 0) {
+                LOG(ERROR, "Host has closed the connection");
+                p_conn->errno = 0;
+            }
+            else {
+                p_conn->errno = Errno();
+                LOG(ERROR, "Failed to receive data from host: %ld", p_conn->errno);
+            }
+            return RECV_FAILED;
+        }
+        p_conn->recv_len += nbytes;
+    }
+    frame_size = p_frame_end - p_conn->p_recv_buffer;
+    LOG(DEBUG, "Dump of received SLIP frame (%ld bytes):", frame_size);
+    LOG_MEMORY(DEBUG, p_conn->p_recv_buffer, frame_size);
+    pb_data->size = decode_slip_frame(p_conn->p_recv_buffer, frame_size, pb_data->p_addr, pb_data->size);
+    // remove the frame and its end-of-frame marker from the buffer
+    p_conn->recv_len -= frame_size + 1;
+    memmove(p_conn->p_recv_buffer, p_frame_end + 1, p_conn->recv_len);
+    if (pb_data->size == 0) {
+        LOG(WARN, "Could not decode SLIP frame of %ld bytes", frame_size);
+        return RECV_CORRUPTED;
+    }
+    return RECV_OK;
+}
+
+
+//
+// local routines
+//
+
+static int send_all(NetConnection *p_conn, const uint8_t *p_data, uint32_t size)
+{
+    long nbytes;
+
+    while (size > 0) {
+        // If send() doesn't send anything without reporting an error, we would loop forever, so we treat this as error.
+        if ((nbytes = send(p_conn->sock, (APTR) p_data, size, 0)) <= 0) {
+            p_conn->errno = Errno();
+            LOG(ERROR, "Failed to send data to host: %ld", p_conn->errno);
+            return DOSFALSE;
+        }
+        p_data += nbytes;
+        size   -= nbytes;
+    }
+    p_conn->errno = 0;
+    return DOSTRUE;
+}
@@ -0,0 +1,39 @@
+#ifndef CWDBG_NETIO_H
+#define CWDBG_NETIO_H
+//
+// netio.h - part of cwdbg, a debugger for the AmigaOS
+//
+// Copyright(C) 2018-2022 Constantin Wiemer
+//
+
+
+#include "stdint.h"
+#include "transport.h"
+
+
+//
+// type declarations
+//
+// The frames are sent synchronously (the TCP stack buffers them anyway), but like the serial connection, we keep the
+// last NUM_KEPT_FRAMES frames so they can be resent if the host asks for them.
+typedef struct NetConnection {
+    long            sock;
+    uint8_t         *p_recv_buffer;                         // data received from the host but not yet processed
+    uint32_t        recv_len;
+    uint8_t         *p_send_buffers[NUM_KEPT_FRAMES];       // SLIP frames sent last
+    uint32_t        send_lens[NUM_KEPT_FRAMES];
+    uint16_t        next_send;                              // index of the buffer used for the next frame
+    uint32_t        errno;
+} NetConnection;
+
+
+//
+// exported functions
+//
+NetConnection *create_net_conn(uint16_t port);
+void destroy_net_conn(NetConnection *p_conn);
+int send_net_frame(NetConnection *p_conn, const Buffer *pb_header, const Buffer *pb_data);
+int resend_net_frames(NetConnection *p_conn, uint16_t nframes);
+int recv_net_frame(NetConnection *p_conn, Buffer *pb_data);
+
+#endif  // CWDBG_NETIO_H
@@ -14,187 +14,230 @@
 #include <proto/alib.h>
 #include <proto/exec.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "serio.h"
 #include "util.h"
 #include "stdint.h"
 
 
-#define SLIP_END                0xc0
-#define SLIP_ESCAPED_END        0xdc
-#define SLIP_ESC                0xdb
-#define SLIP_ESCAPED_ESC        0xdd
+static int wait_for_write(SerialConnection *p_conn, int idx);
 
 
 //
 // exported routines
 //
 
-SerialConnection *create_serial_conn()
+// This routine opens the serial device with one read and NUM_WRITE_REQUESTS write requests. A baud rate of 0 keeps
+// the rate from the preferences. Fast mode uses the high-speed mode of the device (SERF_RAD_BOOGIE, which implies
+// 8N1 and no flow control) with FAST_BAUD_RATE unless another baud rate has been specified.
+SerialConnection *create_serial_conn(uint32_t baud_rate, int f_fast_mode)
 {
     SerialConnection *p_conn;
-    struct MsgPort *port = &(((struct Process *) FindTask(NULL))->pr_MsgPort);
+    int              i;
 
     if ((p_conn = AllocVec(sizeof(SerialConnection), MEMF_CLEAR)) == NULL) {
         LOG(CRIT, "Could not allocate memory for serial connection object");
         return NULL;
     }
-    if ((p_conn->p_io_request = (struct IOExtSer *) CreateExtIO(port, sizeof(struct IOExtSer))) == NULL) {
+    if ((p_conn->p_port = CreateMsgPort()) == NULL) {
+        LOG(CRIT, "Could not create message port for serial device");
+        goto error;
+    }
+    if ((p_conn->p_read_request = (struct IOExtSer *) CreateExtIO(p_conn->p_port, sizeof(struct IOExtSer))) == NULL) {
         LOG(CRIT, "Could not create IO request for serial device");
-        return NULL;
+        goto error;
     }
-    if (OpenDevice("serial.device", 0l, (struct IORequest *) p_conn->p_io_request, 0l) != 0) {
+    if (OpenDevice("serial.device", 0l, (struct IORequest *) p_conn->p_read_request, 0l) != 0) {
         LOG(CRIT, "Could not open serial device");
-        DeleteExtIO((struct IORequest *) p_conn->p_io_request);
-        return NULL;
+        DeleteExtIO((struct IORequest *) p_conn->p_read_request);
+        p_conn->p_read_request = NULL;
+        goto error;
     }
     /* configure device to terminate read requests on SLIP end-of-frame-markers and disable flow control */
-    /* 
-        * TODO: configure device for maximum speed:
-    p_conn->p_io_request->io_SerFlags     |= SERF_XDISABLED | SERF_RAD_BOOGIE;
-    p_conn->p_io_request->io_Baud          = 292000l;
-        */
-    p_conn->p_io_request->io_SerFlags     |= SERF_XDISABLED;
-    p_conn->p_io_request->IOSer.io_Command = SDCMD_SETPARAMS;
-    memset(&p_conn->p_io_request->io_TermArray, SLIP_END, 8);
-    if (DoIO((struct IORequest *) p_conn->p_io_request) != 0) {
+    p_conn->p_read_request->io_SerFlags |= SERF_XDISABLED;
+    if (f_fast_mode) {
+        p_conn->p_read_request->io_SerFlags |= SERF_RAD_BOOGIE;
+        p_conn->p_read_request->io_ReadLen   = 8;
+        p_conn->p_read_request->io_WriteLen  = 8;
+        p_conn->p_read_request->io_StopBits  = 1;
+        if (baud_rate == 0)
+            baud_rate = FAST_BAUD_RATE;
+    }
+    if (baud_rate != 0)
+        p_conn->p_read_request->io_Baud = baud_rate;
+    p_conn->p_read_request->IOSer.io_Command = SDCMD_SETPARAMS;
+    memset(&p_conn->p_read_request->io_TermArray, SLIP_END, 8);
+    if (DoIO((struct IORequest *) p_conn->p_read_request) != 0) {
         LOG(CRIT, "Could not configure serial device");
-        CloseDevice((struct IORequest *) p_conn->p_io_request);
-        DeleteExtIO((struct IORequest *) p_conn->p_io_request);
-        return NULL;
+        goto error;
+    }
+    if ((p_conn->p_read_buffer = AllocVec(MAX_FRAME_SIZE, 0)) == NULL) {
+        LOG(CRIT, "Could not allocate memory for frame buffer");
+        goto error;
+    }
+    LOG(INFO, "Opened serial device with %ld baud%s", p_conn->p_read_request->io_Baud, f_fast_mode ? " (fast mode)" : "");
+
+    // The write requests are copies of the (configured) read request, as recommended for using several requests
+    // with the same unit.
+    for (i = 0; i < NUM_WRITE_REQUESTS; i++) {
+        if ((p_conn->p_write_requests[i] = (struct IOExtSer *) CreateExtIO(p_conn->p_port, sizeof(struct IOExtSer))) == NULL) {
+            LOG(CRIT, "Could not create IO request for serial device");
+            goto error;
+        }
+        memcpy(p_conn->p_write_requests[i], p_conn->p_read_request, sizeof(struct IOExtSer));
+        if ((p_conn->p_write_buffers[i] = AllocVec(MAX_FRAME_SIZE, 0)) == NULL) {
+            LOG(CRIT, "Could not allocate memory for frame buffer");
+            goto error;
+        }
     }
     return p_conn;
+
+    error:
+        for (i = 0; i < NUM_WRITE_REQUESTS; i++) {
+            if (p_conn->p_write_buffers[i])
+                FreeVec(p_conn->p_write_buffers[i]);
+            if (p_conn->p_write_requests[i])
+                DeleteExtIO((struct IORequest *) p_conn->p_write_requests[i]);
+        }
+        if (p_conn->p_read_buffer)
+            FreeVec(p_conn->p_read_buffer);
+        if (p_conn->p_read_request) {
+            CloseDevice((struct IORequest *) p_conn->p_read_request);
+            DeleteExtIO((struct IORequest *) p_conn->p_read_request);
+        }
+        if (p_conn->p_port)
+            DeleteMsgPort(p_conn->p_port);
+        FreeVec(p_conn);
+        return NULL;
 }
 
 
 void destroy_serial_conn(SerialConnection *p_conn)
 {
+    int i;
+
+    flush_serial_writes(p_conn);
     LOG(DEBUG, "Closing serial device");
-    CloseDevice((struct IORequest *) p_conn->p_io_request);
-    DeleteExtIO((struct IORequest *) p_conn->p_io_request);
+    CloseDevice((struct IORequest *) p_conn->p_read_request);
+    DeleteExtIO((struct IORequest *) p_conn->p_read_request);
+    FreeVec(p_conn->p_read_buffer);
+    for (i = 0; i < NUM_WRITE_REQUESTS; i++) {
+        DeleteExtIO((struct IORequest *) p_conn->p_write_requests[i]);
+        FreeVec(p_conn->p_write_buffers[i]);
+    }
+    DeleteMsgPort(p_conn->p_port);
     FreeVec(p_conn);
 }
 
 
-int put_data_into_slip_frame(SerialConnection *p_conn, const Buffer *pb_data, Buffer *pb_frame)
+// This routine SLIP-encodes the header and the data (which can be NULL) directly into the buffer of the next write
+// request, so the data doesn't need to be copied into one block first, and sends the frame asynchronously. The caller
+// can already prepare the next frame while this one is being sent. The routine only blocks if the write request it
+// uses is still busy with the frame sent NUM_WRITE_REQUESTS frames before. An error of a previous write is therefore
+// reported by a later call of this routine (or by flush_serial_writes()).
+int send_slip_frame(SerialConnection *p_conn, const Buffer *pb_header, const Buffer *pb_data)
 {
-    const uint8_t *src = pb_data->p_addr;
-    uint8_t *dst       = pb_frame->p_addr;
-    int nbytes_read, nbytes_written;
-
-    /*
-     * The limit for nbytes_written has to be length of the destination buffer - 1
-     * because due to the escaping mechanism in SLIP, we can get two bytes in
-     * one pass of the loop.
-     */
-    for (nbytes_read = 0, nbytes_written = 0;
-        nbytes_read < pb_data->size && nbytes_written < pb_frame->size - 1; 
-        nbytes_read++, nbytes_written++, src++, dst++) {
-        if (*src == SLIP_END) {
-            *dst = SLIP_ESC;
-            ++dst;
-            ++nbytes_written;
-            *dst = SLIP_ESCAPED_END;
-        }
-        else if (*src == SLIP_ESC) {
-            *dst = SLIP_ESC;
-            ++dst;
-            ++nbytes_written;
-            *dst = SLIP_ESCAPED_ESC;
-        }
-        else {
-            *dst = *src;
-        }
-    }
-    if (nbytes_read < pb_data->size) {
-        LOG(ERROR, "Could not copy all bytes to the destination");
+    uint16_t        idx = p_conn->next_write;
+    struct IOExtSer *p_request = p_conn->p_write_requests[idx];
+    uint8_t         *p_frame = p_conn->p_write_buffers[idx], *p_frame_pos;
+    uint32_t        data_size = pb_data ? pb_data->size : 0;
+
+    // Every byte is encoded into two bytes at the most, so we only need to check the size once.
+    if (2 * (pb_header->size + data_size) + 1 > MAX_FRAME_SIZE) {
+        LOG(ERROR, "Frame with %ld bytes might not fit into the frame buffer", pb_header->size + data_size);
         p_conn->errno = ERROR_BUFFER_OVERFLOW;
         return DOSFALSE;
     }
+    if (wait_for_write(p_conn, idx) == DOSFALSE)
+        return DOSFALSE;
+    p_frame_pos = encode_slip_data(pb_header->p_addr, pb_header->size, p_frame);
+    if (data_size > 0)
+        p_frame_pos = encode_slip_data(pb_data->p_addr, data_size, p_frame_pos);
+    *p_frame_pos++ = SLIP_END;
 
-    /* add SLIP end-of-frame marker */
-    if (nbytes_written < pb_frame->size) {
-        *dst = SLIP_END;
-        pb_frame->size = ++nbytes_written;
-    }
-    else {
-        LOG(ERROR, "Could not add SLIP end-of-frame marker");
-        p_conn->errno = ERROR_BUFFER_OVERFLOW;
-        return NULL;
-    }
+    p_request->io_SerFlags     &= ~SERF_EOFMODE;      /* clear EOF mode */
+    p_request->IOSer.io_Command = CMD_WRITE;
+    p_request->IOSer.io_Length  = p_frame_pos - p_frame;
+    p_request->IOSer.io_Data    = (void *) p_frame;
+    SendIO((struct IORequest *) p_request);
+    p_conn->f_write_pending[idx] = TRUE;
+    p_conn->next_write = (idx + 1) % NUM_WRITE_REQUESTS;
     p_conn->errno = 0;
     return DOSTRUE;
 }
 
 
-int get_data_from_slip_frame(SerialConnection *p_conn, Buffer *pb_data, const Buffer *pb_frame)
+// This routine sends the last nframes frames again (in the order in which they were sent before). The frames are kept
+// in the buffers of the write requests until they are reused, so at most NUM_WRITE_REQUESTS frames can be resent.
+int resend_slip_frames(SerialConnection *p_conn, uint16_t nframes)
 {
-    const uint8_t *src = pb_frame->p_addr;
-    uint8_t *dst       = pb_data->p_addr;
-    int nbytes_read, nbytes_written;
-    for (nbytes_read = 0, nbytes_written = 0;
-        nbytes_read < pb_frame->size && nbytes_written < pb_data->size;
-		nbytes_read++, nbytes_written++, src++, dst++) {
-        if (*src == SLIP_ESC) {
-            ++src;
-            ++nbytes_read;
-            if (*src == SLIP_ESCAPED_END)
-                *dst = SLIP_END;
-            else if (*src == SLIP_ESCAPED_ESC)
-                *dst = SLIP_ESC;
-            else {
-                LOG(ERROR, "Invalid escape sequence found in SLIP frame: 0x%02lx", (uint) *src);
-                p_conn->errno = ERROR_BAD_NUMBER;
-                break;
-            }
-        }
-        else if (*src == SLIP_END) {
-            ++nbytes_read;
-            break;
-        }
-        else
-            *dst = *src;
-    }
-    pb_data->size = nbytes_written;
-    if (nbytes_read < pb_frame->size) {
-        LOG(ERROR, "Could not copy all bytes to the destination");
-        p_conn->errno = ERROR_BUFFER_OVERFLOW;
+    uint16_t        idx, i;
+    struct IOExtSer *p_request;
+
+    if (nframes > NUM_WRITE_REQUESTS) {
+        LOG(ERROR, "Can't resend %d frames, only the last %d frames are kept", nframes, NUM_WRITE_REQUESTS);
+        p_conn->errno = ERROR_BAD_NUMBER;
         return DOSFALSE;
     }
+    for (i = nframes; i > 0; i--) {
+        idx = (p_conn->next_write + NUM_WRITE_REQUESTS - i) % NUM_WRITE_REQUESTS;
+        p_request = p_conn->p_write_requests[idx];
+        // io_Data and io_Length still describe the frame from the last write with this request
+        if (wait_for_write(p_conn, idx) == DOSFALSE)
+            return DOSFALSE;
+        p_request->IOSer.io_Command = CMD_WRITE;
+        SendIO((struct IORequest *) p_request);
+        p_conn->f_write_pending[idx] = TRUE;
+    }
     p_conn->errno = 0;
     return DOSTRUE;
 }
 
 
-int send_slip_frame(SerialConnection *p_conn, const Buffer *pb_frame)
+// This routine waits until all frames have been sent, it returns DOSFALSE if one of the writes failed.
+int flush_serial_writes(SerialConnection *p_conn)
 {
-    p_conn->p_io_request->io_SerFlags     &= ~SERF_EOFMODE;      /* clear EOF mode */
-    p_conn->p_io_request->IOSer.io_Command = CMD_WRITE;
-    p_conn->p_io_request->IOSer.io_Length  = pb_frame->size;
-    p_conn->p_io_request->IOSer.io_Data    = (void *) pb_frame->p_addr;
-    p_conn->errno = DoIO((struct IORequest *) p_conn->p_io_request);
-    if (p_conn->errno == 0)
-        return DOSTRUE;
-    else
-        return DOSFALSE;
+    int i, rc = DOSTRUE;
+
+    for (i = 0; i < NUM_WRITE_REQUESTS; i++) {
+        if (wait_for_write(p_conn, i) == DOSFALSE)
+            rc = DOSFALSE;
+    }
+    return rc;
 }
 
 
-int recv_slip_frame(SerialConnection *p_conn, Buffer *pb_frame)
+// This routine receives the next SLIP frame and decodes it into the buffer. Frames that have been damaged on the
+// line (line errors or an invalid SLIP encoding) are reported as RECV_CORRUPTED.
+int recv_slip_frame(SerialConnection *p_conn, Buffer *pb_data)
 {
-    p_conn->p_io_request->io_SerFlags     |= SERF_EOFMODE;       /* set EOF mode */
-    p_conn->p_io_request->IOSer.io_Command = CMD_READ;
-    p_conn->p_io_request->IOSer.io_Data    = (void *) pb_frame->p_addr;
-    p_conn->p_io_request->IOSer.io_Length  = pb_frame->size;
-    p_conn->errno = DoIO((struct IORequest *) p_conn->p_io_request);
-    if (p_conn->errno == 0) {
-        pb_frame->size = p_conn->p_io_request->IOSer.io_Actual;
-        LOG(DEBUG, "Dump of received SLIP frame (%ld bytes):", pb_frame->size);
-        dump_memory(pb_frame->p_addr, pb_frame->size);
-        return DOSTRUE;
-    }
-    else
-        return DOSFALSE;
+    uint32_t frame_size;
+
+    p_conn->p_read_request->io_SerFlags     |= SERF_EOFMODE;       /* set EOF mode */
+    p_conn->p_read_request->IOSer.io_Command = CMD_READ;
+    p_conn->p_read_request->IOSer.io_Data    = (void *) p_conn->p_read_buffer;
+    p_conn->p_read_request->IOSer.io_Length  = MAX_FRAME_SIZE;
+    if ((p_conn->errno = DoIO((struct IORequest *) p_conn->p_read_request)) != 0) {
+        if ((p_conn->errno == SerErr_LineErr) || (p_conn->errno == SerErr_ParityErr) || (p_conn->errno == SerErr_BufOverflow)) {
+            LOG(WARN, "Line error while receiving SLIP frame: %ld", p_conn->errno);
+            return RECV_CORRUPTED;
+        }
+        LOG(ERROR, "Failed to receive SLIP frame: %ld", p_conn->errno);
+        return RECV_FAILED;
+    }
+    frame_size = p_conn->p_read_request->IOSer.io_Actual;
+    LOG(DEBUG, "Dump of received SLIP frame (%ld bytes):", frame_size);
+    LOG_MEMORY(DEBUG, p_conn->p_read_buffer, frame_size);
+    // The read request terminates on the end-of-frame marker, but if that has been damaged, the frame simply ends
+    // when the buffer is full.
+    if ((frame_size > 0) && (p_conn->p_read_buffer[frame_size - 1] == SLIP_END))
+        --frame_size;
+    if ((pb_data->size = decode_slip_frame(p_conn->p_read_buffer, frame_size, pb_data->p_addr, pb_data->size)) == 0) {
+        LOG(WARN, "Could not decode SLIP frame of %ld bytes", frame_size);
+        return RECV_CORRUPTED;
+    }
+    return RECV_OK;
 }
 
 
@@ -202,24 +245,14 @@ int recv_slip_frame(SerialConnection *p_conn, Buffer *pb_frame)
 // local routines
 //
 
-//
-// calculate IP / ICMP checksum (taken from the code for in_cksum() floating on the net)
-//
-static uint16_t calc_checksum(const uint8_t * bytes, uint32_t len)
+static int wait_for_write(SerialConnection *p_conn, int idx)
 {
-    uint32_t sum, i;
-    uint16_t * p;
-
-    sum = 0;
-    p = (uint16_t *) bytes;
-
-    for (i = len; i > 1; i -= 2)                /* sum all 16-bit words */
-        sum += *p++;
-
-    if (i == 1)                                 /* add an odd byte if necessary */
-        sum += (uint16_t) *((uint8_t *) p);
-
-    sum = (sum >> 16) + (sum & 0x0000ffff);     /* fold in upper 16 bits */
-    sum += (sum >> 16);                         /* add carry bits */
-    return ~((uint16_t) sum);                     /* return 1-complement truncated to 16 bits */
+    if (p_conn->f_write_pending[idx]) {
+        p_conn->f_write_pending[idx] = FALSE;
+        if ((p_conn->errno = WaitIO((struct IORequest *) p_conn->p_write_requests[idx])) != 0) {
+            LOG(ERROR, "Sending SLIP frame failed: %ld", p_conn->errno);
+            return DOSFALSE;
+        }
+    }
+    return DOSTRUE;
 }
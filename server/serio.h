@@ -8,39 +8,41 @@
 
 
 #include "stdint.h"
+#include "transport.h"
 
 
 //
 // constants
 //
-#define MAX_MSG_DATA_LEN 255
-#define MAX_FRAME_SIZE 512      // should be large enough to hold a SLIP-encoded message + data
+#define NUM_WRITE_REQUESTS NUM_KEPT_FRAMES  // frames that can be in flight, they are kept for resending them
+#define FAST_BAUD_RATE     292000           // baud rate used in fast mode if none has been specified
 
 
 //
 // type declarations
 //
+// Reads and writes use their own IO requests, so the server can receive the next command while the last frames of a
+// reply are still being sent.
 typedef struct SerialConnection {
-    struct IOExtSer *p_io_request;
+    struct MsgPort  *p_port;
+    struct IOExtSer *p_read_request;
+    uint8_t         *p_read_buffer;                         // SLIP frame being received
+    struct IOExtSer *p_write_requests[NUM_WRITE_REQUESTS];
+    uint8_t         *p_write_buffers[NUM_WRITE_REQUESTS];   // SLIP frames being sent by the write requests
+    uint16_t        f_write_pending[NUM_WRITE_REQUESTS];
+    uint16_t        next_write;                             // index of the write request used for the next frame
     uint32_t        errno;
 } SerialConnection;
 
 
-
-typedef struct Buffer {
-    uint8_t  *p_addr;
-    uint32_t size;
-} Buffer;
-
-
 //
 // exported functions
 //
-SerialConnection *create_serial_conn();
+SerialConnection *create_serial_conn(uint32_t baud_rate, int f_fast_mode);
 void destroy_serial_conn(SerialConnection *p_conn);
-int put_data_into_slip_frame(SerialConnection *p_conn, const Buffer *pb_data, Buffer *pb_frame);
-int get_data_from_slip_frame(SerialConnection *p_conn, Buffer *pb_data, const Buffer *pb_frame);
-int send_slip_frame(SerialConnection *p_conn, const Buffer *pb_frame);
-int recv_slip_frame(SerialConnection *p_conn, Buffer *pb_frame);
+int send_slip_frame(SerialConnection *p_conn, const Buffer *pb_header, const Buffer *pb_data);
+int resend_slip_frames(SerialConnection *p_conn, uint16_t nframes);
+int flush_serial_writes(SerialConnection *p_conn);
+int recv_slip_frame(SerialConnection *p_conn, Buffer *pb_data);
 
 #endif  // CWDBG_SERIO_H
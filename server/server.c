@@ -11,10 +11,12 @@
 #include <string.h>
 
 #include "debugger.h"
-#include "serio.h"
 #include "server.h"
 #include "stdint.h"
+#include "systrace.h"
 #include "target.h"
+#include "timer.h"
+#include "transport.h"
 #include "util.h"
 
 
@@ -35,6 +37,24 @@
 #define MSG_CLEAR_BPOINT     0x0b
 #define MSG_TARGET_STOPPED   0x0c
 #define MSG_GET_BASE_ADDRESS 0x0d
+#define MSG_STEP_RANGE       0x0e
+#define MSG_BATCH            0x0f
+#define MSG_GET_CALL_STACK   0x10
+#define MSG_READ_TRACE       0x11
+#define MSG_PROFILE          0x12
+#define MSG_GET_PROFILE      0x13
+#define MSG_SET_SYSCALL_TRACE   0x14
+#define MSG_CLEAR_SYSCALL_TRACE 0x15
+#define MSG_READ_SYSCALL_TRACE  0x16
+#define MSG_GET_SYSCALL_STATS   0x17
+#define MSG_ACK_FRAMES          0x18
+#define MSG_RESEND_FRAMES       0x19
+#define MSG_GET_SEGMENTS        0x1a
+#define MSG_STEP_FLOW           0x1b
+#define MSG_GET_STATS           0x1c
+#define MSG_SET_WATCHPOINT      0x1d
+#define MSG_CLEAR_WATCHPOINT    0x1e
+#define MSG_SELECT_TARGET       0x1f
 
 //
 // connection states - for future use
@@ -42,42 +62,161 @@
 #define CONN_STATE_INITIAL   0
 #define CONN_STATE_CONNECTED 1
 
+//
+// protocol version and optional features, negotiated with MSG_INIT
+//
+#define PROTO_VERSION        5
+#define PROTO_FEATURE_FRAGMENTS   (1 << 0)      // messages can be split into several frames
+#define PROTO_FEATURE_COMPRESSION (1 << 1)      // frames sent by the server can carry compressed data
+#define PROTO_FEATURE_DELTA_INFO  (1 << 2)      // MSG_TARGET_STOPPED can carry only the changes to the last TargetInfo
+#define PROTO_FEATURE_WINDOW      (1 << 3)      // the host acknowledges the frames sent by the server
+#define PROTO_SUPPORTED_FEATURES  (PROTO_FEATURE_FRAGMENTS | PROTO_FEATURE_COMPRESSION | PROTO_FEATURE_DELTA_INFO | PROTO_FEATURE_WINDOW)
+
+// maximum number of frames that have been sent but not yet acknowledged by the host, limited by the number of frames
+// the transport keeps for resending them
+#define PROTO_WINDOW_SIZE NUM_KEPT_FRAMES
+
+//
+// message flags
+//
+#define MSG_FLAG_COMPRESSED (1 << 0)            // frame data has been compressed with compress_data()
+#define MSG_FLAG_DELTA      (1 << 1)            // message data has been encoded with encode_delta()
+
+// size of a TargetInfo encoded with encode_delta() if all dwords have changed
+#define MAX_TARGET_INFO_DELTA_SIZE ((sizeof(TargetInfo) / 4 + 7) / 8 + sizeof(TargetInfo))
+
+// Compressing very small frames is not worth the effort.
+#define MIN_COMPRESSED_FRAME_DATA_LEN 16
+
 #define MAX_LIB_NAME_LEN 64
 
+// maximum size of the reply data of the commands that can be executed with exec_*_cmd(), except for MSG_PEEK_MEM,
+// which returns a pointer to the memory block
+#define MAX_CMD_REPLY_LEN   16
+// maximum size of the combined reply to a MSG_BATCH message (keep in sync with server.py)
+#define MAX_BATCH_REPLY_LEN 8192
+
+// size of the offset / type and of the optional condition in a MSG_SET_BPOINT message (keep in sync with server.py)
+#define BPOINT_HEADER_SIZE 6
+#define BPOINT_COND_SIZE   16
+
+// sizes of the header and of a record without registers in the reply to a MSG_READ_TRACE message, and maximum size
+// of the reply (keep in sync with server.py)
+#define TRACE_REPLY_HEADER_SIZE 14
+#define TRACE_RECORD_SIZE       18
+#define MAX_TRACE_REPLY_LEN     4096
+
+// size of a record without registers in the reply to a MSG_READ_SYSCALL_TRACE message (which has the same header as
+// the reply to MSG_READ_TRACE), and sizes of the header and of an entry in the reply to a MSG_GET_SYSCALL_STATS
+// message (keep in sync with server.py)
+#define SYSCALL_RECORD_SIZE       24
+#define SYSCALL_STATS_HEADER_SIZE 6
+#define SYSCALL_STATS_ENTRY_SIZE  18
+
+// size of the reply to a MSG_GET_STATS message, the E clock frequency followed by the ServerStats (keep in sync with
+// server.py)
+#define SERVER_STATS_REPLY_SIZE 40
+
+// number of preallocated message buffers, send_message() needs one (the frames being sent and received are buffered
+// by the transport), the rest are spares (the pool falls back to AllocVec() anyway)
+#define NUM_MSG_BUFFERS 2
 
-struct HostConnection {
-    SerialConnection *p_serial_conn;
-    int              state;
-    uint16_t         next_seq_num;
-};
 
 // This is how a complete protocol message looks like:
-//  ----------------------------------------------------------------
-// | sequence number | checksum | message type | data length | data |
-//  ----------------------------------------------------------------
-// The checksum is calculated in the same way as with IP / UDP headers.
-// TODO: Make length field 16 bits wide to support bigger messages
+//  -----------------------------------------------------------------------------------------
+// | sequence number | checksum | message type | flags | data length | fragment offset | data |
+//  -----------------------------------------------------------------------------------------
+// The checksum is calculated with calc_checksum() over the header (with the checksum set to 0) and the data of the
+// frame as it is sent (i. e. the compressed data for compressed frames). A message carries at most MAX_MSG_DATA_LEN
+// bytes of data. If it carries more than MAX_FRAME_DATA_LEN bytes, it is split into several frames (fragments). Each
+// fragment has its own header with the same sequence number, type and data length (the length of the complete message
+// data), and the offset of its data within the message data. The data length of a fragment is therefore
+// min(MAX_FRAME_DATA_LEN, data length - fragment offset). This way, the host can read up to 64 KB in one round trip.
+// If compression has been negotiated, the server compresses the data of each frame separately. Such frames have the
+// flag MSG_FLAG_COMPRESSED set, the length and offset fields still refer to the uncompressed data.
+//
+// Frames that arrive corrupted (wrong checksum, invalid SLIP encoding or a line error) are dropped by the receiver.
+// The server answers a corrupted command with a MSG_NACK message with ERROR_BAD_CHECKSUM, and the host sends the
+// command again. If the feature PROTO_FEATURE_WINDOW has been negotiated, the host also acknowledges each frame it
+// receives from the server with a MSG_ACK_FRAMES message, and asks for a corrupted or missing frame (and all frames
+// after it) with a MSG_RESEND_FRAMES message. Both carry the sequence number of the message and the offset of the
+// first fragment the host hasn't received yet. The server sends up to PROTO_WINDOW_SIZE frames before it waits for
+// an acknowledgement, so the line is kept busy, and send_message() only returns when the host has acknowledged all
+// frames. These messages are outside of the sequence, so they don't change the sequence number of the connection.
 struct ProtoMessage {
     uint16_t seqnum;
     uint16_t checksum;
     uint8_t  type;
-    uint8_t  length;
-    uint8_t  data[MAX_MSG_DATA_LEN];
+    uint8_t  flags;
+    uint16_t length;
+    uint16_t offset;
+    uint8_t  data[MAX_FRAME_DATA_LEN];
 };
 
+#define MSG_HEADER_SIZE (sizeof(ProtoMessage) - MAX_FRAME_DATA_LEN)
 
-static int send_message(HostConnection *p_conn, ProtoMessage *p_msg);
+
+struct HostConnection {
+    Transport        *p_transport;
+    int              state;
+    uint16_t         next_seq_num;
+    uint16_t         features;                  // features negotiated with the host
+    BlockPool        *p_msg_buffer_pool;        // buffers for messages (MAX_FRAME_SIZE bytes each)
+    BlockPool        *p_batch_buffer_pool;      // buffer for the reply to a MSG_BATCH message
+    TargetInfo       last_target_info;          // TargetInfo sent with the last MSG_TARGET_STOPPED message...
+    int              f_last_target_info_valid;  // ... if this flag is set
+    uint16_t         window_seqnum;             // sequence number of the message whose frames are in the window...
+    uint16_t         nframes_sent;              // ... the number of its frames that have been sent...
+    uint16_t         nframes_acked;             // ... and how many of them the host has acknowledged
+    ProtoMessage     pending_msg;               // message received while waiting for acknowledgements...
+    int              f_msg_pending;             // ... if this flag is set
+};
+
+
+static int send_message(HostConnection *p_conn, uint8_t type, uint8_t flags, const uint8_t *p_data, uint16_t data_len);
+static int send_frame(HostConnection *p_conn, ProtoMessage *p_msg, const uint8_t *p_frame_data, uint32_t frame_data_len);
+static int wait_for_frame_acks(HostConnection *p_conn, uint16_t max_unacked);
+static int recv_frame(HostConnection *p_conn, ProtoMessage *p_msg);
 static int recv_message(HostConnection *p_conn, ProtoMessage *p_msg);
-static void send_ack_msg(HostConnection *p_conn, uint8_t *p_data, uint8_t data_len);
+static void send_ack_msg(HostConnection *p_conn, const uint8_t *p_data, uint16_t data_len);
 static void send_nack_msg(HostConnection *p_conn, uint8_t error_code);
 static void send_target_stopped_msg(HostConnection *p_conn, TargetInfo *p_target_info);
 
 static int is_correct_target_state_for_command(uint32_t state, uint8_t msg_type);
 
-static void handle_set_bpoint_msg(ProtoMessage *p_msg);
-static void handle_clear_bpoint_msg(ProtoMessage *p_msg);
-static void handle_get_base_address_msg(ProtoMessage *p_msg);
-static void handle_peek_mem_msg(ProtoMessage *p_msg);
+// Commands that don't resume the target are implemented by exec_*_cmd() routines, so they can be executed either
+// with their own message (by handle_cmd_msg()) or as part of a MSG_BATCH message (by handle_batch_msg()). They set
+// the buffer to the reply data, which can be stored in the buffer passed by the caller (MAX_CMD_REPLY_LEN bytes).
+// Executors with bigger replies point it to their own buffer instead, which is static to keep it off the stack (the
+// caller sends or copies the reply before it executes the next command).
+typedef DbgError (*CmdExecutor)(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+
+static void handle_init_msg(ProtoMessage *p_msg);
+static void handle_cmd_msg(ProtoMessage *p_msg, CmdExecutor p_exec_cmd);
+static void handle_batch_msg(ProtoMessage *p_msg);
+static int handle_profile_msg(ProtoMessage *p_msg);
+static int handle_step_range_msg(ProtoMessage *p_msg);
+static int handle_step_flow_msg(ProtoMessage *p_msg);
+static CmdExecutor get_cmd_executor(uint8_t msg_type);
+static DbgError exec_set_bpoint_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_clear_bpoint_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_get_base_address_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_peek_mem_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_get_call_stack_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_read_trace_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_get_profile_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_set_syscall_trace_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_clear_syscall_trace_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_read_syscall_trace_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_get_syscall_stats_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_get_segments_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_get_stats_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_set_watchpoint_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_clear_watchpoint_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static DbgError exec_select_target_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply);
+static void report_target_event(int f_wait);
+static void start_cmd_timing();
+static void stop_cmd_timing();
 
 
 // keep aligned with definitions above
@@ -95,37 +234,62 @@ static char *msg_type_names[] = {
     "MSG_SET_BPOINT",
     "MSG_CLEAR_BPOINT",
     "MSG_TARGET_STOPPED",
-    "MSG_GET_BASE_ADDRESS"
+    "MSG_GET_BASE_ADDRESS",
+    "MSG_STEP_RANGE",
+    "MSG_BATCH",
+    "MSG_GET_CALL_STACK",
+    "MSG_READ_TRACE",
+    "MSG_PROFILE",
+    "MSG_GET_PROFILE",
+    "MSG_SET_SYSCALL_TRACE",
+    "MSG_CLEAR_SYSCALL_TRACE",
+    "MSG_READ_SYSCALL_TRACE",
+    "MSG_GET_SYSCALL_STATS",
+    "MSG_ACK_FRAMES",
+    "MSG_RESEND_FRAMES",
+    "MSG_GET_SEGMENTS",
+    "MSG_STEP_FLOW",
+    "MSG_GET_STATS",
+    "MSG_SET_WATCHPOINT",
+    "MSG_CLEAR_WATCHPOINT",
+    "MSG_SELECT_TARGET"
 };
 
+// start of the command being processed by process_remote_commands(), if the flag is set
+static uint32_t g_cmd_start_ts_lo;
+static int      g_f_cmd_timing = FALSE;
+
 
 //
 // exported routines
 //
 
-// This routine is called nested, once by main() as the central message loop of the debugger (the outer call),
-// and by run_target() every time the target stops (the inner calls).
+// This routine is the central message loop of the debugger, called by main(). The resuming commands (MSG_RUN,
+// MSG_CONT, ...) resume the selected target and then wait until any of the targets has stopped or terminated and
+// select this target. The host is informed with a MSG_TARGET_STOPPED message, the TargetInfo contains the ID of the
+// target. Other targets that stop in the meantime are reported after the next resuming command.
 //
-// TODO: Update flow with messages between target and debugger process
 // Programm flow when target is started by host:
 // @startuml
 // User -> Host: command 'run'
 // Host -> Server: MSG_RUN
 // Server -> Host: MSG_ACK
-// Server -> Target: run_target()
+// Server -> Target: start_target()
+// Server -> Server: wait_for_target_event()
 // Target -> Target: target runs until a breakpoint / next instruction is hit
-// Target -> Server: handle_breakpoint() / handle_single_step()
-// Server -> Server: process_remote_commands()
+// Target -> Server: handle_stopped_target() signals debugger process
+// Server -> Server: handle_target_signals()
 // Server -> Host: MSG_TARGET_STOPPED
 // Host -> Server: MSG_ACK
 // Host -> User: display target infos and prompt
 // User -> Host: command 'continue' / 'step'
 // Host -> Server: MSG_CONT / MSG_STEP
 // Server -> Host: MSG_ACK
-// Server -> Target: returns to target
+// Server -> Target: resume_target()
+// Server -> Server: wait_for_target_event()
 // Target -> Target: target runs until completion
-// Target -> Server: returns to run_target()
-// Server -> Server: process_remote_commands()
+// Target -> Server: wrap_target() signals debugger process
+// Server -> Server: handle_target_signals()
 // Server -> Host: MSG_TARGET_STOPPED
 // Host -> Server: MSG_ACK
 // Host -> User: display target infos and prompt
@@ -135,23 +299,26 @@ void process_remote_commands()
 {
     ProtoMessage msg;
     TargetInfo   target_info;
+    int          rc;
 
-    // If we've been called by run_target() the target is still running. In this case the host is waiting for us and we
-    // send a MSG_TARGET_STOPPED message to indicate that the target has stopped and provide the target information to the host.
     LOG(DEBUG, "process_remote_commands() has been called");
-    get_target_info(gp_dbg->p_target, &target_info);
-    if (target_info.state & TS_RUNNING) {
-        send_target_stopped_msg(gp_dbg->p_host_conn, &target_info);
-    }
-
     // TODO: Catch Ctrl-C
     while(TRUE) {
         LOG(INFO, "Waiting for command from host...");
-        // TODO: add timeout
-        if (recv_message(gp_dbg->p_host_conn, &msg) == DOSFALSE) {
+        // The user can take as long as they like for the next command, so there is no timeout here. Lost frames are
+        // detected by the host, which sends its command again or asks us to resend our reply.
+        if ((rc = recv_message(gp_dbg->p_host_conn, &msg)) == RECV_FAILED) {
             LOG(ERROR, "Failed to receive message from host");
             quit_debugger(gp_dbg, RETURN_ERROR);
         }
+        if (rc == RECV_CORRUPTED) {
+            // We can't trust anything in the frame, so we just ask the host to send its command again.
+            LOG(WARN, "Received corrupted command from host, asking host to send it again");
+            send_nack_msg(gp_dbg->p_host_conn, ERROR_BAD_CHECKSUM);
+            continue;
+        }
+        ++g_stats.ncmds;
+        start_cmd_timing();
         LOG(
             DEBUG,
             "Message from host received: seqnum=%d, type=%s (%d), length=%d",
@@ -169,57 +336,87 @@ void process_remote_commands()
             );
             quit_debugger(gp_dbg, RETURN_FAIL);
         }
+        // The state of the selected target can change between the commands, e.g. if another target has stopped, so
+        // the host can send a command the target isn't ready for, which we simply reject.
+        get_target_info(gp_dbg->p_target, &target_info);
         if (!is_correct_target_state_for_command(target_info.state, msg.type)) {
-            LOG(CRIT, "Internal error: Target is in wrong state for command %d", msg.type);
-            quit_debugger(gp_dbg, RETURN_FAIL);
+            send_nack_msg(gp_dbg->p_host_conn, ERROR_BAD_DATA);
+            stop_cmd_timing();
+            continue;
         }
 
         switch (msg.type) {
             case MSG_INIT:
-                LOG(DEBUG, "Initializing connection");
-                gp_dbg->p_host_conn->state = CONN_STATE_CONNECTED;
-                gp_dbg->p_host_conn->next_seq_num = msg.seqnum;
-                send_ack_msg(gp_dbg->p_host_conn, NULL, 0);
+                handle_init_msg(&msg);
                 break;
 
             case MSG_SET_BPOINT:
-                handle_set_bpoint_msg(&msg);
+            case MSG_CLEAR_BPOINT:
+            case MSG_GET_BASE_ADDRESS:
+            case MSG_PEEK_MEM:
+            case MSG_GET_CALL_STACK:
+            case MSG_READ_TRACE:
+            case MSG_GET_PROFILE:
+            case MSG_SET_SYSCALL_TRACE:
+            case MSG_CLEAR_SYSCALL_TRACE:
+            case MSG_READ_SYSCALL_TRACE:
+            case MSG_GET_SYSCALL_STATS:
+            case MSG_GET_SEGMENTS:
+            case MSG_GET_STATS:
+            case MSG_SET_WATCHPOINT:
+            case MSG_CLEAR_WATCHPOINT:
+            case MSG_SELECT_TARGET:
+                handle_cmd_msg(&msg, get_cmd_executor(msg.type));
                 break;
 
-            case MSG_CLEAR_BPOINT:
-                handle_clear_bpoint_msg(&msg);
+            case MSG_BATCH:
+                handle_batch_msg(&msg);
                 break;
 
             case MSG_RUN:
                 send_ack_msg(gp_dbg->p_host_conn, NULL, 0);
-                run_target(gp_dbg->p_target);
-                get_target_info(gp_dbg->p_target, &target_info);
-                send_target_stopped_msg(gp_dbg->p_host_conn, &target_info);
+                // If the target could not be started, its state is TS_ERROR and there is nothing to wait for.
+                report_target_event(start_target(gp_dbg->p_target) == ERROR_OK);
+                break;
+
+            case MSG_PROFILE:
+                if (handle_profile_msg(&msg) == DOSTRUE)
+                    report_target_event(start_target(gp_dbg->p_target) == ERROR_OK);
                 break;
 
             case MSG_CONT:
                 send_ack_msg(gp_dbg->p_host_conn, NULL, 0);
                 set_continue_mode(gp_dbg->p_target);
-                return;
+                resume_target(gp_dbg->p_target);
+                report_target_event(TRUE);
+                break;
 
             case MSG_STEP:
                 send_ack_msg(gp_dbg->p_host_conn, NULL, 0);
                 set_single_step_mode(gp_dbg->p_target);
-                return;
+                resume_target(gp_dbg->p_target);
+                report_target_event(TRUE);
+                break;
 
-            case MSG_KILL:
-                send_ack_msg(gp_dbg->p_host_conn, NULL, 0);
-                kill_target(gp_dbg->p_target);
-                // Return to run_target() so it can exit and the outer invocation can take over again (which will also
-                // send the MSG_TARGET_STOPPED message)
-                return;
+            case MSG_STEP_RANGE:
+                if (handle_step_range_msg(&msg) == DOSTRUE) {
+                    resume_target(gp_dbg->p_target);
+                    report_target_event(TRUE);
+                }
+                break;
 
-            case MSG_GET_BASE_ADDRESS:
-                handle_get_base_address_msg(&msg);
+            case MSG_STEP_FLOW:
+                if (handle_step_flow_msg(&msg) == DOSTRUE) {
+                    resume_target(gp_dbg->p_target);
+                    report_target_event(TRUE);
+                }
                 break;
 
-            case MSG_PEEK_MEM:
-                handle_peek_mem_msg(&msg);
+            case MSG_KILL:
+                send_ack_msg(gp_dbg->p_host_conn, NULL, 0);
+                kill_target(gp_dbg->p_target);
+                // The killed target is reported right away, the other targets keep running (or stay stopped).
+                report_target_event(FALSE);
                 break;
 
             case MSG_QUIT:
@@ -230,11 +427,13 @@ void process_remote_commands()
                 LOG(CRIT, "Internal error: unknown command %d", msg.type);
                 quit_debugger(gp_dbg, RETURN_FAIL);
         }
+        stop_cmd_timing();
     }
 }
 
 
-HostConnection *create_host_conn()
+// This routine connects to the host via TCP if a port is given, and via serial.device otherwise.
+HostConnection *create_host_conn(uint32_t baud_rate, int f_fast_mode, uint16_t tcp_port)
 {
     HostConnection *p_conn;
 
@@ -242,8 +441,27 @@ HostConnection *create_host_conn()
         LOG(CRIT, "Failed to allocate memory for host connection object");
         return NULL;
     }
-    if ((p_conn->p_serial_conn = create_serial_conn()) == NULL) {
-        LOG(CRIT, "Failed to initialize serial connection");
+    if (tcp_port != 0)
+        p_conn->p_transport = create_tcp_transport(tcp_port);
+    else
+        p_conn->p_transport = create_serial_transport(baud_rate, f_fast_mode);
+    if (p_conn->p_transport == NULL) {
+        LOG(CRIT, "Failed to initialize connection to host");
+        FreeVec(p_conn);
+        return NULL;
+    }
+    // The message buffers are used all the time, so we preallocate them instead of allocating them for each message.
+    if ((p_conn->p_msg_buffer_pool = create_block_pool(MAX_FRAME_SIZE, NUM_MSG_BUFFERS)) == NULL) {
+        LOG(CRIT, "Failed to allocate memory for message buffers");
+        destroy_transport(p_conn->p_transport);
+        FreeVec(p_conn);
+        return NULL;
+    }
+    if ((p_conn->p_batch_buffer_pool = create_block_pool(MAX_BATCH_REPLY_LEN, 1)) == NULL) {
+        LOG(CRIT, "Failed to allocate memory for batch reply buffer");
+        destroy_block_pool(p_conn->p_msg_buffer_pool);
+        destroy_transport(p_conn->p_transport);
+        FreeVec(p_conn);
         return NULL;
     }
     p_conn->state = CONN_STATE_INITIAL;
@@ -253,7 +471,9 @@ HostConnection *create_host_conn()
 
 void destroy_host_conn(HostConnection *p_conn)
 {
-    destroy_serial_conn(p_conn->p_serial_conn);
+    destroy_block_pool(p_conn->p_batch_buffer_pool);
+    destroy_block_pool(p_conn->p_msg_buffer_pool);
+    destroy_transport(p_conn->p_transport);
     FreeVec(p_conn);
 }
 
@@ -262,63 +482,198 @@ void destroy_host_conn(HostConnection *p_conn)
 // local routines
 //
 
-static int send_message(HostConnection *p_conn, ProtoMessage *p_msg)
+// This routine sends a message with the sequence number of the connection, split into as many frames as necessary.
+// The flags are set in every frame. If the host acknowledges the frames, the routine sends at most PROTO_WINDOW_SIZE
+// frames ahead and returns only after all of them have been acknowledged.
+static int send_message(HostConnection *p_conn, uint8_t type, uint8_t flags, const uint8_t *p_data, uint16_t data_len)
 {
-    uint8_t frame[MAX_FRAME_SIZE];
-    Buffer b_msg, b_frame;
+    ProtoMessage *p_msg;
+    uint32_t     offset = 0, frame_data_len, compressed_len;
+    int          rc = DOSTRUE;
 
-    // TODO: set checksum
-    b_msg.p_addr = (uint8_t *) p_msg;
-    b_msg.size   = sizeof(ProtoMessage);
-    b_frame.p_addr = frame;
-    b_frame.size   = MAX_FRAME_SIZE;
-    if (put_data_into_slip_frame(p_conn->p_serial_conn, &b_msg, &b_frame) == DOSFALSE) {
-        LOG(ERROR, "Could not put data into SLIP frame: %ld", p_conn->p_serial_conn->errno);
+    if ((p_msg = alloc_block(p_conn->p_msg_buffer_pool)) == NULL) {
+        LOG(ERROR, "Could not allocate message buffer");
         return DOSFALSE;
     }
-    if (send_slip_frame(p_conn->p_serial_conn, &b_frame) == DOSFALSE) {
-        LOG(ERROR, "Failed to send SLIP frame: %ld", p_conn->p_serial_conn->errno);
+    p_msg->seqnum = p_conn->next_seq_num;
+    p_msg->type   = type;
+    p_msg->length = data_len;
+    p_conn->window_seqnum = p_msg->seqnum;
+    p_conn->nframes_sent  = 0;
+    p_conn->nframes_acked = 0;
+    do {
+        if ((p_conn->features & PROTO_FEATURE_WINDOW)
+            && (wait_for_frame_acks(p_conn, PROTO_WINDOW_SIZE - 1) == DOSFALSE)) {
+            rc = DOSFALSE;
+            break;
+        }
+        frame_data_len = data_len - offset;
+        if (frame_data_len > MAX_FRAME_DATA_LEN)
+            frame_data_len = MAX_FRAME_DATA_LEN;
+        p_msg->offset = offset;
+        // We only send the compressed data if it is actually smaller than the original data.
+        if ((p_conn->features & PROTO_FEATURE_COMPRESSION)
+            && (frame_data_len >= MIN_COMPRESSED_FRAME_DATA_LEN)
+            && ((compressed_len = compress_data(p_data + offset, frame_data_len, p_msg->data, frame_data_len - 1)) > 0)) {
+            p_msg->flags = flags | MSG_FLAG_COMPRESSED;
+            rc = send_frame(p_conn, p_msg, p_msg->data, compressed_len);
+        }
+        else {
+            // The data is encoded directly from the caller's buffer (for MSG_PEEK_MEM the target's memory), so only
+            // the header is built in the message buffer.
+            p_msg->flags = flags;
+            rc = send_frame(p_conn, p_msg, p_data + offset, frame_data_len);
+        }
+        offset += frame_data_len;
+        ++p_conn->nframes_sent;
+    } while ((rc == DOSTRUE) && (offset < data_len));
+    if ((rc == DOSTRUE) && (p_conn->features & PROTO_FEATURE_WINDOW))
+        rc = wait_for_frame_acks(p_conn, 0);
+    free_block(p_conn->p_msg_buffer_pool, p_msg);
+    return rc;
+}
+
+
+// The header in the message buffer and the frame data are encoded by the transport into its own buffer (and sent
+// asynchronously by the serial transport), so the caller can reuse both buffers for the next frame right away.
+static int send_frame(HostConnection *p_conn, ProtoMessage *p_msg, const uint8_t *p_frame_data, uint32_t frame_data_len)
+{
+    Buffer b_header, b_data;
+
+    p_msg->checksum = 0;
+    p_msg->checksum = calc_checksum((uint8_t *) p_msg, MSG_HEADER_SIZE, p_frame_data, frame_data_len);
+    b_header.p_addr = (uint8_t *) p_msg;
+    b_header.size   = MSG_HEADER_SIZE;
+    b_data.p_addr   = (uint8_t *) p_frame_data;
+    b_data.size     = frame_data_len;
+    if (p_conn->p_transport->p_send_frame_func(p_conn->p_transport->p_conn, &b_header, &b_data) == DOSFALSE) {
+        LOG(ERROR, "Failed to send frame: %ld", p_conn->p_transport->p_get_errno_func(p_conn->p_transport->p_conn));
         return DOSFALSE;
     }
+    ++g_stats.nframes_sent;
     return DOSTRUE;
 }
 
 
-static int recv_message(HostConnection *p_conn, ProtoMessage *p_msg)
+// This routine reads the acknowledgements from the host until at most max_unacked frames of the current message are
+// unacknowledged, and resends the frames the host asks for.
+static int wait_for_frame_acks(HostConnection *p_conn, uint16_t max_unacked)
 {
-    uint8_t frame[MAX_FRAME_SIZE];
-    Buffer b_msg, b_frame;
+    ProtoMessage msg;
+    uint16_t     seqnum, offset, nframes;
+    int          rc;
+
+    while (p_conn->nframes_sent - p_conn->nframes_acked > max_unacked) {
+        if ((rc = recv_frame(p_conn, &msg)) == RECV_FAILED) {
+            LOG(ERROR, "Failed to receive acknowledgement from host");
+            return DOSFALSE;
+        }
+        if (rc == RECV_OK) {
+            if ((msg.type != MSG_ACK_FRAMES) && (msg.type != MSG_RESEND_FRAMES)) {
+                // The host has received the complete message and has already sent its next command (its last
+                // acknowledgement has been lost), so we keep the command for recv_message().
+                LOG(DEBUG, "Received message of type %d while waiting for acknowledgement, keeping it", msg.type);
+                memcpy(&p_conn->pending_msg, &msg, sizeof(ProtoMessage));
+                p_conn->f_msg_pending = TRUE;
+                p_conn->nframes_acked = p_conn->nframes_sent;
+                break;
+            }
+            if ((unpack_data(msg.data, msg.length, "!H!H", &seqnum, &offset) == DOSFALSE)
+                || (seqnum != p_conn->window_seqnum)) {
+                LOG(DEBUG, "Ignoring %s message for another message", msg_type_names[msg.type]);
+                continue;
+            }
+            // The host has received all fragments before the offset.
+            nframes = (offset + MAX_FRAME_DATA_LEN - 1) / MAX_FRAME_DATA_LEN;
+            if (nframes > p_conn->nframes_sent)
+                nframes = p_conn->nframes_sent;
+            if (nframes > p_conn->nframes_acked)
+                p_conn->nframes_acked = nframes;
+            if (msg.type == MSG_ACK_FRAMES)
+                continue;
+        }
+        else
+            // The host only sends acknowledgements at this point, so one of them has been lost. We don't know which
+            // one and therefore resend all unacknowledged frames, the host ignores the ones it has already received.
+            LOG(WARN, "Received corrupted acknowledgement from host");
+
+        nframes = p_conn->nframes_sent - p_conn->nframes_acked;
+        LOG(INFO, "Resending the last %d frame(s) of message #%d", nframes, p_conn->window_seqnum);
+        if (p_conn->p_transport->p_resend_frames_func(p_conn->p_transport->p_conn, nframes) == DOSFALSE) {
+            LOG(ERROR, "Failed to resend frames: %ld", p_conn->p_transport->p_get_errno_func(p_conn->p_transport->p_conn));
+            return DOSFALSE;
+        }
+        g_stats.nframes_sent += nframes;
+    }
+    return DOSTRUE;
+}
+
+
+// This routine returns RECV_CORRUPTED if the frame has been damaged on the way, the message is undefined then.
+static int recv_frame(HostConnection *p_conn, ProtoMessage *p_msg)
+{
+    Buffer   b_msg;
+    uint16_t checksum;
+    int      rc;
 
     b_msg.p_addr = (uint8_t *) p_msg;
     b_msg.size   = sizeof(ProtoMessage);
-    b_frame.p_addr = frame;
-    b_frame.size   = MAX_FRAME_SIZE;
-    if (recv_slip_frame(p_conn->p_serial_conn, &b_frame) == DOSFALSE) {
-        LOG(ERROR, "Failed to receive SLIP frame: %ld", p_conn->p_serial_conn->errno);
-        return DOSFALSE;
+    if ((rc = p_conn->p_transport->p_recv_frame_func(p_conn->p_transport->p_conn, &b_msg)) != RECV_OK) {
+        if (rc == RECV_CORRUPTED)
+            ++g_stats.nframes_corrupted;
+        return rc;
     }
-    if (get_data_from_slip_frame(p_conn->p_serial_conn, &b_msg, &b_frame) == DOSFALSE) {
-        LOG(ERROR, "Could not get data from SLIP frame: %ld", p_conn->p_serial_conn->errno);
-        return DOSFALSE;
+    // The host only sends messages that fit into one frame.
+    if ((b_msg.size < MSG_HEADER_SIZE) || (p_msg->offset != 0) || (b_msg.size - MSG_HEADER_SIZE != p_msg->length)) {
+        LOG(WARN, "Received frame with invalid size %ld or fragment offset %d", b_msg.size, p_msg->offset);
+        ++g_stats.nframes_corrupted;
+        return RECV_CORRUPTED;
     }
-    // TODO: check checksum
-    return DOSTRUE;
+    checksum = p_msg->checksum;
+    p_msg->checksum = 0;
+    if ((p_msg->checksum = calc_checksum((uint8_t *) p_msg, MSG_HEADER_SIZE, p_msg->data, p_msg->length)) != checksum) {
+        LOG(WARN, "Received frame with wrong checksum 0x%04x, expected 0x%04x", checksum, p_msg->checksum);
+        ++g_stats.nframes_corrupted;
+        return RECV_CORRUPTED;
+    }
+    ++g_stats.nframes_received;
+    return RECV_OK;
 }
 
 
-static void send_ack_msg(HostConnection *p_conn, uint8_t *p_data, uint8_t data_len)
+// This routine receives the next message from the host (or returns the one kept by wait_for_frame_acks()).
+// Acknowledgements arriving here are late duplicates for a message that has already been acknowledged completely, so
+// they are ignored. But if the host asks for the reply to a message we haven't seen yet, its command has been lost
+// and we report it as corrupted.
+static int recv_message(HostConnection *p_conn, ProtoMessage *p_msg)
 {
-    ProtoMessage msg;
+    uint16_t seqnum, offset;
+    int      rc;
 
-    if (data_len > MAX_MSG_DATA_LEN) {
-        LOG(CRIT, "Internal error: send_ack_msg() has been called with more than MAX_MSG_DATA_LEN data");
-        quit_debugger(gp_dbg, RETURN_FAIL);
+    if (p_conn->f_msg_pending) {
+        memcpy(p_msg, &p_conn->pending_msg, sizeof(ProtoMessage));
+        p_conn->f_msg_pending = FALSE;
+        return RECV_OK;
+    }
+    while ((rc = recv_frame(p_conn, p_msg)) == RECV_OK) {
+        if ((p_msg->type != MSG_ACK_FRAMES) && (p_msg->type != MSG_RESEND_FRAMES))
+            break;
+        if ((p_msg->type == MSG_RESEND_FRAMES)
+            && (unpack_data(p_msg->data, p_msg->length, "!H!H", &seqnum, &offset) == DOSTRUE)
+            && (seqnum == p_conn->next_seq_num)) {
+            LOG(WARN, "Host is waiting for the reply to message #%d, which we haven't received", seqnum);
+            rc = RECV_CORRUPTED;
+            break;
+        }
+        LOG(DEBUG, "Ignoring %s message for a message that has already been acknowledged", msg_type_names[p_msg->type]);
     }
-    msg.seqnum = p_conn->next_seq_num;
-    msg.type   = MSG_ACK;
-    msg.length = data_len;
-    memcpy(&msg.data, p_data, data_len);
-    if (send_message(p_conn, &msg) == DOSFALSE) {
+    return rc;
+}
+
+
+static void send_ack_msg(HostConnection *p_conn, const uint8_t *p_data, uint16_t data_len)
+{
+    if (send_message(p_conn, MSG_ACK, 0, p_data, data_len) == DOSFALSE) {
         LOG(ERROR, "Failed to send message to host");
         quit_debugger(gp_dbg, RETURN_ERROR);
     }
@@ -328,12 +683,7 @@ static void send_ack_msg(HostConnection *p_conn, uint8_t *p_data, uint8_t data_l
 
 static void send_nack_msg(HostConnection *p_conn, uint8_t error_code)
 {
-    ProtoMessage msg;
-    msg.seqnum  = p_conn->next_seq_num;
-    msg.type    = MSG_NACK;
-    msg.length  = 1;
-    msg.data[0] = error_code;
-    if (send_message(p_conn, &msg) == DOSFALSE) {
+    if (send_message(p_conn, MSG_NACK, 0, &error_code, 1) == DOSFALSE) {
         LOG(ERROR, "Failed to send message to host");
         quit_debugger(gp_dbg, RETURN_ERROR);
     }
@@ -344,27 +694,44 @@ static void send_nack_msg(HostConnection *p_conn, uint8_t error_code)
 static void send_target_stopped_msg(HostConnection *p_conn, TargetInfo *p_target_info)
 {
     ProtoMessage msg;
-
-    if (sizeof(TargetInfo) > MAX_MSG_DATA_LEN) {
-        LOG(CRIT, "Internal error: send_target_stopped_msg() has been called with TargetInfo larger than MAX_MSG_DATA_LEN");
-        quit_debugger(gp_dbg, RETURN_FAIL);
+    uint8_t      delta[MAX_TARGET_INFO_DELTA_SIZE];
+    size_t       delta_size;
+    int          rc;
+
+    // If the host supports it, we only send what has changed since the last MSG_TARGET_STOPPED message. When
+    // single-stepping, this is usually just the PC and a few registers.
+    if ((p_conn->features & PROTO_FEATURE_DELTA_INFO) && p_conn->f_last_target_info_valid) {
+        delta_size = encode_delta(
+            (uint8_t *) &p_conn->last_target_info,
+            (uint8_t *) p_target_info,
+            sizeof(TargetInfo),
+            delta
+        );
+        LOG(DEBUG, "Sending MSG_TARGET_STOPPED message with delta of %ld bytes to host", delta_size);
+        rc = send_message(p_conn, MSG_TARGET_STOPPED, MSG_FLAG_DELTA, delta, delta_size);
+    }
+    else {
+        LOG(DEBUG, "Sending MSG_TARGET_STOPPED message to host");
+        rc = send_message(p_conn, MSG_TARGET_STOPPED, 0, (uint8_t *) p_target_info, sizeof(TargetInfo));
     }
-    LOG(DEBUG, "Sending MSG_TARGET_STOPPED message to host");
-    msg.seqnum = p_conn->next_seq_num;
-    msg.type   = MSG_TARGET_STOPPED;
-    msg.length = sizeof(TargetInfo);
-    memcpy(&msg.data, p_target_info, sizeof(TargetInfo));
-    if (send_message(p_conn, &msg) == DOSFALSE) {
+    if (rc == DOSFALSE) {
         LOG(ERROR, "Failed to send message to host");
         quit_debugger(gp_dbg, RETURN_ERROR);
     }
+    memcpy(&p_conn->last_target_info, p_target_info, sizeof(TargetInfo));
+    p_conn->f_last_target_info_valid = TRUE;
 
     // TODO: add timeout
-    if (recv_message(p_conn, &msg) == DOSFALSE) {
+    if ((rc = recv_message(p_conn, &msg)) == RECV_FAILED) {
         LOG(ERROR, "Failed to receive message from host");
         quit_debugger(gp_dbg, RETURN_ERROR);
     }
-    if (msg.type == MSG_ACK) {
+    if (rc == RECV_CORRUPTED) {
+        // The host doesn't send anything else before the ACK (and carries on after it), so this must have been the ACK.
+        LOG(WARN, "Received corrupted frame instead of ACK for MSG_TARGET_STOPPED message, assuming it was the ACK");
+        p_conn->next_seq_num++;
+    }
+    else if (msg.type == MSG_ACK) {
         if (msg.seqnum == p_conn->next_seq_num) {
             LOG(DEBUG, "Received ACK for MSG_TARGET_STOPPED message");
             p_conn->next_seq_num++;
@@ -388,9 +755,26 @@ static void send_target_stopped_msg(HostConnection *p_conn, TargetInfo *p_target
 
 static int is_correct_target_state_for_command(uint32_t state, uint8_t msg_type)
 {
+    // A running target that has not stopped can only be killed, the other targets might have stopped in the meantime.
+    // The trace buffers can't be read either because the target adds records to them while it is running.
+    if ((state & TS_RUNNING) && !(state & TS_STOPPED) && (
+        (msg_type == MSG_CONT) ||
+        (msg_type == MSG_STEP) ||
+        (msg_type == MSG_STEP_RANGE) ||
+        (msg_type == MSG_STEP_FLOW) ||
+        (msg_type == MSG_GET_CALL_STACK) ||
+        (msg_type == MSG_READ_TRACE) ||
+        (msg_type == MSG_READ_SYSCALL_TRACE)
+    )) {
+        LOG(ERROR, "Incorrect state for command %d: target has not stopped", msg_type);
+        return 0;
+    }
     if (!(state & TS_RUNNING) && (
         (msg_type == MSG_CONT) ||
         (msg_type == MSG_STEP) ||
+        (msg_type == MSG_STEP_RANGE) ||
+        (msg_type == MSG_STEP_FLOW) ||
+        (msg_type == MSG_GET_CALL_STACK) ||
         (msg_type == MSG_KILL)
     )) {
         LOG(ERROR, "Incorrect state for command %d: target is not yet running", msg_type);
@@ -399,6 +783,8 @@ static int is_correct_target_state_for_command(uint32_t state, uint8_t msg_type)
     if ((state & TS_RUNNING) && (
         (msg_type == MSG_INIT) ||
         (msg_type == MSG_RUN) ||
+        (msg_type == MSG_PROFILE) ||
+        (msg_type == MSG_CLEAR_SYSCALL_TRACE) ||
         (msg_type == MSG_QUIT)
     )) {
         LOG(ERROR, "Incorrect state for command %d: target is already / still running", msg_type);
@@ -408,106 +794,796 @@ static int is_correct_target_state_for_command(uint32_t state, uint8_t msg_type)
 }
 
 
-static void handle_set_bpoint_msg(ProtoMessage *p_msg)
+static void handle_init_msg(ProtoMessage *p_msg)
+{
+    uint16_t version, features;
+    uint8_t  msg_data[4];
+
+    LOG(DEBUG, "Initializing connection");
+    // The reply (even a NACK) has the sequence number of the MSG_INIT message. Until the host has been accepted, it
+    // is sent without the features of an earlier session.
+    gp_dbg->p_host_conn->state = CONN_STATE_INITIAL;
+    gp_dbg->p_host_conn->features = 0;
+    gp_dbg->p_host_conn->next_seq_num = p_msg->seqnum;
+    gp_dbg->p_host_conn->f_last_target_info_valid = FALSE;
+    // Hosts with older protocol versions send a shorter MSG_INIT message (or one without any data at all).
+    if (p_msg->length < 4) {
+        LOG(ERROR, "MSG_INIT message is too short, host uses an older protocol version");
+        send_nack_msg(gp_dbg->p_host_conn, ERROR_PROTO_VERSION_MISMATCH);
+        return;
+    }
+    if (unpack_data(p_msg->data, p_msg->length, "!H!H", &version, &features) == DOSTRUE) {
+        if (version == PROTO_VERSION) {
+            // We use only the features that both sides support and tell the host which ones these are. The host
+            // knows them only after it has received the reply, so we don't use them for the reply itself.
+            features &= PROTO_SUPPORTED_FEATURES;
+            LOG(DEBUG, "Using protocol version %d with features 0x%04x", version, features);
+            pack_data(msg_data, 4, "!H!H", PROTO_VERSION, features);
+            send_ack_msg(gp_dbg->p_host_conn, msg_data, 4);
+            gp_dbg->p_host_conn->state    = CONN_STATE_CONNECTED;
+            gp_dbg->p_host_conn->features = features;
+        }
+        else {
+            LOG(ERROR, "Host uses protocol version %d but we only support version %d", version, PROTO_VERSION);
+            send_nack_msg(gp_dbg->p_host_conn, ERROR_PROTO_VERSION_MISMATCH);
+        }
+    }
+    else {
+        LOG(ERROR, "Failed to unpack data of MSG_INIT message");
+        send_nack_msg(gp_dbg->p_host_conn, ERROR_BAD_DATA);
+    }
+}
+
+
+// This routine returns DOSTRUE if the target should be resumed, which is only possible if the CPU can trace on change
+// of flow.
+static int handle_step_flow_msg(ProtoMessage *p_msg)
+{
+    uint8_t dbg_errno;
+
+    if ((dbg_errno = set_flow_step_mode(gp_dbg->p_target)) == ERROR_OK) {
+        send_ack_msg(gp_dbg->p_host_conn, NULL, 0);
+        return DOSTRUE;
+    }
+    else {
+        LOG(ERROR, "Failed to set flow step mode");
+        send_nack_msg(gp_dbg->p_host_conn, dbg_errno);
+        return DOSFALSE;
+    }
+}
+
+
+// This routine returns DOSTRUE if the target should be run in profile mode.
+static int handle_profile_msg(ProtoMessage *p_msg)
 {
-    uint32_t bpoint_offset;
-    uint16_t bpoint_type;
+    uint32_t interval_us;
+    uint16_t bin_shift;
     uint8_t  dbg_errno;
 
-    if (unpack_data(p_msg->data, p_msg->length, "!I!H", &bpoint_offset, &bpoint_type) == DOSTRUE) {
-        if ((dbg_errno = set_breakpoint(gp_dbg->p_target, bpoint_offset, bpoint_type)) == NULL) {
-            // TODO: Return breakpoint number
+    if (unpack_data(p_msg->data, p_msg->length, "!I!H", &interval_us, &bin_shift) == DOSTRUE) {
+        if ((dbg_errno = set_profile_mode(gp_dbg->p_target, interval_us, bin_shift)) == ERROR_OK) {
             send_ack_msg(gp_dbg->p_host_conn, NULL, 0);
+            return DOSTRUE;
         }
         else {
-            LOG(ERROR, "Failed to set breakpoint");
+            LOG(ERROR, "Failed to set profile mode");
             send_nack_msg(gp_dbg->p_host_conn, dbg_errno);
+            return DOSFALSE;
         }
     }
     else {
-        LOG(ERROR, "Failed to unpack data of MSG_SET_BPOINT message");
+        LOG(ERROR, "Failed to unpack data of MSG_PROFILE message");
         send_nack_msg(gp_dbg->p_host_conn, ERROR_BAD_DATA);
+        return DOSFALSE;
+    }
+}
+
+
+static void handle_cmd_msg(ProtoMessage *p_msg, CmdExecutor p_exec_cmd)
+{
+    uint8_t  reply_data[MAX_CMD_REPLY_LEN];
+    Buffer   b_reply = {reply_data, MAX_CMD_REPLY_LEN};
+    DbgError dbg_errno;
+
+    if ((dbg_errno = p_exec_cmd(p_msg->data, p_msg->length, &b_reply)) == ERROR_OK)
+        send_ack_msg(gp_dbg->p_host_conn, b_reply.p_addr, b_reply.size);
+    else
+        send_nack_msg(gp_dbg->p_host_conn, dbg_errno);
+}
+
+
+// This routine executes all commands contained in a MSG_BATCH message back to back and sends the combined reply
+// in one ACK, so the host has to wait only once for the server. Each command in the message looks like this:
+//  -------------------------------------
+// | message type | data length | data |
+//  -------------------------------------
+// with 8-bit type and length fields. The reply contains for each command its status (the error code) as 8-bit field,
+// the length of the reply data as 16-bit field and the reply data (none if the command failed). A failed command does
+// not stop the execution of the following commands. A truncated command or one without data (the host only batches
+// commands with data) makes the whole message malformed.
+static void handle_batch_msg(ProtoMessage *p_msg)
+{
+    const uint8_t *p_cmd = p_msg->data, *p_end = p_msg->data + p_msg->length;
+    uint8_t       *p_reply, *p_reply_pos, reply_data[MAX_CMD_REPLY_LEN];
+    uint8_t       cmd_type, cmd_len;
+    Buffer        b_reply;
+    DbgError      dbg_errno;
+    CmdExecutor   p_exec_cmd;
+    TargetInfo    target_info;
+
+    if ((p_reply = alloc_block(gp_dbg->p_host_conn->p_batch_buffer_pool)) == NULL) {
+        LOG(ERROR, "Could not allocate memory for reply to MSG_BATCH message");
+        send_nack_msg(gp_dbg->p_host_conn, ERROR_NOT_ENOUGH_MEMORY);
+        return;
+    }
+    p_reply_pos = p_reply;
+    while (p_cmd < p_end) {
+        // The executors rely on unpack_data(), which must not be called without data.
+        if ((p_end - p_cmd < 2) || (p_cmd[1] == 0) || (p_end - p_cmd - 2 < p_cmd[1])) {
+            LOG(ERROR, "Command in MSG_BATCH message is truncated or has no data");
+            send_nack_msg(gp_dbg->p_host_conn, ERROR_BAD_DATA);
+            goto exit;
+        }
+        cmd_type = p_cmd[0];
+        cmd_len  = p_cmd[1];
+        b_reply.p_addr = reply_data;
+        b_reply.size   = MAX_CMD_REPLY_LEN;
+        // A command in the batch might have selected another target.
+        get_target_info(gp_dbg->p_target, &target_info);
+        // The profile can be much bigger than the reply to a batch (up to MAX_PROFILE_BINS bins), so it can only be
+        // read with its own message.
+        if ((cmd_type == MSG_GET_PROFILE) || ((p_exec_cmd = get_cmd_executor(cmd_type)) == NULL)) {
+            LOG(ERROR, "Command %d can't be used in MSG_BATCH message", cmd_type);
+            dbg_errno = ERROR_BAD_DATA;
+        }
+        else if (!is_correct_target_state_for_command(target_info.state, cmd_type))
+            dbg_errno = ERROR_BAD_DATA;
+        else
+            dbg_errno = p_exec_cmd(p_cmd + 2, cmd_len, &b_reply);
+        if (dbg_errno != ERROR_OK)
+            b_reply.size = 0;
+        if (p_reply_pos + 3 + b_reply.size > p_reply + MAX_BATCH_REPLY_LEN) {
+            LOG(ERROR, "Reply to MSG_BATCH message exceeds %d bytes", MAX_BATCH_REPLY_LEN);
+            send_nack_msg(gp_dbg->p_host_conn, ERROR_BAD_DATA);
+            goto exit;
+        }
+        pack_data(p_reply_pos, 3, "!B!H", dbg_errno, b_reply.size);
+        memcpy(p_reply_pos + 3, b_reply.p_addr, b_reply.size);
+        p_reply_pos += 3 + b_reply.size;
+        p_cmd += 2 + cmd_len;
+    }
+    send_ack_msg(gp_dbg->p_host_conn, p_reply, p_reply_pos - p_reply);
+
+    exit:
+        free_block(gp_dbg->p_host_conn->p_batch_buffer_pool, p_reply);
+}
+
+
+static CmdExecutor get_cmd_executor(uint8_t msg_type)
+{
+    switch (msg_type) {
+        case MSG_SET_BPOINT:
+            return exec_set_bpoint_cmd;
+        case MSG_CLEAR_BPOINT:
+            return exec_clear_bpoint_cmd;
+        case MSG_GET_BASE_ADDRESS:
+            return exec_get_base_address_cmd;
+        case MSG_PEEK_MEM:
+            return exec_peek_mem_cmd;
+        case MSG_GET_CALL_STACK:
+            return exec_get_call_stack_cmd;
+        case MSG_READ_TRACE:
+            return exec_read_trace_cmd;
+        case MSG_GET_PROFILE:
+            return exec_get_profile_cmd;
+        case MSG_SET_SYSCALL_TRACE:
+            return exec_set_syscall_trace_cmd;
+        case MSG_CLEAR_SYSCALL_TRACE:
+            return exec_clear_syscall_trace_cmd;
+        case MSG_READ_SYSCALL_TRACE:
+            return exec_read_syscall_trace_cmd;
+        case MSG_GET_SYSCALL_STATS:
+            return exec_get_syscall_stats_cmd;
+        case MSG_GET_SEGMENTS:
+            return exec_get_segments_cmd;
+        case MSG_GET_STATS:
+            return exec_get_stats_cmd;
+        case MSG_SET_WATCHPOINT:
+            return exec_set_watchpoint_cmd;
+        case MSG_CLEAR_WATCHPOINT:
+            return exec_clear_watchpoint_cmd;
+        case MSG_SELECT_TARGET:
+            return exec_select_target_cmd;
+        default:
+            return NULL;
     }
 }
 
 
-static void handle_clear_bpoint_msg(ProtoMessage *p_msg)
+// The data of a MSG_SET_BPOINT message consists of the offset and the type of the breakpoint, optionally followed by
+// its condition (BPOINT_COND_SIZE bytes) and, for tracepoints, the mask of the registers to record.
+static DbgError exec_set_bpoint_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
+{
+    uint32_t            bpoint_offset;
+    uint16_t            bpoint_type, trace_reg_mask = 0;
+    BreakpointCondition cond;
+    DbgError            dbg_errno;
+
+    pb_reply->size = 0;
+    if (unpack_data(p_data, data_len, "!I!H", &bpoint_offset, &bpoint_type) == DOSTRUE) {
+        if (data_len >= BPOINT_HEADER_SIZE + BPOINT_COND_SIZE) {
+            if (unpack_data(
+                p_data + BPOINT_HEADER_SIZE,
+                data_len - BPOINT_HEADER_SIZE,
+                "!B!B!B!B!I!I!I",
+                &cond.type,
+                &cond.op,
+                &cond.reg_num,
+                &cond.size,
+                &cond.p_address,
+                &cond.value,
+                &cond.ignore_count
+            ) == DOSFALSE) {
+                LOG(ERROR, "Failed to unpack breakpoint condition of MSG_SET_BPOINT message");
+                return ERROR_BAD_DATA;
+            }
+        }
+        if (bpoint_type == BPOINT_TYPE_TRACE) {
+            // The register mask follows the condition, which is therefore mandatory for tracepoints.
+            if (data_len < BPOINT_HEADER_SIZE + BPOINT_COND_SIZE + 2) {
+                LOG(ERROR, "MSG_SET_BPOINT message for tracepoint is too short");
+                return ERROR_BAD_DATA;
+            }
+            if (unpack_data(
+                p_data + BPOINT_HEADER_SIZE + BPOINT_COND_SIZE,
+                data_len - BPOINT_HEADER_SIZE - BPOINT_COND_SIZE,
+                "!H",
+                &trace_reg_mask
+            ) == DOSFALSE) {
+                LOG(ERROR, "Failed to unpack register mask of tracepoint in MSG_SET_BPOINT message");
+                return ERROR_BAD_DATA;
+            }
+        }
+        // TODO: Return breakpoint number
+        if ((dbg_errno = set_breakpoint(
+            gp_dbg->p_target,
+            bpoint_offset,
+            bpoint_type,
+            (data_len >= BPOINT_HEADER_SIZE + BPOINT_COND_SIZE) ? &cond : NULL,
+            trace_reg_mask
+        )) != ERROR_OK)
+            LOG(ERROR, "Failed to set breakpoint");
+        return dbg_errno;
+    }
+    else {
+        LOG(ERROR, "Failed to unpack data of MSG_SET_BPOINT message");
+        return ERROR_BAD_DATA;
+    }
+}
+
+
+static DbgError exec_clear_bpoint_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
 {
     uint32_t   bpoint_num;
     Breakpoint *p_bpoint;
 
-    if (unpack_data(p_msg->data, p_msg->length, "!I", &bpoint_num) == DOSTRUE) {
+    pb_reply->size = 0;
+    if (unpack_data(p_data, data_len, "!I", &bpoint_num) == DOSTRUE) {
         if ((p_bpoint = find_bpoint_by_num(gp_dbg->p_target, bpoint_num)) != NULL) {
             clear_breakpoint(gp_dbg->p_target, p_bpoint);
-            send_ack_msg(gp_dbg->p_host_conn, NULL, 0);
+            return ERROR_OK;
         }
         else {
             LOG(ERROR, "Breakpoint #%d not found", bpoint_num);
-            send_nack_msg(gp_dbg->p_host_conn, ERROR_UNKNOWN_BREAKPOINT);
+            return ERROR_UNKNOWN_BREAKPOINT;
         }
     }
     else {
         LOG(ERROR, "Failed to unpack data of MSG_CLEAR_BPOINT message");
-        send_nack_msg(gp_dbg->p_host_conn, ERROR_BAD_DATA);
+        return ERROR_BAD_DATA;
     }
 }
 
 
-static void handle_get_base_address_msg(ProtoMessage *p_msg)
+static DbgError exec_get_base_address_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
 {
     char lib_name[MAX_LIB_NAME_LEN];
-    uint8_t msg_data[4];
     struct Library **pp_sys_base = (struct Library **) 4l, *p_lib_base;
 
-    if (unpack_data(p_msg->data, p_msg->length, "64s", lib_name) == DOSTRUE) {
+    if (unpack_data(p_data, data_len, "64s", lib_name) == DOSTRUE) {
         if (strncmp(lib_name, "exec.library", MAX_LIB_NAME_LEN) == 0) {
             LOG(DEBUG, "Base address of exec.library = 0x%08x\n", *pp_sys_base);
-            pack_data(msg_data, 4, "!I", *pp_sys_base);
-            send_ack_msg(gp_dbg->p_host_conn, msg_data, 4);
+            pack_data(pb_reply->p_addr, 4, "!I", *pp_sys_base);
+            pb_reply->size = 4;
+            return ERROR_OK;
         }
         else {
             if ((p_lib_base = OpenLibrary(lib_name, 0l)) != NULL) {
                 LOG(DEBUG, "Base address of %s = 0x%08x\n", lib_name, p_lib_base);
                 CloseLibrary(p_lib_base);
-                pack_data(msg_data, 4, "!I", p_lib_base);
-                send_ack_msg(gp_dbg->p_host_conn, msg_data, 4);
+                pack_data(pb_reply->p_addr, 4, "!I", p_lib_base);
+                pb_reply->size = 4;
+                return ERROR_OK;
             }
             else {
                 LOG(ERROR, "Could not open library %s\n", lib_name);
-                send_nack_msg(gp_dbg->p_host_conn, ERROR_OPEN_LIB_FAILED);
+                return ERROR_OPEN_LIB_FAILED;
             }
         }
     }
     else {
         LOG(ERROR, "Failed to unpack data of MSG_GET_BASE_ADDRESS message");
-        send_nack_msg(gp_dbg->p_host_conn, ERROR_BAD_DATA);
+        return ERROR_BAD_DATA;
     }
 }
 
 
-static void handle_peek_mem_msg(ProtoMessage *p_msg)
+static DbgError exec_peek_mem_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
 {
     uint32_t address;
     uint16_t nbytes;
 
-    if (unpack_data(p_msg->data, p_msg->length, "!I!H", &address, &nbytes) == DOSTRUE) {
-        if (nbytes > MAX_MSG_DATA_LEN) {
-            LOG(ERROR, "Number of bytes %d exceeds maximum message data size %d", nbytes, MAX_MSG_DATA_LEN);
-            send_nack_msg(gp_dbg->p_host_conn, ERROR_BAD_DATA);
-            return;
+    if (unpack_data(p_data, data_len, "!I!H", &address, &nbytes) == DOSTRUE) {
+        // Without fragments, the data has to fit into one frame. With fragments, the 16-bit field for the number of
+        // bytes already limits it to MAX_MSG_DATA_LEN.
+        if (!(gp_dbg->p_host_conn->features & PROTO_FEATURE_FRAGMENTS) && (nbytes > MAX_FRAME_DATA_LEN)) {
+            LOG(ERROR, "Number of bytes %d exceeds maximum frame data size %d", nbytes, MAX_FRAME_DATA_LEN);
+            return ERROR_BAD_DATA;
         }
         if (address > (0xffffffff - nbytes)) {
             LOG(ERROR, "Invalid address 0x%08x, is greater than maximum address - %d", address, nbytes);
-            send_nack_msg(gp_dbg->p_host_conn, ERROR_BAD_DATA);
-            return;
+            return ERROR_BAD_DATA;
         }
-        // Due to the fact that all processes share the same address space in AmigaOS we can just pass address and
-        // number of bytes to send_ack_msg(), which will copy the data and send it to the host.
+        // Due to the fact that all processes share the same address space in AmigaOS we can just point the reply
+        // buffer to the memory block, the data will be copied by send_ack_msg() / handle_batch_msg().
         LOG(DEBUG, "Copying %d bytes from address 0x%08x to message", nbytes, address);
-        send_ack_msg(gp_dbg->p_host_conn, (uint8_t *) address, nbytes);
+        pb_reply->p_addr = (uint8_t *) address;
+        pb_reply->size   = nbytes;
+        return ERROR_OK;
     }
     else {
         LOG(ERROR, "Failed to unpack data of MSG_PEEK_MEM message");
+        return ERROR_BAD_DATA;
+    }
+}
+
+
+// This routine returns DOSTRUE if the target has been prepared for stepping through the range and should be resumed.
+static int handle_step_range_msg(ProtoMessage *p_msg)
+{
+    uint32_t start_offset, end_offset;
+    uint16_t f_step_over;
+    uint8_t  dbg_errno;
+
+    if (unpack_data(p_msg->data, p_msg->length, "!I!I!H", &start_offset, &end_offset, &f_step_over) == DOSTRUE) {
+        if (start_offset >= end_offset) {
+            LOG(ERROR, "Invalid range [0x%08lx, 0x%08lx)", start_offset, end_offset);
+            send_nack_msg(gp_dbg->p_host_conn, ERROR_BAD_DATA);
+            return DOSFALSE;
+        }
+        if ((dbg_errno = set_range_step_mode(gp_dbg->p_target, start_offset, end_offset, f_step_over)) == ERROR_OK) {
+            send_ack_msg(gp_dbg->p_host_conn, NULL, 0);
+            return DOSTRUE;
+        }
+        else {
+            LOG(ERROR, "Failed to set range step mode");
+            send_nack_msg(gp_dbg->p_host_conn, dbg_errno);
+            return DOSFALSE;
+        }
+    }
+    else {
+        LOG(ERROR, "Failed to unpack data of MSG_STEP_RANGE message");
         send_nack_msg(gp_dbg->p_host_conn, ERROR_BAD_DATA);
+        return DOSFALSE;
+    }
+}
+
+
+// The reply contains the number of frames (16 bits) followed by frame pointer, PC and return address (32 bits each)
+// of each frame, starting with the innermost one.
+static DbgError exec_get_call_stack_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
+{
+    static uint8_t reply_data[2 + MAX_CALL_STACK_DEPTH * 12];
+    StackFrameInfo frames[MAX_CALL_STACK_DEPTH];
+    uint16_t       max_depth;
+    uint32_t       nframes, i;
+
+    if (unpack_data(p_data, data_len, "!H", &max_depth) == DOSTRUE) {
+        if ((max_depth == 0) || (max_depth > MAX_CALL_STACK_DEPTH))
+            max_depth = MAX_CALL_STACK_DEPTH;
+        nframes = get_call_stack(gp_dbg->p_target, frames, max_depth);
+        LOG(DEBUG, "Found %ld stack frames", nframes);
+        pack_data(reply_data, 2, "!H", nframes);
+        for (i = 0; i < nframes; i++) {
+            pack_data(
+                reply_data + 2 + i * 12,
+                12,
+                "!I!I!I",
+                frames[i].p_frame_ptr,
+                frames[i].p_pc,
+                frames[i].p_return_addr
+            );
+        }
+        pb_reply->p_addr = reply_data;
+        pb_reply->size   = 2 + nframes * 12;
+        return ERROR_OK;
+    }
+    else {
+        LOG(ERROR, "Failed to unpack data of MSG_GET_CALL_STACK message");
+        return ERROR_BAD_DATA;
+    }
+}
+
+
+// The reply to a MSG_READ_TRACE message consists of the E clock frequency, the number of records dropped so far, the
+// number of records still in the buffer after this reply and the number of records in this reply, followed by the
+// records, which contain only the selected registers. The records are removed from the buffer, so the host needs to
+// repeat the command until no records are left. The maximum number of records can be limited by the host (0 = as
+// many as fit into the reply).
+static DbgError exec_read_trace_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
+{
+    static uint8_t  reply_data[MAX_TRACE_REPLY_LEN];
+    uint8_t         *p_reply_pos = reply_data + TRACE_REPLY_HEADER_SIZE;
+    TraceRecord     record;
+    TraceBufferInfo info;
+    uint16_t        max_records, nrecords = 0;
+    uint32_t        i, nregs;
+
+    if (unpack_data(p_data, data_len, "!H", &max_records) == DOSTRUE) {
+        while (((max_records == 0) || (nrecords < max_records))
+               && (p_reply_pos + TRACE_RECORD_SIZE + NUM_TRACE_REGS * 4 <= reply_data + MAX_TRACE_REPLY_LEN)
+               && read_trace_record(gp_dbg->p_target, &record)) {
+            pack_data(
+                p_reply_pos,
+                TRACE_RECORD_SIZE,
+                "!I!I!I!I!H",
+                record.bpoint_num,
+                record.p_pc,
+                record.ts_hi,
+                record.ts_lo,
+                record.reg_mask
+            );
+            p_reply_pos += TRACE_RECORD_SIZE;
+            for (i = 0, nregs = 0; i < NUM_TRACE_REGS; i++) {
+                if (record.reg_mask & (1 << i)) {
+                    pack_data(p_reply_pos, 4, "!I", record.regs[nregs++]);
+                    p_reply_pos += 4;
+                }
+            }
+            ++nrecords;
+        }
+        get_trace_buffer_info(gp_dbg->p_target, &info);
+        LOG(DEBUG, "Read %d trace records, %ld records left", nrecords, info.nrecords);
+        pack_data(
+            reply_data,
+            TRACE_REPLY_HEADER_SIZE,
+            "!I!I!I!H",
+            info.eclock_freq,
+            info.noverruns,
+            info.nrecords,
+            nrecords
+        );
+        pb_reply->p_addr = reply_data;
+        pb_reply->size   = p_reply_pos - reply_data;
+        return ERROR_OK;
+    }
+    else {
+        LOG(ERROR, "Failed to unpack data of MSG_READ_TRACE message");
+        return ERROR_BAD_DATA;
     }
 }
+
+
+// The profile is sent as it is, like the TargetInfo in MSG_TARGET_STOPPED, the host knows its layout.
+static DbgError exec_get_profile_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
+{
+    const Profile *p_profile;
+
+    if ((p_profile = get_profile(gp_dbg->p_target)) != NULL) {
+        pb_reply->p_addr = (uint8_t *) p_profile;
+        pb_reply->size   = sizeof(Profile) + p_profile->nbins * sizeof(uint32_t);
+        return ERROR_OK;
+    }
+    else {
+        LOG(ERROR, "No profile available");
+        return ERROR_NO_PROFILE;
+    }
+}
+
+
+// The data of a MSG_SET_SYSCALL_TRACE message consists of the library name (null-terminated) followed by the offset
+// and the register mask (16 bits each) of each function to trace. The host splits long lists into several messages.
+static DbgError exec_set_syscall_trace_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
+{
+    char     lib_name[MAX_LIB_NAME_LEN];
+    uint16_t offsets[MAX_FRAME_DATA_LEN / 4], reg_masks[MAX_FRAME_DATA_LEN / 4];
+    uint32_t name_len, nfuncs = 0;
+    DbgError dbg_errno;
+
+    pb_reply->size = 0;
+    if (unpack_data(p_data, data_len, "64s", lib_name) == DOSTRUE) {
+        name_len = strlen(lib_name) + 1;
+        if ((data_len - name_len) % 4 != 0) {
+            LOG(ERROR, "List of functions in MSG_SET_SYSCALL_TRACE message is truncated");
+            return ERROR_BAD_DATA;
+        }
+        for (p_data += name_len, data_len -= name_len; data_len > 0; p_data += 4, data_len -= 4) {
+            if (nfuncs == MAX_FRAME_DATA_LEN / 4) {
+                LOG(ERROR, "Too many functions in MSG_SET_SYSCALL_TRACE message");
+                return ERROR_BAD_DATA;
+            }
+            unpack_data(p_data, 4, "!H!H", &offsets[nfuncs], &reg_masks[nfuncs]);
+            ++nfuncs;
+        }
+        LOG(DEBUG, "Tracing %ld functions of library %s", nfuncs, lib_name);
+        if ((dbg_errno = trace_syscalls(
+            get_syscall_tracer(gp_dbg->p_target),
+            lib_name,
+            nfuncs,
+            offsets,
+            reg_masks
+        )) != ERROR_OK)
+            LOG(ERROR, "Failed to trace functions of library %s", lib_name);
+        return dbg_errno;
+    }
+    else {
+        LOG(ERROR, "Failed to unpack data of MSG_SET_SYSCALL_TRACE message");
+        return ERROR_BAD_DATA;
+    }
+}
+
+
+static DbgError exec_clear_syscall_trace_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
+{
+    pb_reply->size = 0;
+    untrace_syscalls(get_syscall_tracer(gp_dbg->p_target));
+    return ERROR_OK;
+}
+
+
+// The reply to a MSG_READ_SYSCALL_TRACE message looks like the reply to a MSG_READ_TRACE message, just with
+// syscall records (library base, offset, register mask, timestamp, elapsed ticks, result, registers).
+static DbgError exec_read_syscall_trace_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
+{
+    static uint8_t  reply_data[MAX_TRACE_REPLY_LEN];
+    uint8_t         *p_reply_pos = reply_data + TRACE_REPLY_HEADER_SIZE;
+    SyscallTracer   *p_tracer = get_syscall_tracer(gp_dbg->p_target);
+    SyscallRecord   record;
+    TraceBufferInfo info;
+    uint16_t        max_records, nrecords = 0;
+    uint32_t        i, nregs;
+
+    if (unpack_data(p_data, data_len, "!H", &max_records) == DOSTRUE) {
+        while (((max_records == 0) || (nrecords < max_records))
+               && (p_reply_pos + SYSCALL_RECORD_SIZE + NUM_TRACE_REGS * 4 <= reply_data + MAX_TRACE_REPLY_LEN)
+               && read_syscall_record(p_tracer, &record)) {
+            pack_data(
+                p_reply_pos,
+                SYSCALL_RECORD_SIZE,
+                "!I!H!H!I!I!I!I",
+                record.p_lib_base,
+                record.offset,
+                record.reg_mask,
+                record.ts_hi,
+                record.ts_lo,
+                record.elapsed,
+                record.result
+            );
+            p_reply_pos += SYSCALL_RECORD_SIZE;
+            for (i = 0, nregs = 0; i < NUM_TRACE_REGS; i++) {
+                if (record.reg_mask & (1 << i)) {
+                    pack_data(p_reply_pos, 4, "!I", record.regs[nregs++]);
+                    p_reply_pos += 4;
+                }
+            }
+            ++nrecords;
+        }
+        get_syscall_buffer_info(p_tracer, &info);
+        LOG(DEBUG, "Read %d syscall records, %ld records left", nrecords, info.nrecords);
+        pack_data(
+            reply_data,
+            TRACE_REPLY_HEADER_SIZE,
+            "!I!I!I!H",
+            info.eclock_freq,
+            info.noverruns,
+            info.nrecords,
+            nrecords
+        );
+        pb_reply->p_addr = reply_data;
+        pb_reply->size   = p_reply_pos - reply_data;
+        return ERROR_OK;
+    }
+    else {
+        LOG(ERROR, "Failed to unpack data of MSG_READ_SYSCALL_TRACE message");
+        return ERROR_BAD_DATA;
+    }
+}
+
+
+// The reply to a MSG_GET_SYSCALL_STATS message consists of the E clock frequency and the number of entries, followed
+// by library base, offset, number of calls and total time in E clock ticks (64 bits) of each function that has been
+// called at least once. Unlike the records, the statistics are complete even if the syscall buffer overflows.
+static DbgError exec_get_syscall_stats_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
+{
+    static uint8_t reply_data[SYSCALL_STATS_HEADER_SIZE + MAX_SYSCALL_PATCHES * SYSCALL_STATS_ENTRY_SIZE];
+    uint8_t        *p_reply_pos = reply_data + SYSCALL_STATS_HEADER_SIZE;
+    SyscallTracer  *p_tracer = get_syscall_tracer(gp_dbg->p_target);
+    SyscallPatch   *p_patch;
+    uint16_t       nentries = 0;
+
+    for (p_patch = p_tracer->p_patches; p_patch != NULL; p_patch = p_patch->p_next) {
+        if (p_patch->ncalls == 0)
+            continue;
+        pack_data(
+            p_reply_pos,
+            SYSCALL_STATS_ENTRY_SIZE,
+            "!I!H!I!I!I",
+            p_patch->p_lib,
+            p_patch->offset,
+            p_patch->ncalls,
+            p_patch->ticks_hi,
+            p_patch->ticks_lo
+        );
+        p_reply_pos += SYSCALL_STATS_ENTRY_SIZE;
+        ++nentries;
+    }
+    pack_data(reply_data, SYSCALL_STATS_HEADER_SIZE, "!I!H", p_tracer->p_timer->eclock_freq, nentries);
+    pb_reply->p_addr = reply_data;
+    pb_reply->size   = p_reply_pos - reply_data;
+    return ERROR_OK;
+}
+
+
+// The reply contains the number of segments (16 bits) followed by address and size (32 bits each) of each segment,
+// in the order of the seglist. The host reads the content of the code segments once with MSG_PEEK_MEM (they don't
+// change, apart from the TRAP opcodes of breakpoints), so it doesn't need to read code from the target anymore.
+static DbgError exec_get_segments_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
+{
+    static uint8_t reply_data[2 + MAX_SEGMENTS * 8];
+    SegmentInfo    segments[MAX_SEGMENTS];
+    uint32_t       nsegs, i;
+
+    nsegs = get_segments(gp_dbg->p_target, segments, MAX_SEGMENTS);
+    LOG(DEBUG, "Found %ld segments", nsegs);
+    pack_data(reply_data, 2, "!H", nsegs);
+    for (i = 0; i < nsegs; i++)
+        pack_data(reply_data + 2 + i * 8, 8, "!I!I", segments[i].p_address, segments[i].size);
+    pb_reply->p_addr = reply_data;
+    pb_reply->size   = 2 + nsegs * 8;
+    return ERROR_OK;
+}
+
+
+// The reply to a MSG_GET_STATS message consists of the E clock frequency followed by the counters in ServerStats.
+// The counters are never reset, the host calculates the differences itself.
+static DbgError exec_get_stats_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
+{
+    static uint8_t reply_data[SERVER_STATS_REPLY_SIZE];
+
+    pack_data(
+        reply_data,
+        SERVER_STATS_REPLY_SIZE,
+        "!I!I!I!I!I!I!I!I!I!I",
+        get_target_timer(gp_dbg->p_target)->eclock_freq,
+        g_stats.nframes_sent,
+        g_stats.nframes_received,
+        g_stats.nframes_corrupted,
+        g_stats.nbytes_escaped,
+        g_stats.nbpoint_hits,
+        g_stats.nstep_traps,
+        g_stats.ncmds,
+        g_stats.cmd_ticks_hi,
+        g_stats.cmd_ticks_lo
+    );
+    pb_reply->p_addr = reply_data;
+    pb_reply->size   = SERVER_STATS_REPLY_SIZE;
+    return ERROR_OK;
+}
+
+
+// The data of a MSG_SET_WATCHPOINT message consists of the address and the size of the watched memory, the reply is
+// the number of the watchpoint.
+static DbgError exec_set_watchpoint_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
+{
+    void     *p_address;
+    uint16_t size;
+    uint32_t wpoint_num;
+    DbgError dbg_errno;
+
+    pb_reply->size = 0;
+    if (unpack_data(p_data, data_len, "!I!H", &p_address, &size) == DOSFALSE) {
+        LOG(ERROR, "Failed to unpack data of MSG_SET_WATCHPOINT message");
+        return ERROR_BAD_DATA;
+    }
+    if ((dbg_errno = set_watchpoint(gp_dbg->p_target, p_address, size, &wpoint_num)) != ERROR_OK) {
+        LOG(ERROR, "Failed to set watchpoint");
+        return dbg_errno;
+    }
+    pack_data(pb_reply->p_addr, 4, "!I", wpoint_num);
+    pb_reply->size = 4;
+    return ERROR_OK;
+}
+
+
+static DbgError exec_clear_watchpoint_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
+{
+    uint32_t wpoint_num;
+
+    pb_reply->size = 0;
+    if (unpack_data(p_data, data_len, "!I", &wpoint_num) == DOSFALSE) {
+        LOG(ERROR, "Failed to unpack data of MSG_CLEAR_WATCHPOINT message");
+        return ERROR_BAD_DATA;
+    }
+    return clear_watchpoint(gp_dbg->p_target, wpoint_num);
+}
+
+
+// The data of a MSG_SELECT_TARGET message is the ID of the target that the following commands address, the reply is
+// its TargetInfo.
+static DbgError exec_select_target_cmd(const uint8_t *p_data, uint16_t data_len, Buffer *pb_reply)
+{
+    static TargetInfo target_info;
+    uint16_t          target_id;
+    Target            *p_target;
+
+    pb_reply->size = 0;
+    if (unpack_data(p_data, data_len, "!H", &target_id) == DOSFALSE) {
+        LOG(ERROR, "Failed to unpack data of MSG_SELECT_TARGET message");
+        return ERROR_BAD_DATA;
+    }
+    if ((p_target = find_target(gp_dbg, target_id)) == NULL) {
+        LOG(ERROR, "Target #%d does not exist", target_id);
+        return ERROR_UNKNOWN_TARGET;
+    }
+    gp_dbg->p_target = p_target;
+    // The target might have stopped before, but if its stop hasn't been handled yet, it would still appear as running.
+    handle_pending_target_signals(gp_dbg, p_target);
+    get_target_info(p_target, &target_info);
+    pb_reply->p_addr = (uint8_t *) &target_info;
+    pb_reply->size   = sizeof(TargetInfo);
+    return ERROR_OK;
+}
+
+
+// This routine waits (if requested) until one of the targets has stopped or terminated, selects it and sends the
+// MSG_TARGET_STOPPED message for it to the host.
+static void report_target_event(int f_wait)
+{
+    TargetInfo target_info;
+
+    if (f_wait) {
+        // The time the targets run is not counted.
+        stop_cmd_timing();
+        gp_dbg->p_target = wait_for_target_event(gp_dbg);
+        start_cmd_timing();
+    }
+    get_target_info(gp_dbg->p_target, &target_info);
+    send_target_stopped_msg(gp_dbg->p_host_conn, &target_info);
+}
+
+
+// These routines measure the time process_remote_commands() spends on a command. The time the targets run is not
+// counted, so report_target_event() stops the timing while it waits for them.
+static void start_cmd_timing()
+{
+    uint32_t ts_hi;
+
+    read_timestamp(get_target_timer(gp_dbg->p_target), &ts_hi, &g_cmd_start_ts_lo);
+    g_f_cmd_timing = TRUE;
+}
+
+
+static void stop_cmd_timing()
+{
+    uint32_t ts_hi, ts_lo, elapsed;
+
+    if (!g_f_cmd_timing)
+        return;
+    read_timestamp(get_target_timer(gp_dbg->p_target), &ts_hi, &ts_lo);
+    // The difference of the low dwords is correct as long as the command took less than 2^32 ticks.
+    elapsed = ts_lo - g_cmd_start_ts_lo;
+    g_stats.cmd_ticks_lo += elapsed;
+    if (g_stats.cmd_ticks_lo < elapsed)
+        ++g_stats.cmd_ticks_hi;
+    g_f_cmd_timing = FALSE;
+}
@@ -7,6 +7,9 @@
 //
 
 
+#include "stdint.h"
+
+
 //
 // type declarations
 //
@@ -17,7 +20,7 @@ typedef struct ProtoMessage ProtoMessage;
 //
 // exported functions
 //
-HostConnection *create_host_conn();
+HostConnection *create_host_conn(uint32_t baud_rate, int f_fast_mode, uint16_t tcp_port);
 void destroy_host_conn(HostConnection *p_conn);
 void process_remote_commands();
 
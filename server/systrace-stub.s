@@ -0,0 +1,82 @@
+/*
+ * systrace-stub.s - part of cwdbg, a debugger for AmigaOS
+ *                   This file contains the stub routine that is called instead of a traced library function.
+ *
+ * Copyright(C) 2018-2022 Constantin Wiemer
+ */
+
+
+/*
+ * constants
+ */
+/* see SyscallFrame structure in systrace.h */
+.set fr_result,         60
+.set fr_orig_func,      72
+.set fr_patch,          76
+.set fr_return_addr,    80
+
+/* see exec/execbase.h and exec/exec_lib.fd, GetCC() must not be traced (see trace_syscalls()) */
+.set AbsExecBase,       4
+.set _LVOGetCC,         -528
+
+
+.text
+.extern _enter_syscall
+.extern _exit_syscall
+.global _syscall_stub
+
+
+/*
+ * stub routine for traced library functions
+ *
+ * The trampoline in the SyscallPatch has pushed the address of the patch onto the stack, so the stack looks like this:
+ *
+ * --------------------------------
+ * | address of the patch         |     +0
+ * --------------------------------
+ * | return address of the caller |     +4
+ * --------------------------------
+ *
+ * We build the rest of the SyscallFrame below it and let _enter_syscall decide if the call is traced. If so, we call
+ * the original function with the frame still on the stack (library functions get their arguments in registers, so
+ * they don't care) and call _exit_syscall when it returns. Otherwise, we just jump to the original function.
+ *
+ * Some library functions also return information in the condition codes, so we have to preserve them across the call
+ * of _exit_syscall. Reading the CCR / SR directly is either not possible on the 68000 or privileged on later CPUs, so
+ * we use GetCC() and only use instructions that leave the condition codes alone until we have saved them.
+ */
+_syscall_stub:
+    lea         -16(sp), sp                                 /* room for result, timestamp and original function */
+    movem.l     d0-d7/a0-a6, -(sp)                          /* registers at the time of the call */
+    move.l      sp, -(sp)                                   /* push frame address onto stack */
+    jsr         _enter_syscall
+    addq.l      #4, sp                                      /* remove arg from stack */
+    tst.l       d0
+    beq.s       untraced
+
+    /* call the original function with the original registers, it returns to traced_return */
+    movem.l     (sp), d0-d7/a0-a6                           /* restore registers but keep them in the frame */
+    pea         traced_return
+    move.l      fr_orig_func+4(sp), -(sp)
+    rts
+
+traced_return:
+    movem.l     d0-d1/a0-a1/a6, -(sp)                       /* save registers that are modified by _exit_syscall / GetCC() */
+    movea.l     AbsExecBase, a6
+    jsr         _LVOGetCC(a6)
+    move.w      d0, -(sp)                                   /* save condition codes set by the original function */
+    move.l      2(sp), fr_result+22(sp)
+    pea         22(sp)                                      /* push frame address onto stack */
+    jsr         _exit_syscall
+    addq.l      #4, sp                                      /* remove arg from stack */
+    move.w      (sp)+, ccr                                  /* neither MOVEM nor LEA change the condition codes */
+    movem.l     (sp)+, d0-d1/a0-a1/a6
+    lea         fr_return_addr(sp), sp                      /* remove frame from stack and return to caller */
+    rts
+
+untraced:
+    /* replace the address of the patch with the address of the original function and "return" to it */
+    move.l      fr_orig_func(sp), fr_patch(sp)
+    movem.l     (sp)+, d0-d7/a0-a6
+    lea         16(sp), sp                                  /* remove result, timestamp and original function */
+    rts
@@ -0,0 +1,268 @@
+//
+// systrace.c - part of cwdbg, a debugger for the AmigaOS
+//              This file contains the routines for tracing library calls (system calls) of the target.
+//
+// Copyright(C) 2018-2022 Constantin Wiemer
+//
+
+
+#include <exec/execbase.h>
+#include <exec/libraries.h>
+#include <exec/types.h>
+#include <proto/exec.h>
+
+#include "stdint.h"
+#include "systrace.h"
+#include "target.h"
+#include "timer.h"
+#include "util.h"
+
+
+#define SYSCALL_BUFFER_SIZE   512               // number of records kept until the host reads them
+#define MOVE_L_IMM_PUSH_OPCODE 0x2f3c           // move.l #imm, -(sp)
+#define JMP_ABS_L_OPCODE      0x4ef9            // jmp abs.l
+#define GETCC_OFFSET          528               // offset of GetCC() in exec.library, called by syscall_stub
+
+
+extern void syscall_stub();
+
+
+static SyscallPatch *find_patch(SyscallTracer *p_tracer, struct Library *p_lib, uint16_t offset);
+
+
+//
+// exported routines
+//
+
+SyscallTracer *create_syscall_tracer(Timer *p_timer)
+{
+    SyscallTracer *p_tracer;
+
+    if ((p_tracer = AllocVec(sizeof(SyscallTracer), MEMF_CLEAR)) == NULL) {
+        LOG(ERROR, "Could not allocate memory for syscall tracer object");
+        return NULL;
+    }
+    if ((p_tracer->p_records = create_ring_buffer(sizeof(SyscallRecord), SYSCALL_BUFFER_SIZE)) == NULL) {
+        LOG(ERROR, "Could not allocate memory for syscall buffer");
+        FreeVec(p_tracer);
+        return NULL;
+    }
+    p_tracer->p_timer = p_timer;
+    return p_tracer;
+}
+
+
+void destroy_syscall_tracer(SyscallTracer *p_tracer)
+{
+    untrace_syscalls(p_tracer);
+    destroy_ring_buffer(p_tracer->p_records);
+    FreeVec(p_tracer);
+}
+
+
+// This routine patches the given functions of a library so that calls of them are recorded. Functions that are
+// already traced just get the new register mask. The library stays open until the functions are untraced.
+DbgError trace_syscalls(
+    SyscallTracer *p_tracer,
+    const char *p_lib_name,
+    uint32_t nfuncs,
+    const uint16_t *p_offsets,
+    const uint16_t *p_reg_masks
+)
+{
+    struct Library *p_lib;
+    SyscallPatch   *p_patch;
+    uint32_t       i;
+    DbgError       dbg_errno = ERROR_OK;
+
+    if ((p_lib = OpenLibrary(p_lib_name, 0l)) == NULL) {
+        LOG(ERROR, "Could not open library %s", p_lib_name);
+        return ERROR_OPEN_LIB_FAILED;
+    }
+    for (i = 0; i < nfuncs; i++) {
+        if ((p_offsets[i] == 0) || (p_offsets[i] % 6 != 0) || (p_offsets[i] > p_lib->lib_NegSize)) {
+            LOG(ERROR, "Invalid offset %d for function of library %s", p_offsets[i], p_lib_name);
+            CloseLibrary(p_lib);
+            return ERROR_BAD_DATA;
+        }
+        // Tracing GetCC() would make syscall_stub call itself until the stack overflows.
+        if ((p_lib == (struct Library *) SysBase) && (p_offsets[i] == GETCC_OFFSET)) {
+            LOG(ERROR, "Function GetCC() of library %s is used by the stub routine and can't be traced", p_lib_name);
+            CloseLibrary(p_lib);
+            return ERROR_BAD_DATA;
+        }
+    }
+
+    for (i = 0; i < nfuncs; i++) {
+        if ((p_patch = find_patch(p_tracer, p_lib, p_offsets[i])) != NULL) {
+            p_patch->reg_mask = p_reg_masks[i];
+            continue;
+        }
+        if (p_tracer->npatches == MAX_SYSCALL_PATCHES) {
+            LOG(ERROR, "Can't trace more than %d functions", MAX_SYSCALL_PATCHES);
+            dbg_errno = ERROR_NOT_ENOUGH_MEMORY;
+            break;
+        }
+        if ((p_patch = AllocVec(sizeof(SyscallPatch), MEMF_PUBLIC | MEMF_CLEAR)) == NULL) {
+            LOG(ERROR, "Could not allocate memory for patch of function with offset %d", p_offsets[i]);
+            dbg_errno = ERROR_NOT_ENOUGH_MEMORY;
+            break;
+        }
+        p_patch->trampoline[0] = MOVE_L_IMM_PUSH_OPCODE;
+        p_patch->trampoline[1] = (uint32_t) p_patch >> 16;
+        p_patch->trampoline[2] = (uint32_t) p_patch & 0xffff;
+        p_patch->trampoline[3] = JMP_ABS_L_OPCODE;
+        p_patch->trampoline[4] = (uint32_t) syscall_stub >> 16;
+        p_patch->trampoline[5] = (uint32_t) syscall_stub & 0xffff;
+        // The trampoline is code written as data, so it must not linger in the data cache.
+        CacheClearU();
+        // Each patch holds its own reference to the library.
+        p_patch->p_tracer = p_tracer;
+        p_patch->p_lib    = OpenLibrary(p_lib_name, 0l);
+        p_patch->offset   = p_offsets[i];
+        p_patch->reg_mask = p_reg_masks[i];
+        // Some library functions are also called from interrupts, so we need to make sure that nobody calls the
+        // function before we know the address of the original one.
+        Disable();
+        p_patch->p_orig_func = SetFunction(p_lib, -((LONG) p_patch->offset), (APTR) p_patch->trampoline);
+        Enable();
+        p_patch->p_next = p_tracer->p_patches;
+        p_tracer->p_patches = p_patch;
+        ++p_tracer->npatches;
+    }
+    LOG(INFO, "Tracing %ld functions in total after patching library %s", p_tracer->npatches, p_lib_name);
+    CloseLibrary(p_lib);
+    return dbg_errno;
+}
+
+
+// This routine restores the original functions and removes all patches. The debugger only calls it while the target
+// is not running, so no traced call can be in progress. But if somebody else has patched a function after us, we
+// can't restore it without breaking the other patch. We then leave our patch in place and never free it (nor close
+// the library). As syscall_stub is unloaded together with the debugger, the trampoline is rewritten to jump to the
+// original function directly, so the patch doesn't refer to the debugger's code or the tracer anymore.
+void untrace_syscalls(SyscallTracer *p_tracer)
+{
+    SyscallPatch *p_patch, *p_next;
+    APTR         *pp_jump_addr;
+
+    for (p_patch = p_tracer->p_patches; p_patch != NULL; p_patch = p_next) {
+        p_next = p_patch->p_next;
+        // entry in the jump table is a jmp abs.l instruction
+        pp_jump_addr = (APTR *) ((uint8_t *) p_patch->p_lib - p_patch->offset + 2);
+        Disable();
+        if (*pp_jump_addr == (APTR) p_patch->trampoline) {
+            SetFunction(p_patch->p_lib, -((LONG) p_patch->offset), p_patch->p_orig_func);
+            Enable();
+            CloseLibrary(p_patch->p_lib);
+            FreeVec(p_patch);
+        }
+        else {
+            p_patch->p_tracer = NULL;
+            p_patch->trampoline[0] = JMP_ABS_L_OPCODE;
+            p_patch->trampoline[1] = (uint32_t) p_patch->p_orig_func >> 16;
+            p_patch->trampoline[2] = (uint32_t) p_patch->p_orig_func & 0xffff;
+            // Nobody must run the trampoline before the new instruction has been written back.
+            CacheClearU();
+            Enable();
+            LOG(WARN, "Function with offset %d has been patched by somebody else, can't restore it", p_patch->offset);
+        }
+    }
+    p_tracer->p_patches = NULL;
+    p_tracer->npatches  = 0;
+}
+
+
+void set_traced_task(SyscallTracer *p_tracer, struct Task *p_task)
+{
+    p_tracer->p_task = p_task;
+}
+
+
+// This routine moves the oldest syscall record into the caller's buffer, it returns FALSE if there is none.
+int read_syscall_record(SyscallTracer *p_tracer, SyscallRecord *p_record)
+{
+    return get_elem_from_ring_buffer(p_tracer->p_records, p_record) == DOSTRUE;
+}
+
+
+void get_syscall_buffer_info(SyscallTracer *p_tracer, TraceBufferInfo *p_info)
+{
+    p_info->nrecords    = p_tracer->p_records->count;
+    p_info->noverruns   = p_tracer->p_records->noverruns;
+    p_info->eclock_freq = p_tracer->p_timer->eclock_freq;
+}
+
+
+// This routine is called by syscall_stub in the context of the calling task (which can be any task, or even an
+// interrupt) before the original function. It returns TRUE if the call should be traced. Neither this routine nor
+// exit_syscall() must call any library function that could be traced (not even FindTask() or LOG()), otherwise we
+// would end up in an endless recursion. During an interrupt, ThisTask is still the interrupted task, but the frame
+// is on the supervisor stack then, so we only trace calls whose frame is on the stack of the traced task.
+int enter_syscall(SyscallFrame *p_frame)
+{
+    SyscallTracer *p_tracer = p_frame->p_patch->p_tracer;
+    struct Task   *p_task;
+
+    p_frame->p_orig_func = p_frame->p_patch->p_orig_func;
+    if ((p_tracer == NULL) || ((p_task = p_tracer->p_task) == NULL) || (SysBase->ThisTask != p_task))
+        return FALSE;
+    if (((APTR) p_frame < p_task->tc_SPLower) || ((APTR) p_frame >= p_task->tc_SPUpper))
+        return FALSE;
+    read_timestamp(p_tracer->p_timer, &p_frame->ts_hi, &p_frame->ts_lo);
+    return TRUE;
+}
+
+
+// This routine is called by syscall_stub after the original function has returned, it updates the statistics of the
+// function and writes a record. If the buffer is full, the record is dropped (and counted as overrun).
+void exit_syscall(SyscallFrame *p_frame)
+{
+    SyscallPatch  *p_patch = p_frame->p_patch;
+    SyscallTracer *p_tracer = p_patch->p_tracer;
+    SyscallRecord record;
+    uint32_t      ts_hi, ts_lo, i, nregs = 0;
+
+    if (p_tracer == NULL)
+        return;
+    read_timestamp(p_tracer->p_timer, &ts_hi, &ts_lo);
+    // The difference of the low dwords is correct as long as the call took less than 2^32 ticks.
+    record.elapsed = ts_lo - p_frame->ts_lo;
+    ++p_patch->ncalls;
+    p_patch->ticks_lo += record.elapsed;
+    if (p_patch->ticks_lo < record.elapsed)
+        ++p_patch->ticks_hi;
+
+    record.p_lib_base = p_patch->p_lib;
+    record.offset     = p_patch->offset;
+    record.reg_mask   = p_patch->reg_mask;
+    record.ts_hi      = p_frame->ts_hi;
+    record.ts_lo      = p_frame->ts_lo;
+    record.result     = p_frame->result;
+    for (i = 0; i < NUM_TRACE_REGS; i++) {
+        if (!(record.reg_mask & (1 << i)))
+            continue;
+        if (i < 15)
+            record.regs[nregs++] = p_frame->regs[i];
+        else
+            // SP of the caller at the time of the call (pointing to the return address)
+            record.regs[nregs++] = (uint32_t) &p_frame->p_return_addr;
+    }
+    put_elem_into_ring_buffer(p_tracer->p_records, &record);
+}
+
+
+//
+// local routines
+//
+
+static SyscallPatch *find_patch(SyscallTracer *p_tracer, struct Library *p_lib, uint16_t offset)
+{
+    SyscallPatch *p_patch;
+
+    for (p_patch = p_tracer->p_patches; p_patch != NULL; p_patch = p_patch->p_next) {
+        if ((p_patch->p_lib == p_lib) && (p_patch->offset == offset))
+            return p_patch;
+    }
+    return NULL;
+}
@@ -0,0 +1,92 @@
+#ifndef CWDBG_SYSTRACE_H
+#define CWDBG_SYSTRACE_H
+//
+// systrace.h - part of cwdbg, a debugger for the AmigaOS
+//
+// Copyright(C) 2018-2022 Constantin Wiemer
+//
+
+
+#include "stdint.h"
+#include "target.h"
+#include "timer.h"
+#include "util.h"
+
+
+#define MAX_SYSCALL_PATCHES 512         // maximum number of library functions that can be traced at the same time
+
+
+//
+// type declarations
+//
+
+// For each traced library function, the entry in the library's jump table is replaced (with SetFunction()) by a
+// pointer to the trampoline in the patch, which pushes the address of the patch and jumps to syscall_stub (see
+// systrace-stub.s). So the trampoline has to be the first member.
+typedef struct SyscallTracer SyscallTracer;
+typedef struct SyscallPatch {
+    uint16_t            trampoline[6];  // move.l #p_patch, -(sp) / jmp _syscall_stub (jmp p_orig_func if abandoned)
+    struct SyscallPatch *p_next;
+    // Each target has its own tracer, so the stub finds the tracer via the patch. If several targets trace the same
+    // function, their patches are chained (each one calls the previous one as original function).
+    SyscallTracer       *p_tracer;
+    struct Library      *p_lib;
+    uint16_t            offset;         // offset of the function in the jump table (positive, as in the pragmas)
+    uint16_t            reg_mask;       // registers recorded for each call, numbered as for tracepoints
+    void                *p_orig_func;
+    uint32_t            ncalls;
+    uint32_t            ticks_hi;       // total time spent in the function (in E clock ticks)
+    uint32_t            ticks_lo;
+} SyscallPatch;
+
+struct SyscallTracer {
+    SyscallPatch        *p_patches;
+    uint32_t            npatches;
+    struct Task         *p_task;        // only calls made by this task are traced
+    RingBuffer          *p_records;     // one SyscallRecord for each traced call
+    Timer               *p_timer;
+};
+
+typedef struct SyscallRecord {
+    void                *p_lib_base;
+    uint16_t            offset;
+    uint16_t            reg_mask;
+    uint32_t            ts_hi;          // value of the E clock when the function was called
+    uint32_t            ts_lo;
+    uint32_t            elapsed;        // number of E clock ticks until the function returned
+    uint32_t            result;         // D0 after the call
+    uint32_t            regs[NUM_TRACE_REGS];   // registers at the time of the call selected by reg_mask
+} SyscallRecord;
+
+// This is the stack frame built by syscall_stub for the duration of the call (keep in sync with systrace-stub.s).
+typedef struct SyscallFrame {
+    uint32_t            regs[15];       // D0-D7 / A0-A6 at the time of the call
+    uint32_t            result;
+    uint32_t            ts_hi;
+    uint32_t            ts_lo;
+    void                *p_orig_func;
+    SyscallPatch        *p_patch;
+    void                *p_return_addr; // return address of the caller
+} SyscallFrame;
+
+
+//
+// exported functions
+//
+SyscallTracer *create_syscall_tracer(Timer *p_timer);
+void destroy_syscall_tracer(SyscallTracer *p_tracer);
+DbgError trace_syscalls(
+    SyscallTracer *p_tracer,
+    const char *p_lib_name,
+    uint32_t nfuncs,
+    const uint16_t *p_offsets,
+    const uint16_t *p_reg_masks
+);
+void untrace_syscalls(SyscallTracer *p_tracer);
+void set_traced_task(SyscallTracer *p_tracer, struct Task *p_task);
+int read_syscall_record(SyscallTracer *p_tracer, SyscallRecord *p_record);
+void get_syscall_buffer_info(SyscallTracer *p_tracer, TraceBufferInfo *p_info);
+int enter_syscall(SyscallFrame *p_frame);
+void exit_syscall(SyscallFrame *p_frame);
+
+#endif  // CWDBG_SYSTRACE_H
@@ -7,6 +7,7 @@
 
 
 #include <dos/dostags.h>
+#include <exec/execbase.h>
 #include <exec/types.h>
 #include <memory.h>
 #include <proto/alib.h>
@@ -17,28 +18,92 @@
 #include "debugger.h"
 #include "server.h"
 #include "stdint.h"
+#include "systrace.h"
 #include "target.h"
+#include "timer.h"
 #include "util.h"
 
 
 #define TRAP_NUM_BPOINT       0
 #define TRAP_NUM_RESTORE      1
 #define TRAP_OPCODE           0x4e40
+#define RTS_OPCODE            0x4e75
+// SR bits for tracing, T1 = trace every instruction, T0 = trace on change of flow (68020 - 68040 only)
+#define SR_T1                 0x8000
+#define SR_T0                 0x4000
+#define SR_INT_MASK           0x0700
 #define TARGET_STACK_SIZE     8192
-#define SYNC_SIGNAL_BIT       0x80000000
+#define SYNC_SIGNAL_NUM       31
+#define SYNC_SIGNAL_BIT       (1l << SYNC_SIGNAL_NUM)
+#define INITIAL_BPOINT_SLOTS  32                // must be a power of 2
+#define BPOINT_POOL_SIZE      64                // number of preallocated breakpoints
+#define TRACE_BUFFER_SIZE     256               // number of trace records kept until the host reads them
+#define MIN_PROFILE_INTERVAL  1000              // minimum sampling interval in microseconds
+#define MAX_PROFILE_INTERVAL  1000000           // maximum sampling interval in microseconds (see start_timer())
+// When exec switches tasks on a 68000, it saves SR and PC (in this order, as in the exception frame) followed by the
+// registers D0-D7 / A0-A6 on the stack of the task and stores the stack pointer in tc_SPReg.
+#define SAVED_PC_OFFSET       2
+// not defined in the NDK 3.1 headers, set by the 68060.library
+#ifndef AFF_68060
+#define AFF_68060             (1 << 7)
+#endif
+
+// Areas with the CIAs, the custom chips and the autoconfig boards (keep in sync with UNCACHED_MEM_RANGES in server.py).
+// Watchpoints can't be set there because reading them has side effects and their contents change all the time.
+static const uint32_t g_io_mem_ranges[][2] = {{0xa00000, 0xc00000}, {0xd80000, 0xe00000}, {0xe80000, 0xf00000}};
 
 
 struct Target {
+    uint32_t               id;                  // see add_target() in debugger.c
     BPTR                   p_seglist;
     uint32_t               (*p_entry_point)();
+    uint32_t               code_size;           // size of the first code segment
     struct Task            *p_task;
-    TaskContext            *p_task_context;
+    TaskContext            *p_task_context;     // always points to the context in trap_ctx
+    TrapContext            trap_ctx;
+    struct Task            *p_dbg_task;
+    int8_t                 dbg_signal_num;      // signal of the debugger process the target process stops with
+    uint16_t               f_stopped;           // target has stopped and waits to be resumed by resume_target()
+    LONG                   old_dbg_task_pri;    // priority of the debugger process before profiling
     uint32_t               state;
     uint32_t               exit_code;
     uint32_t               error_code;
-    struct List            bpoints;
+    // Breakpoints are indexed by address and by number with two open-addressing hash tables (with linear probing),
+    // which are allocated as one block. They always have the same number of slots.
+    Breakpoint             **pp_bpoints_by_addr;
+    Breakpoint             **pp_bpoints_by_num;
+    uint32_t               nbpoint_slots;
+    uint32_t               nbpoints;
+    BlockPool              *p_bpoint_pool;      // preallocated memory for the breakpoints
     uint32_t               next_bpoint_num;
+    uint32_t               next_internal_bpoint_num;    // see set_internal_bpoint()
+    uint32_t               run_num;             // incremented for each run, used to reset the breakpoint hit counts
     Breakpoint             *p_active_bpoint;
+    uint32_t               range_start;             // range of offsets for set_range_step_mode()
+    uint32_t               range_end;
+    uint16_t               f_step_over;             // step over subroutine calls while stepping through range?
+    uint16_t               f_running_to_return;     // running to the return address of a subroutine call?
+    uint16_t               last_range_opcode;       // opcode of the last instruction executed in the range
+    Breakpoint             *p_step_over_bpoint;     // one-shot breakpoint at the return address...
+    void                   *p_step_over_sp;         // ... only valid with this SP (see handle_breakpoint())
+    Breakpoint             *p_range_end_bpoint;     // one-shot breakpoint at the end of the range (see prepare_range_step())
+    uint16_t               f_flow_trace_supported;  // CPU can trace on change of flow?
+    uint16_t               f_flow_stepping;         // target is traced on change of flow...
+    uint16_t               f_flow_step_pending;     // ... or will be after the breakpoint has been restored
+    uint16_t               f_stopped_at_range_end;  // range step has ended at the breakpoint at the end of the range
+    RingBuffer             *p_trace_buffer;         // records written by tracepoints
+    Timer                  *p_timer;                // used for the timestamps of the trace records and for profiling
+    Profile                *p_profile;              // histogram of the PC samples of the last profiling run
+    uint16_t               f_profiling;             // sample the PC during the next / current run?
+    SyscallTracer          *p_systracer;            // records the library calls of the target
+    Watchpoint             watchpoints[MAX_WATCHPOINTS];
+    uint32_t               nwatchpoints;
+    uint32_t               next_wpoint_num;
+    uint16_t               f_watch_tracing;         // target is traced to check the watchpoints after every instruction...
+    uint16_t               f_watch_running_to_return;   // ... apart from calls of code outside of its segments...
+    Breakpoint             *p_watch_return_bpoint;  // ... which run to this one-shot breakpoint at the return address
+    void                   *p_watch_pc;             // PC when the target was resumed the last time
+    WatchpointInfo         wpoint_hit;              // watchpoint that has made the target stop with TS_STOPPED_BY_WATCHPOINT
 };
 
 
@@ -46,16 +111,42 @@ extern void exc_handler();
 
 
 static void wrap_target();
-static void handle_breakpoint(Target *p_target);
-static void handle_single_step(Target *p_target);
+static int alloc_bpoint_tables(Target *p_target, uint32_t nslots);
+static uint32_t get_bpoint_key(const Breakpoint *p_bpoint, int f_by_addr);
+static Breakpoint **find_bpoint_slot(Breakpoint **pp_table, uint32_t nslots, uint32_t key, int f_by_addr);
+static void remove_bpoint_from_table(Breakpoint **pp_table, uint32_t nslots, Breakpoint **pp_slot, int f_by_addr);
+static int is_valid_bpoint_condition(const BreakpointCondition *p_cond);
+static int check_bpoint_condition(Target *p_target, const Breakpoint *p_bpoint);
+static int handle_breakpoint(Target *p_target);
+static void resume_from_bpoint(Target *p_target, Breakpoint *p_bpoint);
+static void write_trace_record(Target *p_target, const Breakpoint *p_bpoint);
+static int handle_single_step(Target *p_target);
+static int handle_range_step(Target *p_target);
+static DbgError prepare_range_step(Target *p_target);
+static void stop_range_step(Target *p_target);
+static void prepare_continue(Target *p_target);
+static void prepare_single_step(Target *p_target);
+static DbgError step_over_call(Target *p_target, const uint16_t *p_instr, uint32_t instr_size);
+static DbgError set_internal_bpoint(Target *p_target, uint32_t offset, Breakpoint **pp_bpoint);
+static uint32_t get_call_instr_size(const uint16_t *p_instr);
+static int is_flow_instr(uint16_t opcode);
+static int handle_watchpoints(Target *p_target, int f_stop);
+static int check_watchpoints(Target *p_target);
+static void prepare_watch_step(Target *p_target);
+static void stop_watch_trace(Target *p_target);
+static int is_in_target_segments(Target *p_target, const void *p_addr);
 static void handle_exception(Target *p_target);
+static void sample_target_pc(Target *p_target);
+static void finish_run(Target *p_target);
 
 
 //
 // exported functions
 //
 
-Target *create_target()
+// This routine must be called by the debugger process because it allocates the signal the target process uses to
+// inform the debugger that it has stopped.
+Target *create_target(uint32_t target_id)
 {
     Target *p_target;
 
@@ -63,25 +154,82 @@ Target *create_target()
         LOG(ERROR, "Could not allocate memory for target object");
         return NULL;
     }
+    p_target->id = target_id;
     p_target->state = TS_IDLE;
     p_target->exit_code = -1;
-    NewList(&p_target->bpoints);
+    p_target->p_task_context = &p_target->trap_ctx.task_ctx;
+    p_target->trap_ctx.p_target = p_target;
+    p_target->p_dbg_task = FindTask(NULL);
+    if ((p_target->dbg_signal_num = AllocSignal(-1)) == -1) {
+        LOG(ERROR, "Could not allocate signal for target");
+        FreeVec(p_target);
+        return NULL;
+    }
+    if (!alloc_bpoint_tables(p_target, INITIAL_BPOINT_SLOTS)) {
+        LOG(ERROR, "Could not allocate memory for breakpoint tables");
+        goto error;
+    }
+    if ((p_target->p_bpoint_pool = create_block_pool(sizeof(Breakpoint), BPOINT_POOL_SIZE)) == NULL) {
+        LOG(ERROR, "Could not allocate memory for breakpoint pool");
+        goto error;
+    }
+    if ((p_target->p_trace_buffer = create_ring_buffer(sizeof(TraceRecord), TRACE_BUFFER_SIZE)) == NULL) {
+        LOG(ERROR, "Could not allocate memory for trace buffer");
+        goto error;
+    }
+    if ((p_target->p_timer = create_timer()) == NULL) {
+        LOG(ERROR, "Could not create timer object");
+        goto error;
+    }
+    if ((p_target->p_systracer = create_syscall_tracer(p_target->p_timer)) == NULL) {
+        LOG(ERROR, "Could not create syscall tracer object");
+        goto error;
+    }
     p_target->next_bpoint_num = 1;
+    p_target->next_internal_bpoint_num = 0xffffffff;
+    p_target->next_wpoint_num = 1;
+    // The 68060 has no trace on change of flow, but the 68060.library also sets the flags of the older CPUs.
+    p_target->f_flow_trace_supported = (SysBase->AttnFlags & AFF_68020) && !(SysBase->AttnFlags & AFF_68060);
+    LOG(DEBUG, "Trace on change of flow is %ssupported", p_target->f_flow_trace_supported ? "" : "not ");
 
     return p_target;
+
+    error:
+        if (p_target->p_timer)
+            destroy_timer(p_target->p_timer);
+        if (p_target->p_trace_buffer)
+            destroy_ring_buffer(p_target->p_trace_buffer);
+        if (p_target->p_bpoint_pool)
+            destroy_block_pool(p_target->p_bpoint_pool);
+        if (p_target->pp_bpoints_by_addr)
+            FreeVec(p_target->pp_bpoints_by_addr);
+        FreeSignal(p_target->dbg_signal_num);
+        FreeVec(p_target);
+        return NULL;
 }
 
 
 void destroy_target(Target *p_target)
 {
-    Breakpoint *p_bpoint;
+    uint32_t i;
 
+    // With several targets, the others may still be running when the debugger quits.
     if (p_target->state & TS_RUNNING)
-        DeleteTask(p_target->p_task);
+        kill_target(p_target);
     if (p_target->p_seglist);
         UnLoadSeg(p_target->p_seglist);
-    while ((p_bpoint = (Breakpoint *) RemHead(&p_target->bpoints)))
-        FreeVec(p_bpoint);
+    for (i = 0; i < p_target->nbpoint_slots; i++) {
+        if (p_target->pp_bpoints_by_num[i])
+            free_block(p_target->p_bpoint_pool, p_target->pp_bpoints_by_num[i]);
+    }
+    destroy_block_pool(p_target->p_bpoint_pool);
+    FreeVec(p_target->pp_bpoints_by_addr);
+    destroy_ring_buffer(p_target->p_trace_buffer);
+    destroy_syscall_tracer(p_target->p_systracer);
+    destroy_timer(p_target->p_timer);
+    if (p_target->p_profile)
+        FreeVec(p_target->p_profile);
+    FreeSignal(p_target->dbg_signal_num);
     FreeVec(p_target);
 }
 
@@ -93,31 +241,36 @@ DbgError load_target(Target *p_target, const char *p_program_path)
         return ERROR_LOAD_TARGET_FAILED;
     }
     p_target->p_entry_point = (uint32_t (*)()) BCPL_TO_C_PTR(p_target->p_seglist + 1);
+    // The size of a segment is stored in the dword before it and includes the size and the link to the next segment.
+    p_target->code_size = *((uint32_t *) BCPL_TO_C_PTR(p_target->p_seglist) - 1) - 8;
     return ERROR_OK;
 }
 
 
-void run_target(Target *p_target)
+// This routine starts the target and returns immediately, handle_target_signals() is called when the target has
+// stopped or terminated.
+DbgError start_target(Target *p_target)
 {
-    Breakpoint *p_bpoint;
-
-    // reset breakpoint counters for each run
-    if (!IsListEmpty(&p_target->bpoints)) {
-        for (
-            p_bpoint = (Breakpoint *) p_target->bpoints.lh_Head;
-            p_bpoint != (Breakpoint *) p_target->bpoints.lh_Tail;
-            p_bpoint = (Breakpoint *) p_bpoint->node.ln_Succ
-        )
-            p_bpoint->hit_count = 0;
-    }
+    uint32_t i;
+
+    // The breakpoint hit counts are reset for each run. Instead of walking all breakpoints, we just start a new run,
+    // and handle_breakpoint() resets the hit count of a breakpoint when it is hit for the first time in this run.
+    ++p_target->run_num;
+    // state of a previous run that has been killed while tracing on change of flow, stepping through a range or
+    // checking watchpoints
+    p_target->f_flow_stepping     = FALSE;
+    p_target->f_flow_step_pending = FALSE;
+    p_target->f_stopped           = FALSE;
+    stop_range_step(p_target);
+    stop_watch_trace(p_target);
+    // The watched memory may have changed since the last run. The target is not traced before it stops for the first
+    // time (the startup code calls the OS), so changes up to then are attributed to the entry point.
+    for (i = 0; i < p_target->nwatchpoints; i++)
+        memcpy(p_target->watchpoints[i].shadow, p_target->watchpoints[i].p_address, p_target->watchpoints[i].size);
+    p_target->p_watch_pc = p_target->p_entry_point;
 
     // TODO: support arguments for target
-    LOG(INFO, "Starting target");
-    // TODO: Since all processes share the same address space and we already access the target object in the target
-    //       process, we could replace the semaphore and the messages with signals and treat the target object as
-    //       shared data. But it seems we would have to use a signal without allocating it first as AllocSignal() can
-    //       only allocate signals for the current task. But this happens already anyway because CreatePorts() allocates
-    //       a signal for the debugger task but the port is then used for the target task.
+    LOG(INFO, "Starting target #%ld", p_target->id);
     p_target->state = TS_RUNNING;
     if ((p_target->p_task = (struct Task *) CreateNewProcTags(
         NP_Name, (uint32_t) "CWDBG_TARGET",
@@ -134,109 +287,338 @@ void run_target(Target *p_target)
         NP_Cli, TRUE
     )) == NULL) {
         LOG(CRIT, "Could not create process for target");
-        // We can't return the error code directly because in the normal case this function only returns when the
-        // target exits. But the server needs to immediately acknowledge the MSG_RUN command. So we pack the state
-        // TS_ERROR and the error code into the MSG_TARGET_STOPPED message which is sent when this function returns.
+        // The host is informed with the state TS_ERROR and the error code in the MSG_TARGET_STOPPED message, like
+        // if the target had terminated.
         p_target->state = TS_ERROR;
         p_target->error_code = ERROR_CREATE_PROC_FAILED;
-        return;
+        p_target->f_profiling = FALSE;
+        return ERROR_CREATE_PROC_FAILED;
+    }
+    // The exception handler and wrap_target() find the target via tc_TrapData, so several targets can run at once.
+    p_target->p_task->tc_TrapData = &p_target->trap_ctx;
+    // clear the signal in case a previous run has been killed after it had sent it
+    SetSignal(0, 1l << p_target->dbg_signal_num);
+
+    // Library calls are only traced if they're made by the target process (the patched functions are shared by all tasks).
+    set_traced_task(p_target->p_systracer, p_target->p_task);
+
+    // When profiling, the debugger process needs a higher priority than the target, so that it preempts the target
+    // as soon as the timer signals it. Otherwise, it would only run when the target waits or its quantum is used up.
+    if (p_target->f_profiling) {
+        LOG(INFO, "Profiling target, sampling interval = %ld us", p_target->p_profile->interval_us);
+        p_target->old_dbg_task_pri = SetTaskPri(p_target->p_dbg_task, p_target->p_task->tc_Node.ln_Pri + 1);
+        start_timer(p_target->p_timer, p_target->p_profile->interval_us);
     }
 
-    // Send signal to target process that it can start executing and then wait for a signal from it. Note that we use
-    // the signal bit without allocating it first because AllocSignal() can only allocate signals for the current task.
+    // Send signal to target process that it can start executing. Note that we use the signal bit without allocating it
+    // first because AllocSignal() can only allocate signals for the current task. wrap_target() allocates it then, so
+    // the target doesn't get it for itself.
     Signal(p_target->p_task, SYNC_SIGNAL_BIT);
-    while (TRUE) {
-        LOG(DEBUG, "Waiting for signal from target...");
-        Wait(SYNC_SIGNAL_BIT);
-        LOG(DEBUG, "Received signal from target process, target state = %d", p_target->state);
+    return ERROR_OK;
+}
 
-        // signal from wrap_target()
-        if (p_target->state == TS_EXITED) {
-            LOG(INFO, "Target terminated with exit code %d", p_target->exit_code);
-            Signal(p_target->p_task, SYNC_SIGNAL_BIT);
-            return;
-        }
-        else if (p_target->state == TS_ERROR) {
-            LOG(CRIT, "Running target failed with error code %d", p_target->error_code);
-            Signal(p_target->p_task, SYNC_SIGNAL_BIT);
-            return;
-        }
 
-        // signal from handle_stopped_target()
-        else {
-            if (p_target->state & TS_STOPPED_BY_BPOINT) {
-                handle_breakpoint(p_target);
-                process_commands(gp_dbg);
-            }
-            else if (p_target->state & TS_STOPPED_BY_SINGLE_STEP) {
-                handle_single_step(p_target);
-                if (p_target->state & TS_SINGLE_STEPPING)
-                    process_commands(gp_dbg);
-            }
-            else if (p_target->state & TS_STOPPED_BY_EXCEPTION) {
-                handle_exception(p_target);
-                process_commands(gp_dbg);
-            }
-            else {
-                LOG(CRIT, "Internal error: unknown stop reason %d", p_target->state);
-                p_target->state = TS_ERROR;
-                p_target->error_code = ERROR_UNKNOWN_STOP_REASON;
-                return;
-            }
+// This routine returns the signals of the debugger process that the target uses while it is running, the debugger
+// waits for them (unless the target has stopped) and passes the received ones to handle_target_signals().
+uint32_t get_target_signals(Target *p_target)
+{
+    if (!(p_target->state & TS_RUNNING))
+        return 0;
+    return (1l << p_target->dbg_signal_num) | (p_target->f_profiling ? get_timer_signal(p_target->p_timer) : 0);
+}
 
-            if (p_target->state == TS_KILLED)
-                // Target has been killed after it stopped and process no longer exists.
-                break;
-            else {
-                // send signal to target process that it can resume executing
-                Signal(p_target->p_task, SYNC_SIGNAL_BIT);
-            }
+
+// This routine returns TRUE if the target has stopped and waits to be resumed with resume_target().
+int is_target_stopped(Target *p_target)
+{
+    return p_target->f_stopped;
+}
+
+
+// This routine handles the signals received from the target process (and its timer when profiling). It calls one of
+// the handle_* routines below if the target has stopped, and resumes it if the user / host needn't be informed. It
+// returns TRUE if the target has stopped (and waits for resume_target()) or terminated.
+int handle_target_signals(Target *p_target, uint32_t signals)
+{
+    int f_stop;
+
+    if ((signals & get_timer_signal(p_target->p_timer)) && p_target->f_profiling && check_timer(p_target->p_timer)) {
+        sample_target_pc(p_target);
+        start_timer(p_target->p_timer, p_target->p_profile->interval_us);
+    }
+    if (!(signals & (1l << p_target->dbg_signal_num)))
+        return FALSE;
+    LOG(DEBUG, "Received signal from target process, target state = %d", p_target->state);
+
+    // signal from wrap_target()
+    if (p_target->state == TS_EXITED) {
+        LOG(INFO, "Target #%ld terminated with exit code %d", p_target->id, p_target->exit_code);
+        Signal(p_target->p_task, SYNC_SIGNAL_BIT);
+        finish_run(p_target);
+        return TRUE;
+    }
+    else if (p_target->state == TS_ERROR) {
+        LOG(CRIT, "Running target #%ld failed with error code %d", p_target->id, p_target->error_code);
+        Signal(p_target->p_task, SYNC_SIGNAL_BIT);
+        finish_run(p_target);
+        return TRUE;
+    }
+
+    // signal from handle_stopped_target()
+    if (p_target->state & TS_STOPPED_BY_BPOINT) {
+        ++g_stats.nbpoint_hits;
+        f_stop = handle_breakpoint(p_target)
+            && (!(p_target->state & TS_RANGE_STEPPING) || handle_range_step(p_target));
+    }
+    else if (p_target->state & TS_STOPPED_BY_SINGLE_STEP) {
+        ++g_stats.nstep_traps;
+        if ((f_stop = handle_single_step(p_target))) {
+            if (p_target->state & TS_RANGE_STEPPING)
+                f_stop = handle_range_step(p_target);
+            else
+                f_stop = (p_target->state & TS_SINGLE_STEPPING) != 0;
         }
     }
+    else if (p_target->state & TS_STOPPED_BY_EXCEPTION) {
+        handle_exception(p_target);
+        f_stop = TRUE;
+    }
+    else {
+        LOG(CRIT, "Internal error: unknown stop reason %d", p_target->state);
+        p_target->state = TS_ERROR;
+        p_target->error_code = ERROR_UNKNOWN_STOP_REASON;
+        finish_run(p_target);
+        return TRUE;
+    }
+    // A watchpoint can make the target stop even if it would be resumed otherwise.
+    if (handle_watchpoints(p_target, f_stop)) {
+        p_target->f_stopped = TRUE;
+        return TRUE;
+    }
+    resume_target(p_target);
+    return FALSE;
 }
 
 
+// This routine resumes the stopped target in the mode set by one of the set_*_mode() routines below.
+void resume_target(Target *p_target)
+{
+    p_target->f_stopped = FALSE;
+    p_target->state &= ~TS_STOPPED_BY_WATCHPOINT;
+    // Changes of the watched memory are attributed to the instruction the target is resumed at, or to the call while
+    // it runs to the return address (see prepare_watch_step()).
+    if (!p_target->f_watch_running_to_return)
+        p_target->p_watch_pc = p_target->p_task_context->p_reg_pc;
+    // send signal to target process that it can resume executing
+    Signal(p_target->p_task, SYNC_SIGNAL_BIT);
+}
+
+
+uint32_t get_target_id(Target *p_target)
+{
+    return p_target->id;
+}
+
+
+// If the host continues or single-steps the target, a range step that might still be in progress is aborted.
 void set_continue_mode(Target *p_target)
+{
+    stop_range_step(p_target);
+    prepare_continue(p_target);
+}
+
+
+void set_single_step_mode(Target *p_target)
+{
+    stop_range_step(p_target);
+    prepare_single_step(p_target);
+}
+
+
+// These routines are also used while stepping through a range, so they leave TS_RANGE_STEPPING as it is.
+static void prepare_continue(Target *p_target)
 {
     // If we continue from a regular breakpoint which hasn't been deleted (so p_target->p_active_bpoint still points to it),
     // it has to be restored first, so we single-step the original instruction at the breakpoint and remember to
     // restore the breakpoint afterwards (see handle_single_step() below).
-    p_target->state &= ~TS_SINGLE_STEPPING;
+    p_target->state &= ~(TS_SINGLE_STEPPING | TS_STOPPED_AFTER_RETURN);
+    p_target->f_flow_stepping        = FALSE;
+    p_target->f_flow_step_pending    = FALSE;
+    p_target->f_stopped_at_range_end = FALSE;
+    p_target->p_task_context->reg_sr &= ~SR_T0;
     if ((p_target->state & TS_STOPPED_BY_BPOINT) && p_target->p_active_bpoint) {
-        p_target->p_task_context->reg_sr &= 0xbfff;    // clear T0
-        p_target->p_task_context->reg_sr |= 0x8700;    // set T1 and interrupt mask
+        p_target->p_task_context->reg_sr |= SR_T1 | SR_INT_MASK;
     }
+    // While there are watchpoints, the target is traced so they can be checked after every instruction (but not while
+    // it runs to the return address of a subroutine call when stepping through a range).
+    p_target->f_watch_tracing = (p_target->nwatchpoints > 0) && !(p_target->state & TS_RANGE_STEPPING);
+    if (p_target->f_watch_tracing)
+        prepare_watch_step(p_target);
 }
 
 
-void set_single_step_mode(Target *p_target)
+static void prepare_single_step(Target *p_target)
 {
+    p_target->state &= ~TS_STOPPED_AFTER_RETURN;
     p_target->state |= TS_SINGLE_STEPPING;
+    p_target->f_flow_stepping        = FALSE;
+    p_target->f_stopped_at_range_end = FALSE;
+    p_target->f_watch_tracing        = FALSE;
     // In trace mode, *all* interrupts must be disabled (except for the NMI), otherwise OS code could be executed while
     // the trace bit is still set, which would cause the OS exception handler (an alert) to be executed instead of ours
-    // => value 0x8700 is ORed with the SR.
-    p_target->p_task_context->reg_sr &= 0xbfff;    // clear T0
-    p_target->p_task_context->reg_sr |= 0x8700;    // set T1 and interrupt mask
+    // => the interrupt mask is set together with T1.
+    p_target->p_task_context->reg_sr &= ~SR_T0;
+    p_target->p_task_context->reg_sr |= SR_T1 | SR_INT_MASK;
+}
+
+
+// This routine lets the target execute until the next instruction that changes the flow (branch, jump, subroutine
+// call or return) has been executed, using the trace on change of flow (T0) of the 68020 - 68040. Like with single
+// steps, the target stops with TS_STOPPED_BY_SINGLE_STEP. If the target is stopped at a regular breakpoint, the
+// original instruction is single-stepped first so the breakpoint can be restored (see handle_single_step()).
+DbgError set_flow_step_mode(Target *p_target)
+{
+    if (!p_target->f_flow_trace_supported) {
+        LOG(ERROR, "CPU doesn't support trace on change of flow");
+        return ERROR_NO_FLOW_TRACE;
+    }
+    if ((p_target->state & TS_STOPPED_BY_BPOINT) && p_target->p_active_bpoint) {
+        prepare_single_step(p_target);
+        // If the instruction at the breakpoint changes the flow itself, the single step is all we need to do.
+        p_target->f_flow_step_pending = !is_flow_instr(p_target->p_active_bpoint->opcode);
+        return ERROR_OK;
+    }
+    p_target->state &= ~TS_STOPPED_AFTER_RETURN;
+    p_target->state |= TS_SINGLE_STEPPING;
+    p_target->f_flow_stepping        = TRUE;
+    p_target->f_flow_step_pending    = FALSE;
+    p_target->f_stopped_at_range_end = FALSE;
+    p_target->f_watch_tracing        = FALSE;
+    // interrupts need to be disabled as in prepare_single_step()
+    p_target->p_task_context->reg_sr &= ~SR_T1;
+    p_target->p_task_context->reg_sr |= SR_T0 | SR_INT_MASK;
+    return ERROR_OK;
 }
 
 
-DbgError set_breakpoint(Target *p_target, uint32_t offset, uint16_t f_is_one_shot)
+// This routine prepares the next run of the target (with start_target()) as profiling run, which samples the PC of the
+// target every interval_us microseconds and counts the samples in a histogram with bins of 2^bin_shift bytes of the
+// first code segment. The bin size is increased if the segment needs more than MAX_PROFILE_BINS bins. The target is
+// not stopped for sampling, so breakpoints can still be used.
+DbgError set_profile_mode(Target *p_target, uint32_t interval_us, uint16_t bin_shift)
+{
+    uint32_t nbins;
+
+    if (!p_target->p_seglist) {
+        LOG(ERROR, "Target has not been loaded");
+        return ERROR_LOAD_TARGET_FAILED;
+    }
+    if ((interval_us < MIN_PROFILE_INTERVAL) || (interval_us > MAX_PROFILE_INTERVAL) || (bin_shift > 16)) {
+        LOG(ERROR, "Invalid sampling interval %ld us or bin shift %d", interval_us, bin_shift);
+        return ERROR_BAD_DATA;
+    }
+    while ((nbins = (p_target->code_size >> bin_shift) + 1) > MAX_PROFILE_BINS)
+        ++bin_shift;
+    if (p_target->p_profile)
+        FreeVec(p_target->p_profile);
+    if ((p_target->p_profile = AllocVec(sizeof(Profile) + nbins * sizeof(uint32_t), MEMF_CLEAR)) == NULL) {
+        LOG(ERROR, "Could not allocate memory for profile");
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    p_target->p_profile->interval_us = interval_us;
+    p_target->p_profile->bin_shift   = bin_shift;
+    p_target->p_profile->nbins       = nbins;
+    p_target->f_profiling            = TRUE;
+    LOG(DEBUG, "Profile has %ld bins with %ld bytes each", nbins, 1l << bin_shift);
+    return ERROR_OK;
+}
+
+
+// This routine returns the profile of the last profiling run or NULL if there is none.
+const Profile *get_profile(Target *p_target)
+{
+    return p_target->p_profile;
+}
+
+
+// This routine lets the target execute until the PC leaves the range [start_offset, end_offset) (relative to the entry
+// point). Instructions in the range are single-stepped, but subroutine calls are stepped over if requested by setting
+// a one-shot breakpoint on the return address and running the target until it is hit. This way, the host gets only
+// one MSG_TARGET_STOPPED message for a complete source line. If the PC leaves the range because of an RTS, the
+// target state also contains TS_STOPPED_AFTER_RETURN, so the host can step through the rest of the calling line.
+DbgError set_range_step_mode(Target *p_target, uint32_t start_offset, uint32_t end_offset, uint16_t f_step_over)
+{
+    DbgError dbg_errno;
+
+    p_target->range_start         = start_offset;
+    p_target->range_end           = end_offset;
+    p_target->f_step_over         = f_step_over;
+    p_target->f_running_to_return = FALSE;
+    p_target->last_range_opcode   = 0;
+    // The flag must already be set for prepare_range_step(), so prepare_continue() doesn't trace the target for the
+    // watchpoints while it steps over a subroutine call.
+    p_target->state |= TS_RANGE_STEPPING;
+    if ((dbg_errno = prepare_range_step(p_target)) != ERROR_OK) {
+        p_target->state &= ~TS_RANGE_STEPPING;
+        return dbg_errno;
+    }
+    return ERROR_OK;
+}
+
+
+// The register mask is only used for tracepoints, bit n selects register n (numbered as for conditions).
+DbgError set_breakpoint(
+    Target *p_target,
+    uint32_t offset,
+    uint16_t type,
+    const BreakpointCondition *p_cond,
+    uint16_t trace_reg_mask
+)
 {
     Breakpoint *p_bpoint;
     void       *p_baddr;
 
+    if (type > BPOINT_TYPE_TRACE) {
+        LOG(ERROR, "Invalid type %d for breakpoint at entry + 0x%08lx", type, offset);
+        return ERROR_BAD_DATA;
+    }
+    if (p_cond && !is_valid_bpoint_condition(p_cond)) {
+        LOG(ERROR, "Invalid condition for breakpoint at entry + 0x%08lx", offset);
+        return ERROR_BAD_DATA;
+    }
+
     // TODO: Check if offset is valid
-    if ((p_bpoint = AllocVec(sizeof(Breakpoint), 0)) == NULL) {
+    p_baddr = (void *) ((uint32_t) p_target->p_entry_point) + offset;
+    if (find_bpoint_by_addr(p_target, p_baddr) != NULL) {
+        // We would save the trap instruction of the existing breakpoint as original opcode otherwise.
+        LOG(ERROR, "There is already a breakpoint at entry + 0x%08lx", offset);
+        return ERROR_INVALID_ADDRESS;
+    }
+    // We keep the load factor of the tables at 50% at the most, otherwise the probe sequences get too long.
+    if ((p_target->nbpoints + 1) * 2 > p_target->nbpoint_slots) {
+        if (!alloc_bpoint_tables(p_target, p_target->nbpoint_slots * 2)) {
+            LOG(ERROR, "Could not allocate memory for breakpoint tables");
+            return ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+    if ((p_bpoint = alloc_block(p_target->p_bpoint_pool)) == NULL) {
         LOG(ERROR, "Could not allocate memory for breakpoint");
         return ERROR_NOT_ENOUGH_MEMORY;
     }
-    p_baddr = (void *) ((uint32_t) p_target->p_entry_point) + offset;
-    p_bpoint->num           = p_target->next_bpoint_num++;
-    p_bpoint->p_address     = p_baddr;
-    p_bpoint->opcode        = *((uint16_t *) p_baddr);
-    p_bpoint->f_is_one_shot = f_is_one_shot;
-    p_bpoint->hit_count     = 0;
-    AddTail(&p_target->bpoints, (struct Node *) p_bpoint);
+    p_bpoint->num            = p_target->next_bpoint_num++;
+    p_bpoint->p_address      = p_baddr;
+    p_bpoint->opcode         = *((uint16_t *) p_baddr);
+    p_bpoint->type           = type;
+    p_bpoint->trace_reg_mask = trace_reg_mask;
+    p_bpoint->hit_count      = 0;
+    p_bpoint->run_num        = p_target->run_num;
+    if (p_cond)
+        p_bpoint->cond = *p_cond;
+    else
+        memset(&p_bpoint->cond, 0, sizeof(BreakpointCondition));
+    *find_bpoint_slot(p_target->pp_bpoints_by_addr, p_target->nbpoint_slots, (uint32_t) p_baddr, TRUE) = p_bpoint;
+    *find_bpoint_slot(p_target->pp_bpoints_by_num, p_target->nbpoint_slots, p_bpoint->num, FALSE) = p_bpoint;
+    ++p_target->nbpoints;
     *((uint16_t *) p_baddr) = TRAP_OPCODE;
     LOG(DEBUG, "Breakpoint #%ld at entry + 0x%08lx set", p_bpoint->num, offset);
     return ERROR_OK;
@@ -247,59 +629,124 @@ DbgError set_breakpoint(Target *p_target, uint32_t offset, uint16_t f_is_one_sho
 void clear_breakpoint(Target *p_target, Breakpoint *p_bpoint)
 {
     *((uint16_t *) p_bpoint->p_address) = p_bpoint->opcode;
-    Remove((struct Node *) p_bpoint);
+    remove_bpoint_from_table(
+        p_target->pp_bpoints_by_addr,
+        p_target->nbpoint_slots,
+        find_bpoint_slot(p_target->pp_bpoints_by_addr, p_target->nbpoint_slots, (uint32_t) p_bpoint->p_address, TRUE),
+        TRUE
+    );
+    remove_bpoint_from_table(
+        p_target->pp_bpoints_by_num,
+        p_target->nbpoint_slots,
+        find_bpoint_slot(p_target->pp_bpoints_by_num, p_target->nbpoint_slots, p_bpoint->num, FALSE),
+        FALSE
+    );
+    --p_target->nbpoints;
     if (p_target->p_active_bpoint == p_bpoint)
         p_target->p_active_bpoint = NULL;
+    if (p_target->p_step_over_bpoint == p_bpoint)
+        p_target->p_step_over_bpoint = NULL;
+    if (p_target->p_range_end_bpoint == p_bpoint)
+        p_target->p_range_end_bpoint = NULL;
+    if (p_target->p_watch_return_bpoint == p_bpoint)
+        p_target->p_watch_return_bpoint = NULL;
     LOG(
         DEBUG,
         "Breakpoint #%ld at entry + 0x%08lx cleared",
         p_bpoint->num,
         ((uint32_t) p_bpoint->p_address - (uint32_t) p_target->p_entry_point)
     );
-    FreeVec(p_bpoint);
+    free_block(p_target->p_bpoint_pool, p_bpoint);
 }
 
 
 Breakpoint *find_bpoint_by_addr(Target *p_target, void *p_bp_addr)
 {
-    Breakpoint *p_bpoint;
-
-    if (IsListEmpty(&p_target->bpoints))
-        return NULL;
-    for (p_bpoint = (Breakpoint *) p_target->bpoints.lh_Head;
-         p_bpoint != (Breakpoint *) p_target->bpoints.lh_Tail;
-         p_bpoint = (Breakpoint *) p_bpoint->node.ln_Succ) {
-        if (p_bpoint->p_address == p_bp_addr)
-            return p_bpoint;
-    }
-    return NULL;
+    return *find_bpoint_slot(p_target->pp_bpoints_by_addr, p_target->nbpoint_slots, (uint32_t) p_bp_addr, TRUE);
 }
 
 
 Breakpoint *find_bpoint_by_num(Target *p_target, uint32_t bp_num)
 {
-    Breakpoint *p_bpoint;
+    return *find_bpoint_slot(p_target->pp_bpoints_by_num, p_target->nbpoint_slots, bp_num, FALSE);
+}
 
-    if (IsListEmpty(&p_target->bpoints))
-        return NULL;
-    for (p_bpoint = (Breakpoint *) p_target->bpoints.lh_Head;
-         p_bpoint != (Breakpoint *) p_target->bpoints.lh_Tail;
-         p_bpoint = (Breakpoint *) p_bpoint->node.ln_Succ) {
-        if (p_bpoint->num == bp_num)
-            return p_bpoint;
+
+// Watchpoints are numbered independently of the breakpoints. The memory below the target's stack pointer can't be
+// watched because the exception handler uses this part of the stack whenever the target stops. We can only check
+// this while the target has stopped (before it has been started, its stack doesn't even exist).
+DbgError set_watchpoint(Target *p_target, void *p_address, uint32_t size, uint32_t *p_wpoint_num)
+{
+    Watchpoint *p_wpoint;
+    uint32_t   i;
+
+    if ((size == 0) || (size > MAX_WATCH_SIZE)) {
+        LOG(ERROR, "Invalid size %ld for watchpoint, must be between 1 and %d", size, MAX_WATCH_SIZE);
+        return ERROR_BAD_DATA;
+    }
+    if ((uint32_t) p_address > 0xffffffff - size) {
+        LOG(ERROR, "Invalid address 0x%08lx for watchpoint", p_address);
+        return ERROR_INVALID_ADDRESS;
+    }
+    for (i = 0; i < sizeof(g_io_mem_ranges) / sizeof(g_io_mem_ranges[0]); i++) {
+        if (((uint32_t) p_address + size > g_io_mem_ranges[i][0]) && ((uint32_t) p_address < g_io_mem_ranges[i][1])) {
+            LOG(ERROR, "Watchpoint at 0x%08lx overlaps with the CIAs, the custom chips or the autoconfig area", p_address);
+            return ERROR_INVALID_ADDRESS;
+        }
     }
-    return NULL;
+    if ((p_target->state & TS_RUNNING) && p_target->f_stopped
+        && ((uint8_t *) p_address + size > (uint8_t *) p_target->p_task->tc_SPLower)
+        && ((uint8_t *) p_address < (uint8_t *) p_target->p_task_context->p_reg_sp)) {
+        LOG(ERROR, "Watchpoint at 0x%08lx is below the stack pointer of the target", p_address);
+        return ERROR_BAD_DATA;
+    }
+    if (p_target->nwatchpoints == MAX_WATCHPOINTS) {
+        LOG(ERROR, "Can't set more than %d watchpoints", MAX_WATCHPOINTS);
+        return ERROR_TOO_MANY_WATCHPOINTS;
+    }
+    p_wpoint = &p_target->watchpoints[p_target->nwatchpoints++];
+    p_wpoint->num       = p_target->next_wpoint_num++;
+    p_wpoint->p_address = p_address;
+    p_wpoint->size      = size;
+    memcpy(p_wpoint->shadow, p_address, size);
+    *p_wpoint_num = p_wpoint->num;
+    LOG(DEBUG, "Watchpoint #%ld at 0x%08lx (%ld bytes) set", p_wpoint->num, p_address, size);
+    return ERROR_OK;
+}
+
+
+DbgError clear_watchpoint(Target *p_target, uint32_t wpoint_num)
+{
+    uint32_t i;
+
+    for (i = 0; i < p_target->nwatchpoints; i++) {
+        if (p_target->watchpoints[i].num == wpoint_num) {
+            // The order of the watchpoints doesn't matter, so we just move the last one into the gap.
+            p_target->watchpoints[i] = p_target->watchpoints[--p_target->nwatchpoints];
+            LOG(DEBUG, "Watchpoint #%ld cleared", wpoint_num);
+            return ERROR_OK;
+        }
+    }
+    LOG(ERROR, "Watchpoint #%ld not found", wpoint_num);
+    return ERROR_UNKNOWN_WATCHPOINT;
 }
 
 
 void get_target_info(Target *p_target, TargetInfo *p_target_info)
 {
+    // The context is only filled in if the target has stopped, so we don't leave anything of a previous call behind.
+    memset(p_target_info, 0, sizeof(TargetInfo));
+    p_target_info->target_id    = p_target->id;
     p_target_info->p_initial_pc = p_target->p_entry_point;
-    p_target_info->p_initial_sp = p_target->p_task->tc_SPUpper - 2;
+    p_target_info->p_initial_sp = p_target->p_task ? p_target->p_task->tc_SPUpper - 2 : NULL;
     p_target_info->state        = p_target->state;
     p_target_info->exit_code    = p_target->exit_code;
     p_target_info->error_code   = p_target->error_code;
-    if (p_target->state & TS_RUNNING) {
+    if ((p_target->state & TS_RUNNING) && !p_target->f_stopped) {
+        // The target is running (or has stopped but the debugger hasn't handled it yet), so its context is not valid.
+        p_target_info->state = TS_RUNNING;
+    }
+    else if (p_target->state & TS_RUNNING) {
         // target is still running, add task context, next n instructions and top n dwords on the stack
         memcpy(&p_target_info->task_context, p_target->p_task_context, sizeof(TaskContext));
         if ((uint32_t) p_target->p_task_context->p_reg_pc <= (0xffffffff - NUM_NEXT_INSTRUCTIONS * MAX_INSTR_BYTES)) {
@@ -316,11 +763,100 @@ void get_target_info(Target *p_target, TargetInfo *p_target_info)
                 p_target_info->bpoint.hit_count = p_target->p_active_bpoint->hit_count;
             }
             else {
+                // The breakpoint at the end of a range is an implementation detail of set_range_step_mode(), so the
+                // host sees the same state as if the target had been single-stepped out of the range. The same goes
+                // for the breakpoint at the return address of a library call when tracing for the watchpoints.
                 p_target_info->state &= ~TS_STOPPED_BY_BPOINT;
-                p_target_info->state |= TS_STOPPED_BY_ONE_SHOT_BPOINT;
+                if (!(p_target->state & TS_STOPPED_BY_WATCHPOINT))
+                    p_target_info->state |= p_target->f_stopped_at_range_end ? TS_STOPPED_BY_SINGLE_STEP : TS_STOPPED_BY_ONE_SHOT_BPOINT;
             }
         }
+        if (p_target->state & TS_STOPPED_BY_WATCHPOINT)
+            memcpy(&p_target_info->wpoint, &p_target->wpoint_hit, sizeof(WatchpointInfo));
+    }
+}
+
+
+// This routine follows the chain of frame pointers (A5, set up by the LINK instruction at the beginning of each
+// function) and stores the frames in the array. It stops after max_frames frames, at the initial frame or if a frame
+// pointer does not point into the target's stack (e. g. because a function doesn't use A5 as frame pointer). Each
+// frame pointer must also be above the previous one because the stack grows downwards. It returns the number of
+// frames found.
+uint32_t get_call_stack(Target *p_target, StackFrameInfo *p_frames, uint32_t max_frames)
+{
+    uint32_t *p_frame_ptr, *p_prev_frame_ptr = NULL;
+    void     *p_pc;
+    uint32_t nframes = 0;
+
+    if (!(p_target->state & TS_RUNNING))
+        return 0;
+    p_frame_ptr = (uint32_t *) p_target->p_task_context->reg_a[5];
+    p_pc        = p_target->p_task_context->p_reg_pc;
+    while ((nframes < max_frames) && ((uint32_t) p_frame_ptr != 0xffffffff)) {
+        if (((uint32_t) p_frame_ptr & 1)
+            || ((void *) p_frame_ptr < p_target->p_task_context->p_reg_sp)
+            || ((void *) p_frame_ptr < p_target->p_task->tc_SPLower)
+            || ((void *) (p_frame_ptr + 2) > p_target->p_task->tc_SPUpper)
+            || (p_frame_ptr <= p_prev_frame_ptr)) {
+            LOG(DEBUG, "Frame pointer 0x%08lx is invalid, stopping at frame #%ld", p_frame_ptr, nframes);
+            break;
+        }
+        // previous frame pointer is stored at the address pointed to by the current frame pointer, return address
+        // is at current frame pointer + 4
+        p_frames[nframes].p_frame_ptr   = p_frame_ptr;
+        p_frames[nframes].p_pc          = p_pc;
+        p_frames[nframes].p_return_addr = (void *) p_frame_ptr[1];
+        p_pc             = (void *) p_frame_ptr[1];
+        p_prev_frame_ptr = p_frame_ptr;
+        p_frame_ptr      = (uint32_t *) p_frame_ptr[0];
+        nframes++;
+    }
+    return nframes;
+}
+
+
+// This routine stores address and size of the target's segments in the array, in the order of the seglist (which is
+// the order of the hunks in the executable). It stops after max_segments segments and returns the number of segments
+// found.
+uint32_t get_segments(Target *p_target, SegmentInfo *p_segments, uint32_t max_segments)
+{
+    BPTR     p_seg;
+    uint32_t nsegs = 0;
+
+    for (p_seg = p_target->p_seglist; p_seg && (nsegs < max_segments); p_seg = *((BPTR *) BCPL_TO_C_PTR(p_seg))) {
+        // see load_target() for the layout of a segment
+        p_segments[nsegs].p_address = (uint8_t *) BCPL_TO_C_PTR(p_seg) + 4;
+        p_segments[nsegs].size      = *((uint32_t *) BCPL_TO_C_PTR(p_seg) - 1) - 8;
+        nsegs++;
     }
+    return nsegs;
+}
+
+
+// This routine moves the oldest trace record into the caller's buffer, it returns FALSE if there is none.
+int read_trace_record(Target *p_target, TraceRecord *p_record)
+{
+    return get_elem_from_ring_buffer(p_target->p_trace_buffer, p_record) == DOSTRUE;
+}
+
+
+void get_trace_buffer_info(Target *p_target, TraceBufferInfo *p_info)
+{
+    p_info->nrecords    = p_target->p_trace_buffer->count;
+    p_info->noverruns   = p_target->p_trace_buffer->noverruns;
+    p_info->eclock_freq = p_target->p_timer->eclock_freq;
+}
+
+
+struct SyscallTracer *get_syscall_tracer(Target *p_target)
+{
+    return p_target->p_systracer;
+}
+
+
+struct Timer *get_target_timer(Target *p_target)
+{
+    return p_target->p_timer;
 }
 
 
@@ -332,27 +868,33 @@ void kill_target(Target *p_target)
     Forbid();
     RemTask(p_target->p_task);
     Permit();
-    LOG(INFO, "Target has been killed");
+    p_target->f_stopped = FALSE;
+    // remove the internal breakpoints of a range step / watchpoint check in progress
+    stop_range_step(p_target);
+    stop_watch_trace(p_target);
+    finish_run(p_target);
+    LOG(INFO, "Target #%ld has been killed", p_target->id);
 }
 
 
 // This routine is the entry point into the debugger called by the exception handler in the context of the target process.
 // It sends sends a signal to the debugger process, informing it that the target has stopped. This signal is received
-// by run_target() which then calls one of the handle_* routines below (in the context of the debugger process).
+// by the debugger, which then calls handle_target_signals() (in the context of the debugger process).
 // This routine is necessary because an exception handler runs in supervisor mode and therefore can't use Signal() and
 // Wait(). It has to run in the context of the target process so that Wait() blocks the target until the user requests
-// to continue it. Note that it accesses the global variable gp_dbg, which is possible because all processes share the
-// same address space in AmigaOS (the same goes for wrap_target() below).
-void handle_stopped_target(uint32_t stop_reason, TaskContext *p_task_context)
+// to continue it. Note that it accesses the target object of the debugger, which is possible because all processes
+// share the same address space in AmigaOS (the same goes for wrap_target() below).
+void handle_stopped_target(uint32_t stop_reason, TrapContext *p_trap_ctx)
 {
+    Target *p_target = p_trap_ctx->p_target;
+
     LOG(DEBUG, "handle_stopped_target() has been called, stop reason = %d", stop_reason);
-    gp_dbg->p_target->state |= stop_reason;
-    gp_dbg->p_target->p_task_context = p_task_context;
+    p_target->state |= stop_reason;
     LOG(DEBUG, "Sending signal to debugger process");
-    Signal(gp_dbg->p_task, SYNC_SIGNAL_BIT);
+    Signal(p_target->p_dbg_task, 1l << p_target->dbg_signal_num);
     Wait(SYNC_SIGNAL_BIT);
     LOG(DEBUG, "Received signal from debugger process - resuming target");
-    gp_dbg->p_target->state &= ~stop_reason;
+    p_target->state &= ~stop_reason;
 }
 
 
@@ -360,48 +902,53 @@ void handle_stopped_target(uint32_t stop_reason, TaskContext *p_task_context)
 // local routines
 //
 
-// This routine is the entry point for the target process (used by run_target() when creating the target process).
+// This routine is the entry point for the target process (used by start_target() when creating the target process).
 static void wrap_target()
 {
-    int result;
+    Target *p_target;
+    int    result;
 
-    // wait for signal from debugger process that we can start executing
+    // wait for signal from debugger process that we can start executing, it has set tc_TrapData before
     Wait(SYNC_SIGNAL_BIT);
+    p_target = ((TrapContext *) FindTask(NULL)->tc_TrapData)->p_target;
+    if (AllocSignal(SYNC_SIGNAL_NUM) == -1)
+        LOG(WARN, "Could not allocate signal for synchronizing with debugger process");
 
     // install exception handler
-    gp_dbg->p_target->p_task->tc_TrapCode = exc_handler;
+    p_target->p_task->tc_TrapCode = exc_handler;
 
     // allocate traps
     if (AllocTrap(TRAP_NUM_BPOINT) == -1) {
         LOG(CRIT, "Internal error: could not allocate trap for breakpoints");
-        gp_dbg->p_target->state = TS_ERROR;
-        gp_dbg->p_target->error_code = ERROR_NO_TRAP;
+        p_target->state = TS_ERROR;
+        p_target->error_code = ERROR_NO_TRAP;
         goto send_signal;
     }
     if (AllocTrap(TRAP_NUM_RESTORE) == -1) {
         LOG(CRIT, "Internal error: could not allocate trap for restoring the task context");
-        gp_dbg->p_target->state = TS_ERROR;
-        gp_dbg->p_target->error_code = ERROR_NO_TRAP;
+        p_target->state = TS_ERROR;
+        p_target->error_code = ERROR_NO_TRAP;
         goto send_signal;
     }
 
     LOG(
         DEBUG,
-        "Running target, initial PC = 0x%08lx, initial SP = 0x%08lx",
-        gp_dbg->p_target->p_entry_point,
-        (uint32_t) gp_dbg->p_target->p_task->tc_SPUpper - 2
+        "Running target #%ld, initial PC = 0x%08lx, initial SP = 0x%08lx",
+        p_target->id,
+        p_target->p_entry_point,
+        (uint32_t) p_target->p_task->tc_SPUpper - 2
     );
     // We need to use RunCommand() instead of just calling the entry point if we specify NP_Cli in CreateNewProcTags(),
     // otherwise we get a crash. The argument string (3rd argument) has to be terminated by a newline character.
-    if ((result = RunCommand(gp_dbg->p_target->p_seglist, TARGET_STACK_SIZE, "\n", 1)) == -1) {
+    if ((result = RunCommand(p_target->p_seglist, TARGET_STACK_SIZE, "\n", 1)) == -1) {
         LOG(CRIT, "Running target with RunCommand() failed");
-        gp_dbg->p_target->state = TS_ERROR;
-        gp_dbg->p_target->error_code = ERROR_RUN_COMMAND_FAILED;
+        p_target->state = TS_ERROR;
+        p_target->error_code = ERROR_RUN_COMMAND_FAILED;
         goto send_signal;
     }
     else {
-        gp_dbg->p_target->state = TS_EXITED;
-        gp_dbg->p_target->exit_code = (uint32_t) result;
+        p_target->state = TS_EXITED;
+        p_target->exit_code = (uint32_t) result;
         goto send_signal;
     }
 
@@ -409,28 +956,185 @@ static void wrap_target()
     // signal from it before we exit
     send_signal:
         LOG(DEBUG, "Sending signal to debugger process");
-        Signal(gp_dbg->p_task, SYNC_SIGNAL_BIT);
+        Signal(p_target->p_dbg_task, 1l << p_target->dbg_signal_num);
         Wait(SYNC_SIGNAL_BIT);
         LOG(DEBUG, "Received signal from debugger process - exiting target");
 }
 
 
-static void handle_breakpoint(Target *p_target)
+// This routine (re-)allocates the breakpoint tables with the given number of slots and moves the existing
+// breakpoints to the new tables. It returns FALSE if there is not enough memory, the old tables are kept in this case.
+static int alloc_bpoint_tables(Target *p_target, uint32_t nslots)
+{
+    Breakpoint **pp_tables, *p_bpoint;
+    uint32_t   i;
+
+    if ((pp_tables = AllocVec(nslots * 2 * sizeof(Breakpoint *), MEMF_CLEAR)) == NULL)
+        return FALSE;
+    for (i = 0; i < p_target->nbpoint_slots; i++) {
+        if ((p_bpoint = p_target->pp_bpoints_by_num[i]) != NULL) {
+            *find_bpoint_slot(pp_tables, nslots, (uint32_t) p_bpoint->p_address, TRUE) = p_bpoint;
+            *find_bpoint_slot(pp_tables + nslots, nslots, p_bpoint->num, FALSE) = p_bpoint;
+        }
+    }
+    if (p_target->pp_bpoints_by_addr)
+        FreeVec(p_target->pp_bpoints_by_addr);
+    p_target->pp_bpoints_by_addr = pp_tables;
+    p_target->pp_bpoints_by_num  = pp_tables + nslots;
+    p_target->nbpoint_slots      = nslots;
+    return TRUE;
+}
+
+
+static uint32_t get_bpoint_key(const Breakpoint *p_bpoint, int f_by_addr)
+{
+    return f_by_addr ? (uint32_t) p_bpoint->p_address : p_bpoint->num;
+}
+
+
+// The hash functions avoid multiplications as they are slow on a 68000. Addresses are always even, and breakpoint
+// numbers are consecutive and therefore already spread well. The number of slots must be a power of 2.
+#define BPOINT_SLOT_MASK(nslots)           ((nslots) - 1)
+#define BPOINT_HOME_SLOT(key, f_by_addr, nslots) \
+    (((f_by_addr) ? (((key) >> 1) ^ ((key) >> 11)) : (key)) & BPOINT_SLOT_MASK(nslots))
+
+// This routine returns the slot containing the breakpoint with the given key or, if there is no such breakpoint,
+// the empty slot where it would have to be inserted.
+static Breakpoint **find_bpoint_slot(Breakpoint **pp_table, uint32_t nslots, uint32_t key, int f_by_addr)
+{
+    uint32_t i = BPOINT_HOME_SLOT(key, f_by_addr, nslots);
+
+    while (pp_table[i] && (get_bpoint_key(pp_table[i], f_by_addr) != key))
+        i = (i + 1) & BPOINT_SLOT_MASK(nslots);
+    return &pp_table[i];
+}
+
+
+// This routine empties the slot and moves following breakpoints of the same probe sequence back (backward-shift
+// deletion), so we don't need tombstones and lookups don't get slower over time.
+static void remove_bpoint_from_table(Breakpoint **pp_table, uint32_t nslots, Breakpoint **pp_slot, int f_by_addr)
+{
+    uint32_t i = pp_slot - pp_table, j = i, home;
+
+    pp_table[i] = NULL;
+    while (TRUE) {
+        j = (j + 1) & BPOINT_SLOT_MASK(nslots);
+        if (pp_table[j] == NULL)
+            return;
+        // The breakpoint in slot j can only be moved to slot i if its home slot is not (cyclically) in (i, j].
+        home = BPOINT_HOME_SLOT(get_bpoint_key(pp_table[j], f_by_addr), f_by_addr, nslots);
+        if ((i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j)))
+            continue;
+        pp_table[i] = pp_table[j];
+        pp_table[j] = NULL;
+        i = j;
+    }
+}
+
+
+static int is_valid_bpoint_condition(const BreakpointCondition *p_cond)
+{
+    if ((p_cond->type > BPOINT_COND_MEM) || (p_cond->op >= NUM_COND_OPS) || (p_cond->reg_num >= NUM_COND_REGS))
+        return FALSE;
+    if ((p_cond->size != 1) && (p_cond->size != 2) && (p_cond->size != 4))
+        return FALSE;
+    // The 68000 raises an address error for word / dword accesses at odd addresses.
+    if ((p_cond->type == BPOINT_COND_MEM) && (p_cond->size > 1) && ((uint32_t) p_cond->p_address & 1))
+        return FALSE;
+    return TRUE;
+}
+
+
+// This routine returns TRUE if the target should stop at the breakpoint. For register compares, the operand is the
+// lower byte / word of the register if the size is 1 or 2.
+static int check_bpoint_condition(Target *p_target, const Breakpoint *p_bpoint)
+{
+    const BreakpointCondition *p_cond = &p_bpoint->cond;
+    uint32_t                  operand;
+
+    if (p_bpoint->hit_count <= p_cond->ignore_count)
+        return FALSE;
+    if (p_cond->type == BPOINT_COND_NONE)
+        return TRUE;
+
+    if (p_cond->type == BPOINT_COND_REG) {
+        if (p_cond->reg_num < 8)
+            operand = p_target->p_task_context->reg_d[p_cond->reg_num];
+        else if (p_cond->reg_num < 15)
+            operand = p_target->p_task_context->reg_a[p_cond->reg_num - 8];
+        else
+            operand = (uint32_t) p_target->p_task_context->p_reg_sp;
+        if (p_cond->size == 1)
+            operand &= 0xff;
+        else if (p_cond->size == 2)
+            operand &= 0xffff;
+    }
+    else {
+        if (p_cond->size == 1)
+            operand = *((uint8_t *) p_cond->p_address);
+        else if (p_cond->size == 2)
+            operand = *((uint16_t *) p_cond->p_address);
+        else
+            operand = *((uint32_t *) p_cond->p_address);
+    }
+
+    switch (p_cond->op) {
+        case COND_OP_EQ: return operand == p_cond->value;
+        case COND_OP_NE: return operand != p_cond->value;
+        case COND_OP_LT: return operand <  p_cond->value;
+        case COND_OP_LE: return operand <= p_cond->value;
+        case COND_OP_GT: return operand >  p_cond->value;
+        default:         return operand >= p_cond->value;
+    }
+}
+
+
+// This routine returns TRUE if the target should stop and the host be informed, FALSE if the condition of the
+// breakpoint is false and the target should just be resumed.
+static int handle_breakpoint(Target *p_target)
 {
     Breakpoint *p_bpoint;
     void       *p_baddr;
 
     p_baddr = p_target->p_task_context->p_reg_pc - 2;
     if ((p_bpoint = find_bpoint_by_addr(p_target, p_baddr)) != NULL) {
-        if (!p_bpoint->f_is_one_shot)
-            // set pointer to active breakpoint only if the hit breakpoint is a regular one
-            // to indicate that it needs to be restored (see set_continue_mode() and handle_single_step())
-            p_target->p_active_bpoint = p_bpoint;
-
         // rewind PC by 2 bytes and replace trap instruction with original instruction
         p_target->p_task_context->p_reg_pc = p_baddr;
         *((uint16_t *) p_baddr) = p_bpoint->opcode;
+        if (p_bpoint->run_num != p_target->run_num) {
+            // first hit in this run
+            p_bpoint->hit_count = 0;
+            p_bpoint->run_num   = p_target->run_num;
+        }
         ++p_bpoint->hit_count;
+
+        // In recursive functions, the breakpoint on the return address can be hit by a call in a deeper stack frame
+        // (the stack grows downwards), so we keep running until the call we're stepping over returns.
+        if ((p_bpoint == p_target->p_step_over_bpoint) && (p_target->p_task_context->p_reg_sp < p_target->p_step_over_sp)) {
+            LOG(DEBUG, "Return address has been hit in deeper stack frame, resuming target");
+            resume_from_bpoint(p_target, p_bpoint);
+            return FALSE;
+        }
+        if (!check_bpoint_condition(p_target, p_bpoint)) {
+            LOG(
+                DEBUG,
+                "Condition of breakpoint #%ld not met (hit count = %ld), resuming target",
+                p_bpoint->num,
+                p_bpoint->hit_count
+            );
+            resume_from_bpoint(p_target, p_bpoint);
+            return FALSE;
+        }
+        if (p_bpoint->type == BPOINT_TYPE_TRACE) {
+            write_trace_record(p_target, p_bpoint);
+            resume_from_bpoint(p_target, p_bpoint);
+            return FALSE;
+        }
+
+        if (p_bpoint->type == BPOINT_TYPE_REGULAR)
+            // set pointer to active breakpoint only if the hit breakpoint is a regular one
+            // to indicate that it needs to be restored (see prepare_continue() and handle_single_step())
+            p_target->p_active_bpoint = p_bpoint;
         LOG(
             INFO,
             "Target has hit breakpoint #%ld at entry + 0x%08lx, hit count = %ld", 
@@ -438,6 +1142,9 @@ static void handle_breakpoint(Target *p_target)
             ((uint32_t) p_baddr - (uint32_t) p_target->p_entry_point),
             p_bpoint->hit_count
         );
+        // one-shot breakpoints are no longer needed once they have been hit
+        if (p_bpoint->type == BPOINT_TYPE_ONE_SHOT)
+            clear_breakpoint(p_target, p_bpoint);
     }
     else {
         LOG(
@@ -446,10 +1153,52 @@ static void handle_breakpoint(Target *p_target)
             ((uint32_t) p_baddr - (uint32_t) p_target->p_entry_point)
         );
     }
+    return TRUE;
 }
 
 
-static void handle_single_step(Target *p_target)
+// This routine resumes the target without informing the host in the mode it was running in. In both modes, the
+// original instruction is single-stepped first and the breakpoint restored afterwards by handle_single_step(), like
+// when continuing from a breakpoint (this also applies to one-shot breakpoints, which are kept).
+static void resume_from_bpoint(Target *p_target, Breakpoint *p_bpoint)
+{
+    p_target->p_active_bpoint = p_bpoint;
+    if (p_target->f_flow_stepping)
+        set_flow_step_mode(p_target);
+    else if (p_target->state & TS_SINGLE_STEPPING)
+        prepare_single_step(p_target);
+    else
+        prepare_continue(p_target);
+}
+
+
+static void write_trace_record(Target *p_target, const Breakpoint *p_bpoint)
+{
+    TraceRecord record;
+    uint32_t    i, nregs = 0;
+
+    record.bpoint_num = p_bpoint->num;
+    record.p_pc       = p_target->p_task_context->p_reg_pc;
+    record.reg_mask   = p_bpoint->trace_reg_mask;
+    read_timestamp(p_target->p_timer, &record.ts_hi, &record.ts_lo);
+    for (i = 0; i < NUM_TRACE_REGS; i++) {
+        if (!(record.reg_mask & (1 << i)))
+            continue;
+        if (i < 8)
+            record.regs[nregs++] = p_target->p_task_context->reg_d[i];
+        else if (i < 15)
+            record.regs[nregs++] = p_target->p_task_context->reg_a[i - 8];
+        else
+            record.regs[nregs++] = (uint32_t) p_target->p_task_context->p_reg_sp;
+    }
+    if (put_elem_into_ring_buffer(p_target->p_trace_buffer, &record) == DOSFALSE)
+        LOG(DEBUG, "Trace buffer is full, dropped record for tracepoint #%ld", p_bpoint->num);
+}
+
+
+// This routine returns FALSE if the target has only been single-stepped to restore a breakpoint before tracing it on
+// change of flow, and should just be resumed.
+static int handle_single_step(Target *p_target)
 {
     if (p_target->p_active_bpoint) {
         // breakpoint needs to be restored
@@ -462,15 +1211,384 @@ static void handle_single_step(Target *p_target)
         *((uint16_t *) p_target->p_active_bpoint->p_address) = TRAP_OPCODE;
         p_target->p_active_bpoint = NULL;
     }
+    if (p_target->f_flow_step_pending) {
+        // While stepping through a range, handle_range_step() decides how to go on.
+        p_target->f_flow_step_pending = FALSE;
+        if (!(p_target->state & TS_RANGE_STEPPING)) {
+            set_flow_step_mode(p_target);
+            return FALSE;
+        }
+    }
     if (p_target->state & TS_SINGLE_STEPPING) {
-        LOG(INFO, "Target has stopped after single step");
+        LOG(INFO, "Target has stopped after %s", p_target->f_flow_stepping ? "change of flow" : "single step");
+    }
+    return TRUE;
+}
+
+
+// This routine is called by handle_target_signals() whenever the target stops while stepping through a range and decides how to
+// go on. It returns TRUE if the target should stop and the host be informed, FALSE if it should just be resumed.
+static int handle_range_step(Target *p_target)
+{
+    uint32_t offset = (uint32_t) p_target->p_task_context->p_reg_pc - (uint32_t) p_target->p_entry_point;
+    uint32_t instr_size;
+
+    if (p_target->state & TS_STOPPED_BY_BPOINT) {
+        p_target->f_running_to_return = FALSE;
+        // If we've hit a regular breakpoint or a breakpoint other than the one at the return address, we stop. The
+        // one-shot breakpoint at the return address has already been deleted by handle_breakpoint().
+        if (p_target->p_active_bpoint || p_target->p_step_over_bpoint) {
+            LOG(INFO, "Target has hit breakpoint while stepping through range");
+            stop_range_step(p_target);
+            return TRUE;
+        }
+    }
+    else if (p_target->f_running_to_return) {
+        // We've only single-stepped to restore a breakpoint, so we keep running until the return address is reached.
+        return FALSE;
+    }
+    else if (p_target->f_flow_stepping) {
+        // The instruction that has changed the flow is the last one executed in the range. If it was a subroutine
+        // call that should be stepped over, we run to its return address.
+        p_target->last_range_opcode = *p_target->trap_ctx.p_flow_instr;
+        if (((offset < p_target->range_start) || (offset >= p_target->range_end))
+            && p_target->f_step_over
+            && ((instr_size = get_call_instr_size(p_target->trap_ctx.p_flow_instr)) > 0)) {
+            if (step_over_call(p_target, p_target->trap_ctx.p_flow_instr, instr_size) != ERROR_OK) {
+                stop_range_step(p_target);
+                return TRUE;
+            }
+            return FALSE;
+        }
+    }
+
+    if ((offset < p_target->range_start) || (offset >= p_target->range_end)) {
+        LOG(INFO, "Target has left range at entry + 0x%08lx", offset);
+        if (p_target->last_range_opcode == RTS_OPCODE)
+            p_target->state |= TS_STOPPED_AFTER_RETURN;
+        if ((p_target->state & TS_STOPPED_BY_BPOINT) && (offset == p_target->range_end))
+            p_target->f_stopped_at_range_end = TRUE;
+        stop_range_step(p_target);
+        return TRUE;
+    }
+    if (prepare_range_step(p_target) != ERROR_OK) {
+        stop_range_step(p_target);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+
+// This routine looks at the next instruction in the range and either sets a breakpoint on the return address (if the
+// instruction is a subroutine call that should be stepped over) or steps it. On CPUs that can trace on change of flow,
+// the target is only traced on change of flow instead of single-stepping every instruction. This doesn't stop the
+// target if it leaves the range at its end without a branch, so we set a one-shot breakpoint there. We only do this
+// if the end of the range is word-aligned because it must be the start of an instruction (the host passes the start
+// of the next line, or an odd end to step just one instruction).
+static DbgError prepare_range_step(Target *p_target)
+{
+    uint16_t *p_instr = (uint16_t *) p_target->p_task_context->p_reg_pc;
+    uint8_t  *p_range_end = (uint8_t *) p_target->p_entry_point + p_target->range_end;
+    uint32_t instr_size;
+
+    p_target->last_range_opcode = *p_instr;
+    if (p_target->f_step_over && ((instr_size = get_call_instr_size(p_instr)) > 0))
+        return step_over_call(p_target, p_instr, instr_size);
+    if (p_target->f_flow_trace_supported && !(p_target->range_end & 1)) {
+        if ((p_target->p_range_end_bpoint == NULL) && (find_bpoint_by_addr(p_target, p_range_end) == NULL)) {
+            if (set_internal_bpoint(p_target, p_target->range_end, &p_target->p_range_end_bpoint) != ERROR_OK) {
+                LOG(WARN, "Could not set breakpoint on end of range entry + 0x%08lx, single-stepping instead", p_target->range_end);
+                prepare_single_step(p_target);
+                return ERROR_OK;
+            }
+        }
+        return set_flow_step_mode(p_target);
+    }
+    prepare_single_step(p_target);
+    return ERROR_OK;
+}
+
+
+// This routine sets a one-shot breakpoint on the return address of the subroutine call and lets the target run until
+// it is hit.
+static DbgError step_over_call(Target *p_target, const uint16_t *p_instr, uint32_t instr_size)
+{
+    uint32_t ret_offset = (uint32_t) p_instr + instr_size - (uint32_t) p_target->p_entry_point;
+    DbgError dbg_errno;
+
+    // If there is already a breakpoint on the return address, the target will stop there anyway. When the call has
+    // returned, the SP is the same as before the call (if the target has already executed the call when tracing on
+    // change of flow, the return address has been pushed since).
+    p_target->p_step_over_sp = (uint8_t *) p_target->p_task_context->p_reg_sp
+                               + (((uint16_t *) p_target->p_task_context->p_reg_pc != p_instr) ? 4 : 0);
+    if (find_bpoint_by_addr(p_target, (uint8_t *) p_instr + instr_size) == NULL) {
+        if ((dbg_errno = set_internal_bpoint(p_target, ret_offset, &p_target->p_step_over_bpoint)) != ERROR_OK) {
+            LOG(ERROR, "Could not set breakpoint on return address entry + 0x%08lx", ret_offset);
+            return dbg_errno;
+        }
+    }
+    LOG(DEBUG, "Stepping over subroutine call, return address = entry + 0x%08lx", ret_offset);
+    p_target->f_running_to_return = TRUE;
+    prepare_continue(p_target);
+    return ERROR_OK;
+}
+
+
+// This routine sets a one-shot breakpoint for stepping through a range. Such breakpoints are numbered downwards from
+// the highest number, so they don't use up the numbers of the breakpoints set by the host (which expects them to be
+// numbered consecutively).
+static DbgError set_internal_bpoint(Target *p_target, uint32_t offset, Breakpoint **pp_bpoint)
+{
+    uint32_t next_bpoint_num = p_target->next_bpoint_num;
+    DbgError dbg_errno;
+
+    p_target->next_bpoint_num = p_target->next_internal_bpoint_num;
+    if ((dbg_errno = set_breakpoint(p_target, offset, BPOINT_TYPE_ONE_SHOT, NULL, 0)) == ERROR_OK) {
+        --p_target->next_internal_bpoint_num;
+        *pp_bpoint = find_bpoint_by_addr(p_target, (uint8_t *) p_target->p_entry_point + offset);
+    }
+    p_target->next_bpoint_num = next_bpoint_num;
+    return dbg_errno;
+}
+
+
+static void stop_range_step(Target *p_target)
+{
+    p_target->state &= ~TS_RANGE_STEPPING;
+    p_target->f_running_to_return = FALSE;
+    if (p_target->p_step_over_bpoint)
+        clear_breakpoint(p_target, p_target->p_step_over_bpoint);
+    if (p_target->p_range_end_bpoint)
+        clear_breakpoint(p_target, p_target->p_range_end_bpoint);
+}
+
+
+// This routine returns the size of the instruction if it is a JSR or BSR and 0 otherwise, see Motorola's M68000 Family
+// Programmer's Reference Manual for the encodings.
+static uint32_t get_call_instr_size(const uint16_t *p_instr)
+{
+    uint16_t opcode = *p_instr;
+
+    if ((opcode & 0xffc0) == 0x4e80) {
+        // JSR, size depends on the addressing mode of the effective address
+        switch ((opcode >> 3) & 7) {
+            case 2:                             // (An)
+                return 2;
+            case 5:                             // d16(An)
+            case 6:                             // d8(An, Xn), only brief extension word supported
+                return 4;
+            case 7:
+                switch (opcode & 7) {
+                    case 0:                     // abs.W
+                    case 2:                     // d16(PC)
+                    case 3:                     // d8(PC, Xn)
+                        return 4;
+                    case 1:                     // abs.L
+                        return 6;
+                }
+        }
+    }
+    else if ((opcode & 0xff00) == 0x6100) {
+        // BSR, size depends on the displacement
+        if ((opcode & 0xff) == 0)
+            return 4;                           // 16-bit displacement
+        else if ((opcode & 0xff) == 0xff)
+            return 6;                           // 32-bit displacement (68020 and up)
+        else
+            return 2;                           // 8-bit displacement
+    }
+    return 0;
+}
+
+
+// This routine returns TRUE if the instruction can change the flow and therefore causes a trace exception when tracing
+// on change of flow (Bcc, BRA, BSR, DBcc, JMP, JSR, RTS, RTE, RTR, RTD and TRAP).
+static int is_flow_instr(uint16_t opcode)
+{
+    return ((opcode & 0xf000) == 0x6000)        // Bcc, BRA, BSR
+        || ((opcode & 0xf0f8) == 0x50c8)        // DBcc
+        || ((opcode & 0xff80) == 0x4e80)        // JSR, JMP
+        || ((opcode & 0xfff0) == 0x4e40)        // TRAP
+        || (opcode == 0x4e73)                   // RTE
+        || (opcode == 0x4e74)                   // RTD
+        || (opcode == RTS_OPCODE)
+        || (opcode == 0x4e77);                  // RTR
+}
+
+
+// This routine is called by handle_target_signals() whenever the target has stopped, after the other handle_* routines have
+// decided if it should stop (f_stop). It makes the target also stop if the memory of a watchpoint has changed. It
+// returns TRUE if the target should stop and the host be informed.
+static int handle_watchpoints(Target *p_target, int f_stop)
+{
+    if ((p_target->state & TS_STOPPED_BY_BPOINT)
+        && p_target->f_watch_running_to_return
+        && (p_target->p_watch_return_bpoint == NULL)) {
+        // The call has returned, handle_breakpoint() has already deleted the one-shot breakpoint.
+        p_target->f_watch_running_to_return = FALSE;
+        f_stop = FALSE;
+    }
+    if (check_watchpoints(p_target)) {
+        // The host must not continue with stepping through the range after the target has returned.
+        p_target->state |= TS_STOPPED_BY_WATCHPOINT;
+        p_target->state &= ~TS_STOPPED_AFTER_RETURN;
+        if (p_target->state & TS_RANGE_STEPPING)
+            stop_range_step(p_target);
+        f_stop = TRUE;
+    }
+    if (f_stop)
+        stop_watch_trace(p_target);
+    else if (p_target->f_watch_tracing)
+        prepare_watch_step(p_target);
+    return f_stop;
+}
+
+
+// This routine updates the copies of the watched memory and returns TRUE if it has changed. Only the first
+// watchpoint that has changed is reported to the host.
+static int check_watchpoints(Target *p_target)
+{
+    Watchpoint *p_wpoint;
+    uint32_t   i;
+    int        f_changed = FALSE;
+
+    for (i = 0; i < p_target->nwatchpoints; i++) {
+        p_wpoint = &p_target->watchpoints[i];
+        if (memcmp(p_wpoint->p_address, p_wpoint->shadow, p_wpoint->size) == 0)
+            continue;
+        memcpy(p_wpoint->shadow, p_wpoint->p_address, p_wpoint->size);
+        if (!f_changed) {
+            p_target->wpoint_hit.num       = p_wpoint->num;
+            p_target->wpoint_hit.p_address = p_wpoint->p_address;
+            p_target->wpoint_hit.p_pc      = p_target->p_watch_pc;
+            LOG(
+                INFO,
+                "Watchpoint #%ld at 0x%08lx has been changed by instruction at 0x%08lx",
+                p_wpoint->num,
+                p_wpoint->p_address,
+                p_target->p_watch_pc
+            );
+            f_changed = TRUE;
+        }
+    }
+    return f_changed;
+}
+
+
+// This routine prepares the next step while the target is traced for the watchpoints. Only the target's own code is
+// traced, code outside of its segments (usually a library function) would take very long to trace, and the OS must
+// not run with the interrupts disabled. If the target has just called such code, it runs to the return address at
+// full speed, and changes made by the call are found when it has returned. Otherwise (e. g. if the target returns to
+// the OS when it exits), we stop tracing it.
+static void prepare_watch_step(Target *p_target)
+{
+    uint8_t *p_ret_addr;
+
+    if (is_in_target_segments(p_target, p_target->p_task_context->p_reg_pc)) {
+        // interrupts need to be disabled as in prepare_single_step()
+        p_target->p_task_context->reg_sr &= ~SR_T0;
+        p_target->p_task_context->reg_sr |= SR_T1 | SR_INT_MASK;
+        return;
+    }
+    p_target->p_task_context->reg_sr &= ~(SR_T1 | SR_T0 | SR_INT_MASK);
+    // The return address is on top of the stack after a JSR, and also after a JMP into a library (as used by the stubs
+    // of link libraries), which leaves the return address of the stub's caller there.
+    p_ret_addr = *((uint8_t **) p_target->p_task_context->p_reg_sp);
+    if (((uint32_t) p_ret_addr & 1) || !is_in_target_segments(p_target, p_ret_addr)) {
+        LOG(
+            DEBUG,
+            "Target has left its code at 0x%08lx, watchpoints are only checked when it stops",
+            p_target->p_task_context->p_reg_pc
+        );
+        p_target->f_watch_tracing = FALSE;
+        return;
+    }
+    // If there is already a breakpoint at the return address, the target will stop there anyway.
+    if (find_bpoint_by_addr(p_target, p_ret_addr) == NULL) {
+        if (set_internal_bpoint(
+            p_target,
+            (uint32_t) p_ret_addr - (uint32_t) p_target->p_entry_point,
+            &p_target->p_watch_return_bpoint
+        ) != ERROR_OK) {
+            LOG(WARN, "Could not set breakpoint on return address 0x%08lx, watchpoints are only checked when target stops", p_ret_addr);
+            p_target->f_watch_tracing = FALSE;
+            return;
+        }
+        p_target->f_watch_running_to_return = TRUE;
+    }
+}
+
+
+static void stop_watch_trace(Target *p_target)
+{
+    p_target->f_watch_tracing           = FALSE;
+    p_target->f_watch_running_to_return = FALSE;
+    if (p_target->p_watch_return_bpoint)
+        clear_breakpoint(p_target, p_target->p_watch_return_bpoint);
+}
+
+
+// see get_segments() for the layout of the segments
+static int is_in_target_segments(Target *p_target, const void *p_addr)
+{
+    BPTR    p_seg;
+    uint8_t *p_start;
+
+    for (p_seg = p_target->p_seglist; p_seg; p_seg = *((BPTR *) BCPL_TO_C_PTR(p_seg))) {
+        p_start = (uint8_t *) BCPL_TO_C_PTR(p_seg) + 4;
+        if (((const uint8_t *) p_addr >= p_start)
+            && ((const uint8_t *) p_addr < p_start + *((uint32_t *) BCPL_TO_C_PTR(p_seg) - 1) - 8))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+// This routine cleans up after the target has terminated or has been killed.
+static void finish_run(Target *p_target)
+{
+    set_traced_task(p_target->p_systracer, NULL);
+    if (p_target->f_profiling) {
+        stop_timer(p_target->p_timer);
+        SetTaskPri(p_target->p_dbg_task, p_target->old_dbg_task_pri);
+        p_target->f_profiling = FALSE;
+        LOG(
+            INFO,
+            "Profiling finished, %ld samples (%ld while waiting, %ld outside of code segment)",
+            p_target->p_profile->nsamples,
+            p_target->p_profile->nsamples_waiting,
+            p_target->p_profile->nsamples_outside
+        );
+    }
+}
+
+
+// This routine is called by handle_target_signals() in the context of the debugger process, which has a higher priority than the
+// target, so the target has been preempted (or is waiting) and its PC has been saved on its stack by exec.
+static void sample_target_pc(Target *p_target)
+{
+    Profile  *p_profile = p_target->p_profile;
+    uint32_t offset;
+
+    ++p_profile->nsamples;
+    if (p_target->p_task->tc_State == TS_WAIT) {
+        ++p_profile->nsamples_waiting;
+        return;
     }
+    // addresses before the entry point become very large offsets
+    offset = *((uint32_t *) ((uint8_t *) p_target->p_task->tc_SPReg + SAVED_PC_OFFSET)) - (uint32_t) p_target->p_entry_point;
+    if (offset < p_target->code_size)
+        ++p_profile->bins[offset >> p_profile->bin_shift];
+    else
+        ++p_profile->nsamples_outside;
 }
 
 
 static void handle_exception(Target *p_target)
 {
-    // unhandled exception occurred
+    // unhandled exception occurred, the host can't go on with stepping through a range or checking the watchpoints
+    stop_range_step(p_target);
+    stop_watch_trace(p_target);
     LOG(
         INFO,
         "Unhandled exception #%ld occurred at entry + 0x%08lx",
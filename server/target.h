@@ -24,12 +24,24 @@ typedef enum {
     ERROR_NO_TRAP                = 7,
     ERROR_RUN_COMMAND_FAILED     = 8,
     ERROR_BAD_DATA               = 9,
-    ERROR_OPEN_LIB_FAILED        = 10
+    ERROR_OPEN_LIB_FAILED        = 10,
+    ERROR_PROTO_VERSION_MISMATCH = 11,
+    ERROR_NO_PROFILE             = 12,
+    ERROR_BAD_CHECKSUM           = 13,
+    ERROR_NO_FLOW_TRACE          = 14,
+    ERROR_UNKNOWN_WATCHPOINT     = 15,
+    ERROR_TOO_MANY_WATCHPOINTS   = 16,
+    ERROR_UNKNOWN_TARGET         = 17
 } DbgError;
 
 #define NUM_NEXT_INSTRUCTIONS 8
 #define NUM_TOP_STACK_DWORDS  8
 #define MAX_INSTR_BYTES       8
+#define MAX_CALL_STACK_DEPTH  64
+#define MAX_PROFILE_BINS      4096
+#define MAX_SEGMENTS          64
+#define MAX_WATCHPOINTS       8
+#define MAX_WATCH_SIZE        16
 
 //
 // target states
@@ -44,7 +56,39 @@ typedef enum {
 #define TS_STOPPED_BY_ONE_SHOT_BPOINT   (1l << 5)
 #define TS_STOPPED_BY_SINGLE_STEP       (1l << 6)
 #define TS_STOPPED_BY_EXCEPTION         (1l << 7)
+#define TS_RANGE_STEPPING               (1l << 8)
+#define TS_STOPPED_AFTER_RETURN         (1l << 9)
+#define TS_STOPPED_BY_WATCHPOINT        (1l << 10)
 #define TS_ERROR                        (1l << 16)
+// one of these flags is set while a running target has stopped and waits to be resumed by the user / host
+#define TS_STOPPED                      (TS_STOPPED_BY_BPOINT | TS_STOPPED_BY_ONE_SHOT_BPOINT | TS_STOPPED_BY_SINGLE_STEP | TS_STOPPED_BY_EXCEPTION | TS_STOPPED_BY_WATCHPOINT)
+
+//
+// breakpoint conditions (keep in sync with server.py)
+//
+#define BPOINT_COND_NONE                0       // only the ignore count is checked
+#define BPOINT_COND_REG                 1       // compare register with value
+#define BPOINT_COND_MEM                 2       // compare memory location with value
+
+// Registers are numbered D0-D7 = 0-7, A0-A6 = 8-14 and SP = 15, all comparisons are unsigned.
+#define COND_OP_EQ                      0
+#define COND_OP_NE                      1
+#define COND_OP_LT                      2
+#define COND_OP_LE                      3
+#define COND_OP_GT                      4
+#define COND_OP_GE                      5
+#define NUM_COND_OPS                    6
+#define NUM_COND_REGS                   16
+
+//
+// breakpoint types (keep in sync with server.py)
+//
+#define BPOINT_TYPE_REGULAR             0
+#define BPOINT_TYPE_ONE_SHOT            1       // deleted after it has been hit (used to step over subroutines)
+#define BPOINT_TYPE_TRACE               2       // writes a trace record and resumes the target
+
+// Tracepoints record the registers selected by their register mask, numbered as for conditions.
+#define NUM_TRACE_REGS                  16
 
 
 //
@@ -60,15 +104,46 @@ typedef struct TaskContext {
     uint32_t reg_a[7];                  // without A7 = SP
 } TaskContext;
 
+// Each target has its own context for the exception handler, which finds it via tc_TrapData of the target process
+// (keep in sync with exc-handler.s).
+typedef struct TrapContext {
+    TaskContext  task_ctx;
+    uint32_t     stop_reason;
+    uint16_t     *p_flow_instr;         // address of the instruction that caused the last trace on change of flow
+    Target       *p_target;
+} TrapContext;
+
+// The condition is compiled by the host and evaluated by the server every time the breakpoint is hit, so the target
+// only stops if the condition is true and the hit count is greater than the ignore count.
+typedef struct BreakpointCondition {
+    uint8_t      type;                  // one of the BPOINT_COND_* values
+    uint8_t      op;                    // one of the COND_OP_* values
+    uint8_t      reg_num;               // register for BPOINT_COND_REG
+    uint8_t      size;                  // size of the operand in bytes (1, 2 or 4)
+    void         *p_address;            // memory location for BPOINT_COND_MEM
+    uint32_t     value;                 // value to compare the operand with
+    uint32_t     ignore_count;          // number of hits to ignore
+} BreakpointCondition;
+
 typedef struct Breakpoint {
-    struct Node  node;
     uint32_t     num;
     void         *p_address;            // address in code segment
     uint16_t     opcode;                // original opcode at this address
-    uint16_t     f_is_one_shot;         // one-shot breakpoint (used to step over subroutines)?
-    uint32_t     hit_count;             // number of times it has been hit
+    uint16_t     type;                  // one of the BPOINT_TYPE_* values
+    uint16_t     trace_reg_mask;        // registers recorded by a tracepoint
+    uint32_t     hit_count;             // number of times it has been hit...
+    uint32_t     run_num;               // ... in this run of the target (reset lazily for each run)
+    BreakpointCondition cond;
 } Breakpoint;
 
+// A watchpoint is checked by comparing the watched memory with a copy of it, see handle_watchpoints() in target.c.
+typedef struct Watchpoint {
+    uint32_t     num;
+    uint8_t      *p_address;
+    uint32_t     size;
+    uint8_t      shadow[MAX_WATCH_SIZE];    // contents of the watched memory at the last check
+} Watchpoint;
+
 // The *Info type are used to provide information to the host without exposing the internal data structures
 // used by the server.
 typedef struct BreakpointInfo {
@@ -78,7 +153,51 @@ typedef struct BreakpointInfo {
     uint32_t     hit_count;
 } BreakpointInfo;
 
+typedef struct WatchpointInfo {
+    uint32_t     num;
+    void         *p_address;
+    void         *p_pc;                 // address of the instruction that has changed the watched memory
+} WatchpointInfo;
+
+typedef struct TraceRecord {
+    uint32_t     bpoint_num;
+    void         *p_pc;
+    uint32_t     ts_hi;                 // value of the E clock when the tracepoint was hit
+    uint32_t     ts_lo;
+    uint16_t     reg_mask;
+    uint32_t     regs[NUM_TRACE_REGS];  // registers selected by reg_mask, in ascending order of their numbers
+} TraceRecord;
+
+typedef struct TraceBufferInfo {
+    uint32_t     nrecords;              // number of records not yet read
+    uint32_t     noverruns;             // number of records dropped because the buffer was full
+    uint32_t     eclock_freq;           // frequency of the E clock used for the timestamps
+} TraceBufferInfo;
+
+// The profile is sent to the host as it is, so it only contains dwords (keep in sync with server.py).
+typedef struct Profile {
+    uint32_t     interval_us;           // sampling interval
+    uint32_t     bin_shift;             // each bin covers 2^bin_shift bytes of the first code segment
+    uint32_t     nsamples;
+    uint32_t     nsamples_waiting;      // number of samples when the target was waiting (e. g. for IO)
+    uint32_t     nsamples_outside;      // number of samples with the PC outside of the first code segment
+    uint32_t     nbins;
+    uint32_t     bins[];
+} Profile;
+
+typedef struct StackFrameInfo {
+    void         *p_frame_ptr;
+    void         *p_pc;
+    void         *p_return_addr;
+} StackFrameInfo;
+
+typedef struct SegmentInfo {
+    void         *p_address;            // address of the segment's content (after size and link to the next segment)
+    uint32_t     size;                  // size of the content
+} SegmentInfo;
+
 typedef struct TargetInfo {
+    uint32_t        target_id;
     void            *p_initial_pc;
     void            *p_initial_sp;
     TaskContext     task_context;
@@ -90,24 +209,48 @@ typedef struct TargetInfo {
     // top n dwords on the stack
     uint32_t        top_stack_dwords[NUM_TOP_STACK_DWORDS];
     BreakpointInfo  bpoint;
+    WatchpointInfo  wpoint;             // only valid with TS_STOPPED_BY_WATCHPOINT
 } TargetInfo;
 
 
 //
 // exported functions
 //
-Target *create_target();
+Target *create_target(uint32_t target_id);
 void destroy_target(Target *p_target);
 DbgError load_target(Target *p_target, const char *p_program_path);
-void run_target(Target *p_target);
+DbgError start_target(Target *p_target);
+uint32_t get_target_signals(Target *p_target);
+int is_target_stopped(Target *p_target);
+int handle_target_signals(Target *p_target, uint32_t signals);
+void resume_target(Target *p_target);
+uint32_t get_target_id(Target *p_target);
 void set_continue_mode(Target *p_target);
 void set_single_step_mode(Target *p_target);
-DbgError set_breakpoint(Target *p_target, uint32_t offset, uint16_t f_is_one_shot);
+DbgError set_flow_step_mode(Target *p_target);
+DbgError set_profile_mode(Target *p_target, uint32_t interval_us, uint16_t bin_shift);
+const Profile *get_profile(Target *p_target);
+DbgError set_range_step_mode(Target *p_target, uint32_t start_offset, uint32_t end_offset, uint16_t f_step_over);
+DbgError set_breakpoint(
+    Target *p_target,
+    uint32_t offset,
+    uint16_t type,
+    const BreakpointCondition *p_cond,
+    uint16_t trace_reg_mask
+);
 void clear_breakpoint(Target *p_target, Breakpoint *p_bpoint);
 Breakpoint *find_bpoint_by_addr(Target *p_target, void *p_baddr);
 Breakpoint *find_bpoint_by_num(Target *p_target, uint32_t bp_num);
 void get_target_info(Target *p_target, TargetInfo *p_target_info);
+uint32_t get_call_stack(Target *p_target, StackFrameInfo *p_frames, uint32_t max_frames);
+uint32_t get_segments(Target *p_target, SegmentInfo *p_segments, uint32_t max_segments);
+int read_trace_record(Target *p_target, TraceRecord *p_record);
+void get_trace_buffer_info(Target *p_target, TraceBufferInfo *p_info);
+DbgError set_watchpoint(Target *p_target, void *p_address, uint32_t size, uint32_t *p_wpoint_num);
+DbgError clear_watchpoint(Target *p_target, uint32_t wpoint_num);
+struct SyscallTracer *get_syscall_tracer(Target *p_target);
+struct Timer *get_target_timer(Target *p_target);
 void kill_target(Target *p_target);
-void handle_stopped_target(uint32_t stop_reason, TaskContext *p_task_ctx);
+void handle_stopped_target(uint32_t stop_reason, TrapContext *p_trap_ctx);
 
 #endif  // CWDBG_TARGET_H
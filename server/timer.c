@@ -0,0 +1,126 @@
+//
+// timer.c - part of cwdbg, a debugger for the AmigaOS
+//           This file contains the routines for the timer device.
+//
+// Copyright(C) 2018-2022 Constantin Wiemer
+//
+
+
+#include <devices/timer.h>
+#include <exec/io.h>
+#include <proto/alib.h>
+#include <proto/exec.h>
+#include <proto/timer.h>
+
+#include "stdint.h"
+#include "timer.h"
+#include "util.h"
+
+
+// base address of the timer device, needed by ReadEClock()
+struct Device *TimerBase;
+
+
+//
+// exported routines
+//
+
+Timer *create_timer()
+{
+    Timer           *p_timer;
+    struct EClockVal ev;
+
+    if ((p_timer = AllocVec(sizeof(Timer), MEMF_CLEAR)) == NULL) {
+        LOG(CRIT, "Could not allocate memory for timer object");
+        return NULL;
+    }
+    if ((p_timer->p_port = CreateMsgPort()) == NULL) {
+        LOG(CRIT, "Could not create message port for timer device");
+        FreeVec(p_timer);
+        return NULL;
+    }
+    if ((p_timer->p_io_request = (struct timerequest *) CreateExtIO(p_timer->p_port, sizeof(struct timerequest))) == NULL) {
+        LOG(CRIT, "Could not create IO request for timer device");
+        DeleteMsgPort(p_timer->p_port);
+        FreeVec(p_timer);
+        return NULL;
+    }
+    if (OpenDevice("timer.device", UNIT_ECLOCK, (struct IORequest *) p_timer->p_io_request, 0l) != 0) {
+        LOG(CRIT, "Could not open timer device");
+        DeleteExtIO((struct IORequest *) p_timer->p_io_request);
+        DeleteMsgPort(p_timer->p_port);
+        FreeVec(p_timer);
+        return NULL;
+    }
+    TimerBase = p_timer->p_io_request->tr_node.io_Device;
+    p_timer->eclock_freq = ReadEClock(&ev);
+    LOG(DEBUG, "Opened timer device, E clock frequency = %ld Hz", p_timer->eclock_freq);
+    return p_timer;
+}
+
+
+void destroy_timer(Timer *p_timer)
+{
+    stop_timer(p_timer);
+    LOG(DEBUG, "Closing timer device");
+    CloseDevice((struct IORequest *) p_timer->p_io_request);
+    DeleteExtIO((struct IORequest *) p_timer->p_io_request);
+    DeleteMsgPort(p_timer->p_port);
+    FreeVec(p_timer);
+}
+
+
+// This routine returns the current value of the E clock as timestamp. ReadEClock() is cheap (it doesn't need an IO
+// request) and can be called from any task, so it can also be used while handling breakpoints.
+void read_timestamp(Timer *p_timer, uint32_t *p_ts_hi, uint32_t *p_ts_lo)
+{
+    struct EClockVal ev;
+
+    ReadEClock(&ev);
+    *p_ts_hi = ev.ev_hi;
+    *p_ts_lo = ev.ev_lo;
+}
+
+
+// The timer signals the task that created it (via the signal bit of its message port) when the interval has elapsed.
+uint32_t get_timer_signal(Timer *p_timer)
+{
+    return 1l << p_timer->p_port->mp_SigBit;
+}
+
+
+// This routine starts the timer asynchronously. The E clock unit expects the interval as number of E clock ticks in
+// tr_time, so we convert it, dividing by 1000 twice to avoid an overflow (set_profile_mode() limits the interval to
+// one second).
+void start_timer(Timer *p_timer, uint32_t interval_us)
+{
+    if (p_timer->f_request_pending)
+        return;
+    p_timer->p_io_request->tr_node.io_Command = TR_ADDREQUEST;
+    p_timer->p_io_request->tr_time.tv_secs    = 0;
+    p_timer->p_io_request->tr_time.tv_micro   = (p_timer->eclock_freq / 1000) * interval_us / 1000;
+    SendIO((struct IORequest *) p_timer->p_io_request);
+    p_timer->f_request_pending = TRUE;
+}
+
+
+// This routine returns TRUE if the interval has elapsed. The timer then needs to be started again.
+int check_timer(Timer *p_timer)
+{
+    if (p_timer->f_request_pending && CheckIO((struct IORequest *) p_timer->p_io_request)) {
+        WaitIO((struct IORequest *) p_timer->p_io_request);
+        p_timer->f_request_pending = FALSE;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+
+void stop_timer(Timer *p_timer)
+{
+    if (p_timer->f_request_pending) {
+        AbortIO((struct IORequest *) p_timer->p_io_request);
+        WaitIO((struct IORequest *) p_timer->p_io_request);
+        p_timer->f_request_pending = FALSE;
+    }
+}
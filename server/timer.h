@@ -0,0 +1,35 @@
+#ifndef CWDBG_TIMER_H
+#define CWDBG_TIMER_H
+//
+// timer.h - part of cwdbg, a debugger for the AmigaOS
+//
+// Copyright(C) 2018-2022 Constantin Wiemer
+//
+
+
+#include "stdint.h"
+
+
+//
+// type declarations
+//
+typedef struct Timer {
+    struct MsgPort     *p_port;
+    struct timerequest *p_io_request;
+    uint32_t           eclock_freq;     // number of E clock ticks per second
+    uint16_t           f_request_pending;   // has a timer request been sent that hasn't been completed yet?
+} Timer;
+
+
+//
+// exported functions
+//
+Timer *create_timer();
+void destroy_timer(Timer *p_timer);
+void read_timestamp(Timer *p_timer, uint32_t *p_ts_hi, uint32_t *p_ts_lo);
+uint32_t get_timer_signal(Timer *p_timer);
+void start_timer(Timer *p_timer, uint32_t interval_us);
+int check_timer(Timer *p_timer);
+void stop_timer(Timer *p_timer);
+
+#endif  // CWDBG_TIMER_H
@@ -0,0 +1,157 @@
+//
+// transport.c - part of cwdbg, a debugger for the AmigaOS
+//               This file contains the routines that connect the backends (serial.device and TCP) to the transport
+//               interface used by the server.
+//
+// Copyright(C) 2018-2022 Constantin Wiemer
+//
+
+
+#include <proto/exec.h>
+
+#include "netio.h"
+#include "serio.h"
+#include "stdint.h"
+#include "transport.h"
+#include "util.h"
+
+
+static Transport *create_transport(void *p_conn);
+static int send_serial_frame(void *p_conn, const Buffer *pb_header, const Buffer *pb_data);
+static int resend_serial_frames(void *p_conn, uint16_t nframes);
+static int recv_serial_frame(void *p_conn, Buffer *pb_data);
+static uint32_t get_serial_errno(void *p_conn);
+static void destroy_serial_transport(void *p_conn);
+static int send_tcp_frame(void *p_conn, const Buffer *pb_header, const Buffer *pb_data);
+static int resend_tcp_frames(void *p_conn, uint16_t nframes);
+static int recv_tcp_frame(void *p_conn, Buffer *pb_data);
+static uint32_t get_tcp_errno(void *p_conn);
+static void destroy_tcp_transport(void *p_conn);
+
+
+//
+// exported routines
+//
+
+Transport *create_serial_transport(uint32_t baud_rate, int f_fast_mode)
+{
+    SerialConnection *p_conn;
+    Transport        *p_transport;
+
+    if ((p_conn = create_serial_conn(baud_rate, f_fast_mode)) == NULL)
+        return NULL;
+    if ((p_transport = create_transport(p_conn)) == NULL) {
+        destroy_serial_conn(p_conn);
+        return NULL;
+    }
+    p_transport->p_send_frame_func    = send_serial_frame;
+    p_transport->p_resend_frames_func = resend_serial_frames;
+    p_transport->p_recv_frame_func    = recv_serial_frame;
+    p_transport->p_get_errno_func     = get_serial_errno;
+    p_transport->p_destroy_func       = destroy_serial_transport;
+    return p_transport;
+}
+
+
+Transport *create_tcp_transport(uint16_t port)
+{
+    NetConnection *p_conn;
+    Transport     *p_transport;
+
+    if ((p_conn = create_net_conn(port)) == NULL)
+        return NULL;
+    if ((p_transport = create_transport(p_conn)) == NULL) {
+        destroy_net_conn(p_conn);
+        return NULL;
+    }
+    p_transport->p_send_frame_func    = send_tcp_frame;
+    p_transport->p_resend_frames_func = resend_tcp_frames;
+    p_transport->p_recv_frame_func    = recv_tcp_frame;
+    p_transport->p_get_errno_func     = get_tcp_errno;
+    p_transport->p_destroy_func       = destroy_tcp_transport;
+    return p_transport;
+}
+
+
+void destroy_transport(Transport *p_transport)
+{
+    p_transport->p_destroy_func(p_transport->p_conn);
+    FreeVec(p_transport);
+}
+
+
+//
+// local routines
+//
+
+static Transport *create_transport(void *p_conn)
+{
+    Transport *p_transport;
+
+    if ((p_transport = AllocVec(sizeof(Transport), MEMF_CLEAR)) == NULL) {
+        LOG(CRIT, "Could not allocate memory for transport object");
+        return NULL;
+    }
+    p_transport->p_conn = p_conn;
+    return p_transport;
+}
+
+
+static int send_serial_frame(void *p_conn, const Buffer *pb_header, const Buffer *pb_data)
+{
+    return send_slip_frame(p_conn, pb_header, pb_data);
+}
+
+
+static int resend_serial_frames(void *p_conn, uint16_t nframes)
+{
+    return resend_slip_frames(p_conn, nframes);
+}
+
+
+static int recv_serial_frame(void *p_conn, Buffer *pb_data)
+{
+    return recv_slip_frame(p_conn, pb_data);
+}
+
+
+static uint32_t get_serial_errno(void *p_conn)
+{
+    return ((SerialConnection *) p_conn)->errno;
+}
+
+
+static void destroy_serial_transport(void *p_conn)
+{
+    destroy_serial_conn(p_conn);
+}
+
+
+static int send_tcp_frame(void *p_conn, const Buffer *pb_header, const Buffer *pb_data)
+{
+    return send_net_frame(p_conn, pb_header, pb_data);
+}
+
+
+static int resend_tcp_frames(void *p_conn, uint16_t nframes)
+{
+    return resend_net_frames(p_conn, nframes);
+}
+
+
+static int recv_tcp_frame(void *p_conn, Buffer *pb_data)
+{
+    return recv_net_frame(p_conn, pb_data);
+}
+
+
+static uint32_t get_tcp_errno(void *p_conn)
+{
+    return ((NetConnection *) p_conn)->errno;
+}
+
+
+static void destroy_tcp_transport(void *p_conn)
+{
+    destroy_net_conn(p_conn);
+}
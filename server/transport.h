@@ -0,0 +1,60 @@
+#ifndef CWDBG_TRANSPORT_H
+#define CWDBG_TRANSPORT_H
+//
+// transport.h - part of cwdbg, a debugger for the AmigaOS
+//
+// Copyright(C) 2018-2022 Constantin Wiemer
+//
+
+
+#include "stdint.h"
+
+
+//
+// constants
+//
+#define MAX_MSG_DATA_LEN   65535    // limited by the 16-bit length field in the message header
+#define MAX_FRAME_DATA_LEN 256      // maximum number of data bytes carried by one frame
+#define MAX_FRAME_SIZE     544      // should be large enough to hold a SLIP-encoded message header + MAX_FRAME_DATA_LEN bytes
+#define NUM_KEPT_FRAMES    4        // number of frames each transport keeps after sending them so they can be resent
+
+// results of receiving a frame
+#define RECV_OK        0
+#define RECV_CORRUPTED 1            // frame has been damaged on the way and has been dropped
+#define RECV_FAILED    2
+
+
+//
+// type declarations
+//
+typedef struct Buffer {
+    uint8_t  *p_addr;
+    uint32_t size;
+} Buffer;
+
+// A transport carries the frames of the protocol between server and host. All of them use SLIP to mark the frame
+// boundaries, so the host doesn't need to know how the server is connected (serial.device bridged by an emulator
+// and TCP look the same to it). The routines are provided by the backend (see serio.c and netio.c).
+typedef struct Transport {
+    void     *p_conn;               // connection object of the backend
+    // send header + data (which can be NULL) as one frame, returns DOSFALSE on error
+    int      (*p_send_frame_func)(void *p_conn, const Buffer *pb_header, const Buffer *pb_data);
+    // send the last nframes frames (at most NUM_KEPT_FRAMES) again, returns DOSFALSE on error
+    int      (*p_resend_frames_func)(void *p_conn, uint16_t nframes);
+    // receive the next frame and decode it into the buffer (whose size is set to the size of the data), returns one
+    // of the RECV_* codes
+    int      (*p_recv_frame_func)(void *p_conn, Buffer *pb_data);
+    // error code of the last failed operation
+    uint32_t (*p_get_errno_func)(void *p_conn);
+    void     (*p_destroy_func)(void *p_conn);
+} Transport;
+
+
+//
+// exported functions
+//
+Transport *create_serial_transport(uint32_t baud_rate, int f_fast_mode);
+Transport *create_tcp_transport(uint16_t port);
+void destroy_transport(Transport *p_transport);
+
+#endif  // CWDBG_TRANSPORT_H
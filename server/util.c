@@ -29,10 +29,14 @@
 #ifdef TEST
     #undef assert
     #define assert(expression) mock_assert((int) (expression), #expression, __FILE__, __LINE__);
+    // There is no exec.library when running the unit tests.
+    #define AllocVec(size, flags) calloc(1, size)
+    #define FreeVec(ptr)          free(ptr)
 #endif
 
 
 uint8_t g_loglevel;
+ServerStats g_stats;
 
 
 static char *p_level_name[] = {
@@ -44,6 +48,7 @@ static char *p_level_name[] = {
 };
 
 
+static uint32_t sum_words(uint32_t sum, const uint8_t *p_data, size_t size);
 #ifndef TEST
     static size_t strnlen(const char *p_str, size_t max_len);
 #endif
@@ -301,6 +306,297 @@ int unpack_data(const uint8_t *p_buffer, size_t buf_size, const char *p_format_s
 }
 
 
+// This routine compresses the data with the PackBits algorithm (the run-length encoding also used by IFF ILBM), which
+// is cheap enough for a 68000. The compressed data consists of chunks that start with a control byte n: 0..127 means
+// that n + 1 literal bytes follow, -127..-1 means that the following byte is repeated 1 - n times. It returns the size
+// of the compressed data or 0 if the compressed data does not fit into the destination buffer.
+size_t compress_data(const uint8_t *p_src, size_t src_size, uint8_t *p_dst, size_t dst_size)
+{
+    const uint8_t *p_src_end = p_src + src_size;
+    uint8_t *p_dst_pos = p_dst, *p_dst_end = p_dst + dst_size;
+    size_t run_len, lit_len;
+
+    assert(p_src != NULL);
+    assert(p_dst != NULL);
+    while (p_src < p_src_end) {
+        for (run_len = 1; (p_src + run_len < p_src_end) && (run_len < 128) && (p_src[run_len] == *p_src); run_len++)
+            ;
+        if (run_len >= 3) {
+            if (p_dst_pos + 2 > p_dst_end)
+                return 0;
+            *p_dst_pos++ = (uint8_t) (1 - run_len);
+            *p_dst_pos++ = *p_src;
+            p_src += run_len;
+        }
+        else {
+            // collect literal bytes up to the next run of at least 3 identical bytes
+            for (lit_len = 1; (p_src + lit_len < p_src_end) && (lit_len < 128); lit_len++) {
+                if ((p_src + lit_len + 2 < p_src_end)
+                    && (p_src[lit_len] == p_src[lit_len + 1])
+                    && (p_src[lit_len] == p_src[lit_len + 2]))
+                    break;
+            }
+            if (p_dst_pos + lit_len + 1 > p_dst_end)
+                return 0;
+            *p_dst_pos++ = (uint8_t) (lit_len - 1);
+            memcpy(p_dst_pos, p_src, lit_len);
+            p_dst_pos += lit_len;
+            p_src += lit_len;
+        }
+    }
+    return p_dst_pos - p_dst;
+}
+
+
+// This routine SLIP-encodes the data without the end-of-frame marker and returns the position after the encoded data.
+// The destination must have room for 2 * size bytes.
+uint8_t *encode_slip_data(const uint8_t *p_src, size_t size, uint8_t *p_dst)
+{
+    const uint8_t *p_src_end = p_src + size;
+    uint8_t       byte;
+
+    assert((p_src != NULL) || (size == 0));
+    assert(p_dst != NULL);
+    while (p_src < p_src_end) {
+        byte = *p_src++;
+        if (byte == SLIP_END) {
+            *p_dst++ = SLIP_ESC;
+            *p_dst++ = SLIP_ESCAPED_END;
+            ++g_stats.nbytes_escaped;
+        }
+        else if (byte == SLIP_ESC) {
+            *p_dst++ = SLIP_ESC;
+            *p_dst++ = SLIP_ESCAPED_ESC;
+            ++g_stats.nbytes_escaped;
+        }
+        else
+            *p_dst++ = byte;
+    }
+    return p_dst;
+}
+
+
+// This routine decodes a SLIP frame without the end-of-frame marker. It returns the size of the decoded data or 0 if
+// the frame contains an invalid escape sequence or an end-of-frame marker, or if the data doesn't fit into the
+// destination buffer.
+size_t decode_slip_frame(const uint8_t *p_src, size_t size, uint8_t *p_dst, size_t dst_size)
+{
+    const uint8_t *p_src_end = p_src + size;
+    size_t        nbytes = 0;
+    uint8_t       byte;
+
+    assert((p_src != NULL) || (size == 0));
+    assert(p_dst != NULL);
+    while (p_src < p_src_end) {
+        if ((byte = *p_src++) == SLIP_ESC) {
+            if (p_src == p_src_end)
+                return 0;
+            byte = *p_src++;
+            if (byte == SLIP_ESCAPED_END)
+                byte = SLIP_END;
+            else if (byte == SLIP_ESCAPED_ESC)
+                byte = SLIP_ESC;
+            else
+                return 0;
+        }
+        else if (byte == SLIP_END)
+            return 0;
+        if (nbytes == dst_size)
+            return 0;
+        p_dst[nbytes++] = byte;
+    }
+    return nbytes;
+}
+
+
+// This routine calculates the checksum over a message header and the data of a frame in the same way as with IP /
+// UDP headers (RFC 1071), i. e. the one's complement of the one's complement sum of all 16-bit words (in big-endian
+// order). An odd byte at the end of the data is padded with a zero byte. The header must have an even number of bytes
+// so that the data starts with a new word.
+uint16_t calc_checksum(const uint8_t *p_header, size_t header_size, const uint8_t *p_data, size_t data_size)
+{
+    uint32_t sum;
+
+    assert(p_header != NULL);
+    assert(header_size % 2 == 0);
+    assert((p_data != NULL) || (data_size == 0));
+    sum = sum_words(0, p_header, header_size);
+    sum = sum_words(sum, p_data, data_size);
+    sum = (sum >> 16) + (sum & 0xffff);         // fold in upper 16 bits...
+    sum += (sum >> 16);                         // ... and the carry from this addition
+    return ~sum & 0xffff;
+}
+
+
+// This routine encodes the differences between two blocks of data, whose size must be a multiple of 4, as a bitmask
+// with one bit per dword (bit 7 of the first byte corresponds to the first dword), followed by the changed dwords of
+// the new block. We compare byte-wise because the blocks are not necessarily aligned on a dword boundary. The
+// destination buffer must hold at least (size / 4 + 7) / 8 + size bytes. It returns the size of the encoded data.
+size_t encode_delta(const uint8_t *p_old, const uint8_t *p_new, size_t size, uint8_t *p_dst)
+{
+    size_t ndwords = size / 4, mask_size = (ndwords + 7) / 8, i;
+    uint8_t *p_dst_pos = p_dst + mask_size;
+
+    assert(p_old != NULL);
+    assert(p_new != NULL);
+    assert(p_dst != NULL);
+    assert(size % 4 == 0);
+    memset(p_dst, 0, mask_size);
+    for (i = 0; i < ndwords; i++) {
+        if (memcmp(p_old + i * 4, p_new + i * 4, 4) != 0) {
+            p_dst[i / 8] |= 0x80 >> (i % 8);
+            memcpy(p_dst_pos, p_new + i * 4, 4);
+            p_dst_pos += 4;
+        }
+    }
+    return p_dst_pos - p_dst;
+}
+
+
+// This routine creates a pool of nblocks blocks with block_size bytes each, which are allocated with only one call of
+// AllocVec(). Objects that are allocated and freed often (like breakpoints and message buffers) can be taken from such
+// a pool in constant time without fragmenting memory. If all blocks are in use, alloc_block() falls back to AllocVec(),
+// so the pool never runs out of blocks as long as there is memory.
+BlockPool *create_block_pool(uint32_t block_size, uint32_t nblocks)
+{
+    BlockPool *p_pool;
+    uint8_t   *p_block;
+    uint32_t  i;
+
+    assert(block_size > 0);
+    // Blocks are aligned on a dword boundary and must be able to hold the link to the next free block.
+    block_size = (block_size + 3) & ~3;
+    if (block_size < sizeof(void *))
+        block_size = sizeof(void *);
+    if ((p_pool = AllocVec(sizeof(BlockPool) + block_size * nblocks, 0)) == NULL)
+        return NULL;
+    p_pool->p_blocks     = (uint8_t *) (p_pool + 1);
+    p_pool->p_blocks_end = p_pool->p_blocks + block_size * nblocks;
+    p_pool->p_free_list  = NULL;
+    p_pool->block_size   = block_size;
+    p_pool->nfree_blocks = nblocks;
+    // We link the blocks from the last one down to the first one, so the free list starts with the first block. The
+    // index runs from nblocks down to 1 so the pointer never points below the start of the blocks.
+    for (i = nblocks; i > 0; i--) {
+        p_block = p_pool->p_blocks + (i - 1) * block_size;
+        *((void **) p_block) = p_pool->p_free_list;
+        p_pool->p_free_list  = p_block;
+    }
+    return p_pool;
+}
+
+
+// All blocks that have been allocated with alloc_block() must have been freed before the pool is destroyed.
+void destroy_block_pool(BlockPool *p_pool)
+{
+    FreeVec(p_pool);
+}
+
+
+void *alloc_block(BlockPool *p_pool)
+{
+    void *p_block;
+
+    assert(p_pool != NULL);
+    if ((p_block = p_pool->p_free_list) != NULL) {
+        p_pool->p_free_list = *((void **) p_block);
+        --p_pool->nfree_blocks;
+        return p_block;
+    }
+    else {
+        LOG(DEBUG, "Block pool with block size %ld is exhausted, using AllocVec()", p_pool->block_size);
+        return AllocVec(p_pool->block_size, 0);
+    }
+}
+
+
+void free_block(BlockPool *p_pool, void *p_block)
+{
+    assert(p_pool != NULL);
+    assert(p_block != NULL);
+    if (((uint8_t *) p_block >= p_pool->p_blocks) && ((uint8_t *) p_block < p_pool->p_blocks_end)) {
+        *((void **) p_block) = p_pool->p_free_list;
+        p_pool->p_free_list  = p_block;
+        ++p_pool->nfree_blocks;
+    }
+    else
+        // block has been allocated by alloc_block() with AllocVec() because the pool was exhausted
+        FreeVec(p_block);
+}
+
+
+// This routine creates a ring buffer for nelems elements with elem_size bytes each. It is meant for data that is
+// produced while the target is running and collected by the host later (like trace records), so a full buffer doesn't
+// overwrite the oldest elements, which the host hasn't seen yet, but drops the new ones and counts them as overruns.
+RingBuffer *create_ring_buffer(uint32_t elem_size, uint32_t nelems)
+{
+    RingBuffer *p_rb;
+
+    assert((elem_size > 0) && (nelems > 0));
+    if ((p_rb = AllocVec(sizeof(RingBuffer) + elem_size * nelems, 0)) == NULL)
+        return NULL;
+    p_rb->p_elems   = (uint8_t *) (p_rb + 1);
+    p_rb->elem_size = elem_size;
+    p_rb->nelems    = nelems;
+    p_rb->head      = 0;
+    p_rb->count     = 0;
+    p_rb->noverruns = 0;
+    return p_rb;
+}
+
+
+void destroy_ring_buffer(RingBuffer *p_rb)
+{
+    FreeVec(p_rb);
+}
+
+
+// This routine returns DOSFALSE if the buffer is full.
+int put_elem_into_ring_buffer(RingBuffer *p_rb, const void *p_elem)
+{
+    uint32_t tail;
+
+    assert((p_rb != NULL) && (p_elem != NULL));
+    if (p_rb->count == p_rb->nelems) {
+        ++p_rb->noverruns;
+        return DOSFALSE;
+    }
+    tail = p_rb->head + p_rb->count;
+    if (tail >= p_rb->nelems)
+        tail -= p_rb->nelems;
+    memcpy(p_rb->p_elems + tail * p_rb->elem_size, p_elem, p_rb->elem_size);
+    ++p_rb->count;
+    return DOSTRUE;
+}
+
+
+// This routine returns DOSFALSE if the buffer is empty.
+int get_elem_from_ring_buffer(RingBuffer *p_rb, void *p_elem)
+{
+    assert((p_rb != NULL) && (p_elem != NULL));
+    if (p_rb->count == 0)
+        return DOSFALSE;
+    memcpy(p_elem, p_rb->p_elems + p_rb->head * p_rb->elem_size, p_rb->elem_size);
+    if (++p_rb->head == p_rb->nelems)
+        p_rb->head = 0;
+    --p_rb->count;
+    return DOSTRUE;
+}
+
+
+// This routine adds the 16-bit words of the data to the sum, which can't overflow for the sizes of our frames.
+static uint32_t sum_words(uint32_t sum, const uint8_t *p_data, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < size; i += 2)
+        sum += (p_data[i] << 8) | p_data[i + 1];
+    if (i < size)
+        sum += p_data[i] << 8;
+    return sum;
+}
+
+
 #ifndef TEST
 // libnix doesn't contain strnlen(), so we have to implement it ourselves.
 static size_t strnlen(const char *p_str, size_t max_len)
@@ -314,7 +610,7 @@ static size_t strnlen(const char *p_str, size_t max_len)
 
 
 //
-// unit tests for pack / unpack
+// unit tests for pack / unpack / compress / SLIP / checksum / encode_delta / block pool / ring buffer
 //
 #ifdef TEST
 #pragma GCC diagnostic push
@@ -433,6 +729,197 @@ static void test_unpack_null_args(void **state)
     expect_assert_failure(unpack_data(NULL, 0, NULL));
 }
 
+static void test_compress_run(void **state)
+{
+    uint8_t src[256] = {0}, dst[16], expected_dst[] = {0x81, 0x00, 0x81, 0x00};
+    assert_int_equal(compress_data(src, sizeof(src), dst, sizeof(dst)), 4);
+    assert_memory_equal(dst, expected_dst, 4);
+}
+
+static void test_compress_literals(void **state)
+{
+    uint8_t src[] = {'t', 'e', 's', 't'}, dst[16], expected_dst[] = {0x03, 't', 'e', 's', 't'};
+    assert_int_equal(compress_data(src, sizeof(src), dst, sizeof(dst)), 5);
+    assert_memory_equal(dst, expected_dst, 5);
+}
+
+static void test_compress_mixed(void **state)
+{
+    uint8_t src[] = {'a', 'b', 'b', 'c', 'c', 'c', 'c', 'd'}, dst[16];
+    uint8_t expected_dst[] = {0x02, 'a', 'b', 'b', 0xfd, 'c', 0x00, 'd'};
+    assert_int_equal(compress_data(src, sizeof(src), dst, sizeof(dst)), 8);
+    assert_memory_equal(dst, expected_dst, 8);
+}
+
+static void test_compress_dst_too_small(void **state)
+{
+    uint8_t src[] = {'t', 'e', 's', 't'}, dst[4];
+    assert_int_equal(compress_data(src, sizeof(src), dst, sizeof(dst)), 0);
+}
+
+static void test_compress_null_args(void **state)
+{
+    expect_assert_failure(compress_data(NULL, 0, NULL, 0));
+}
+
+static void test_slip_encode_decode(void **state)
+{
+    uint8_t data[] = {0x01, 0xc0, 0x02, 0xdb, 0x03}, frame[10], decoded[5];
+    uint8_t expected_frame[] = {0x01, 0xdb, 0xdc, 0x02, 0xdb, 0xdd, 0x03};
+    uint32_t nbytes_escaped = g_stats.nbytes_escaped;
+    assert_ptr_equal(encode_slip_data(data, sizeof(data), frame), frame + 7);
+    assert_memory_equal(frame, expected_frame, 7);
+    assert_int_equal(g_stats.nbytes_escaped - nbytes_escaped, 2);
+    assert_int_equal(decode_slip_frame(frame, 7, decoded, sizeof(decoded)), 5);
+    assert_memory_equal(decoded, data, 5);
+}
+
+static void test_slip_decode_invalid(void **state)
+{
+    uint8_t decoded[4];
+    // invalid escape sequence, escape at the end, end-of-frame marker inside the frame, data too large
+    assert_int_equal(decode_slip_frame(((uint8_t[]) {0x01, 0xdb, 0x02}), 3, decoded, sizeof(decoded)), 0);
+    assert_int_equal(decode_slip_frame(((uint8_t[]) {0x01, 0xdb}), 2, decoded, sizeof(decoded)), 0);
+    assert_int_equal(decode_slip_frame(((uint8_t[]) {0x01, 0xc0, 0x02}), 3, decoded, sizeof(decoded)), 0);
+    assert_int_equal(decode_slip_frame(((uint8_t[]) {1, 2, 3, 4, 5}), 5, decoded, sizeof(decoded)), 0);
+}
+
+static void test_checksum(void **state)
+{
+    // example from RFC 1071, with the header and an odd number of data bytes
+    uint8_t header[] = {0x00, 0x01, 0xf2, 0x03}, data[] = {0xf4, 0xf5, 0xf6, 0xf7, 0x42};
+    assert_int_equal(calc_checksum(header, sizeof(header), data, 4), 0x220d);
+    assert_int_equal(calc_checksum(header, sizeof(header), data, 5), 0xe00c);
+    assert_int_equal(calc_checksum(header, sizeof(header), NULL, 0), 0x0dfb);
+}
+
+static void test_checksum_odd_header(void **state)
+{
+    uint8_t header[3] = {0};
+    expect_assert_failure(calc_checksum(header, sizeof(header), NULL, 0));
+}
+
+static void test_encode_delta(void **state)
+{
+    uint8_t old[40] = {0}, new[40] = {0}, dst[64];
+    uint8_t expected_dst[] = {0x40, 0x40, 0xca, 0xfe, 0xba, 0xbe, 0x00, 0x00, 0x00, 0x42};
+    memcpy(new + 4, ((uint8_t[]) {0xca, 0xfe, 0xba, 0xbe}), 4);
+    new[39] = 0x42;
+    assert_int_equal(encode_delta(old, new, sizeof(old), dst), 10);
+    assert_memory_equal(dst, expected_dst, 10);
+}
+
+static void test_encode_delta_unchanged(void **state)
+{
+    uint8_t old[8] = {1, 2, 3, 4, 5, 6, 7, 8}, dst[16];
+    assert_int_equal(encode_delta(old, old, sizeof(old), dst), 1);
+    assert_int_equal(dst[0], 0);
+}
+
+static void test_encode_delta_wrong_size(void **state)
+{
+    uint8_t old[6] = {0}, dst[16];
+    expect_assert_failure(encode_delta(old, old, sizeof(old), dst));
+}
+
+static void test_block_pool_alloc_free(void **state)
+{
+    BlockPool *p_pool = create_block_pool(10, 2);
+    void      *p_block1, *p_block2;
+
+    assert_non_null(p_pool);
+    assert_int_equal(p_pool->block_size, 12);
+    p_block1 = alloc_block(p_pool);
+    p_block2 = alloc_block(p_pool);
+    assert_non_null(p_block1);
+    assert_non_null(p_block2);
+    assert_ptr_not_equal(p_block1, p_block2);
+    assert_int_equal(p_pool->nfree_blocks, 0);
+    free_block(p_pool, p_block1);
+    assert_int_equal(p_pool->nfree_blocks, 1);
+    // the block freed last is reused first
+    assert_ptr_equal(alloc_block(p_pool), p_block1);
+    free_block(p_pool, p_block1);
+    free_block(p_pool, p_block2);
+    assert_int_equal(p_pool->nfree_blocks, 2);
+    destroy_block_pool(p_pool);
+}
+
+static void test_block_pool_exhausted(void **state)
+{
+    BlockPool *p_pool = create_block_pool(16, 1);
+    void      *p_block1, *p_block2;
+
+    p_block1 = alloc_block(p_pool);
+    p_block2 = alloc_block(p_pool);
+    assert_non_null(p_block2);
+    assert_true(((uint8_t *) p_block2 < p_pool->p_blocks) || ((uint8_t *) p_block2 >= p_pool->p_blocks_end));
+    free_block(p_pool, p_block2);
+    assert_int_equal(p_pool->nfree_blocks, 0);
+    free_block(p_pool, p_block1);
+    assert_int_equal(p_pool->nfree_blocks, 1);
+    destroy_block_pool(p_pool);
+}
+
+static void test_block_pool_order(void **state)
+{
+    BlockPool *p_pool = create_block_pool(8, 3);
+
+    // the blocks are handed out from the first one on
+    assert_ptr_equal(alloc_block(p_pool), p_pool->p_blocks);
+    assert_ptr_equal(alloc_block(p_pool), p_pool->p_blocks + 8);
+    assert_ptr_equal(alloc_block(p_pool), p_pool->p_blocks + 16);
+    assert_int_equal(p_pool->nfree_blocks, 0);
+    destroy_block_pool(p_pool);
+}
+
+static void test_block_pool_null_args(void **state)
+{
+    expect_assert_failure(alloc_block(NULL));
+}
+
+static void test_ring_buffer_put_get(void **state)
+{
+    RingBuffer *p_rb = create_ring_buffer(sizeof(uint32_t), 3);
+    uint32_t   elem, i;
+
+    assert_ptr_not_equal(p_rb, NULL);
+    assert_int_equal(get_elem_from_ring_buffer(p_rb, &elem), DOSFALSE);
+    // put / get more elements than the capacity so that the indexes wrap around
+    for (i = 0; i < 10; i++) {
+        assert_int_equal(put_elem_into_ring_buffer(p_rb, &i), DOSTRUE);
+        assert_int_equal(get_elem_from_ring_buffer(p_rb, &elem), DOSTRUE);
+        assert_int_equal(elem, i);
+    }
+    // elements come out in FIFO order
+    for (i = 0; i < 3; i++)
+        assert_int_equal(put_elem_into_ring_buffer(p_rb, &i), DOSTRUE);
+    for (i = 0; i < 3; i++) {
+        assert_int_equal(get_elem_from_ring_buffer(p_rb, &elem), DOSTRUE);
+        assert_int_equal(elem, i);
+    }
+    assert_int_equal(p_rb->noverruns, 0);
+    destroy_ring_buffer(p_rb);
+}
+
+static void test_ring_buffer_overrun(void **state)
+{
+    RingBuffer *p_rb = create_ring_buffer(sizeof(uint32_t), 2);
+    uint32_t   elem, i;
+
+    for (i = 0; i < 2; i++)
+        assert_int_equal(put_elem_into_ring_buffer(p_rb, &i), DOSTRUE);
+    // new elements are dropped, the oldest ones are kept
+    assert_int_equal(put_elem_into_ring_buffer(p_rb, &i), DOSFALSE);
+    assert_int_equal(p_rb->noverruns, 1);
+    assert_int_equal(get_elem_from_ring_buffer(p_rb, &elem), DOSTRUE);
+    assert_int_equal(elem, 0);
+    assert_int_equal(get_elem_from_ring_buffer(p_rb, &elem), DOSTRUE);
+    assert_int_equal(elem, 1);
+    assert_int_equal(get_elem_from_ring_buffer(p_rb, &elem), DOSFALSE);
+    destroy_ring_buffer(p_rb);
+}
+
 
 int main(void)
 {
@@ -454,6 +941,24 @@ int main(void)
         cmocka_unit_test(test_unpack_wrong_size),
         cmocka_unit_test(test_unpack_wrong_format),
         cmocka_unit_test(test_unpack_null_args),
+        cmocka_unit_test(test_compress_run),
+        cmocka_unit_test(test_compress_literals),
+        cmocka_unit_test(test_compress_mixed),
+        cmocka_unit_test(test_compress_dst_too_small),
+        cmocka_unit_test(test_compress_null_args),
+        cmocka_unit_test(test_slip_encode_decode),
+        cmocka_unit_test(test_slip_decode_invalid),
+        cmocka_unit_test(test_checksum),
+        cmocka_unit_test(test_checksum_odd_header),
+        cmocka_unit_test(test_encode_delta),
+        cmocka_unit_test(test_encode_delta_unchanged),
+        cmocka_unit_test(test_encode_delta_wrong_size),
+        cmocka_unit_test(test_block_pool_alloc_free),
+        cmocka_unit_test(test_block_pool_exhausted),
+        cmocka_unit_test(test_block_pool_order),
+        cmocka_unit_test(test_block_pool_null_args),
+        cmocka_unit_test(test_ring_buffer_put_get),
+        cmocka_unit_test(test_ring_buffer_overrun),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -22,6 +22,53 @@
 #define ERROR 3
 #define CRIT  4
 
+// Messages below this level are removed at compile time (the release build uses -DMIN_LOG_LEVEL=WARN), the remaining
+// ones are filtered at runtime by g_loglevel.
+#ifndef MIN_LOG_LEVEL
+#define MIN_LOG_LEVEL DEBUG
+#endif
+
+// SLIP special characters
+#define SLIP_END         0xc0
+#define SLIP_ESCAPED_END 0xdc
+#define SLIP_ESC         0xdb
+#define SLIP_ESCAPED_ESC 0xdd
+
+
+//
+// type declarations
+//
+typedef struct BlockPool {
+    uint8_t  *p_blocks;                 // all blocks of the pool, allocated in one go
+    uint8_t  *p_blocks_end;
+    void     *p_free_list;              // free blocks, linked via their first dword
+    uint32_t block_size;
+    uint32_t nfree_blocks;
+} BlockPool;
+
+typedef struct RingBuffer {
+    uint8_t  *p_elems;                  // all elements, allocated together with the header
+    uint32_t elem_size;
+    uint32_t nelems;                    // capacity of the buffer
+    uint32_t head;                      // index of the oldest element
+    uint32_t count;                     // number of elements in the buffer
+    uint32_t noverruns;                 // number of elements dropped because the buffer was full
+} RingBuffer;
+
+// Counters for instrumenting the server that are cheap enough to be always on, returned by MSG_GET_STATS (keep in
+// sync with server.py). They are incremented by the debugger process only.
+typedef struct ServerStats {
+    uint32_t nframes_sent;
+    uint32_t nframes_received;
+    uint32_t nframes_corrupted;         // received frames that have been dropped
+    uint32_t nbytes_escaped;            // bytes that had to be escaped in the SLIP frames sent
+    uint32_t nbpoint_hits;
+    uint32_t nstep_traps;               // trace exceptions (single steps and steps to the next change of flow)
+    uint32_t ncmds;                     // commands received from the host
+    uint32_t cmd_ticks_hi;              // time spent processing the commands (in E clock ticks), without the time
+    uint32_t cmd_ticks_lo;              // the target runs or the server waits for the host
+} ServerStats;
+
 
 //
 // exported functions
@@ -30,12 +77,26 @@ void logmsg(const char *p_fname, int lineno, const char *p_func, UBYTE level, co
 void dump_memory(const uint8_t *p_addr, uint32_t size);
 int pack_data(uint8_t *p_buffer, size_t buf_size, const char *p_fmt_str, ...);
 int unpack_data(const uint8_t *p_buffer, size_t buf_size, const char *p_fmt_str, ...);
+size_t compress_data(const uint8_t *p_src, size_t src_size, uint8_t *p_dst, size_t dst_size);
+uint8_t *encode_slip_data(const uint8_t *p_src, size_t size, uint8_t *p_dst);
+size_t decode_slip_frame(const uint8_t *p_src, size_t size, uint8_t *p_dst, size_t dst_size);
+uint16_t calc_checksum(const uint8_t *p_header, size_t header_size, const uint8_t *p_data, size_t data_size);
+size_t encode_delta(const uint8_t *p_old, const uint8_t *p_new, size_t size, uint8_t *p_dst);
+BlockPool *create_block_pool(uint32_t block_size, uint32_t nblocks);
+void destroy_block_pool(BlockPool *p_pool);
+void *alloc_block(BlockPool *p_pool);
+void free_block(BlockPool *p_pool, void *p_block);
+RingBuffer *create_ring_buffer(uint32_t elem_size, uint32_t nelems);
+void destroy_ring_buffer(RingBuffer *p_rb);
+int put_elem_into_ring_buffer(RingBuffer *p_rb, const void *p_elem);
+int get_elem_from_ring_buffer(RingBuffer *p_rb, void *p_elem);
 
 
 //
 // macros
 //
-#define LOG(level, p_fmtstr, ...) {logmsg(__FILE__, __LINE__, __func__, level, p_fmtstr, ##__VA_ARGS__);}
+#define LOG(level, p_fmtstr, ...) {if ((level) >= MIN_LOG_LEVEL) logmsg(__FILE__, __LINE__, __func__, level, p_fmtstr, ##__VA_ARGS__);}
+#define LOG_MEMORY(level, p_addr, size) {if (((level) >= MIN_LOG_LEVEL) && ((level) >= g_loglevel)) dump_memory(p_addr, size);}
 #define C_TO_BCPL_PTR(ptr) ((BPTR) (((ULONG) (ptr)) >> 2))
 #define BCPL_TO_C_PTR(ptr) ((APTR) (((ULONG) (ptr)) << 2))
 
@@ -44,5 +105,6 @@ int unpack_data(const uint8_t *p_buffer, size_t buf_size, const char *p_fmt_str,
 // external references
 //
 extern UBYTE g_loglevel;
+extern ServerStats g_stats;
 
 #endif // CWDBG_UTIL_H